@@ -0,0 +1,13 @@
+#/bin/bash 2>nul || goto :windows
+
+# bash
+set -e
+mkdir -p bin
+gcc -O2 src/*.c bench/$1/*.c -o bin/bench_$1 -Iinclude -Ibench -pthread $2
+exit
+
+:windows
+@echo off
+
+sh bench.sh.bat %1 -lws2_32
+exit /b
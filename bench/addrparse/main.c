@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "socketaddress.h"
+#include "bench.h"
+
+#ifndef _WINDOWS
+  #include <arpa/inet.h>
+  #include <netdb.h>
+#endif
+
+#define COUNT 1024
+#define ROUNDS 2000
+
+static uint8_t addrs4[COUNT][4];
+static uint8_t addrs6[COUNT][16];
+static char text4[COUNT][SOCKET_ADDRESS_IPV4_STRLEN];
+static char text6[COUNT][SOCKET_ADDRESS_IPV6_STRLEN];
+static size_t len4[COUNT];
+static size_t len6[COUNT];
+
+static uint32_t next_random(void) {
+  static uint32_t state = 0x12345678;
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+
+  return state;
+}
+
+/* Realistic IPv6 mixes: zero runs, mapped IPv4 and fully random words */
+static void make_addresses(void) {
+  int32_t i, j;
+
+  for (i = 0; i < COUNT; i++) {
+    for (j = 0; j < 4; j++) {
+      addrs4[i][j] = (uint8_t)next_random();
+    }
+
+    for (j = 0; j < 16; j++) {
+      addrs6[i][j] = (uint8_t)next_random();
+    }
+
+    switch (i % 4) {
+      case 0:
+        memset(addrs6[i] + 4, 0, 8);
+        break;
+      case 1:
+        memset(addrs6[i], 0, 10);
+        addrs6[i][10] = 0xff;
+        addrs6[i][11] = 0xff;
+        break;
+      case 2:
+        addrs6[i][0] = 0xfe;
+        addrs6[i][1] = 0x80;
+        memset(addrs6[i] + 2, 0, 6);
+        break;
+      default:
+        break;
+    }
+
+    len4[i] = socket_address_format_ipv4(addrs4[i], text4[i]);
+    len6[i] = socket_address_format_ipv6(addrs6[i], text6[i]);
+  }
+}
+
+static int32_t check(void) {
+  char buffer[SOCKET_ADDRESS_IPV6_STRLEN];
+  uint8_t bytes[16];
+  int32_t i, failures;
+
+  failures = 0;
+
+  for (i = 0; i < COUNT; i++) {
+    inet_ntop(AF_INET, addrs4[i], buffer, sizeof(buffer));
+    failures += strcmp(buffer, text4[i]) != 0;
+
+    inet_ntop(AF_INET6, addrs6[i], buffer, sizeof(buffer));
+    failures += strcmp(buffer, text6[i]) != 0;
+
+    failures += !socket_address_parse_ipv4(text4[i], len4[i], bytes) || memcmp(bytes, addrs4[i], 4) != 0;
+    failures += !socket_address_parse_ipv6(text6[i], len6[i], bytes, NULL) || memcmp(bytes, addrs6[i], 16) != 0;
+  }
+
+  return failures;
+}
+
+int32_t main(void) {
+  char buffer[SOCKET_ADDRESS_IPV6_STRLEN];
+  uint8_t bytes[16];
+  struct addrinfo hints, *res;
+  uint64_t start;
+  int32_t i, round, failures;
+
+  make_addresses();
+
+  if ((failures = check()) != 0) {
+    printf("%d mismatches against inet_pton()/inet_ntop()\n", failures);
+    return 1;
+  }
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(socket_address_parse_ipv4(text4[i], len4[i], bytes));
+    }
+  }
+  BENCH_REPORT("socket_address_parse_ipv4", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(inet_pton(AF_INET, text4[i], bytes));
+    }
+  }
+  BENCH_REPORT("inet_pton(AF_INET)", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(socket_address_parse_ipv6(text6[i], len6[i], bytes, NULL));
+    }
+  }
+  BENCH_REPORT("socket_address_parse_ipv6", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(inet_pton(AF_INET6, text6[i], bytes));
+    }
+  }
+  BENCH_REPORT("inet_pton(AF_INET6)", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  /* What socket_address_new() used to do for IPv6 literals */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS / 10; round++) {
+    for (i = 0; i < COUNT; i++) {
+      if (getaddrinfo(text6[i], NULL, &hints, &res) == 0) {
+        freeaddrinfo(res);
+      }
+    }
+  }
+  BENCH_REPORT("getaddrinfo(AI_NUMERICHOST)", bench_time_ns() - start, (uint64_t)(ROUNDS / 10) * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(socket_address_format_ipv4(addrs4[i], buffer));
+    }
+  }
+  BENCH_REPORT("socket_address_format_ipv4", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(inet_ntop(AF_INET, addrs4[i], buffer, sizeof(buffer)));
+    }
+  }
+  BENCH_REPORT("inet_ntop(AF_INET)", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(socket_address_format_ipv6(addrs6[i], buffer));
+    }
+  }
+  BENCH_REPORT("socket_address_format_ipv6", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  start = bench_time_ns();
+  for (round = 0; round < ROUNDS; round++) {
+    for (i = 0; i < COUNT; i++) {
+      BENCH_KEEP(inet_ntop(AF_INET6, addrs6[i], buffer, sizeof(buffer)));
+    }
+  }
+  BENCH_REPORT("inet_ntop(AF_INET6)", bench_time_ns() - start, (uint64_t)ROUNDS * COUNT);
+
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _WINDOWS
+  #include <winsock2.h>
+  #include <windows.h>
+#else
+  #include <time.h>
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <sys/resource.h>
+#endif
+
+/* Nanosecond clock for benchmarks, sys_time_monotonic() is too coarse */
+static inline uint64_t bench_time_ns(void) {
+#ifdef _WINDOWS
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+
+  QueryPerformanceCounter(&now);
+
+  return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Keeps the compiler from optimizing benchmarked results away */
+#if defined(__GNUC__) || defined(__clang__)
+  #define BENCH_KEEP(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+#else
+  #define BENCH_KEEP(x) do { volatile uintptr_t bench_keep_ = (uintptr_t)(x); UNUSED(bench_keep_); } while (0)
+#endif
+
+#define BENCH_REPORT(name, ns, ops) \
+  printf("%-32s %10.2f ns/op\n", (name), (double)(ns) / (double)(ops))
+
+/* Disables Nagle so small pipelined requests are not held back */
+static inline void bench_set_nodelay(int32_t fd) {
+  int32_t on = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&on, sizeof(on));
+}
+
+/* Lifts the soft open file limit towards wanted, returns the limit in effect */
+static inline int32_t bench_raise_fd_limit(int32_t wanted) {
+#ifndef _WINDOWS
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 1024;
+  }
+
+  if (limit.rlim_cur < (rlim_t)wanted) {
+    limit.rlim_cur = limit.rlim_max < (rlim_t)wanted ? limit.rlim_max : (rlim_t)wanted;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  return limit.rlim_cur > INT32_MAX ? INT32_MAX : (int32_t)limit.rlim_cur;
+#else
+  UNUSED(wanted);
+  return INT32_MAX;
+#endif
+}
+
+/* Minimal JSON writer: {"benchmark": name, "results": [{"name": ..., ...}]}.
+ * Keys and string values are plain identifiers and are not escaped. */
+typedef struct {
+  FILE *out;
+  int32_t results;
+} BenchJson;
+
+static inline void bench_json_begin(BenchJson *json, FILE *out, const char *benchmark) {
+  json->out = out;
+  json->results = 0;
+  fprintf(out, "{\n  \"benchmark\": \"%s\",\n  \"results\": [", benchmark);
+}
+
+static inline void bench_json_result_begin(BenchJson *json, const char *name) {
+  fprintf(json->out, "%s\n    {\"name\": \"%s\"", json->results++ ? "," : "", name);
+}
+
+static inline void bench_json_int(BenchJson *json, const char *key, int64_t value) {
+  fprintf(json->out, ", \"%s\": %lld", key, (long long)value);
+}
+
+static inline void bench_json_double(BenchJson *json, const char *key, double value) {
+  fprintf(json->out, ", \"%s\": %.3f", key, value);
+}
+
+static inline void bench_json_string(BenchJson *json, const char *key, const char *value) {
+  fprintf(json->out, ", \"%s\": \"%s\"", key, value);
+}
+
+static inline void bench_json_result_end(BenchJson *json) {
+  fputs("}", json->out);
+  fflush(json->out);
+}
+
+static inline void bench_json_end(BenchJson *json) {
+  fputs("\n  ]\n}\n", json->out);
+  fflush(json->out);
+}
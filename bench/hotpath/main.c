@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "socket.h"
+#include "socketaddress.h"
+#include "error.h"
+#include "websocket.h"
+#include "linereader.h"
+#include "bench.h"
+
+#ifndef _WINDOWS
+  #include <arpa/inet.h>
+#endif
+
+#define ROUNDS 200000
+#define SYSCALL_ROUNDS 20000
+#define BACKLOG 512
+#define ACCEPT_ROUNDS 16
+#define MASK_SIZE 4096
+#define LINE_SIZE 64
+#define LINE_BLOCK 16384
+#define LINE_ROUNDS 2000
+
+static atomic_uint_fast64_t allocs;
+
+/* glibc lets the program replace malloc(), which also catches the calls made
+ * from inside libc such as strdup(). Elsewhere allocs/op reads as -1. */
+#if defined(__GLIBC__)
+  #define COUNTS_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+#else
+  #define COUNTS_ALLOCS 0
+#endif
+
+static bool json_output = false;
+static BenchJson json;
+
+static uint64_t allocs_now(void) {
+  return atomic_load_explicit(&allocs, memory_order_relaxed);
+}
+
+static void report(const char *name, uint64_t ns, uint64_t ops, uint64_t alloc_count) {
+  double per_op = COUNTS_ALLOCS ? (double)alloc_count / (double)ops : -1.0;
+
+  if (json_output) {
+    bench_json_result_begin(&json, name);
+    bench_json_double(&json, "ns_per_op", (double)ns / (double)ops);
+    bench_json_double(&json, "allocs_per_op", per_op);
+    bench_json_int(&json, "ops", (int64_t)ops);
+    bench_json_result_end(&json);
+  } else {
+    printf("%-32s %10.2f ns/op %8.2f allocs/op\n", name, (double)ns / (double)ops, per_op);
+  }
+}
+
+static Socket *listener_new(SocketAddress **address) {
+  SocketAddress *loopback = socket_address_new_loopback(SOCKET_FAMILY_INET, 0);
+  Socket *listener = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  socket_set_listen_backlog(listener, BACKLOG);
+
+  if (socket_bind(listener, loopback, true) == false || socket_listen(listener) == false) {
+    fprintf(stderr, "failed to listen: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_address_free(loopback);
+  *address = socket_get_local_address(listener);
+
+  return listener;
+}
+
+static void bench_accept(void) {
+  static Socket *clients[BACKLOG], *accepted[BACKLOG];
+  SocketAddress *address;
+  Socket *listener;
+  uint64_t start, ns = 0, alloc_count = 0, ops = 0;
+  int32_t round, i;
+
+  listener = listener_new(&address);
+  socket_set_blocking(listener, false);
+
+  for (round = 0; round < ACCEPT_ROUNDS; round++) {
+    for (i = 0; i < BACKLOG; i++) {
+      clients[i] = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+      if (socket_connect_until(clients[i], address, sys_time_monotonic() + 5000) == false) {
+        fprintf(stderr, "failed to connect: %s\n", error_get_message());
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    alloc_count -= allocs_now();
+    start = bench_time_ns();
+    for (i = 0; i < BACKLOG && (accepted[i] = socket_accept(listener)) != NULL; i++);
+    ns += bench_time_ns() - start;
+    alloc_count += allocs_now();
+    ops += (uint64_t)i;
+
+    while (i-- > 0) {
+      socket_free(accepted[i]);
+    }
+
+    for (i = 0; i < BACKLOG; i++) {
+      socket_free(clients[i]);
+    }
+  }
+
+  report("socket_accept", ns, ops, alloc_count);
+  socket_address_free(address);
+  socket_free(listener);
+}
+
+static void bench_websocket_mask(void) {
+  static char payload[MASK_SIZE];
+  const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  uint64_t start, alloc_count;
+  int32_t i;
+
+  memset(payload, 'x', sizeof(payload));
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    websocket_mask(payload, sizeof(payload), mask, (uint64_t) i);
+  }
+  report("websocket_mask (4 KiB)", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+  BENCH_KEEP(payload[0]);
+}
+
+static void bench_line_reader(void) {
+  static char block[LINE_BLOCK];
+  SocketAddress *address;
+  Socket *listener, *client, *server;
+  LineReader *reader;
+  uint64_t start, ns = 0, alloc_count = 0;
+  size_t len;
+  int32_t round, i;
+
+  listener = listener_new(&address);
+  client = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  if (socket_connect_until(client, address, sys_time_monotonic() + 5000) == false ||
+      (server = socket_accept_until(listener, sys_time_monotonic() + 5000)) == NULL) {
+    fprintf(stderr, "failed to connect: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  memset(block, 'x', sizeof(block));
+  for (i = LINE_SIZE - 1; i < LINE_BLOCK; i += LINE_SIZE) {
+    block[i] = '\n';
+  }
+
+  reader = line_reader_new(server);
+
+  for (round = 0; round < LINE_ROUNDS; round++) {
+    if (socket_send_all_until(client, block, sizeof(block), sys_time_monotonic() + 5000, NULL) != (ssize_t) sizeof(block)) {
+      fprintf(stderr, "failed to send: %s\n", error_get_message());
+      exit(EXIT_FAILURE);
+    }
+
+    alloc_count -= allocs_now();
+    start = bench_time_ns();
+    for (i = 0; i < LINE_BLOCK / LINE_SIZE; i++) {
+      BENCH_KEEP(line_reader_read_until(reader, &len, sys_time_monotonic() + 5000));
+    }
+    ns += bench_time_ns() - start;
+    alloc_count += allocs_now();
+  }
+  report("line_reader_read_until (64 B)", ns, (uint64_t)LINE_ROUNDS * (LINE_BLOCK / LINE_SIZE), alloc_count);
+
+  line_reader_free(reader);
+  socket_free(server);
+  socket_free(client);
+  socket_free(listener);
+  socket_address_free(address);
+}
+
+static void bench_receive_would_block(void) {
+  SocketAddress *address;
+  Socket *listener, *client, *server;
+  char buffer[64];
+  uint64_t start, alloc_count;
+  int32_t i;
+
+  listener = listener_new(&address);
+  client = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  if (socket_connect_until(client, address, sys_time_monotonic() + 5000) == false ||
+      (server = socket_accept_until(listener, sys_time_monotonic() + 5000)) == NULL) {
+    fprintf(stderr, "failed to connect: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_set_blocking(server, false);
+
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    BENCH_KEEP(socket_receive(server, buffer, sizeof(buffer)));
+  }
+  report("socket_receive (would block)", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+
+  socket_free(server);
+  socket_free(client);
+  socket_free(listener);
+  socket_address_free(address);
+}
+
+int32_t main(int32_t argc, char **argv) {
+  struct sockaddr_in native;
+  SocketAddress *address;
+  Socket *socket;
+  uint64_t start, alloc_count;
+  int32_t i;
+
+  json_output = argc > 1 && strcmp(argv[1], "-j") == 0;
+  socket_init_once();
+
+  if (json_output) {
+    bench_json_begin(&json, stdout, "hotpath");
+  }
+
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < SYSCALL_ROUNDS; i++) {
+    socket = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+    socket_free(socket);
+  }
+  report("socket_new+socket_free", bench_time_ns() - start, SYSCALL_ROUNDS, allocs_now() - alloc_count);
+
+  bench_accept();
+
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    address = socket_address_new("192.168.10.20", 8080);
+    socket_address_free(address);
+  }
+  report("socket_address_new+free", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+
+  address = socket_address_new("2001:db8::8:800:200c:417a", 8080);
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    free(socket_address_get_address(address));
+  }
+  report("socket_address_get_address", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+  socket_address_free(address);
+
+  memset(&native, 0, sizeof(native));
+  native.sin_family = AF_INET;
+  native.sin_port = htons(8080);
+  native.sin_addr.s_addr = htonl(0xc0a80a14);
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    address = socket_address_new_from_native(&native, sizeof(native));
+    socket_address_free(address);
+  }
+  report("socket_address_new_from_native", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+
+  alloc_count = allocs_now();
+  start = bench_time_ns();
+  for (i = 0; i < ROUNDS; i++) {
+    error_set_error((int32_t)ERROR_IO_WOULD_BLOCK, 11, "Failed to call recv() on socket");
+  }
+  report("error_set_error", bench_time_ns() - start, ROUNDS, allocs_now() - alloc_count);
+
+  bench_websocket_mask();
+  bench_line_reader();
+  bench_receive_would_block();
+
+  if (json_output) {
+    bench_json_end(&json);
+  }
+
+  socket_close_once();
+
+  return 0;
+}
@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "socket.h"
+#include "poller.h"
+#include "thread.h"
+#include "histogram.h"
+#include "error.h"
+#include "bench.h"
+
+#define MAX_EVENTS 256
+#define RING_SIZE 4096
+#define HEADER_MAX 8192
+#define READ_CHUNK (64 * 1024)
+#define SWEEP_MS 100
+
+typedef enum {
+  MODE_HTTP = 0, /* HTTP/1.1 GET, responses framed by Content-Length. */
+  MODE_TCP  = 1  /* Fixed size messages echoed back by the server. */
+} Mode;
+
+/* One connection. Entries [head, sent) of the ring are the scheduled times
+ * of requests on the wire, [sent, tail) requests waiting for a pipeline
+ * slot. Latency is taken from the scheduled time. */
+typedef struct {
+  Socket *socket;
+  bool connecting;
+  SocketIOCondition condition;
+  uint64_t *ring;
+  uint32_t head;
+  uint32_t sent;
+  uint32_t tail;
+  size_t out_offset;
+  char *header;
+  size_t header_len;
+  uint64_t body_left;
+  bool in_body;
+  int32_t status;
+} Conn;
+
+typedef struct {
+  Thread *thread;
+  Poller *poller;
+  Conn *conns;
+  int32_t count;
+  uint32_t next_conn;
+  uint64_t interval;
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t non2xx;
+  uint64_t dropped;
+  uint64_t errors_connect;
+  uint64_t errors_read;
+  uint64_t errors_write;
+  uint64_t errors_timeout;
+  char *scratch;
+} Worker;
+
+static Mode mode = MODE_HTTP;
+static SocketAddress *target = NULL;
+static const char *target_text = NULL;
+static int32_t threads = 2;
+static int32_t connections = 10;
+static uint32_t depth = 1;
+static uint64_t rate = 0;
+static uint32_t duration = 10;
+static uint32_t timeout = 2000;
+static size_t message_size = 64;
+static bool json_output = false;
+
+static char *request = NULL;
+static size_t request_len = 0;
+static char *batch = NULL;
+static Histogram *latency = NULL;
+static uint64_t start_ns, end_ns;
+
+static void conn_open(Worker *worker, Conn *conn);
+
+static void conn_watch(Worker *worker, Conn *conn, SocketIOCondition condition) {
+  if (conn->condition != condition) {
+    poller_modify(worker->poller, conn->socket, condition, conn);
+    conn->condition = condition;
+  }
+}
+
+static void conn_schedule(Worker *worker, Conn *conn, uint64_t when) {
+  if (conn->tail - conn->head == RING_SIZE) {
+    worker->dropped++;
+    return;
+  }
+
+  conn->ring[conn->tail++ % RING_SIZE] = when;
+}
+
+/* Without a target rate every connection keeps depth requests in flight */
+static void conn_fill(Worker *worker, Conn *conn, uint64_t now) {
+  if (rate == 0) {
+    while (conn->tail - conn->head < depth) {
+      conn_schedule(worker, conn, now);
+    }
+  }
+}
+
+static void conn_reset(Worker *worker, Conn *conn, uint64_t *counter) {
+  (*counter)++;
+  poller_remove(worker->poller, conn->socket);
+  socket_free(conn->socket);
+  conn->head = conn->sent = conn->tail = 0;
+  conn->out_offset = 0;
+  conn->header_len = 0;
+  conn->body_left = 0;
+  conn->in_body = false;
+
+  conn->socket = NULL;
+
+  /* Refused connections are retried by the next sweep instead of spinning */
+  if (counter != &worker->errors_connect && bench_time_ns() < end_ns) {
+    conn_open(worker, conn);
+  }
+}
+
+/* Writes as many pipelined requests as the window and the socket take */
+static void conn_flush(Worker *worker, Conn *conn) {
+  size_t pending, waiting;
+  ssize_t ret;
+
+  while ((waiting = conn->tail - conn->sent) > 0 && conn->sent - conn->head < depth) {
+    if (waiting > depth - (conn->sent - conn->head)) {
+      waiting = depth - (conn->sent - conn->head);
+    }
+
+    pending = waiting * request_len - conn->out_offset;
+    ret = socket_send(conn->socket, batch + conn->out_offset, pending);
+
+    if (ret < 0) {
+      if (error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK) {
+        conn_watch(worker, conn, SOCKET_IO_CONDITION_POLLIN | SOCKET_IO_CONDITION_POLLOUT);
+      } else {
+        conn_reset(worker, conn, &worker->errors_write);
+      }
+
+      return;
+    }
+
+    conn->out_offset += (size_t)ret;
+    conn->sent += (uint32_t)(conn->out_offset / request_len);
+    conn->out_offset %= request_len;
+
+    if ((size_t)ret < pending) {
+      conn_watch(worker, conn, SOCKET_IO_CONDITION_POLLIN | SOCKET_IO_CONDITION_POLLOUT);
+      return;
+    }
+  }
+
+  conn_watch(worker, conn, SOCKET_IO_CONDITION_POLLIN);
+}
+
+static void conn_open(Worker *worker, Conn *conn) {
+  conn->socket = socket_new(socket_address_get_family(target), SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  if (conn->socket == NULL) {
+    fprintf(stderr, "failed to create a socket: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_set_blocking(conn->socket, false);
+  bench_set_nodelay(socket_get_fd(conn->socket));
+  conn->connecting = !socket_connect(conn->socket, target);
+
+  if (conn->connecting && error_get_code() != (int32_t)ERROR_IO_IN_PROGRESS &&
+      error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+    worker->errors_connect++;
+    socket_free(conn->socket);
+    conn->socket = NULL;
+    return;
+  }
+
+  conn->condition = conn->connecting ? SOCKET_IO_CONDITION_POLLOUT : SOCKET_IO_CONDITION_POLLIN;
+  poller_add(worker->poller, conn->socket, conn->condition, conn);
+  conn_fill(worker, conn, bench_time_ns());
+
+  if (conn->connecting == false) {
+    conn_flush(worker, conn);
+  }
+}
+
+static void conn_complete(Worker *worker, Conn *conn, uint64_t now) {
+  uint64_t scheduled = conn->ring[conn->head++ % RING_SIZE];
+
+  if (mode == MODE_HTTP && (conn->status < 200 || conn->status >= 400)) {
+    worker->non2xx++;
+  }
+
+  histogram_record(latency, now - scheduled);
+  worker->requests++;
+  conn_fill(worker, conn, now);
+}
+
+static bool header_is(const char *line, const char *end, const char *name) {
+  for (; *name != '\0'; line++, name++) {
+    if (line == end || tolower((unsigned char)*line) != *name) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool header_parse(Conn *conn) {
+  const char *line, *end = conn->header + conn->header_len;
+
+  if (conn->header_len < 12 || memcmp(conn->header, "HTTP/1.", 7) != 0) {
+    return false;
+  }
+
+  conn->status = atoi(conn->header + 9);
+  conn->body_left = 0;
+
+  for (line = conn->header; line < end && (line = memchr(line, '\n', (size_t)(end - line))) != NULL; ) {
+    line++;
+
+    if (header_is(line, end, "content-length:")) {
+      conn->body_left = strtoull(line + 15, NULL, 10);
+    } else if (header_is(line, end, "transfer-encoding:")) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Feeds received bytes through the response framing, returns false when
+ * the stream can't be parsed */
+static bool conn_consume(Worker *worker, Conn *conn, const char *data, size_t len, uint64_t now) {
+  const char *found;
+  size_t take, from;
+
+  /* body_left counts the echoed bytes not yet matched to a request */
+  if (mode == MODE_TCP) {
+    conn->body_left += len;
+
+    while (conn->body_left >= request_len && conn->head != conn->sent) {
+      conn->body_left -= request_len;
+      conn_complete(worker, conn, now);
+    }
+
+    return true;
+  }
+
+  while (len > 0) {
+    if (conn->head == conn->sent) {
+      return false;
+    }
+
+    if (conn->in_body) {
+      take = conn->body_left < len ? (size_t)conn->body_left : len;
+      conn->body_left -= take;
+      data += take;
+      len -= take;
+    } else {
+      from = conn->header_len > 3 ? conn->header_len - 3 : 0;
+      take = HEADER_MAX - conn->header_len < len ? HEADER_MAX - conn->header_len : len;
+      memcpy(conn->header + conn->header_len, data, take);
+      conn->header_len += take;
+      found = NULL;
+
+      for (; from + 4 <= conn->header_len; from++) {
+        if (memcmp(conn->header + from, "\r\n\r\n", 4) == 0) {
+          found = conn->header + from + 4;
+          break;
+        }
+      }
+
+      if (found == NULL) {
+        if (conn->header_len == HEADER_MAX) {
+          return false;
+        }
+
+        return true;
+      }
+
+      take -= conn->header_len - (size_t)(found - conn->header);
+      conn->header_len = (size_t)(found - conn->header);
+      data += take;
+      len -= take;
+
+      if (header_parse(conn) == false) {
+        return false;
+      }
+
+      conn->header_len = 0;
+      conn->in_body = true;
+    }
+
+    if (conn->in_body && conn->body_left == 0) {
+      conn->in_body = false;
+      conn_complete(worker, conn, now);
+    }
+  }
+
+  return true;
+}
+
+static void conn_readable(Worker *worker, Conn *conn, uint64_t now) {
+  ssize_t ret = socket_receive(conn->socket, worker->scratch, READ_CHUNK);
+
+  if (ret < 0 && error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK) {
+    return;
+  }
+
+  if (ret <= 0 || conn_consume(worker, conn, worker->scratch, (size_t)ret, now) == false) {
+    conn_reset(worker, conn, &worker->errors_read);
+    return;
+  }
+
+  worker->bytes += (uint64_t)ret;
+  conn_flush(worker, conn);
+}
+
+static void conn_event(Worker *worker, PollerEvent *event, uint64_t now) {
+  Conn *conn = event->data;
+
+  if (conn->connecting) {
+    if (event->error || socket_check_connect_result(conn->socket) == false) {
+      conn_reset(worker, conn, &worker->errors_connect);
+      return;
+    }
+
+    conn->connecting = false;
+    conn_flush(worker, conn);
+    return;
+  }
+
+  if (event->condition & SOCKET_IO_CONDITION_POLLIN || event->error) {
+    conn_readable(worker, conn, now);
+  } else if (event->condition & SOCKET_IO_CONDITION_POLLOUT) {
+    conn_flush(worker, conn);
+  }
+}
+
+static void worker_sweep(Worker *worker, uint64_t now) {
+  uint64_t limit = (uint64_t)timeout * 1000000ull;
+  int32_t i;
+
+  for (i = 0; i < worker->count; i++) {
+    Conn *conn = &worker->conns[i];
+
+    if (conn->socket == NULL) {
+      conn_open(worker, conn);
+    } else if (conn->head != conn->sent && now - conn->ring[conn->head % RING_SIZE] > limit) {
+      conn_reset(worker, conn, &worker->errors_timeout);
+    }
+  }
+}
+
+static void worker_run(void *data) {
+  Worker *worker = data;
+  PollerEvent events[MAX_EVENTS];
+  uint64_t now, next, sweep;
+  int32_t i, n, wait;
+  Conn *conn;
+
+  for (i = 0; i < worker->count; i++) {
+    conn_open(worker, &worker->conns[i]);
+  }
+
+  next = start_ns;
+  sweep = start_ns + (uint64_t)SWEEP_MS * 1000000ull;
+
+  while ((now = bench_time_ns()) < end_ns) {
+    /* Constant throughput, requests go round robin over the connections */
+    while (worker->interval != 0 && next <= now) {
+      conn = &worker->conns[worker->next_conn++ % (uint32_t)worker->count];
+
+      if (conn->socket == NULL) {
+        worker->dropped++;
+      } else {
+        conn_schedule(worker, conn, next);
+
+        if (conn->connecting == false) {
+          conn_flush(worker, conn);
+        }
+      }
+
+      next += worker->interval;
+    }
+
+    if (now >= sweep) {
+      worker_sweep(worker, now);
+      sweep = now + (uint64_t)SWEEP_MS * 1000000ull;
+    }
+
+    wait = worker->interval == 0 ? SWEEP_MS : (next > now + 1000000ull ? (int32_t)((next - now) / 1000000ull) : 0);
+    n = poller_wait(worker->poller, events, MAX_EVENTS, wait);
+    now = bench_time_ns();
+
+    for (i = 0; i < n; i++) {
+      if (((Conn *)events[i].data)->socket != NULL) {
+        conn_event(worker, &events[i], now);
+      }
+    }
+  }
+}
+
+static bool parse_target(const char *text) {
+  char host[256], path[1024];
+  const char *rest, *colon, *slash;
+  uint16_t port;
+  size_t len;
+
+  if (strncmp(text, "http://", 7) == 0) {
+    mode = MODE_HTTP;
+    rest = text + 7;
+    port = 80;
+  } else if (strncmp(text, "tcp://", 6) == 0) {
+    mode = MODE_TCP;
+    rest = text + 6;
+    port = 0;
+  } else {
+    return false;
+  }
+
+  slash = strchr(rest, '/');
+  len = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+
+  if (len == 0 || len >= sizeof(host)) {
+    return false;
+  }
+
+  memcpy(host, rest, len);
+  host[len] = '\0';
+  snprintf(path, sizeof(path), "%s", slash != NULL ? slash : "/");
+
+  if ((colon = strrchr(host, ':')) != NULL && strchr(host, ']') < colon) {
+    port = (uint16_t)atoi(colon + 1);
+    host[colon - host] = '\0';
+  }
+
+  if (host[0] == '[') {
+    memmove(host, host + 1, strlen(host));
+    host[strlen(host) - 1] = '\0';
+  }
+
+  if (port == 0) {
+    return false;
+  }
+
+  target = socket_address_new(strcmp(host, "localhost") == 0 ? "127.0.0.1" : host, port);
+
+  if (target == NULL) {
+    return false;
+  }
+
+  if (mode == MODE_HTTP) {
+    request_len = (size_t)snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+    request = malloc(request_len + 1);
+    snprintf(request, request_len + 1, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+  } else {
+    request_len = message_size;
+    request = malloc(request_len);
+    memset(request, 'x', request_len);
+  }
+
+  return true;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+    "usage: %s [options] http://host:port/path | tcp://host:port\n"
+    "  -t threads      worker threads (2)\n"
+    "  -c connections  connections in total (10)\n"
+    "  -d seconds      test duration (10)\n"
+    "  -p depth        requests pipelined per connection (1)\n"
+    "  -R rate         constant throughput in requests/sec, 0 for as fast as possible (0)\n"
+    "  -T msec         request timeout (2000)\n"
+    "  -s bytes        message size in tcp mode (64)\n"
+    "  -j              print the results as json\n", program);
+  exit(EXIT_FAILURE);
+}
+
+static void report(Worker *workers, double seconds) {
+  static const double percentiles[] = { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99 };
+  static const char *names[] = { "p50", "p75", "p90", "p99", "p999", "p9999" };
+  uint64_t values[6], requests = 0, bytes = 0, non2xx = 0, dropped = 0;
+  uint64_t connect = 0, read = 0, write = 0, timed_out = 0;
+  char key[32];
+  BenchJson json;
+  int32_t i;
+
+  for (i = 0; i < threads; i++) {
+    requests += workers[i].requests;
+    bytes += workers[i].bytes;
+    non2xx += workers[i].non2xx;
+    dropped += workers[i].dropped;
+    connect += workers[i].errors_connect;
+    read += workers[i].errors_read;
+    write += workers[i].errors_write;
+    timed_out += workers[i].errors_timeout;
+  }
+
+  histogram_get_percentiles(latency, percentiles, values, 6);
+
+  if (json_output) {
+    bench_json_begin(&json, stdout, "loadgen");
+    bench_json_result_begin(&json, mode == MODE_HTTP ? "http" : "tcp");
+    bench_json_string(&json, "target", target_text);
+    bench_json_int(&json, "threads", threads);
+    bench_json_int(&json, "connections", connections);
+    bench_json_int(&json, "pipeline", depth);
+    bench_json_int(&json, "rate", (int64_t)rate);
+    bench_json_double(&json, "duration_sec", seconds);
+    bench_json_int(&json, "requests", (int64_t)requests);
+    bench_json_int(&json, "bytes_read", (int64_t)bytes);
+    bench_json_double(&json, "requests_per_sec", (double)requests / seconds);
+    bench_json_double(&json, "bytes_per_sec", (double)bytes / seconds);
+
+    for (i = 0; i < 6; i++) {
+      snprintf(key, sizeof(key), "latency_%s_us", names[i]);
+      bench_json_double(&json, key, (double)values[i] / 1000.0);
+    }
+
+    bench_json_double(&json, "latency_max_us", (double)histogram_get_max(latency) / 1000.0);
+    bench_json_double(&json, "latency_mean_us", histogram_get_mean(latency) / 1000.0);
+    bench_json_int(&json, "non2xx", (int64_t)non2xx);
+    bench_json_int(&json, "dropped", (int64_t)dropped);
+    bench_json_int(&json, "errors_connect", (int64_t)connect);
+    bench_json_int(&json, "errors_read", (int64_t)read);
+    bench_json_int(&json, "errors_write", (int64_t)write);
+    bench_json_int(&json, "errors_timeout", (int64_t)timed_out);
+    bench_json_result_end(&json);
+    bench_json_end(&json);
+    return;
+  }
+
+  printf("%d threads and %d connections, pipeline %u, ", threads, connections, depth);
+
+  if (rate != 0) {
+    printf("%llu requests/sec\n", (unsigned long long)rate);
+  } else {
+    printf("unthrottled\n");
+  }
+
+  printf("  Latency (usec)");
+
+  for (i = 0; i < 6; i++) {
+    printf(" %5s %9.1f", names[i], (double)values[i] / 1000.0);
+  }
+
+  printf("   max %9.1f\n", (double)histogram_get_max(latency) / 1000.0);
+  printf("  %llu requests in %.2fs, %.2f MB read\n", (unsigned long long)requests, seconds,
+    (double)bytes / (1024.0 * 1024.0));
+
+  if (connect + read + write + timed_out != 0) {
+    printf("  Socket errors: connect %llu, read %llu, write %llu, timeout %llu\n",
+      (unsigned long long)connect, (unsigned long long)read,
+      (unsigned long long)write, (unsigned long long)timed_out);
+  }
+
+  if (non2xx != 0) {
+    printf("  Non-2xx or 3xx responses: %llu\n", (unsigned long long)non2xx);
+  }
+
+  if (dropped != 0) {
+    printf("  Requests not scheduled: %llu\n", (unsigned long long)dropped);
+  }
+
+  printf("Requests/sec: %12.2f\n", (double)requests / seconds);
+  printf("Transfer/sec: %12.2f MB\n", (double)bytes / seconds / (1024.0 * 1024.0));
+}
+
+int32_t main(int32_t argc, char **argv) {
+  Worker *workers;
+  int32_t i, j, share;
+
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-j") == 0) {
+      json_output = true;
+      continue;
+    }
+
+    if (i + 1 == argc - 1 || argv[i][0] != '-') {
+      usage(argv[0]);
+    }
+
+    switch (argv[i][1]) {
+      case 't': threads = atoi(argv[++i]); break;
+      case 'c': connections = atoi(argv[++i]); break;
+      case 'd': duration = (uint32_t)atoi(argv[++i]); break;
+      case 'p': depth = (uint32_t)atoi(argv[++i]); break;
+      case 'R': rate = strtoull(argv[++i], NULL, 10); break;
+      case 'T': timeout = (uint32_t)atoi(argv[++i]); break;
+      case 's': message_size = (size_t)atoi(argv[++i]); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  socket_init_once();
+
+  if (argc < 2 || threads <= 0 || connections < threads || depth == 0 || depth > RING_SIZE ||
+      duration == 0 || message_size == 0 || parse_target(argv[argc - 1]) == false) {
+    usage(argv[0]);
+  }
+
+  target_text = argv[argc - 1];
+  bench_raise_fd_limit(connections + threads * 4 + 64);
+
+  batch = malloc(request_len * depth);
+
+  for (i = 0; i < (int32_t)depth; i++) {
+    memcpy(batch + (size_t)i * request_len, request, request_len);
+  }
+
+  latency = histogram_new();
+  workers = calloc(sizeof(Worker), (size_t)threads);
+  start_ns = bench_time_ns();
+  end_ns = start_ns + (uint64_t)duration * 1000000000ull;
+
+  for (i = 0; i < threads; i++) {
+    share = connections / threads + (i < connections % threads);
+    workers[i].count = share;
+    workers[i].conns = calloc(sizeof(Conn), (size_t)share);
+    workers[i].poller = poller_new();
+    workers[i].scratch = malloc(READ_CHUNK);
+    workers[i].interval = rate != 0 ? (uint64_t)threads * 1000000000ull / rate : 0;
+
+    for (j = 0; j < share; j++) {
+      workers[i].conns[j].ring = malloc(sizeof(uint64_t) * RING_SIZE);
+      workers[i].conns[j].header = mode == MODE_HTTP ? malloc(HEADER_MAX) : NULL;
+    }
+
+    workers[i].thread = thread_new(worker_run, &workers[i]);
+  }
+
+  for (i = 0; i < threads; i++) {
+    thread_join(workers[i].thread);
+  }
+
+  report(workers, (double)(bench_time_ns() - start_ns) / 1e9);
+
+  for (i = 0; i < threads; i++) {
+    for (j = 0; j < workers[i].count; j++) {
+      if (workers[i].conns[j].socket != NULL) {
+        socket_free(workers[i].conns[j].socket);
+      }
+
+      free(workers[i].conns[j].ring);
+      free(workers[i].conns[j].header);
+    }
+
+    poller_free(workers[i].poller);
+    free(workers[i].conns);
+    free(workers[i].scratch);
+  }
+
+  free(workers);
+  free(batch);
+  free(request);
+  histogram_free(latency);
+  socket_address_free(target);
+  socket_close_once();
+
+  return 0;
+}
@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "socket.h"
+#include "poller.h"
+#include "thread.h"
+#include "histogram.h"
+#include "error.h"
+#include "bench.h"
+
+#define MESSAGE_SIZE 64
+#define MAX_EVENTS 256
+#define BULK_CHUNK (64 * 1024)
+#define RING_SIZE 4096
+#define WARMUP_MS 200
+#define IO_DEADLINE_MS 1000
+
+typedef struct EchoConn {
+  Socket *socket;
+  struct EchoConn *prev;
+  struct EchoConn *next;
+} EchoConn;
+
+/* In-process server, echoes everything back or just counts the bytes */
+typedef struct {
+  Socket *listener;
+  SocketAddress *address;
+  Thread *thread;
+  bool sink;
+  atomic_bool stop;
+  atomic_uint_fast64_t bytes;
+} EchoServer;
+
+/* Client side of one connection. The ring holds the send times of the
+ * requests still in flight, oldest first. */
+typedef struct {
+  Socket *socket;
+  size_t received;
+  uint64_t *ring;
+  uint32_t head;
+  uint32_t tail;
+} Client;
+
+typedef struct {
+  Socket *socket;
+  atomic_bool stop;
+  atomic_uint_fast64_t received;
+} UdpReceiver;
+
+static uint32_t duration = 2000;
+static uint32_t rate = 20000;
+static int32_t max_connections = 10000;
+static const char *only = NULL;
+static char payload[BULK_CHUNK];
+
+static double ns_to_usec(uint64_t ns) {
+  return (double)ns / 1000.0;
+}
+
+static void echo_server_close(Poller *poller, EchoConn **conns, EchoConn *conn) {
+  poller_remove(poller, conn->socket);
+  socket_free(conn->socket);
+
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    *conns = conn->next;
+  }
+
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+
+  free(conn);
+}
+
+static void echo_server_run(void *data) {
+  EchoServer *server = data;
+  PollerEvent events[MAX_EVENTS];
+  EchoConn *conns = NULL, *conn;
+  Socket *client;
+  Poller *poller;
+  char *buffer;
+  ssize_t ret;
+  int32_t i, n;
+
+  poller = poller_new();
+  buffer = malloc(BULK_CHUNK);
+  poller_add(poller, server->listener, SOCKET_IO_CONDITION_POLLIN, NULL);
+
+  while (atomic_load(&server->stop) == false) {
+    n = poller_wait(poller, events, MAX_EVENTS, 50);
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data == NULL) {
+        while ((client = socket_accept(server->listener)) != NULL) {
+          conn = calloc(sizeof(EchoConn), 1);
+          conn->socket = client;
+          conn->next = conns;
+
+          if (conns != NULL) {
+            conns->prev = conn;
+          }
+
+          conns = conn;
+          socket_set_blocking(client, false);
+          bench_set_nodelay(socket_get_fd(client));
+          poller_add(poller, client, SOCKET_IO_CONDITION_POLLIN, conn);
+        }
+
+        continue;
+      }
+
+      conn = events[i].data;
+      ret = socket_receive(conn->socket, buffer, BULK_CHUNK);
+
+      if (ret > 0) {
+        atomic_fetch_add_explicit(&server->bytes, (uint64_t)ret, memory_order_relaxed);
+
+        if (server->sink || socket_send_all_until(conn->socket, buffer, (size_t)ret,
+            sys_time_monotonic() + IO_DEADLINE_MS, NULL) == ret) {
+          continue;
+        }
+      } else if (ret < 0 && error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK) {
+        continue;
+      }
+
+      echo_server_close(poller, &conns, conn);
+    }
+  }
+
+  while (conns != NULL) {
+    echo_server_close(poller, &conns, conns);
+  }
+
+  free(buffer);
+  poller_free(poller);
+}
+
+static EchoServer *echo_server_start(bool sink) {
+  EchoServer *server = calloc(sizeof(EchoServer), 1);
+  SocketAddress *any = socket_address_new_loopback(SOCKET_FAMILY_INET, 0);
+
+  server->sink = sink;
+  server->listener = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  if (server->listener == NULL || socket_bind(server->listener, any, true) == false) {
+    fprintf(stderr, "failed to start the echo server: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_set_listen_backlog(server->listener, 4096);
+  socket_set_blocking(server->listener, false);
+
+  if (socket_listen(server->listener) == false) {
+    fprintf(stderr, "failed to start the echo server: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_address_free(any);
+  server->address = socket_get_local_address(server->listener);
+  server->thread = thread_new(echo_server_run, server);
+
+  return server;
+}
+
+static uint64_t echo_server_stop(EchoServer *server) {
+  uint64_t bytes;
+
+  atomic_store(&server->stop, true);
+  thread_join(server->thread);
+  bytes = atomic_load(&server->bytes);
+  socket_free(server->listener);
+  socket_address_free(server->address);
+  free(server);
+
+  return bytes;
+}
+
+static Client *clients_connect(EchoServer *server, int32_t count, bool pipelined, Poller *poller) {
+  Client *clients = calloc(sizeof(Client), (size_t)count);
+  int32_t i;
+
+  for (i = 0; i < count; i++) {
+    clients[i].socket = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+    if (clients[i].socket == NULL ||
+        socket_connect_until(clients[i].socket, server->address, sys_time_monotonic() + 5000) == false) {
+      fprintf(stderr, "connection %d failed: %s\n", i, error_get_message());
+      exit(EXIT_FAILURE);
+    }
+
+    socket_set_blocking(clients[i].socket, false);
+    bench_set_nodelay(socket_get_fd(clients[i].socket));
+
+    if (pipelined) {
+      clients[i].ring = malloc(sizeof(uint64_t) * RING_SIZE);
+    }
+
+    poller_add(poller, clients[i].socket, SOCKET_IO_CONDITION_POLLIN, &clients[i]);
+  }
+
+  return clients;
+}
+
+static void clients_free(Client *clients, int32_t count) {
+  int32_t i;
+
+  for (i = 0; i < count; i++) {
+    socket_free(clients[i].socket);
+    free(clients[i].ring);
+  }
+
+  free(clients);
+}
+
+static void report_latency(BenchJson *json, Histogram *latency) {
+  HistogramSummary summary;
+
+  histogram_get_summary(latency, &summary);
+  bench_json_double(json, "latency_p50_us", ns_to_usec(summary.p50));
+  bench_json_double(json, "latency_p99_us", ns_to_usec(summary.p99));
+  bench_json_double(json, "latency_p999_us", ns_to_usec(summary.p999));
+  bench_json_double(json, "latency_max_us", ns_to_usec(summary.max));
+  bench_json_double(json, "latency_mean_us", summary.mean / 1000.0);
+}
+
+/* Closed loop, every connection keeps one message in flight */
+static void bench_tcp_echo(BenchJson *json, int32_t connections) {
+  PollerEvent events[MAX_EVENTS];
+  char buffer[MESSAGE_SIZE];
+  uint64_t now, start, end, requests = 0;
+  int32_t requested = connections, limit, i, n;
+  EchoServer *server;
+  Histogram *latency;
+  Poller *poller;
+  Client *clients, *client;
+  ssize_t ret;
+
+  limit = bench_raise_fd_limit(connections * 2 + 64);
+
+  if (connections * 2 + 64 > limit) {
+    connections = (limit - 64) / 2;
+  }
+
+  server = echo_server_start(false);
+  poller = poller_new();
+  latency = histogram_new();
+  clients = clients_connect(server, connections, true, poller);
+
+  start = bench_time_ns();
+  end = start + (uint64_t)(duration + WARMUP_MS) * 1000000ull;
+
+  for (i = 0; i < connections; i++) {
+    clients[i].ring[0] = start;
+    socket_send_all_until(clients[i].socket, payload, MESSAGE_SIZE, sys_time_monotonic() + IO_DEADLINE_MS, NULL);
+  }
+
+  start += (uint64_t)WARMUP_MS * 1000000ull;
+
+  while ((now = bench_time_ns()) < end) {
+    n = poller_wait(poller, events, MAX_EVENTS, 10);
+    now = bench_time_ns();
+
+    for (i = 0; i < n; i++) {
+      client = events[i].data;
+      ret = socket_receive(client->socket, buffer, MESSAGE_SIZE - client->received);
+
+      if (ret <= 0) {
+        continue;
+      }
+
+      client->received += (size_t)ret;
+
+      if (client->received < MESSAGE_SIZE) {
+        continue;
+      }
+
+      if (client->ring[0] >= start) {
+        histogram_record(latency, now - client->ring[0]);
+        requests++;
+      }
+
+      client->received = 0;
+      client->ring[0] = now;
+      socket_send_all_until(client->socket, payload, MESSAGE_SIZE, sys_time_monotonic() + IO_DEADLINE_MS, NULL);
+    }
+  }
+
+  bench_json_result_begin(json, "tcp_echo");
+  bench_json_int(json, "connections", connections);
+  bench_json_int(json, "connections_requested", requested);
+  bench_json_int(json, "message_size", MESSAGE_SIZE);
+  bench_json_int(json, "duration_ms", duration);
+  bench_json_int(json, "requests", (int64_t)requests);
+  bench_json_double(json, "requests_per_sec", (double)requests * 1e9 / (double)(end - start));
+  report_latency(json, latency);
+  bench_json_result_end(json);
+
+  clients_free(clients, connections);
+  histogram_free(latency);
+  poller_free(poller);
+  echo_server_stop(server);
+}
+
+/* Open loop at a fixed offered rate. Latency is measured from the time a
+ * request was scheduled to go out rather than from when it was actually
+ * sent, so stalls on either side are charged to every request queued
+ * behind them instead of being hidden by coordinated omission. */
+static void bench_tcp_fixed_rate(BenchJson *json, int32_t connections) {
+  PollerEvent events[MAX_EVENTS];
+  char buffer[MESSAGE_SIZE * 16];
+  uint64_t now, start, end, next, interval, sent = 0, requests = 0, dropped = 0;
+  int32_t i, n, timeout;
+  EchoServer *server;
+  Histogram *latency;
+  Poller *poller;
+  Client *clients, *client;
+  ssize_t ret;
+
+  server = echo_server_start(false);
+  poller = poller_new();
+  latency = histogram_new();
+  clients = clients_connect(server, connections, true, poller);
+
+  interval = 1000000000ull / rate;
+  start = bench_time_ns();
+  next = start;
+  end = start + (uint64_t)(duration + WARMUP_MS) * 1000000ull;
+  start += (uint64_t)WARMUP_MS * 1000000ull;
+
+  for (;;) {
+    now = bench_time_ns();
+
+    while (next <= now && next < end) {
+      client = &clients[sent++ % (uint64_t)connections];
+
+      if (client->tail - client->head == RING_SIZE) {
+        dropped++;
+      } else {
+        client->ring[client->tail++ % RING_SIZE] = next;
+        socket_send_all_until(client->socket, payload, MESSAGE_SIZE, sys_time_monotonic() + IO_DEADLINE_MS, NULL);
+      }
+
+      next += interval;
+    }
+
+    if (next >= end) {
+      for (i = 0; i < connections && clients[i].head == clients[i].tail; i++);
+
+      if (i == connections || now > end + (uint64_t)IO_DEADLINE_MS * 1000000ull) {
+        break;
+      }
+    }
+
+    /* Spin when the next request is due within the poller's resolution */
+    timeout = next > now + 1000000ull ? (int32_t)((next - now) / 1000000ull) : 0;
+    n = poller_wait(poller, events, MAX_EVENTS, timeout);
+    now = bench_time_ns();
+
+    for (i = 0; i < n; i++) {
+      client = events[i].data;
+      ret = socket_receive(client->socket, buffer, sizeof(buffer));
+
+      if (ret <= 0) {
+        continue;
+      }
+
+      for (client->received += (size_t)ret; client->received >= MESSAGE_SIZE; client->received -= MESSAGE_SIZE) {
+        uint64_t scheduled = client->ring[client->head++ % RING_SIZE];
+
+        if (scheduled >= start) {
+          histogram_record(latency, now - scheduled);
+          requests++;
+        }
+      }
+    }
+  }
+
+  bench_json_result_begin(json, "tcp_fixed_rate");
+  bench_json_int(json, "connections", connections);
+  bench_json_int(json, "offered_rate", rate);
+  bench_json_int(json, "message_size", MESSAGE_SIZE);
+  bench_json_int(json, "duration_ms", duration);
+  bench_json_int(json, "requests", (int64_t)requests);
+  bench_json_int(json, "dropped", (int64_t)dropped);
+  bench_json_double(json, "requests_per_sec", (double)requests * 1e9 / (double)(end - start));
+  report_latency(json, latency);
+  bench_json_result_end(json);
+
+  clients_free(clients, connections);
+  histogram_free(latency);
+  poller_free(poller);
+  echo_server_stop(server);
+}
+
+static void udp_receiver_run(void *data) {
+  UdpReceiver *receiver = data;
+  char buffer[2048];
+
+  while (atomic_load(&receiver->stop) == false) {
+    if (socket_receive(receiver->socket, buffer, sizeof(buffer)) > 0) {
+      atomic_fetch_add_explicit(&receiver->received, 1, memory_order_relaxed);
+    }
+  }
+}
+
+static void bench_udp_pps(BenchJson *json) {
+  UdpReceiver receiver;
+  SocketAddress *any, *address;
+  Socket *sender;
+  Thread *thread;
+  uint64_t start, end, sent = 0, received;
+
+  memset(&receiver, 0, sizeof(receiver));
+  any = socket_address_new_loopback(SOCKET_FAMILY_INET, 0);
+  receiver.socket = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_DATAGRAM, SOCKET_PROTOCOL_UDP);
+  sender = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_DATAGRAM, SOCKET_PROTOCOL_UDP);
+
+  if (receiver.socket == NULL || sender == NULL || socket_bind(receiver.socket, any, true) == false) {
+    fprintf(stderr, "failed to set up the UDP sockets: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  socket_set_buffer_size(receiver.socket, SOCKET_DIRECTION_RCV, 4 * 1024 * 1024);
+  socket_set_timeout(receiver.socket, 50);
+  address = socket_get_local_address(receiver.socket);
+  thread = thread_new(udp_receiver_run, &receiver);
+
+  start = bench_time_ns();
+  end = start + (uint64_t)duration * 1000000ull;
+
+  while (bench_time_ns() < end) {
+    if (socket_send_to(sender, address, payload, MESSAGE_SIZE) == MESSAGE_SIZE) {
+      sent++;
+    }
+  }
+
+  end = bench_time_ns();
+  thread_sleep(100);
+  atomic_store(&receiver.stop, true);
+  thread_join(thread);
+  received = atomic_load(&receiver.received);
+
+  bench_json_result_begin(json, "udp_pps");
+  bench_json_int(json, "datagram_size", MESSAGE_SIZE);
+  bench_json_int(json, "duration_ms", duration);
+  bench_json_int(json, "sent", (int64_t)sent);
+  bench_json_int(json, "received", (int64_t)received);
+  bench_json_double(json, "sent_per_sec", (double)sent * 1e9 / (double)(end - start));
+  bench_json_double(json, "received_per_sec", (double)received * 1e9 / (double)(end - start));
+  bench_json_double(json, "loss_percent", sent ? 100.0 * (double)(sent - received) / (double)sent : 0.0);
+  bench_json_result_end(json);
+
+  socket_address_free(address);
+  socket_address_free(any);
+  socket_free(receiver.socket);
+  socket_free(sender);
+}
+
+/* One connection, as many bytes as the stack takes */
+static void bench_tcp_bulk(BenchJson *json) {
+  EchoServer *server = echo_server_start(true);
+  Socket *socket;
+  uint64_t start, end, sent = 0, received;
+
+  socket = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+  if (socket == NULL || socket_connect_until(socket, server->address, sys_time_monotonic() + 5000) == false) {
+    fprintf(stderr, "bulk connection failed: %s\n", error_get_message());
+    exit(EXIT_FAILURE);
+  }
+
+  start = bench_time_ns();
+  end = start + (uint64_t)duration * 1000000ull;
+
+  while (bench_time_ns() < end) {
+    if (socket_send_all_until(socket, payload, BULK_CHUNK, sys_time_monotonic() + IO_DEADLINE_MS, NULL) != BULK_CHUNK) {
+      break;
+    }
+
+    sent += BULK_CHUNK;
+  }
+
+  end = bench_time_ns();
+  socket_free(socket);
+  thread_sleep(100);
+  received = echo_server_stop(server);
+
+  bench_json_result_begin(json, "tcp_bulk");
+  bench_json_int(json, "chunk_size", BULK_CHUNK);
+  bench_json_int(json, "duration_ms", duration);
+  bench_json_int(json, "bytes_sent", (int64_t)sent);
+  bench_json_int(json, "bytes_received", (int64_t)received);
+  bench_json_double(json, "mib_per_sec", (double)received * 1e9 / (double)(end - start) / (1024.0 * 1024.0));
+  bench_json_double(json, "gbit_per_sec", (double)received * 8.0 / (double)(end - start));
+  bench_json_result_end(json);
+}
+
+static bool selected(const char *name) {
+  return only == NULL || strcmp(only, name) == 0;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+    "usage: %s [-d duration_ms] [-r rate] [-c max_connections] [-o test]\n"
+    "tests: tcp_echo, tcp_fixed_rate, udp_pps, tcp_bulk\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int32_t main(int32_t argc, char **argv) {
+  BenchJson json;
+  int32_t i;
+
+  for (i = 1; i < argc; i++) {
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      duration = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-r") == 0) {
+      rate = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      max_connections = (int32_t)strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      only = argv[++i];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (duration == 0 || rate == 0 || max_connections <= 0) {
+    usage(argv[0]);
+  }
+
+  socket_init_once();
+  memset(payload, 'x', sizeof(payload));
+  bench_json_begin(&json, stdout, "suite");
+
+  if (selected("tcp_echo")) {
+    bench_tcp_echo(&json, 1);
+    bench_tcp_echo(&json, max_connections < 64 ? max_connections : 64);
+    bench_tcp_echo(&json, max_connections);
+  }
+
+  if (selected("tcp_fixed_rate")) {
+    bench_tcp_fixed_rate(&json, 16);
+  }
+
+  if (selected("udp_pps")) {
+    bench_udp_pps(&json);
+  }
+
+  if (selected("tcp_bulk")) {
+    bench_tcp_bulk(&json);
+  }
+
+  bench_json_end(&json);
+  socket_close_once();
+
+  return 0;
+}
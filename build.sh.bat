@@ -3,7 +3,7 @@
 # bash
 set -e
 mkdir -p bin
-gcc src/*.c examples/$1/*.c -o bin/$1 -Iinclude $2
+gcc src/*.c examples/$1/*.c -o bin/$1 -Iinclude -pthread $2
 exit
 
 :windows
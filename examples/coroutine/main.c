@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "socket.h"
+#include "error.h"
+#include "util.h"
+#include "coroutine.h"
+
+#define PORT 8888
+#define BUF_SIZE 512
+const char *RESPONSE = "HTTP/1.1 200 OK\r\nContent-type: text/plain\r\nContent-length: 17\r\n\r\ncoroutine example\r\n";
+
+/* the same straight-line code as the http example, but socket_receive()
+ * and socket_send() only suspend this coroutine while they wait */
+static void handle_client(void *data) {
+	Socket *client = data;
+	char buf[BUF_SIZE];
+
+	socket_set_timeout(client, 5000);
+
+	if (socket_receive(client, buf, BUF_SIZE) > 0) {
+		socket_send(client, RESPONSE, strlen(RESPONSE));
+	}
+
+	socket_free(client);
+}
+
+static void serve(void *data) {
+	Socket *server = data;
+
+	while (true) {
+		Socket *client = socket_accept(server);
+
+		if (!client) {
+			ALERT_ERROR(error_get_message());
+			continue;
+		}
+
+		if (!coroutine_spawn(coroutine_get_scheduler(), handle_client, client)) {
+			ALERT_ERROR(error_get_message());
+			socket_free(client);
+		}
+	}
+}
+
+int32_t main(void) {
+/* disables output buffering on mingw */
+#if defined(_WINDOWS)
+  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+#endif
+
+	if (!socket_init_once()) {
+		ALERT_ERROR("failed to initialize");
+	}
+
+	atexit(socket_close_once);
+
+	Socket *server = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+	if (!server) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	SocketAddress *address = socket_address_new_any(SOCKET_FAMILY_INET, PORT);
+	socket_set_listen_backlog(server, 1024);
+
+	if (!socket_bind(server, address, true) || !socket_listen(server)) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	socket_address_free(address);
+
+	CoroutineScheduler *scheduler = coroutine_scheduler_new();
+	if (!scheduler || !coroutine_spawn(scheduler, serve, server)) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	printf("serving http on port %u\n\n", PORT);
+	if (!coroutine_scheduler_run(scheduler)) {
+		ALERT_ERROR(error_get_message());
+	}
+
+	coroutine_scheduler_free(scheduler);
+	socket_free(server);
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "socket.h"
+#include "error.h"
+#include "util.h"
+#include "workpool.h"
+
+#define PORT 8888
+#define BUF_SIZE 512
+#define STATS_EVERY 1000
+const char *RESPONSE = "HTTP/1.1 200 OK\r\nContent-type: text/plain\r\nContent-length: 12\r\n\r\npool example\r\n";
+
+static void handle_client(Socket *client, void *data) {
+	char buf[BUF_SIZE];
+	UNUSED(data);
+
+	socket_set_timeout(client, 5000);
+
+	if (socket_receive(client, buf, BUF_SIZE) > 0) {
+		socket_send(client, RESPONSE, strlen(RESPONSE));
+	}
+
+	socket_free(client);
+}
+
+int32_t main(void) {
+/* disables output buffering on mingw */
+#if defined(_WINDOWS)
+  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+#endif
+
+	if (!socket_init_once()) {
+		ALERT_ERROR("failed to initialize");
+	}
+
+	atexit(socket_close_once);
+
+	WorkPool *pool = work_pool_new(0);
+	if (!pool) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	Socket *server = socket_new(SOCKET_FAMILY_INET, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+	if (!server) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	SocketAddress *address = socket_address_new_any(SOCKET_FAMILY_INET, PORT);
+	if (!socket_bind(server, address, true) || !socket_listen(server)) {
+		ALERT_ERROR(error_get_message());
+		return 0;
+	}
+
+	socket_address_free(address);
+
+	printf("serving http on port %u with %u workers\n\n", PORT, work_pool_get_size(pool));
+	for (uint64_t served = 1;; served++) {
+		Socket *client = socket_accept(server);
+
+		if (!client) {
+			ALERT_ERROR(error_get_message());
+			continue;
+		}
+
+		if (!work_pool_submit_socket(pool, handle_client, client, NULL)) {
+			socket_free(client);
+		}
+
+		if (served % STATS_EVERY == 0) {
+			for (uint32_t i = 0; i < work_pool_get_size(pool); i++) {
+				WorkPoolStats stats;
+				work_pool_get_stats(pool, i, &stats);
+				printf("worker %u: depth %zu, executed %llu, steals %llu\n", i, stats.queue_depth,
+					(unsigned long long)stats.executed, (unsigned long long)stats.steals);
+			}
+		}
+	}
+}
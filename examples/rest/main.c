@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "socket.h"
+#include "resolver.h"
+#include "connector.h"
 #include "error.h"
 #include "util.h"
 
 #define PORT 13
 #define BUF_SIZE 512
+#define TIMEOUT 5000
 
 /*
 GET /api/users?page=2 HTTP/1.1
@@ -27,41 +30,42 @@ int32_t main(void) {
 
 	atexit(socket_close_once);
 
-	Socket *client = socket_new(SOCKET_FAMILY_INET6, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
-	if (!client) {
+	Resolver *resolver = resolver_new(NULL);
+	if (!resolver) {
 		ALERT_ERROR(error_get_message());
 		return 0;
 	}
 
 	// SocketAddress *address = socket_address_new("https://www.reqres.in", PORT);
-	SocketAddress *address = socket_address_new("time-nw.nist.gov", PORT);
+	uint64_t deadline = sys_time_monotonic() + TIMEOUT;
+	size_t count = 0;
+	SocketAddress **addresses = resolver_lookup(resolver, "time-nw.nist.gov", PORT, &count, deadline);
+	resolver_free(resolver);
 
-	if (!address) {
-		ALERT_ERROR("%d\n", error_get_last_net());
+	if (!addresses) {
+		ALERT_ERROR(error_get_message());
 		return 0;
 	}
 
-	if (!socket_connect(client, address)) {
-		ALERT_ERROR(error_get_message());	
+	/* races the IPv6 and IPv4 addresses instead of waiting out a broken route */
+	Socket *client = connector_connect(addresses, count, SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP, deadline);
+	resolver_free_addresses(addresses, count);
+
+	if (!client) {
+		ALERT_ERROR(error_get_message());
 		return 0;
 	}
 
-	socket_address_free(address);
-
 	ssize_t recieved = 0;
 	char buf[BUF_SIZE] = {0};
-	socket_set_blocking(client, false);
-
-	do {
-		recieved = socket_receive(client, buf, BUF_SIZE);
-		int32_t err = error_get_code();
-		switch (err) {
-			case ERROR_IO_WOULD_BLOCK:
-				continue;
-			default:
-				ALERT_ERROR(error_code_to_string(err));
-		}
-	} while (recieved > 0);
+
+	while ((recieved = socket_receive_until(client, buf, BUF_SIZE, deadline)) > 0) {
+		fwrite(buf, 1, (size_t)recieved, stdout);
+	}
+
+	if (recieved < 0) {
+		ALERT_ERROR(error_code_to_string(error_get_code()));
+	}
 
 	socket_free(client);
 }
\ No newline at end of file
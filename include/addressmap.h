@@ -0,0 +1,55 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socketaddress.h"
+
+/* Called for each entry by address_map_foreach(), return false to stop. */
+typedef bool (*AddressMapFunc)(const SocketAddressKey *key, void *value, void *data);
+
+/* Address map opaque structure. */
+typedef struct AddressMap AddressMap;
+
+/* Open-addressing hash map from packed socket addresses to pointers, for
+ * per-peer state. Each map hashes with its own random seed so peers can't
+ * pick colliding addresses. The map must not change during foreach. */
+AddressMap *address_map_new(size_t capacity);
+size_t address_map_get_count(const AddressMap *map);
+void *address_map_get(const AddressMap *map, const SocketAddressKey *key);
+bool address_map_put(AddressMap *map, const SocketAddressKey *key, void *value);
+void **address_map_get_or_insert(AddressMap *map, const SocketAddressKey *key, bool *inserted);
+bool address_map_remove(AddressMap *map, const SocketAddressKey *key, void **value);
+void address_map_foreach(const AddressMap *map, AddressMapFunc func, void *data);
+void address_map_clear(AddressMap *map);
+void address_map_free(AddressMap *map);
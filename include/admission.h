@@ -0,0 +1,66 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socketaddress.h"
+#include "socket.h"
+
+/* Admission control opaque structure. */
+typedef struct Admission Admission;
+
+/* Admission control for listening sockets, install it with
+ * socket_set_accept_filter(listener, admission_accept_filter, admission)
+ * and socket_set_accept_undo(listener, admission_accept_undo).
+ * Connections are reset (SO_LINGER 0) when their source is over its token
+ * bucket, when the concurrent connection cap is reached, or, with a
+ * probability that grows with the overload, while the smoothed
+ * accept-to-first-byte latency is above the threshold.
+ *
+ * IPv6 sources share one bucket per /64. Every allowed connection counts
+ * against the cap until admission_release() is called for it. All the
+ * functions are thread safe. */
+Admission *admission_new(size_t max_sources);
+void admission_set_rate(Admission *admission, uint32_t per_second, uint32_t burst);
+void admission_set_max_connections(Admission *admission, size_t max_connections);
+void admission_set_latency_threshold(Admission *admission, uint32_t msec);
+size_t admission_get_active(const Admission *admission);
+uint64_t admission_get_rejected(const Admission *admission);
+uint32_t admission_get_latency(const Admission *admission);
+SocketAcceptVerdict admission_check(Admission *admission, const SocketAddressKey *peer);
+void admission_first_byte(Admission *admission, uint64_t accepted_at);
+void admission_release(Admission *admission);
+void admission_free(Admission *admission);
+
+SocketAcceptVerdict admission_accept_filter(const SocketAddressKey *peer, void *admission);
+void admission_accept_undo(const SocketAddressKey *peer, void *admission);
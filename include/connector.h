@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Connector state, see connector_poll(). */
+typedef enum {
+  CONNECTOR_STATE_CONNECTING = 0, /* Attempts are still in flight. */
+  CONNECTOR_STATE_CONNECTED  = 1, /* One attempt won, see connector_take_socket(). */
+  CONNECTOR_STATE_FAILED     = 2  /* Every attempt failed or the deadline passed. */
+} ConnectorState;
+
+/* Connector opaque structure. */
+typedef struct Connector Connector;
+
+/* Races non-blocking connects to a list of addresses (Happy Eyeballs,
+ * RFC 8305): families are interleaved starting with the family of the
+ * first address, and a new attempt starts whenever the previous one fails
+ * or the attempt delay elapses. The addresses must outlive the connector. */
+Connector *connector_new(SocketAddress **addresses, size_t count, SocketType type, SocketProtocol protocol);
+void connector_set_attempt_delay(Connector *connector, uint32_t msec);
+void connector_set_deadline(Connector *connector, uint64_t deadline);
+ConnectorState connector_get_state(const Connector *connector);
+int32_t connector_get_timeout(const Connector *connector);
+ConnectorState connector_poll(Connector *connector, int32_t timeout);
+Socket *connector_take_socket(Connector *connector);
+SocketAddress *connector_get_address(const Connector *connector);
+void connector_free(Connector *connector);
+
+Socket *connector_connect(SocketAddress **addresses, size_t count, SocketType type, SocketProtocol protocol,
+                          uint64_t deadline);
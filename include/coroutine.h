@@ -0,0 +1,54 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Coroutine entry point. */
+typedef void (*CoroutineFunc)(void *data);
+
+/* Coroutine scheduler opaque structure. */
+typedef struct CoroutineScheduler CoroutineScheduler;
+
+CoroutineScheduler *coroutine_scheduler_new(void);
+void coroutine_scheduler_set_stack_size(CoroutineScheduler *scheduler, size_t size);
+size_t coroutine_scheduler_get_count(const CoroutineScheduler *scheduler);
+bool coroutine_scheduler_run(CoroutineScheduler *scheduler);
+void coroutine_scheduler_free(CoroutineScheduler *scheduler);
+bool coroutine_spawn(CoroutineScheduler *scheduler, CoroutineFunc func, void *data);
+CoroutineScheduler *coroutine_get_scheduler(void);
+bool coroutine_is_active(void);
+void coroutine_yield(void);
+bool coroutine_sleep(uint32_t msec);
+bool coroutine_io_wait(const Socket *socket, SocketIOCondition condition, int32_t timeout);
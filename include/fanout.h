@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+#include "outqueue.h"
+
+/* What happens to a subscriber whose output queue is over the high watermark. */
+typedef enum {
+  FANOUT_POLICY_DROP       = 0, /* New messages are skipped until it catches up. */
+  FANOUT_POLICY_DISCONNECT = 1, /* The subscriber is removed. */
+  FANOUT_POLICY_CONFLATE   = 2  /* It gets only the latest message of each key once it catches up. */
+} FanoutPolicy;
+
+/* Counters of a fanout, per subscriber deliveries. */
+typedef struct {
+  uint64_t published;    /* Messages published. */
+  uint64_t queued;       /* Messages handed to output queues. */
+  uint64_t dropped;      /* Messages skipped for slow subscribers. */
+  uint64_t conflated;    /* Messages superseded while a subscriber was paused. */
+  uint64_t disconnected; /* Subscribers removed for being slow or failing. */
+} FanoutStats;
+
+/* Fanout opaque structure. */
+typedef struct Fanout Fanout;
+
+/* Subscriber opaque structure. */
+typedef struct FanoutSubscriber FanoutSubscriber;
+
+/* Shared, reference counted message opaque structure. */
+typedef struct FanoutMessage FanoutMessage;
+
+/* Called after a subscriber was removed by the fanout, the socket is left
+ * to the caller. */
+typedef void (*FanoutDisconnectFunc)(Fanout *fanout, Socket *socket, void *data);
+
+/* Messages are stored once and referenced by every output queue they are
+ * on. Key 0 means the message can't be conflated. */
+FanoutMessage *fanout_message_new(const char *data, size_t len, uint64_t key);
+FanoutMessage *fanout_message_ref(FanoutMessage *message);
+void fanout_message_unref(FanoutMessage *message);
+const char *fanout_message_get_data(const FanoutMessage *message);
+size_t fanout_message_get_size(const FanoutMessage *message);
+uint64_t fanout_message_get_key(const FanoutMessage *message);
+
+/* Broadcasts messages to a set of non-blocking sockets. Publishing only
+ * queues, fanout_flush() then writes every subscriber that got something
+ * with one vectored write, so call it once per event loop wakeup. Sockets
+ * that report writable go through fanout_subscriber_flush(). Not thread
+ * safe. */
+Fanout *fanout_new(void);
+void fanout_set_watermarks(Fanout *fanout, size_t low, size_t high);
+void fanout_set_disconnect_func(Fanout *fanout, FanoutDisconnectFunc func);
+FanoutSubscriber *fanout_subscribe(Fanout *fanout, Socket *socket, FanoutPolicy policy, void *data);
+void fanout_unsubscribe(Fanout *fanout, FanoutSubscriber *subscriber);
+size_t fanout_get_count(const Fanout *fanout);
+size_t fanout_publish(Fanout *fanout, FanoutMessage *message);
+size_t fanout_publish_data(Fanout *fanout, const char *data, size_t len, uint64_t key);
+size_t fanout_flush(Fanout *fanout);
+bool fanout_subscriber_flush(Fanout *fanout, FanoutSubscriber *subscriber);
+bool fanout_subscriber_wants_write(const FanoutSubscriber *subscriber);
+OutQueue *fanout_subscriber_get_queue(const FanoutSubscriber *subscriber);
+void fanout_get_stats(const Fanout *fanout, FanoutStats *stats);
+void fanout_free(Fanout *fanout);
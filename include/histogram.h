@@ -0,0 +1,69 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Snapshot of the usual latency figures. */
+typedef struct {
+  uint64_t count;
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+  double mean;
+} HistogramSummary;
+
+/* Histogram opaque structure. */
+typedef struct Histogram Histogram;
+
+/* Log-linear histogram: every power of two is split into 32 linear
+ * buckets, so any recorded value is reported within ~3% over the full
+ * uint64_t range. Recording is lock-free and safe from any thread, each
+ * thread records into its own shard and reads merge the shards. Reads
+ * taken while other threads record are approximate. Percentiles are
+ * given in the 0..100 range. */
+Histogram *histogram_new(void);
+void histogram_record(Histogram *histogram, uint64_t value);
+uint64_t histogram_get_count(const Histogram *histogram);
+uint64_t histogram_get_min(const Histogram *histogram);
+uint64_t histogram_get_max(const Histogram *histogram);
+double histogram_get_mean(const Histogram *histogram);
+uint64_t histogram_get_percentile(const Histogram *histogram, double percentile);
+bool histogram_get_percentiles(const Histogram *histogram, const double *percentiles, uint64_t *values,
+                               size_t count);
+bool histogram_get_summary(const Histogram *histogram, HistogramSummary *summary);
+bool histogram_merge(Histogram *histogram, const Histogram *other);
+void histogram_reset(Histogram *histogram);
+void histogram_free(Histogram *histogram);
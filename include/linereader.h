@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Longest delimiter line_reader_set_delimiter() takes. */
+#define LINE_READER_MAX_DELIMITER 16
+
+/* Line reader opaque structure. */
+typedef struct LineReader LineReader;
+
+/* Splits what arrives on a stream socket into records ending in a
+ * delimiter, "\n" by default. Records are returned without the delimiter
+ * as slices into the reader's buffer, valid until the next call that
+ * reads from the socket. Bytes already searched are not searched again
+ * and the buffer is only compacted once its tail is full. At end of
+ * stream a last record without delimiter is returned as is. */
+LineReader *line_reader_new(Socket *socket);
+bool line_reader_set_delimiter(LineReader *reader, const char *delimiter, size_t len);
+void line_reader_set_max_record(LineReader *reader, size_t max_record);
+ssize_t line_reader_fill(LineReader *reader);
+const char *line_reader_next(LineReader *reader, size_t *len);
+const char *line_reader_next_exact(LineReader *reader, size_t count);
+const char *line_reader_read_until(LineReader *reader, size_t *len, uint64_t deadline);
+const char *line_reader_read_exact_until(LineReader *reader, size_t count, uint64_t deadline);
+size_t line_reader_get_buffered(const LineReader *reader);
+bool line_reader_is_eof(const LineReader *reader);
+Socket *line_reader_get_socket(const LineReader *reader);
+void line_reader_free(LineReader *reader);
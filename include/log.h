@@ -0,0 +1,84 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Log levels, in increasing severity. */
+typedef enum {
+  LOG_LEVEL_DEBUG   = 0,
+  LOG_LEVEL_WARNING = 1,
+  LOG_LEVEL_ERROR   = 2,
+  LOG_LEVEL_NONE    = 3
+} LogLevel;
+
+/* Messages below this level are compiled out. */
+#ifndef LOG_COMPILE_LEVEL
+  #ifdef NDEBUG
+    #define LOG_COMPILE_LEVEL LOG_LEVEL_WARNING
+  #else
+    #define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+  #endif
+#endif
+
+/* Receives drained messages on the logging thread. */
+typedef void (*LogSinkFunc)(LogLevel level, const char *file, int32_t line, const char *message, void *data);
+
+/* Rate limiting state of one call site. */
+typedef struct {
+  atomic_uint_fast64_t state;
+} LogSite;
+
+#define LOG_WRITE(level, ...) do { \
+  static LogSite log_site_; \
+  if ((level) >= LOG_COMPILE_LEVEL && log_site_allow(&log_site_, (level))) { \
+    log_write((level), __FILE__, __LINE__, __VA_ARGS__); \
+  } \
+} while (0)
+
+#define ALERT_DEBUG(msg, ...)   LOG_WRITE(LOG_LEVEL_DEBUG, msg, ##__VA_ARGS__)
+#define ALERT_WARNING(msg, ...) LOG_WRITE(LOG_LEVEL_WARNING, msg, ##__VA_ARGS__)
+#define ALERT_ERROR(msg, ...)   LOG_WRITE(LOG_LEVEL_ERROR, msg, ##__VA_ARGS__)
+
+/* Messages are formatted by the calling thread into its own ring and
+ * written out by a background thread, so logging never takes a lock or
+ * blocks on the output. Messages are dropped when a ring is full or a
+ * call site goes over the rate limit; the drops are reported with the
+ * next drained batch. Pending messages are flushed at exit, rings live
+ * until log_shutdown(). */
+bool log_site_allow(LogSite *site, LogLevel level);
+void log_write(LogLevel level, const char *file, int32_t line, const char *format, ...);
+void log_set_level(LogLevel level);
+void log_set_rate_limit(uint32_t per_second);
+void log_set_sink(LogSinkFunc func, void *data);
+uint64_t log_get_dropped(void);
+void log_flush(void);
+void log_shutdown(void);
@@ -0,0 +1,81 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "socket.h"
+
+/* Traffic directions through the simulator. */
+typedef enum {
+  NETSIM_DIRECTION_UPSTREAM   = 0, /* Client to target. */
+  NETSIM_DIRECTION_DOWNSTREAM = 1, /* Target to client. */
+  NETSIM_DIRECTIONS           = 2
+} NetSimDirection;
+
+/* Impairments of one direction. Rates are in parts per million. */
+typedef struct {
+  uint32_t latency_usec;  /* Fixed one-way delay. */
+  uint32_t jitter_usec;   /* Extra random delay up to this, streams stay in order. */
+  uint64_t bandwidth;     /* Bytes per second per connection or flow, 0 for unlimited. */
+  uint32_t loss_ppm;      /* Datagrams dropped. UDP only. */
+  uint32_t reorder_ppm;   /* Datagrams held back by reorder_usec so later ones pass them. UDP only. */
+  uint32_t reorder_usec;
+  uint32_t max_segment;   /* Writes are split into random sizes up to this, 0 for whole reads. */
+  uint32_t stall_ppm;     /* Chance per read to stop reading for stall_usec. */
+  uint32_t stall_usec;
+  uint32_t buffer_size;   /* SO_SNDBUF and SO_RCVBUF of the simulator sockets, 0 for the default. */
+} NetSimConfig;
+
+/* Counters of one direction. */
+typedef struct {
+  uint64_t bytes;      /* Bytes delivered. */
+  uint64_t packets;    /* Datagrams or stream reads delivered. */
+  uint64_t dropped;    /* Datagrams lost, on purpose or on a full queue. */
+  uint64_t reordered;  /* Datagrams held back. */
+  uint64_t stalls;     /* Read stalls started. */
+} NetSimStats;
+
+/* Network simulator opaque structure. */
+typedef struct NetSim NetSim;
+
+/* Loopback proxy that forwards TCP connections or UDP flows to target
+ * through configurable WAN impairments, from a background thread. Random
+ * choices come from a generator seeded with seed, so a run can be
+ * repeated. Read stalls and small buffers make the peers see EAGAIN and
+ * partial writes, max_segment makes them see short reads. */
+NetSim *netsim_new(SocketType type, const SocketAddress *target, uint64_t seed);
+bool netsim_set_config(NetSim *sim, NetSimDirection direction, const NetSimConfig *config);
+SocketAddress *netsim_get_address(const NetSim *sim);
+bool netsim_get_stats(NetSim *sim, NetSimDirection direction, NetSimStats *stats);
+bool netsim_start(NetSim *sim);
+void netsim_stop(NetSim *sim);
+void netsim_free(NetSim *sim);
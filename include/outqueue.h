@@ -0,0 +1,67 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Output queue opaque structure. */
+typedef struct OutQueue OutQueue;
+
+/* Releases a buffer once it was written or dropped. */
+typedef void (*OutQueueFreeFunc)(void *buffer, void *data);
+
+/* Called when the queue crosses a watermark. */
+typedef void (*OutQueueFunc)(OutQueue *queue, void *data);
+
+/* Per-socket queue of buffers waiting to be sent. Pushing takes ownership
+ * of a buffer and writes straight through while nothing is queued ahead
+ * of it, the rest goes out with vectored writes from out_queue_flush()
+ * once the socket is writable. The pause callback fires when the queued
+ * bytes reach the high watermark, resume once a flush drains them to the
+ * low watermark. Pushes past the limit fail and leave the buffer with the
+ * caller. Meant for non-blocking sockets, and not thread safe. */
+OutQueue *out_queue_new(Socket *socket);
+void out_queue_set_watermarks(OutQueue *queue, size_t low, size_t high);
+void out_queue_set_limit(OutQueue *queue, size_t limit);
+void out_queue_set_callbacks(OutQueue *queue, OutQueueFunc pause, OutQueueFunc resume, void *data);
+bool out_queue_push(OutQueue *queue, const char *buffer, size_t len, OutQueueFreeFunc free_func, void *free_data);
+bool out_queue_append(OutQueue *queue, const char *buffer, size_t len, OutQueueFreeFunc free_func, void *free_data);
+bool out_queue_push_copy(OutQueue *queue, const char *buffer, size_t len);
+ssize_t out_queue_flush(OutQueue *queue);
+size_t out_queue_get_size(const OutQueue *queue);
+size_t out_queue_get_count(const OutQueue *queue);
+bool out_queue_is_paused(const OutQueue *queue);
+Socket *out_queue_get_socket(const OutQueue *queue);
+void out_queue_clear(OutQueue *queue);
+void out_queue_free(OutQueue *queue);
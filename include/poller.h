@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "socket.h"
+#include "timerwheel.h"
+
+/* Readiness event reported by poller_wait(). */
+typedef struct {
+  void *data;                  /* User data passed on registration. */
+  SocketIOCondition condition; /* Ready conditions, a mask of SocketIOCondition values. */
+  bool error;                  /* Error or hang up on the socket. */
+} PollerEvent;
+
+/* Poller opaque structure. */
+typedef struct Poller Poller;
+
+Poller *poller_new(void);
+bool poller_add(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data);
+bool poller_modify(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data);
+bool poller_arm(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data);
+bool poller_remove(Poller *poller, const Socket *socket);
+int32_t poller_wait(Poller *poller, PollerEvent *events, int32_t max_events, int32_t timeout);
+void poller_set_timer_wheel(Poller *poller, TimerWheel *wheel);
+TimerWheel *poller_get_timer_wheel(const Poller *poller);
+void poller_free(Poller *poller);
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socketaddress.h"
+#include "socket.h"
+
+/* Prefix table opaque structure. */
+typedef struct PrefixTable PrefixTable;
+
+/* Longest-prefix-match table for IPv4 and IPv6 CIDR sets. Each prefix
+ * maps to a non-zero value, lookups return 0 when nothing matches.
+ *
+ * Changes are staged by add/remove and published by commit(), which
+ * compiles a poptrie (6-bit strides, popcount-indexed child and leaf
+ * arrays) and swaps it in. Lookups never lock and may run on any thread
+ * while another thread stages and commits changes. */
+PrefixTable *prefix_table_new(void);
+bool prefix_table_add(PrefixTable *table, SocketFamily family, const uint8_t *address, uint32_t prefix_len,
+                      uint32_t value);
+bool prefix_table_add_cidr(PrefixTable *table, const char *cidr, uint32_t value);
+bool prefix_table_remove(PrefixTable *table, SocketFamily family, const uint8_t *address, uint32_t prefix_len);
+void prefix_table_clear(PrefixTable *table);
+bool prefix_table_commit(PrefixTable *table);
+size_t prefix_table_get_count(const PrefixTable *table);
+uint32_t prefix_table_lookup(PrefixTable *table, SocketFamily family, const uint8_t *address);
+uint32_t prefix_table_lookup_key(PrefixTable *table, const SocketAddressKey *key);
+
+/* Accept filter over a table whose values are SocketAcceptVerdict,
+ * pass the table as the filter data. */
+SocketAcceptVerdict prefix_table_accept_filter(const SocketAddressKey *peer, void *table);
+void prefix_table_free(PrefixTable *table);
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Relay directions, named after the sockets given to relay_new(). */
+typedef enum {
+  RELAY_DIRECTION_FORWARD  = 0, /* From the first socket to the second. */
+  RELAY_DIRECTION_BACKWARD = 1, /* From the second socket to the first. */
+  RELAY_DIRECTIONS         = 2
+} RelayDirection;
+
+/* Relay opaque structure. */
+typedef struct Relay Relay;
+
+/* Moves bytes between two connected stream sockets in both directions.
+ * On Linux the data goes through a pipe with splice() and never reaches
+ * user space, elsewhere through a buffer per direction. End of stream on
+ * one side is passed on as a write shutdown of the other, the remaining
+ * direction keeps going. The sockets are switched to non-blocking and
+ * stay owned by the caller. */
+Relay *relay_new(Socket *first, Socket *second);
+ssize_t relay_transfer(Relay *relay, RelayDirection direction);
+ssize_t relay_pump(Relay *relay);
+bool relay_run_until(Relay *relay, uint64_t deadline);
+SocketIOCondition relay_get_condition(const Relay *relay, const Socket *socket);
+bool relay_is_closed(const Relay *relay, RelayDirection direction);
+bool relay_is_done(const Relay *relay);
+bool relay_is_zero_copy(const Relay *relay);
+uint64_t relay_get_bytes(const Relay *relay, RelayDirection direction);
+void relay_free(Relay *relay);
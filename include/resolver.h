@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Called once a lookup completes. On failure addresses is NULL, count is
+ * 0 and the error state tells why (ERROR_IO_NOT_EXISTS for names without
+ * addresses). The array belongs to the callee, release it with
+ * resolver_free_addresses(). */
+typedef void (*ResolverFunc)(const char *name, SocketAddress **addresses, size_t count, void *data);
+
+/* Resolver opaque structure. */
+typedef struct Resolver Resolver;
+
+/* Non-blocking DNS stub resolver for A and AAAA records. Answers are
+ * cached for their TTL, names without addresses are cached too (RFC 2308)
+ * and concurrent lookups of one name share the same queries. Each query
+ * goes out from its own socket with an ID from the system CSPRNG. When
+ * server is NULL the first nameserver from /etc/resolv.conf is used. */
+Resolver *resolver_new(SocketAddress *server);
+void resolver_set_timeout(Resolver *resolver, uint32_t msec);
+void resolver_set_attempts(Resolver *resolver, uint32_t attempts);
+int32_t resolver_get_timeout(const Resolver *resolver);
+size_t resolver_get_cache_count(const Resolver *resolver);
+bool resolver_resolve(Resolver *resolver, const char *name, uint16_t port, ResolverFunc func, void *data);
+bool resolver_poll(Resolver *resolver, int32_t timeout);
+SocketAddress **resolver_lookup(Resolver *resolver, const char *name, uint16_t port, size_t *count, uint64_t deadline);
+void resolver_clear_cache(Resolver *resolver);
+void resolver_free(Resolver *resolver);
+
+void resolver_free_addresses(SocketAddress **addresses, size_t count);
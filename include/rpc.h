@@ -0,0 +1,83 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Counters of a channel. */
+typedef struct {
+  uint64_t calls;     /* Calls started. */
+  uint64_t completed; /* Calls answered by the peer. */
+  uint64_t timed_out; /* Calls past their deadline. */
+  uint64_t failed;    /* Calls aborted or refused by the peer. */
+  uint64_t frames;    /* Frames written, requests and responses. */
+  uint64_t writes;    /* Vectored writes the frames went out with. */
+} RpcStats;
+
+/* RPC channel opaque structure. */
+typedef struct RpcChannel RpcChannel;
+
+/* Called once an asynchronous call completes. On failure response is NULL
+ * and the error state tells why: ERROR_IO_TIMED_OUT past the deadline,
+ * ERROR_IO_ABORTED when the channel went down, ERROR_IO_NOT_SUPPORTED
+ * when the peer has no handler. */
+typedef void (*RpcFunc)(RpcChannel *channel, const char *response, size_t len, void *data);
+
+/* Called for every request from the peer, answer it with
+ * rpc_channel_respond() from any thread. */
+typedef void (*RpcHandlerFunc)(RpcChannel *channel, uint64_t id, const char *request, size_t len, void *data);
+
+/* Multiplexes calls over one stream socket. Each frame carries a
+ * correlation id, so any number of calls up to the capacity can be in
+ * flight and answered out of order. Frames queued by concurrent callers
+ * go out together with one vectored write, and responses are dispatched
+ * by a reader thread between rpc_channel_start() and rpc_channel_stop().
+ * Both ends use a channel, with a handler on the serving side. The socket
+ * is switched to non-blocking and stays owned by the caller. Calls and
+ * responses are thread safe. */
+RpcChannel *rpc_channel_new(Socket *socket, size_t capacity);
+void rpc_channel_set_handler(RpcChannel *channel, RpcHandlerFunc func, void *data);
+void rpc_channel_set_max_frame(RpcChannel *channel, size_t max_frame);
+bool rpc_channel_start(RpcChannel *channel);
+void rpc_channel_stop(RpcChannel *channel);
+ssize_t rpc_channel_call_until(RpcChannel *channel, const char *request, size_t len,
+                               char *response, size_t buflen, uint64_t deadline);
+bool rpc_channel_call_async(RpcChannel *channel, const char *request, size_t len, uint64_t deadline,
+                            RpcFunc func, void *data);
+bool rpc_channel_respond(RpcChannel *channel, uint64_t id, const char *response, size_t len);
+size_t rpc_channel_get_pending(const RpcChannel *channel);
+bool rpc_channel_is_closed(const RpcChannel *channel);
+void rpc_channel_get_stats(const RpcChannel *channel, RpcStats *stats);
+Socket *rpc_channel_get_socket(const RpcChannel *channel);
+void rpc_channel_free(RpcChannel *channel);
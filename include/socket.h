@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "socketaddress.h"
+#include "histogram.h"
 
 /* Socket protocols specified by the IANA.  */
 typedef enum {
@@ -62,9 +63,63 @@ typedef enum {
   SOCKET_IO_CONDITION_POLLOUT = 2  /* Ready to write. */
 } SocketIOCondition;
 
+/* Accept filter verdicts, 0 means the filter has no opinion. */
+typedef enum {
+  SOCKET_ACCEPT_ALLOW = 1, /* Hand the connection to the caller. */
+  SOCKET_ACCEPT_DENY  = 2, /* Close the connection right after accept(). */
+  SOCKET_ACCEPT_RESET = 3  /* Abort the connection with a RST (SO_LINGER 0). */
+} SocketAcceptVerdict;
+
+/* I/O counters of one socket, or summed over all the sockets with stats
+ * enabled. Syscall counts include calls that failed. */
+typedef struct {
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t receive_calls;
+  uint64_t send_calls;
+  uint64_t would_block;  /* Calls that failed with EAGAIN. */
+  uint64_t interrupted;  /* Calls retried after EINTR. */
+  uint64_t waits;        /* Readiness waits. */
+  uint64_t wait_usec;    /* Time blocked in readiness waits. */
+} SocketStats;
+
+/* Congestion control state of a TCP connection. */
+typedef struct {
+  uint32_t rtt_usec;      /* Smoothed round trip time. */
+  uint32_t rtt_var_usec;  /* Round trip time variance. */
+  uint32_t min_rtt_usec;  /* Lowest round trip time seen. */
+  uint32_t cwnd;          /* Congestion window, in segments. */
+  uint32_t mss;           /* Send segment size. */
+  uint32_t unacked;       /* Segments in flight. */
+  uint32_t lost;          /* Segments considered lost. */
+  uint32_t retransmits;   /* Segments retransmitted over the connection lifetime. */
+  uint64_t delivery_rate; /* Recent goodput in bytes per second. */
+} SocketTcpInfo;
+
+/* Library-wide latency histograms, values in microseconds. */
+typedef enum {
+  SOCKET_LATENCY_WAIT    = 0, /* Time blocked in readiness waits. */
+  SOCKET_LATENCY_ACCEPT  = 1, /* From accept() returning to the Socket being handed out. */
+  SOCKET_LATENCY_RECEIVE = 2, /* Receive calls, including the waits for data. */
+  SOCKET_LATENCY_CONNECT = 3, /* From connect() to the connection being established. */
+  SOCKET_LATENCY_KINDS   = 4
+} SocketLatency;
+
+/* One piece of a vectored write. */
+typedef struct {
+  const char *data;
+  size_t len;
+} SocketBuffer;
+
 /* Socket opaque structure. */
 typedef struct Socket Socket;
 
+/* Called on every accepted connection before a Socket is allocated for it. */
+typedef SocketAcceptVerdict (*SocketAcceptFilter)(const SocketAddressKey *peer, void *data);
+
+/* Called when a connection the filter didn't drop is lost before its Socket exists. */
+typedef void (*SocketAcceptUndo)(const SocketAddressKey *peer, void *data);
+
 bool socket_init_once(void);
 void socket_close_once(void);
 
@@ -93,16 +148,40 @@ void socket_set_blocking(Socket *socket, bool blocking);
 
 void socket_set_listen_backlog(Socket *socket, int32_t backlog);
 void socket_set_timeout(Socket *socket, int32_t timeout);
+void socket_set_accept_filter(Socket *socket, SocketAcceptFilter filter, void *data);
+void socket_set_accept_undo(Socket *socket, SocketAcceptUndo undo);
+bool socket_set_stats_enabled(Socket *socket, bool enabled);
+bool socket_get_stats(const Socket *socket, SocketStats *stats);
+void socket_get_global_stats(SocketStats *stats);
+bool socket_set_latency_tracking(bool enabled);
+Histogram *socket_get_latency_histogram(SocketLatency kind);
 bool socket_bind(const Socket *socket, SocketAddress *address, bool allow_reuse);
 bool socket_connect(Socket *socket, SocketAddress *address);
+bool socket_connect_until(Socket *socket, SocketAddress *address, uint64_t deadline);
 bool socket_listen(Socket *socket);
 Socket *socket_accept(const Socket *socket);
+Socket *socket_accept_until(const Socket *socket, uint64_t deadline);
 ssize_t socket_receive(const Socket *socket, char *buffer, size_t buflen);
 ssize_t socket_receive_from(const Socket *socket, SocketAddress **address, char *buffer, size_t buflen);
 ssize_t socket_send(const Socket *socket, const char *buffer, size_t buflen);
 ssize_t socket_send_to(const Socket *socket, SocketAddress *address, const char *buffer, size_t buflen);
+ssize_t socket_send_iov(const Socket *socket, const SocketBuffer *buffers, size_t count);
+
+/* Deadlines are absolute sys_time_monotonic() values, shared by all the
+ * waits of one operation instead of being re-armed on every retry. The
+ * whole-buffer variants report the bytes moved before a failure through
+ * done, which may be NULL. */
+ssize_t socket_receive_until(const Socket *socket, char *buffer, size_t buflen, uint64_t deadline);
+ssize_t socket_receive_exact_until(const Socket *socket, char *buffer, size_t buflen, uint64_t deadline,
+                                   size_t *done);
+ssize_t socket_send_all_until(const Socket *socket, const char *buffer, size_t buflen, uint64_t deadline,
+                              size_t *done);
+ssize_t socket_send_iov_all_until(const Socket *socket, const SocketBuffer *buffers, size_t count,
+                                  uint64_t deadline, size_t *done);
+
 bool socket_close(Socket *socket);
 bool socket_shutdown(Socket *socket, bool shutdown_read, bool shutdown_write);
 void socket_free(Socket *socket);
 bool socket_set_buffer_size(const Socket *socket, SocketDirection dir, size_t size);
+bool socket_get_tcp_info(const Socket *socket, SocketTcpInfo *info);
 bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition);
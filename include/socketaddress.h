@@ -64,6 +64,19 @@ typedef enum {
 /* Socket address opaque structure. */
 typedef struct SocketAddress SocketAddress;
 
+/* Packed 20-byte address form for hashing and table keys. IPv4 addresses
+ * are stored IPv4-mapped, the port in network byte order. */
+typedef struct {
+  uint8_t address[16];
+  uint8_t port[2];
+  uint8_t family;   /* 4 or 6. */
+  uint8_t reserved; /* Always zero. */
+} SocketAddressKey;
+
+/* Text buffer sizes for the formatting functions, including the terminating zero. */
+#define SOCKET_ADDRESS_IPV4_STRLEN 16
+#define SOCKET_ADDRESS_IPV6_STRLEN 46
+
 SocketAddress *socket_address_new_from_native(const void *native, size_t len);
 SocketAddress *socket_address_new(const char *address, uint16_t port);
 SocketAddress *socket_address_new_any(SocketFamily family, uint16_t port);
@@ -84,3 +97,24 @@ bool socket_address_is_any(const SocketAddress *addr);
 bool socket_address_is_loopback(const SocketAddress *addr);
 void socket_address_free(SocketAddress *addr);
 
+/* Allocation-free conversions between raw addresses (network byte order)
+ * and text. Parsers take a length so they work on unterminated slices,
+ * formatters return the text length and IPv6 follows RFC 5952. */
+bool socket_address_parse_ipv4(const char *str, size_t len, uint8_t *dest);
+bool socket_address_parse_ipv6(const char *str, size_t len, uint8_t *dest, uint32_t *scope_id);
+size_t socket_address_format_ipv4(const uint8_t *addr, char *dest);
+size_t socket_address_format_ipv6(const uint8_t *addr, char *dest);
+size_t socket_address_format(const SocketAddress *addr, char *dest, size_t destlen);
+
+/* Comparisons look at the family, address and port, flow info and scope
+ * ids are ignored. Ordering is the byte order of the packed keys. */
+bool socket_address_equal(const SocketAddress *a, const SocketAddress *b);
+int32_t socket_address_compare(const SocketAddress *a, const SocketAddress *b);
+uint64_t socket_address_hash(const SocketAddress *addr, uint64_t seed);
+bool socket_address_to_key(const SocketAddress *addr, SocketAddressKey *key);
+bool socket_address_key_from_native(const void *native, size_t len, SocketAddressKey *key);
+SocketAddress *socket_address_new_from_key(const SocketAddressKey *key);
+bool socket_address_key_equal(const SocketAddressKey *a, const SocketAddressKey *b);
+int32_t socket_address_key_compare(const SocketAddressKey *a, const SocketAddressKey *b);
+uint64_t socket_address_key_hash(const SocketAddressKey *key, uint64_t seed);
+
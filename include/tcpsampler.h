@@ -0,0 +1,66 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+#include "histogram.h"
+
+/* Values recorded on every sample. */
+typedef enum {
+  TCP_SAMPLER_RTT           = 0, /* Smoothed RTT in microseconds. */
+  TCP_SAMPLER_RTT_VAR       = 1, /* RTT variance in microseconds. */
+  TCP_SAMPLER_CWND          = 2, /* Congestion window in segments. */
+  TCP_SAMPLER_UNACKED       = 3, /* Segments in flight. */
+  TCP_SAMPLER_LOST          = 4, /* Segments considered lost. */
+  TCP_SAMPLER_RETRANSMITS   = 5, /* Retransmits since the previous sample. */
+  TCP_SAMPLER_DELIVERY_RATE = 6, /* Goodput in bytes per second. */
+  TCP_SAMPLER_METRICS       = 7
+} TcpSamplerMetric;
+
+/* TCP sampler opaque structure. */
+typedef struct TcpSampler TcpSampler;
+
+/* Samples socket_get_tcp_info() of a set of sockets into one histogram
+ * per metric, either on demand with tcp_sampler_sample() or every
+ * interval milliseconds from a background thread. Sockets must be
+ * removed from the sampler before they are freed. */
+TcpSampler *tcp_sampler_new(uint32_t interval);
+bool tcp_sampler_add(TcpSampler *sampler, Socket *socket);
+bool tcp_sampler_remove(TcpSampler *sampler, Socket *socket);
+size_t tcp_sampler_get_count(TcpSampler *sampler);
+size_t tcp_sampler_sample(TcpSampler *sampler);
+bool tcp_sampler_start(TcpSampler *sampler);
+void tcp_sampler_stop(TcpSampler *sampler);
+Histogram *tcp_sampler_get_histogram(TcpSampler *sampler, TcpSamplerMetric metric);
+void tcp_sampler_free(TcpSampler *sampler);
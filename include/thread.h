@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Thread entry point. */
+typedef void (*ThreadFunc)(void *data);
+
+/* Thread opaque structure. */
+typedef struct Thread Thread;
+
+/* Mutex opaque structure. */
+typedef struct Mutex Mutex;
+
+/* Condition variable opaque structure. */
+typedef struct Cond Cond;
+
+Thread *thread_new(ThreadFunc func, void *data);
+bool thread_join(Thread *thread);
+void thread_yield(void);
+void thread_sleep(uint32_t msec);
+uint32_t thread_get_ideal_count(void);
+
+Mutex *mutex_new(void);
+void mutex_lock(Mutex *mutex);
+bool mutex_trylock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void mutex_free(Mutex *mutex);
+
+Cond *cond_new(void);
+void cond_wait(Cond *cond, Mutex *mutex);
+bool cond_timed_wait(Cond *cond, Mutex *mutex, int32_t msec);
+void cond_signal(Cond *cond);
+void cond_broadcast(Cond *cond);
+void cond_free(Cond *cond);
@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Timer opaque structure. */
+typedef struct Timer Timer;
+
+/* Timer wheel opaque structure. */
+typedef struct TimerWheel TimerWheel;
+
+/* Called from timer_wheel_advance() when a timer expires. */
+typedef void (*TimerFunc)(Timer *timer, void *data);
+
+TimerWheel *timer_wheel_new(uint32_t resolution);
+uint64_t timer_wheel_get_time(const TimerWheel *wheel);
+uint64_t timer_wheel_update_time(TimerWheel *wheel);
+size_t timer_wheel_get_count(const TimerWheel *wheel);
+int32_t timer_wheel_get_timeout(TimerWheel *wheel);
+bool timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t deadline);
+bool timer_wheel_schedule_after(TimerWheel *wheel, Timer *timer, uint32_t msec);
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer);
+size_t timer_wheel_advance(TimerWheel *wheel);
+void timer_wheel_free(TimerWheel *wheel);
+
+Timer *timer_new(TimerFunc func, void *data);
+bool timer_is_pending(const Timer *timer);
+uint64_t timer_get_deadline(const Timer *timer);
+void timer_set_data(Timer *timer, void *data);
+void timer_free(Timer *timer);
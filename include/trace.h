@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+/* Static tracepoints for bpftrace, perf and SystemTap, all under the
+ * "sockpuppet" provider. The names are emitted as written here, double
+ * underscores included (e.g. usdt:./binary:sockpuppet:socket__new):
+ *
+ *   socket__new(fd, family, type)
+ *   socket__accept(listen_fd, fd)
+ *   socket__connect(fd, native_error)       connect() returned, 0 or errno
+ *   socket__connect__done(fd, native_error) in-progress connect finished
+ *   socket__receive(fd, bytes, native_error)
+ *   socket__send(fd, bytes, native_error)
+ *   socket__close(fd)
+ *   error__set(code, native_code, message)
+ *
+ * Probes are compiled in with -DTRACE_ENABLE_USDT and <sys/sdt.h>
+ * (systemtap-sdt-dev), otherwise they expand to nothing and their
+ * arguments are not evaluated. A probe site is a single nop until a
+ * tracer attaches to it. */
+#if defined(TRACE_ENABLE_USDT) && defined(__has_include)
+  #if __has_include(<sys/sdt.h>)
+    #include <sys/sdt.h>
+    #define TRACE_USDT
+  #endif
+#endif
+
+#ifdef TRACE_USDT
+  #define TRACE_PROBE1(name, a)          DTRACE_PROBE1(sockpuppet, name, a)
+  #define TRACE_PROBE2(name, a, b)       DTRACE_PROBE2(sockpuppet, name, a, b)
+  #define TRACE_PROBE3(name, a, b, c)    DTRACE_PROBE3(sockpuppet, name, a, b, c)
+#else
+  #define TRACE_PROBE1(name, a)          do {} while (0)
+  #define TRACE_PROBE2(name, a, b)       do {} while (0)
+  #define TRACE_PROBE3(name, a, b, c)    do {} while (0)
+#endif
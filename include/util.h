@@ -30,24 +30,12 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-#define ALERT_WARNING(msg, ...) do { \
-	printf("** Warning [line %d] **\n", __LINE__); \
-	printf(msg, ##__VA_ARGS__); \
-	printf("\n\n"); \
-} while(0)
-
-#define ALERT_ERROR(msg, ...) do { \
-	printf("** Error [line %d] **\n", __LINE__); \
-	printf(msg, ##__VA_ARGS__); \
-	printf("\n\n"); \
-} while(0)
-
-#define ALERT_DEBUG(msg, ...) do { \
-	printf("** Debug [line %d] **\n", __LINE__); \
-	printf(msg, ##__VA_ARGS__); \
-	printf("\n\n"); \
-} while(0)
+/* ALERT_WARNING(), ALERT_ERROR() and ALERT_DEBUG() go through the
+ * asynchronous logger */
+#include "log.h"
 
 #ifndef __has_builtin
   #define __has_builtin(x) 0
@@ -55,6 +43,17 @@
 
 #define UNUSED(x) ((void) (x))
 
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+  #define THREAD_LOCAL __thread
+#else
+  #define THREAD_LOCAL _Thread_local
+#endif
+
+/* Keeps per-thread hot data on separate cache lines */
+#define CACHE_LINE_SIZE 64
+
 #if (defined(__GNUC__) && (__GNUC__ > 2 && __GNUC_MINOR__ > 0)) || \
     (defined(__INTEL_COMPILER) && __INTEL_COMPILER >= 800) || \
     (defined(__xlc__) || defined(__xlC__) && __xlC__ >= 0x0900) || \
@@ -81,3 +80,9 @@
 #endif
 
 int32_t sys_close(int32_t pid);
+uint64_t sys_time_monotonic(void);
+uint64_t sys_time_monotonic_coarse(void);
+uint64_t sys_time_monotonic_usec(void);
+/* Fills the buffer from the operating system's CSPRNG, for values an
+ * attacker must not predict */
+bool sys_random_bytes(void *buffer, size_t len);
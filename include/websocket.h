@@ -0,0 +1,111 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Longest frame header: 2 bytes, 8 bytes of extended length and a mask. */
+#define WEBSOCKET_MAX_HEADER_SIZE 14
+
+/* Frame opcodes (RFC 6455, section 5.2). */
+typedef enum {
+  WEBSOCKET_OPCODE_CONTINUATION = 0x0, /* Follow-up fragment of a message. */
+  WEBSOCKET_OPCODE_TEXT         = 0x1, /* UTF-8 text message. */
+  WEBSOCKET_OPCODE_BINARY       = 0x2, /* Binary message. */
+  WEBSOCKET_OPCODE_CLOSE        = 0x8, /* Closing handshake. */
+  WEBSOCKET_OPCODE_PING         = 0x9, /* Ping, answered with a pong. */
+  WEBSOCKET_OPCODE_PONG         = 0xA  /* Pong. */
+} WebSocketOpcode;
+
+/* Close status codes (RFC 6455, section 7.4.1). */
+typedef enum {
+  WEBSOCKET_CLOSE_NORMAL         = 1000, /* Normal closure. */
+  WEBSOCKET_CLOSE_GOING_AWAY     = 1001, /* Endpoint is going away. */
+  WEBSOCKET_CLOSE_PROTOCOL_ERROR = 1002, /* Malformed frame. */
+  WEBSOCKET_CLOSE_TOO_BIG        = 1009  /* Message over the size limit. */
+} WebSocketCloseCode;
+
+/* Decoded frame header. */
+typedef struct {
+  bool fin;                 /* Last fragment of a message. */
+  WebSocketOpcode opcode;   /* Frame opcode. */
+  bool masked;              /* Payload is masked with mask. */
+  uint8_t mask[4];          /* Masking key. */
+  uint64_t length;          /* Payload length. */
+  size_t header_size;       /* Bytes taken by the header. */
+} WebSocketFrame;
+
+/* WebSocket opaque structure. */
+typedef struct WebSocket WebSocket;
+
+/* Called for every complete message and control frame. The data is only
+ * valid during the call. */
+typedef void (*WebSocketMessageFunc)(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len,
+                                     void *user);
+
+/* Frame level codec. Parsing returns the header size, 0 while the header
+ * is incomplete or -1 on a malformed header. Masking XORs in place,
+ * offset being the position of data within the payload so a payload can
+ * be unmasked piece by piece. */
+ssize_t websocket_frame_parse(const char *buffer, size_t len, WebSocketFrame *frame);
+size_t websocket_frame_encode(char *buffer, bool fin, WebSocketOpcode opcode, uint64_t length, const uint8_t *mask);
+void websocket_mask(char *data, size_t len, const uint8_t *mask, uint64_t offset);
+
+/* Upgrade handshake over HTTP/1.1. The server side parses a request and
+ * writes the 101 response, the client side writes a request and checks
+ * the response. Both return the length written or consumed, 0 while the
+ * headers are incomplete and -1 on a request or response to reject. */
+ssize_t websocket_handshake_respond(const char *request, size_t len, size_t *consumed, char *response, size_t buflen);
+ssize_t websocket_handshake_request(WebSocket *websocket, const char *host, const char *path, char *buffer,
+                                    size_t buflen);
+ssize_t websocket_handshake_verify(WebSocket *websocket, const char *response, size_t len);
+
+/* Message level endpoint on an upgraded socket. Fragments are reassembled,
+ * pings answered and a close echoed before the callback sees them. Clients
+ * mask what they send, servers insist on masked input. Text is not
+ * checked for valid UTF-8. websocket_feed() decodes bytes the caller read
+ * itself, such as the ones following the handshake, and unmasks them in
+ * place. The socket stays owned by the caller. */
+WebSocket *websocket_new(Socket *socket, bool client);
+void websocket_set_message_func(WebSocket *websocket, WebSocketMessageFunc func, void *user);
+void websocket_set_max_message(WebSocket *websocket, size_t max_message);
+ssize_t websocket_feed(WebSocket *websocket, char *data, size_t len);
+ssize_t websocket_receive(WebSocket *websocket);
+bool websocket_send(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len);
+bool websocket_send_fragment(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len, bool fin);
+bool websocket_close(WebSocket *websocket, uint16_t code, const char *reason);
+bool websocket_is_closed(const WebSocket *websocket);
+uint16_t websocket_get_close_code(const WebSocket *websocket);
+Socket *websocket_get_socket(const WebSocket *websocket);
+void websocket_free(WebSocket *websocket);
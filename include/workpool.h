@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#pragma once
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "socket.h"
+
+/* Generic task handler. */
+typedef void (*WorkPoolFunc)(void *data);
+
+/* Handler for a freshly accepted socket. */
+typedef void (*WorkPoolSocketFunc)(Socket *socket, void *data);
+
+/* Handler for a socket which became ready for IO. */
+typedef void (*WorkPoolIOFunc)(Socket *socket, SocketIOCondition condition, void *data);
+
+/* Per-worker statistics. */
+typedef struct {
+  size_t queue_depth; /* Tasks currently queued in the worker's deque. */
+  uint64_t executed;  /* Tasks executed by the worker. */
+  uint64_t steals;    /* Tasks the worker stole from other workers. */
+} WorkPoolStats;
+
+/* Work pool opaque structure. */
+typedef struct WorkPool WorkPool;
+
+WorkPool *work_pool_new(uint32_t workers);
+uint32_t work_pool_get_size(const WorkPool *pool);
+bool work_pool_submit(WorkPool *pool, WorkPoolFunc func, void *data);
+bool work_pool_submit_socket(WorkPool *pool, WorkPoolSocketFunc func, Socket *socket, void *data);
+bool work_pool_submit_io(WorkPool *pool, WorkPoolIOFunc func, Socket *socket, SocketIOCondition condition, void *data);
+bool work_pool_get_stats(const WorkPool *pool, uint32_t worker, WorkPoolStats *stats);
+void work_pool_free(WorkPool *pool);
@@ -0,0 +1,276 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "addressmap.h"
+#include "error.h"
+
+#define ADDRESS_MAP_MIN_CAPACITY 16
+
+/* An empty slot has a zero tag, the tag also gives the home slot so it
+ * never has to be recomputed from the key */
+typedef struct {
+  SocketAddressKey key;
+  uint32_t tag;
+  void *value;
+} AddressMapSlot;
+
+struct AddressMap {
+  AddressMapSlot *slots;
+  size_t capacity;
+  size_t mask;
+  size_t count;
+  uint64_t seed;
+};
+
+static inline uint32_t private_address_map_tag(const AddressMap *map, const SocketAddressKey *key) {
+  uint64_t hash;
+  uint32_t ret;
+
+  hash = socket_address_key_hash(key, map->seed);
+  ret = (uint32_t)(hash ^ (hash >> 32));
+
+  return ret != 0 ? ret : 1;
+}
+
+/* Returns the slot holding the key, or the empty slot ending its probe */
+static inline AddressMapSlot *private_address_map_find(const AddressMap *map, const SocketAddressKey *key,
+                                                       uint32_t tag) {
+  AddressMapSlot *slot;
+  size_t index;
+
+  for (index = tag & map->mask;; index = (index + 1) & map->mask) {
+    slot = &map->slots[index];
+
+    if (slot->tag == 0 || (slot->tag == tag && socket_address_key_equal(&slot->key, key))) {
+      return slot;
+    }
+  }
+}
+
+static bool private_address_map_resize(AddressMap *map, size_t capacity) {
+  AddressMapSlot *slots, *old, *slot;
+  size_t old_capacity, i, index;
+
+  if (UNLIKELY((slots = calloc(sizeof(AddressMapSlot), capacity)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for address map");
+    return false;
+  }
+
+  old = map->slots;
+  old_capacity = map->capacity;
+  map->slots = slots;
+  map->capacity = capacity;
+  map->mask = capacity - 1;
+
+  for (i = 0; i < old_capacity; i++) {
+    if (old[i].tag == 0) {
+      continue;
+    }
+
+    for (index = old[i].tag & map->mask; slots[index].tag != 0; index = (index + 1) & map->mask);
+
+    slot = &slots[index];
+    *slot = old[i];
+  }
+
+  free(old);
+
+  return true;
+}
+
+AddressMap *address_map_new(size_t capacity) {
+  AddressMap *ret;
+  size_t size;
+
+  if (UNLIKELY((ret = calloc(sizeof(AddressMap), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for address map");
+    return NULL;
+  }
+
+  /* Room for the requested entries below the 3/4 load limit */
+  for (size = ADDRESS_MAP_MIN_CAPACITY; size - size / 4 < capacity; size *= 2);
+
+  /* A guessable seed would let peers flood one probe chain */
+  if (UNLIKELY(sys_random_bytes(&ret->seed, sizeof(ret->seed)) == false)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to generate address map seed");
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY(private_address_map_resize(ret, size) == false)) {
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+size_t address_map_get_count(const AddressMap *map) {
+  if (UNLIKELY(map == NULL)) {
+    return 0;
+  }
+
+  return map->count;
+}
+
+void *address_map_get(const AddressMap *map, const SocketAddressKey *key) {
+  AddressMapSlot *slot;
+
+  if (UNLIKELY(map == NULL || key == NULL)) {
+    return NULL;
+  }
+
+  slot = private_address_map_find(map, key, private_address_map_tag(map, key));
+
+  return slot->tag != 0 ? slot->value : NULL;
+}
+
+/* Returns the value slot for the key, inserting a NULL value first when
+ * the key is missing. The pointer is valid until the map changes. */
+void **address_map_get_or_insert(AddressMap *map, const SocketAddressKey *key, bool *inserted) {
+  AddressMapSlot *slot;
+  uint32_t tag;
+
+  if (UNLIKELY(map == NULL || key == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  tag = private_address_map_tag(map, key);
+  slot = private_address_map_find(map, key, tag);
+
+  if (slot->tag != 0) {
+    if (inserted != NULL) {
+      *inserted = false;
+    }
+
+    return &slot->value;
+  }
+
+  if (map->count + 1 > map->capacity - map->capacity / 4) {
+    if (UNLIKELY(private_address_map_resize(map, map->capacity * 2) == false)) {
+      return NULL;
+    }
+
+    slot = private_address_map_find(map, key, tag);
+  }
+
+  slot->key = *key;
+  slot->tag = tag;
+  slot->value = NULL;
+  map->count++;
+
+  if (inserted != NULL) {
+    *inserted = true;
+  }
+
+  return &slot->value;
+}
+
+bool address_map_put(AddressMap *map, const SocketAddressKey *key, void *value) {
+  void **slot;
+
+  if (UNLIKELY((slot = address_map_get_or_insert(map, key, NULL)) == NULL)) {
+    return false;
+  }
+
+  *slot = value;
+
+  return true;
+}
+
+/* Backward shift deletion, linear probing needs no tombstones */
+bool address_map_remove(AddressMap *map, const SocketAddressKey *key, void **value) {
+  AddressMapSlot *slot;
+  size_t hole, index, home;
+
+  if (UNLIKELY(map == NULL || key == NULL)) {
+    return false;
+  }
+
+  slot = private_address_map_find(map, key, private_address_map_tag(map, key));
+
+  if (slot->tag == 0) {
+    return false;
+  }
+
+  if (value != NULL) {
+    *value = slot->value;
+  }
+
+  hole = (size_t)(slot - map->slots);
+
+  for (index = (hole + 1) & map->mask; map->slots[index].tag != 0; index = (index + 1) & map->mask) {
+    home = map->slots[index].tag & map->mask;
+
+    /* Moves entries whose home slot doesn't lie between the hole and them */
+    if (((index - home) & map->mask) >= ((index - hole) & map->mask)) {
+      map->slots[hole] = map->slots[index];
+      hole = index;
+    }
+  }
+
+  map->slots[hole].tag = 0;
+  map->count--;
+
+  return true;
+}
+
+void address_map_foreach(const AddressMap *map, AddressMapFunc func, void *data) {
+  size_t i;
+
+  if (UNLIKELY(map == NULL || func == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < map->capacity; i++) {
+    if (map->slots[i].tag != 0 && func(&map->slots[i].key, map->slots[i].value, data) == false) {
+      break;
+    }
+  }
+}
+
+void address_map_clear(AddressMap *map) {
+  if (UNLIKELY(map == NULL)) {
+    return;
+  }
+
+  memset(map->slots, 0, sizeof(AddressMapSlot) * map->capacity);
+  map->count = 0;
+}
+
+void address_map_free(AddressMap *map) {
+  if (UNLIKELY(map == NULL)) {
+    return;
+  }
+
+  free(map->slots);
+  free(map);
+}
@@ -0,0 +1,424 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "admission.h"
+#include "addressmap.h"
+#include "thread.h"
+#include "error.h"
+
+#define ADMISSION_DEFAULT_RATE      20
+#define ADMISSION_DEFAULT_BURST     40
+#define ADMISSION_DEFAULT_LATENCY   500
+#define ADMISSION_SWEEP_INTERVAL    1000
+/* Latency samples are smoothed over roughly the last eight connections,
+ * and the estimate halves for every second without samples */
+#define ADMISSION_LATENCY_WEIGHT    0.125
+#define ADMISSION_LATENCY_DECAY     1000
+#define ADMISSION_MAX_SHED          0.95
+
+typedef struct {
+  double tokens;
+  uint64_t updated;
+} AdmissionBucket;
+
+struct Admission {
+  Mutex *lock;
+  AddressMap *buckets;
+  /* Shared by the sources that don't fit in the map */
+  AdmissionBucket overflow;
+  size_t max_sources;
+  uint64_t last_sweep;
+  double rate;
+  double burst;
+  double latency;
+  uint64_t last_sample;
+  uint32_t threshold;
+  uint64_t random;
+  atomic_size_t max_connections;
+  atomic_size_t active;
+  atomic_uint_fast64_t rejected;
+};
+
+typedef struct {
+  SocketAddressKey *keys;
+  size_t count;
+  size_t capacity;
+  double burst;
+  double rate;
+  uint64_t now;
+} AdmissionSweep;
+
+static bool private_admission_refill(const Admission *admission, AdmissionBucket *bucket, uint64_t now);
+static bool private_admission_sweep_collect(const SocketAddressKey *key, void *value, void *data);
+static void private_admission_sweep(Admission *admission, uint64_t now);
+static bool private_admission_take(Admission *admission, const SocketAddressKey *peer, uint64_t now);
+static bool private_admission_shed(Admission *admission, uint64_t now);
+static bool private_admission_free_bucket(const SocketAddressKey *key, void *value, void *data);
+
+/* Returns true when the bucket is full again, i.e. it carries no state */
+static bool private_admission_refill(const Admission *admission, AdmissionBucket *bucket, uint64_t now) {
+  if (now > bucket->updated) {
+    bucket->tokens += (double)(now - bucket->updated) * admission->rate / 1000.0;
+    bucket->updated = now;
+  }
+
+  if (bucket->tokens >= admission->burst) {
+    bucket->tokens = admission->burst;
+    return true;
+  }
+
+  return false;
+}
+
+static bool private_admission_sweep_collect(const SocketAddressKey *key, void *value, void *data) {
+  AdmissionSweep *sweep;
+  AdmissionBucket *bucket;
+
+  sweep = (AdmissionSweep *) data;
+  bucket = (AdmissionBucket *) value;
+
+  if (bucket->tokens + (double)(sweep->now - bucket->updated) * sweep->rate / 1000.0 >= sweep->burst) {
+    sweep->keys[sweep->count++] = *key;
+  }
+
+  return sweep->count < sweep->capacity;
+}
+
+/* Drops the buckets that refilled completely, they behave the same as
+ * a source that was never seen */
+static void private_admission_sweep(Admission *admission, uint64_t now) {
+  AdmissionSweep sweep;
+  void *value;
+  size_t i;
+
+  admission->last_sweep = now;
+  sweep.capacity = address_map_get_count(admission->buckets);
+  sweep.count = 0;
+  sweep.rate = admission->rate;
+  sweep.burst = admission->burst;
+  sweep.now = now;
+
+  if (UNLIKELY((sweep.keys = malloc(sizeof(SocketAddressKey) * (sweep.capacity + 1))) == NULL)) {
+    return;
+  }
+
+  address_map_foreach(admission->buckets, private_admission_sweep_collect, &sweep);
+
+  for (i = 0; i < sweep.count; i++) {
+    if (address_map_remove(admission->buckets, &sweep.keys[i], &value)) {
+      free(value);
+    }
+  }
+
+  free(sweep.keys);
+}
+
+static bool private_admission_take(Admission *admission, const SocketAddressKey *peer, uint64_t now) {
+  SocketAddressKey key;
+  AdmissionBucket *bucket;
+  void **slot;
+  bool inserted;
+
+  key = *peer;
+  key.port[0] = 0;
+  key.port[1] = 0;
+
+  if (key.family == 6) {
+    memset(key.address + 8, 0, 8);
+  }
+
+  bucket = (AdmissionBucket *) address_map_get(admission->buckets, &key);
+
+  if (bucket == NULL) {
+    if (address_map_get_count(admission->buckets) >= admission->max_sources &&
+        now - admission->last_sweep >= ADMISSION_SWEEP_INTERVAL) {
+      private_admission_sweep(admission, now);
+    }
+
+    if (address_map_get_count(admission->buckets) < admission->max_sources &&
+        (bucket = malloc(sizeof(AdmissionBucket))) != NULL) {
+      if (UNLIKELY((slot = address_map_get_or_insert(admission->buckets, &key, &inserted)) == NULL)) {
+        free(bucket);
+        bucket = NULL;
+      } else {
+        bucket->tokens = admission->burst;
+        bucket->updated = now;
+        *slot = bucket;
+      }
+    }
+
+    if (bucket == NULL) {
+      bucket = &admission->overflow;
+    }
+  }
+
+  private_admission_refill(admission, bucket, now);
+
+  if (bucket->tokens < 1.0) {
+    return false;
+  }
+
+  bucket->tokens -= 1.0;
+
+  return true;
+}
+
+/* Sheds a share of the connections proportional to how far the smoothed
+ * latency is over the threshold */
+static bool private_admission_shed(Admission *admission, uint64_t now) {
+  double ratio;
+
+  if (admission->threshold == 0) {
+    return false;
+  }
+
+  while (now - admission->last_sample >= ADMISSION_LATENCY_DECAY && admission->latency > 0) {
+    admission->latency *= 0.5;
+    admission->last_sample += ADMISSION_LATENCY_DECAY;
+
+    if (admission->latency < 1.0) {
+      admission->latency = 0;
+    }
+  }
+
+  if (admission->latency <= (double) admission->threshold) {
+    return false;
+  }
+
+  ratio = (admission->latency - (double) admission->threshold) / (double) admission->threshold;
+
+  if (ratio > ADMISSION_MAX_SHED) {
+    ratio = ADMISSION_MAX_SHED;
+  }
+
+  /* xorshift64, only needs to be cheap */
+  admission->random ^= admission->random << 13;
+  admission->random ^= admission->random >> 7;
+  admission->random ^= admission->random << 17;
+
+  return (double)(admission->random >> 11) * (1.0 / 9007199254740992.0) < ratio;
+}
+
+Admission *admission_new(size_t max_sources) {
+  Admission *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Admission), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for admission control");
+    return NULL;
+  }
+
+  if (max_sources == 0) {
+    max_sources = 65536;
+  }
+
+  if (UNLIKELY((ret->lock = mutex_new()) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->buckets = address_map_new(max_sources)) == NULL)) {
+    mutex_free(ret->lock);
+    free(ret);
+    return NULL;
+  }
+
+  ret->max_sources = max_sources;
+  ret->rate = ADMISSION_DEFAULT_RATE;
+  ret->burst = ADMISSION_DEFAULT_BURST;
+  ret->threshold = ADMISSION_DEFAULT_LATENCY;
+  ret->last_sweep = sys_time_monotonic_coarse();
+  ret->last_sample = ret->last_sweep;
+  ret->overflow.tokens = ret->burst;
+  ret->overflow.updated = ret->last_sweep;
+  ret->random = ((uint64_t)(uintptr_t) ret) ^ (ret->last_sweep * 0x9e3779b97f4a7c15ull) ^ 1;
+  atomic_init(&ret->max_connections, 0);
+  atomic_init(&ret->active, 0);
+  atomic_init(&ret->rejected, 0);
+
+  return ret;
+}
+
+/* A rate of 0 turns the per-source limit off */
+void admission_set_rate(Admission *admission, uint32_t per_second, uint32_t burst) {
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  mutex_lock(admission->lock);
+  admission->rate = (double) per_second;
+  admission->burst = burst > 0 ? (double) burst : 1.0;
+  mutex_unlock(admission->lock);
+}
+
+/* A cap of 0 means unlimited */
+void admission_set_max_connections(Admission *admission, size_t max_connections) {
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  atomic_store_explicit(&admission->max_connections, max_connections, memory_order_relaxed);
+}
+
+/* A threshold of 0 turns shedding off */
+void admission_set_latency_threshold(Admission *admission, uint32_t msec) {
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  mutex_lock(admission->lock);
+  admission->threshold = msec;
+  mutex_unlock(admission->lock);
+}
+
+size_t admission_get_active(const Admission *admission) {
+  if (UNLIKELY(admission == NULL)) {
+    return 0;
+  }
+
+  return atomic_load(&((Admission *) admission)->active);
+}
+
+uint64_t admission_get_rejected(const Admission *admission) {
+  if (UNLIKELY(admission == NULL)) {
+    return 0;
+  }
+
+  return atomic_load(&((Admission *) admission)->rejected);
+}
+
+/* Smoothed accept-to-first-byte latency in milliseconds */
+uint32_t admission_get_latency(const Admission *admission) {
+  uint32_t ret;
+
+  if (UNLIKELY(admission == NULL)) {
+    return 0;
+  }
+
+  mutex_lock(admission->lock);
+  ret = (uint32_t) admission->latency;
+  mutex_unlock(admission->lock);
+
+  return ret;
+}
+
+SocketAcceptVerdict admission_check(Admission *admission, const SocketAddressKey *peer) {
+  size_t active, max_connections;
+  uint64_t now;
+  bool allow;
+
+  if (UNLIKELY(admission == NULL || peer == NULL)) {
+    return SOCKET_ACCEPT_ALLOW;
+  }
+
+  /* The cap is the cheapest test and the one that matters most in a flood */
+  active = atomic_fetch_add(&admission->active, 1);
+  max_connections = atomic_load_explicit(&admission->max_connections, memory_order_relaxed);
+
+  if (max_connections != 0 && active >= max_connections) {
+    atomic_fetch_sub(&admission->active, 1);
+    atomic_fetch_add(&admission->rejected, 1);
+    return SOCKET_ACCEPT_RESET;
+  }
+
+  now = sys_time_monotonic_coarse();
+
+  mutex_lock(admission->lock);
+  allow = private_admission_shed(admission, now) == false &&
+          (admission->rate == 0 || private_admission_take(admission, peer, now));
+  mutex_unlock(admission->lock);
+
+  if (allow == false) {
+    atomic_fetch_sub(&admission->active, 1);
+    atomic_fetch_add(&admission->rejected, 1);
+    return SOCKET_ACCEPT_RESET;
+  }
+
+  return SOCKET_ACCEPT_ALLOW;
+}
+
+/* Feeds the shedding estimate, accepted_at is the sys_time_monotonic()
+ * value taken when the connection was accepted */
+void admission_first_byte(Admission *admission, uint64_t accepted_at) {
+  uint64_t now;
+  double sample;
+
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  now = sys_time_monotonic();
+  sample = now > accepted_at ? (double)(now - accepted_at) : 0;
+
+  mutex_lock(admission->lock);
+  admission->latency += (sample - admission->latency) * ADMISSION_LATENCY_WEIGHT;
+  admission->last_sample = sys_time_monotonic_coarse();
+  mutex_unlock(admission->lock);
+}
+
+void admission_release(Admission *admission) {
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  atomic_fetch_sub(&admission->active, 1);
+}
+
+static bool private_admission_free_bucket(const SocketAddressKey *key, void *value, void *data) {
+  UNUSED(key);
+  UNUSED(data);
+
+  free(value);
+
+  return true;
+}
+
+void admission_free(Admission *admission) {
+  if (UNLIKELY(admission == NULL)) {
+    return;
+  }
+
+  address_map_foreach(admission->buckets, private_admission_free_bucket, NULL);
+  address_map_free(admission->buckets);
+  mutex_free(admission->lock);
+  free(admission);
+}
+
+SocketAcceptVerdict admission_accept_filter(const SocketAddressKey *peer, void *admission) {
+  return admission_check((Admission *) admission, peer);
+}
+
+/* Gives back the slot admission_check() took for a connection that never
+ * reached the caller */
+void admission_accept_undo(const SocketAddressKey *peer, void *admission) {
+  UNUSED(peer);
+
+  admission_release((Admission *) admission);
+}
@@ -0,0 +1,418 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "connector.h"
+#include "poller.h"
+#include "error.h"
+
+/* Recommended defaults from RFC 8305, section 5 */
+#define CONNECTOR_DEFAULT_ATTEMPT_DELAY 250
+#define CONNECTOR_MIN_ATTEMPT_DELAY     10
+#define CONNECTOR_MAX_ATTEMPT_DELAY     2000
+#define CONNECTOR_MAX_EVENTS            16
+
+typedef struct {
+  SocketAddress *address;
+  Socket *socket;
+  bool registered;
+} ConnectorAttempt;
+
+struct Connector {
+  Poller *poller;
+  PollerEvent events[CONNECTOR_MAX_EVENTS];
+  ConnectorAttempt *attempts;
+  size_t count;
+  size_t next;
+  size_t pending;
+  SocketType type;
+  SocketProtocol protocol;
+  ConnectorState state;
+  ConnectorAttempt *winner;
+  uint32_t attempt_delay;
+  uint64_t next_attempt;
+  uint64_t deadline;
+  int32_t last_code;
+  int32_t last_native_code;
+};
+
+static void private_connector_close_attempt(Connector *connector, ConnectorAttempt *attempt);
+static void private_connector_start_next(Connector *connector, uint64_t now);
+static void private_connector_finish(Connector *connector, ConnectorAttempt *winner);
+
+static void private_connector_close_attempt(Connector *connector, ConnectorAttempt *attempt) {
+  if (attempt->socket == NULL) {
+    return;
+  }
+
+  if (attempt->registered) {
+    poller_remove(connector->poller, attempt->socket);
+    attempt->registered = false;
+  }
+
+  socket_free(attempt->socket);
+  attempt->socket = NULL;
+  connector->pending--;
+}
+
+/* Starts attempts until one is in flight or connects right away, an
+ * attempt failing synchronously (i.e. no route for the family) moves on
+ * to the next address without waiting for the attempt delay */
+static void private_connector_start_next(Connector *connector, uint64_t now) {
+  ConnectorAttempt *attempt;
+  ErrorIO code;
+
+  while (connector->next < connector->count) {
+    attempt = &connector->attempts[connector->next++];
+
+    if (UNLIKELY((attempt->socket = socket_new(socket_address_get_family(attempt->address),
+                                               connector->type, connector->protocol)) == NULL)) {
+      connector->last_code = error_get_code();
+      connector->last_native_code = error_get_native_code();
+      continue;
+    }
+
+    connector->pending++;
+    socket_set_blocking(attempt->socket, false);
+
+    if (socket_connect(attempt->socket, attempt->address) == true) {
+      private_connector_finish(connector, attempt);
+      return;
+    }
+
+    code = (ErrorIO)error_get_code();
+
+    if (LIKELY(code == ERROR_IO_WOULD_BLOCK || code == ERROR_IO_IN_PROGRESS) &&
+        LIKELY(poller_add(connector->poller, attempt->socket, SOCKET_IO_CONDITION_POLLOUT, attempt) == true)) {
+      attempt->registered = true;
+      connector->next_attempt = now + connector->attempt_delay;
+      return;
+    }
+
+    connector->last_code = error_get_code();
+    connector->last_native_code = error_get_native_code();
+    private_connector_close_attempt(connector, attempt);
+  }
+}
+
+static void private_connector_finish(Connector *connector, ConnectorAttempt *winner) {
+  size_t i;
+
+  for (i = 0; i < connector->next; i++) {
+    if (&connector->attempts[i] != winner) {
+      private_connector_close_attempt(connector, &connector->attempts[i]);
+    }
+  }
+
+  /* A synchronous connect never made it into the poller */
+  if (winner != NULL) {
+    if (winner->registered) {
+      poller_remove(connector->poller, winner->socket);
+      winner->registered = false;
+    }
+
+    connector->winner = winner;
+    connector->state = CONNECTOR_STATE_CONNECTED;
+  } else {
+    connector->state = CONNECTOR_STATE_FAILED;
+  }
+}
+
+Connector *connector_new(SocketAddress **addresses, size_t count, SocketType type, SocketProtocol protocol) {
+  Connector *ret;
+  SocketFamily first;
+  size_t i, primary, secondary, index;
+
+  if (UNLIKELY(addresses == NULL || count == 0)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(Connector), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for connector");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->attempts = calloc(sizeof(ConnectorAttempt), count)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for connector");
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->poller = poller_new()) == NULL)) {
+    free(ret->attempts);
+    free(ret);
+    return NULL;
+  }
+
+  /* Interleave the families, keeping the resolver order within each */
+  first = socket_address_get_family(addresses[0]);
+  primary = 0;
+  secondary = 0;
+
+  for (index = 0; index < count; index++) {
+    bool want_primary = (index % 2 == 0);
+
+    for (i = want_primary ? primary : secondary; i < count; i++) {
+      if ((socket_address_get_family(addresses[i]) == first) == want_primary) {
+        break;
+      }
+    }
+
+    /* One family ran out, take the rest of the other one */
+    if (i == count) {
+      want_primary = !want_primary;
+
+      for (i = want_primary ? primary : secondary; i < count; i++) {
+        if ((socket_address_get_family(addresses[i]) == first) == want_primary) {
+          break;
+        }
+      }
+    }
+
+    ret->attempts[index].address = addresses[i];
+
+    if (want_primary) {
+      primary = i + 1;
+    } else {
+      secondary = i + 1;
+    }
+  }
+
+  ret->count = count;
+  ret->type = type;
+  ret->protocol = protocol;
+  ret->state = CONNECTOR_STATE_CONNECTING;
+  ret->attempt_delay = CONNECTOR_DEFAULT_ATTEMPT_DELAY;
+  ret->last_code = (int32_t)ERROR_IO_FAILED;
+
+  return ret;
+}
+
+void connector_set_attempt_delay(Connector *connector, uint32_t msec) {
+  if (UNLIKELY(connector == NULL)) {
+    return;
+  }
+
+  if (msec < CONNECTOR_MIN_ATTEMPT_DELAY) {
+    msec = CONNECTOR_MIN_ATTEMPT_DELAY;
+  } else if (msec > CONNECTOR_MAX_ATTEMPT_DELAY) {
+    msec = CONNECTOR_MAX_ATTEMPT_DELAY;
+  }
+
+  connector->attempt_delay = msec;
+}
+
+void connector_set_deadline(Connector *connector, uint64_t deadline) {
+  if (UNLIKELY(connector == NULL)) {
+    return;
+  }
+
+  connector->deadline = deadline;
+}
+
+ConnectorState connector_get_state(const Connector *connector) {
+  if (UNLIKELY(connector == NULL)) {
+    return CONNECTOR_STATE_FAILED;
+  }
+
+  return connector->state;
+}
+
+/* Time until the connector has to be polled again even without socket
+ * events, -1 when only socket events are left to wait for */
+int32_t connector_get_timeout(const Connector *connector) {
+  uint64_t now, until;
+
+  if (UNLIKELY(connector == NULL) || connector->state != CONNECTOR_STATE_CONNECTING ||
+      connector->pending == 0) {
+    return 0;
+  }
+
+  until = 0;
+
+  if (connector->next < connector->count) {
+    until = connector->next_attempt;
+  }
+
+  if (connector->deadline != 0 && (until == 0 || connector->deadline < until)) {
+    until = connector->deadline;
+  }
+
+  if (until == 0) {
+    return -1;
+  }
+
+  now = sys_time_monotonic();
+
+  if (until <= now) {
+    return 0;
+  }
+
+  return until - now > INT32_MAX ? INT32_MAX : (int32_t)(until - now);
+}
+
+ConnectorState connector_poll(Connector *connector, int32_t timeout) {
+  ConnectorAttempt *attempt;
+  uint64_t now;
+  int32_t wait, evret, i;
+
+  if (UNLIKELY(connector == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return CONNECTOR_STATE_FAILED;
+  }
+
+  if (connector->state != CONNECTOR_STATE_CONNECTING) {
+    return connector->state;
+  }
+
+  now = sys_time_monotonic();
+
+  if (connector->next == 0 || (connector->next < connector->count && now >= connector->next_attempt)) {
+    private_connector_start_next(connector, now);
+  }
+
+  while (connector->state == CONNECTOR_STATE_CONNECTING) {
+    if (connector->pending == 0) {
+      private_connector_finish(connector, NULL);
+      error_set_error(connector->last_code, connector->last_native_code, "Failed to connect to any address");
+      break;
+    }
+
+    if (connector->deadline != 0 && now >= connector->deadline) {
+      private_connector_finish(connector, NULL);
+      error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Timed out while connecting");
+      break;
+    }
+
+    wait = connector_get_timeout(connector);
+
+    if (timeout >= 0 && (wait < 0 || timeout < wait)) {
+      wait = timeout;
+    }
+
+    if (UNLIKELY((evret = poller_wait(connector->poller, connector->events, CONNECTOR_MAX_EVENTS, wait)) < 0)) {
+      return connector->state;
+    }
+
+    now = sys_time_monotonic();
+
+    for (i = 0; i < evret && connector->state == CONNECTOR_STATE_CONNECTING; i++) {
+      attempt = connector->events[i].data;
+
+      if (socket_check_connect_result(attempt->socket) == true) {
+        private_connector_finish(connector, attempt);
+        break;
+      }
+
+      connector->last_code = error_get_code();
+      connector->last_native_code = error_get_native_code();
+      private_connector_close_attempt(connector, attempt);
+
+      /* A failed attempt doesn't wait out the attempt delay */
+      private_connector_start_next(connector, now);
+    }
+
+    if (connector->state != CONNECTOR_STATE_CONNECTING) {
+      break;
+    }
+
+    if (connector->next < connector->count && now >= connector->next_attempt) {
+      private_connector_start_next(connector, now);
+    }
+
+    /* A bounded poll waits once, the caller drives the next round */
+    if (timeout >= 0) {
+      break;
+    }
+  }
+
+  return connector->state;
+}
+
+Socket *connector_take_socket(Connector *connector) {
+  Socket *ret;
+
+  if (UNLIKELY(connector == NULL || connector->winner == NULL || connector->winner->socket == NULL)) {
+    return NULL;
+  }
+
+  ret = connector->winner->socket;
+  connector->winner->socket = NULL;
+  connector->pending--;
+
+  return ret;
+}
+
+SocketAddress *connector_get_address(const Connector *connector) {
+  if (UNLIKELY(connector == NULL || connector->winner == NULL)) {
+    return NULL;
+  }
+
+  return connector->winner->address;
+}
+
+void connector_free(Connector *connector) {
+  size_t i;
+
+  if (UNLIKELY(connector == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < connector->next; i++) {
+    private_connector_close_attempt(connector, &connector->attempts[i]);
+  }
+
+  poller_free(connector->poller);
+  free(connector->attempts);
+  free(connector);
+}
+
+Socket *connector_connect(SocketAddress **addresses, size_t count, SocketType type, SocketProtocol protocol,
+                          uint64_t deadline) {
+  Connector *connector;
+  Socket *ret;
+
+  if (UNLIKELY((connector = connector_new(addresses, count, type, protocol)) == NULL)) {
+    return NULL;
+  }
+
+  connector_set_deadline(connector, deadline);
+
+  ret = NULL;
+
+  if (connector_poll(connector, -1) == CONNECTOR_STATE_CONNECTED) {
+    ret = connector_take_socket(connector);
+    socket_set_blocking(ret, true);
+  }
+
+  connector_free(connector);
+
+  return ret;
+}
@@ -0,0 +1,792 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "coroutine.h"
+#include "poller.h"
+#include "timerwheel.h"
+#include "error.h"
+
+#if defined(_WINDOWS)
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #include <windows.h>
+  #define COROUTINE_USE_FIBERS
+#else
+  #include <sys/mman.h>
+  #include <unistd.h>
+  #if defined(__amd64__) && defined(__ELF__)
+    #define COROUTINE_USE_ASM
+  #else
+    #define COROUTINE_USE_UCONTEXT
+    #include <ucontext.h>
+  #endif
+  #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+    #define MAP_ANONYMOUS MAP_ANON
+  #endif
+#endif
+
+#define COROUTINE_DEFAULT_STACK_SIZE (64 * 1024)
+#define COROUTINE_MAX_EVENTS 256
+/* Finished coroutines kept around to reuse their stacks */
+#define COROUTINE_MAX_FREE 1024
+#define COROUTINE_INITIAL_WAITER_BUCKETS 64
+
+typedef enum {
+  COROUTINE_STATE_READY   = 0,
+  COROUTINE_STATE_RUNNING = 1,
+  COROUTINE_STATE_WAITING = 2,
+  COROUTINE_STATE_DONE    = 3
+} CoroutineState;
+
+typedef struct Coroutine {
+  CoroutineFunc func;
+  void *data;
+  CoroutineScheduler *scheduler;
+  CoroutineState state;
+#if defined(COROUTINE_USE_FIBERS)
+  LPVOID fiber;
+#elif defined(COROUTINE_USE_ASM)
+  void *sp;
+  void *stack;
+  size_t stack_size;
+#else
+  ucontext_t context;
+  void *stack;
+  size_t stack_size;
+#endif
+  struct CoroutineWaiter *waiter;
+  Timer *timer;
+  bool timed_out;
+  struct Coroutine *next;
+} Coroutine;
+
+/* The poller holds one registration per fd, so the coroutines waiting on
+ * a socket share a record and the registration waits for the union of
+ * their conditions. Released records go to a free list and are never
+ * freed before the scheduler, events still queued for them see a NULL
+ * socket. */
+typedef struct CoroutineWaiter {
+  const Socket *socket;
+  int32_t fd;
+  Coroutine *reader;
+  Coroutine *writer;
+  struct CoroutineWaiter *next;
+} CoroutineWaiter;
+
+struct CoroutineScheduler {
+  Poller *poller;
+  PollerEvent events[COROUTINE_MAX_EVENTS];
+  Coroutine *ready_head;
+  Coroutine *ready_tail;
+  Coroutine *free_list;
+  size_t free_count;
+  CoroutineWaiter **waiters;
+  size_t waiter_buckets;
+  size_t waiter_count;
+  CoroutineWaiter *waiter_free;
+  TimerWheel *wheel;
+  size_t count;
+  size_t stack_size;
+  bool running;
+#if defined(COROUTINE_USE_FIBERS)
+  LPVOID fiber;
+#elif defined(COROUTINE_USE_ASM)
+  void *sp;
+#else
+  ucontext_t context;
+#endif
+};
+
+static THREAD_LOCAL CoroutineScheduler *CURRENT_SCHEDULER = NULL;
+static THREAD_LOCAL Coroutine *CURRENT_COROUTINE = NULL;
+
+#ifdef COROUTINE_USE_ASM
+/* Saves callee-saved registers on the current stack, stores the stack
+ * pointer to *from and restores the registers saved on the stack at to */
+void coroutine_switch_context(void **from, void *to);
+
+__asm__(
+  ".text\n"
+  ".globl coroutine_switch_context\n"
+  ".hidden coroutine_switch_context\n"
+  ".type coroutine_switch_context, @function\n"
+  "coroutine_switch_context:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size coroutine_switch_context, .-coroutine_switch_context\n"
+);
+#endif
+
+static void private_coroutine_suspend(Coroutine *coroutine);
+static void private_coroutine_resume(CoroutineScheduler *scheduler, Coroutine *coroutine);
+static bool private_coroutine_prepare(CoroutineScheduler *scheduler, Coroutine *coroutine);
+static void private_coroutine_destroy(Coroutine *coroutine);
+static void private_coroutine_make_ready(CoroutineScheduler *scheduler, Coroutine *coroutine);
+static void private_coroutine_timer_expired(Timer *timer, void *data);
+static CoroutineWaiter *private_coroutine_get_waiter(CoroutineScheduler *scheduler, const Socket *socket);
+static void private_coroutine_release_waiter(CoroutineScheduler *scheduler, CoroutineWaiter *waiter);
+static void private_coroutine_detach(CoroutineWaiter *waiter, Coroutine *coroutine);
+static void private_coroutine_rearm(CoroutineScheduler *scheduler, CoroutineWaiter *waiter, bool armed);
+static void private_coroutine_wake(CoroutineScheduler *scheduler, CoroutineWaiter *waiter,
+                                   SocketIOCondition condition);
+
+/* Runs coroutine bodies in a loop so a finished coroutine can be handed
+ * a new body without allocating a new stack */
+#ifdef COROUTINE_USE_FIBERS
+static VOID CALLBACK private_coroutine_entry(LPVOID arg) {
+  UNUSED(arg);
+#else
+static void private_coroutine_entry(void) {
+#endif
+  Coroutine *coroutine;
+
+  for (;;) {
+    coroutine = CURRENT_COROUTINE;
+    coroutine->func(coroutine->data);
+    coroutine->state = COROUTINE_STATE_DONE;
+    private_coroutine_suspend(coroutine);
+  }
+}
+
+static void private_coroutine_suspend(Coroutine *coroutine) {
+#if defined(COROUTINE_USE_FIBERS)
+  SwitchToFiber(coroutine->scheduler->fiber);
+#elif defined(COROUTINE_USE_ASM)
+  coroutine_switch_context(&coroutine->sp, coroutine->scheduler->sp);
+#else
+  swapcontext(&coroutine->context, &coroutine->scheduler->context);
+#endif
+}
+
+static void private_coroutine_resume(CoroutineScheduler *scheduler, Coroutine *coroutine) {
+  CURRENT_COROUTINE = coroutine;
+  coroutine->state = COROUTINE_STATE_RUNNING;
+
+#if defined(COROUTINE_USE_FIBERS)
+  SwitchToFiber(coroutine->fiber);
+#elif defined(COROUTINE_USE_ASM)
+  coroutine_switch_context(&scheduler->sp, coroutine->sp);
+#else
+  swapcontext(&scheduler->context, &coroutine->context);
+#endif
+
+  CURRENT_COROUTINE = NULL;
+}
+
+static bool private_coroutine_prepare(CoroutineScheduler *scheduler, Coroutine *coroutine) {
+#if defined(COROUTINE_USE_FIBERS)
+  if (UNLIKELY((coroutine->fiber = CreateFiber(scheduler->stack_size, private_coroutine_entry, NULL)) == NULL)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_system()),
+      (int32_t)error_get_last_system(),
+      "Failed to call CreateFiber() to create coroutine"
+    );
+    return false;
+  }
+#else
+  size_t page;
+
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  coroutine->stack_size = ((scheduler->stack_size + page - 1) / page) * page + page;
+
+  coroutine->stack = mmap(NULL, coroutine->stack_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (UNLIKELY(coroutine->stack == MAP_FAILED)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_system()),
+      (int32_t)error_get_last_system(),
+      "Failed to call mmap() to allocate coroutine stack"
+    );
+    coroutine->stack = NULL;
+    return false;
+  }
+
+  /* Guard page to turn stack overflows into faults */
+  if (UNLIKELY(mprotect(coroutine->stack, page, PROT_NONE) != 0)) {
+    ALERT_WARNING("Coroutine::private_coroutine_prepare: mprotect() failed");
+  }
+
+  #if defined(COROUTINE_USE_ASM)
+  {
+    uint64_t *sp;
+    int32_t i;
+
+    /* Stack for coroutine_switch_context(): six zeroed registers and the
+     * entry address for ret, which leaves the entry with the same stack
+     * alignment as a regular call */
+    sp = (uint64_t *)(((uintptr_t)coroutine->stack + coroutine->stack_size) & ~(uintptr_t)15);
+    *--sp = 0;
+    *--sp = (uint64_t)(uintptr_t)private_coroutine_entry;
+
+    for (i = 0; i < 6; i++) {
+      *--sp = 0;
+    }
+
+    coroutine->sp = sp;
+  }
+  #else
+  if (UNLIKELY(getcontext(&coroutine->context) != 0)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to call getcontext() to create coroutine");
+    munmap(coroutine->stack, coroutine->stack_size);
+    coroutine->stack = NULL;
+    return false;
+  }
+
+  coroutine->context.uc_stack.ss_sp = (char *)coroutine->stack + page;
+  coroutine->context.uc_stack.ss_size = coroutine->stack_size - page;
+  coroutine->context.uc_link = NULL;
+  makecontext(&coroutine->context, private_coroutine_entry, 0);
+  #endif
+#endif
+
+  return true;
+}
+
+static void private_coroutine_destroy(Coroutine *coroutine) {
+#if defined(COROUTINE_USE_FIBERS)
+  if (coroutine->fiber != NULL) {
+    DeleteFiber(coroutine->fiber);
+  }
+#else
+  if (coroutine->stack != NULL) {
+    munmap(coroutine->stack, coroutine->stack_size);
+  }
+#endif
+
+  timer_free(coroutine->timer);
+  free(coroutine);
+}
+
+static void private_coroutine_make_ready(CoroutineScheduler *scheduler, Coroutine *coroutine) {
+  coroutine->state = COROUTINE_STATE_READY;
+  coroutine->next = NULL;
+
+  if (scheduler->ready_tail != NULL) {
+    scheduler->ready_tail->next = coroutine;
+  } else {
+    scheduler->ready_head = coroutine;
+  }
+
+  scheduler->ready_tail = coroutine;
+}
+
+static void private_coroutine_timer_expired(Timer *timer, void *data) {
+  CoroutineWaiter *waiter;
+  Coroutine *coroutine;
+
+  UNUSED(timer);
+  coroutine = data;
+
+  if (coroutine->state != COROUTINE_STATE_WAITING) {
+    return;
+  }
+
+  if ((waiter = coroutine->waiter) != NULL) {
+    coroutine->timed_out = true;
+    coroutine->waiter = NULL;
+    private_coroutine_detach(waiter, coroutine);
+    private_coroutine_rearm(coroutine->scheduler, waiter, true);
+  }
+
+  private_coroutine_make_ready(coroutine->scheduler, coroutine);
+}
+
+/* Finds the record for the socket's fd or makes a new one */
+static CoroutineWaiter *private_coroutine_get_waiter(CoroutineScheduler *scheduler, const Socket *socket) {
+  CoroutineWaiter **buckets, *waiter, *next;
+  size_t count, i;
+  int32_t fd;
+
+  fd = socket_get_fd(socket);
+
+  for (waiter = scheduler->waiters[(uint32_t) fd & (scheduler->waiter_buckets - 1)]; waiter != NULL;
+       waiter = waiter->next) {
+    if (waiter->fd == fd) {
+      return waiter;
+    }
+  }
+
+  if (scheduler->waiter_count >= scheduler->waiter_buckets) {
+    count = scheduler->waiter_buckets * 2;
+
+    if (UNLIKELY((buckets = calloc(sizeof(CoroutineWaiter *), count)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for coroutine waiter");
+      return NULL;
+    }
+
+    for (i = 0; i < scheduler->waiter_buckets; i++) {
+      for (waiter = scheduler->waiters[i]; waiter != NULL; waiter = next) {
+        next = waiter->next;
+        waiter->next = buckets[(uint32_t) waiter->fd & (count - 1)];
+        buckets[(uint32_t) waiter->fd & (count - 1)] = waiter;
+      }
+    }
+
+    free(scheduler->waiters);
+    scheduler->waiters = buckets;
+    scheduler->waiter_buckets = count;
+  }
+
+  if ((waiter = scheduler->waiter_free) != NULL) {
+    scheduler->waiter_free = waiter->next;
+  } else if (UNLIKELY((waiter = calloc(sizeof(CoroutineWaiter), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for coroutine waiter");
+    return NULL;
+  }
+
+  waiter->socket = socket;
+  waiter->fd = fd;
+  waiter->reader = NULL;
+  waiter->writer = NULL;
+  waiter->next = scheduler->waiters[(uint32_t) fd & (scheduler->waiter_buckets - 1)];
+  scheduler->waiters[(uint32_t) fd & (scheduler->waiter_buckets - 1)] = waiter;
+  scheduler->waiter_count++;
+
+  return waiter;
+}
+
+static void private_coroutine_release_waiter(CoroutineScheduler *scheduler, CoroutineWaiter *waiter) {
+  CoroutineWaiter **link;
+
+  for (link = &scheduler->waiters[(uint32_t) waiter->fd & (scheduler->waiter_buckets - 1)]; *link != waiter;
+       link = &(*link)->next);
+
+  *link = waiter->next;
+  scheduler->waiter_count--;
+
+  waiter->socket = NULL;
+  waiter->next = scheduler->waiter_free;
+  scheduler->waiter_free = waiter;
+}
+
+static void private_coroutine_detach(CoroutineWaiter *waiter, Coroutine *coroutine) {
+  if (waiter->reader == coroutine) {
+    waiter->reader = NULL;
+  }
+
+  if (waiter->writer == coroutine) {
+    waiter->writer = NULL;
+  }
+}
+
+/* Arms the registration for whoever still waits and drops the record once
+ * nobody does, armed tells whether the registration may still fire */
+static void private_coroutine_rearm(CoroutineScheduler *scheduler, CoroutineWaiter *waiter, bool armed) {
+  SocketIOCondition condition;
+
+  condition = (SocketIOCondition) 0;
+
+  if (waiter->reader != NULL) {
+    condition |= SOCKET_IO_CONDITION_POLLIN;
+  }
+
+  if (waiter->writer != NULL) {
+    condition |= SOCKET_IO_CONDITION_POLLOUT;
+  }
+
+  if (condition == 0) {
+    if (armed) {
+      poller_remove(scheduler->poller, waiter->socket);
+    }
+
+    private_coroutine_release_waiter(scheduler, waiter);
+    return;
+  }
+
+  /* Without a registration the waiters are woken to retry on their own */
+  if (UNLIKELY(poller_arm(scheduler->poller, waiter->socket, condition, waiter) == false)) {
+    private_coroutine_wake(scheduler, waiter, SOCKET_IO_CONDITION_POLLIN | SOCKET_IO_CONDITION_POLLOUT);
+  }
+}
+
+/* Resumes the waiters whose condition is ready, the registration has
+ * fired and is re-armed for the rest */
+static void private_coroutine_wake(CoroutineScheduler *scheduler, CoroutineWaiter *waiter,
+                                   SocketIOCondition condition) {
+  Coroutine *woken[2];
+  int32_t count, i;
+
+  if (waiter->socket == NULL) {
+    return;
+  }
+
+  count = 0;
+
+  if ((condition & SOCKET_IO_CONDITION_POLLIN) && waiter->reader != NULL) {
+    woken[count++] = waiter->reader;
+  }
+
+  if ((condition & SOCKET_IO_CONDITION_POLLOUT) && waiter->writer != NULL && waiter->writer != waiter->reader) {
+    woken[count++] = waiter->writer;
+  }
+
+  for (i = 0; i < count; i++) {
+    private_coroutine_detach(waiter, woken[i]);
+    woken[i]->waiter = NULL;
+    timer_wheel_cancel(scheduler->wheel, woken[i]->timer);
+    private_coroutine_make_ready(scheduler, woken[i]);
+  }
+
+  private_coroutine_rearm(scheduler, waiter, false);
+}
+
+CoroutineScheduler *coroutine_scheduler_new(void) {
+  CoroutineScheduler *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(CoroutineScheduler), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for coroutine scheduler");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->poller = poller_new()) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->wheel = timer_wheel_new(1)) == NULL)) {
+    poller_free(ret->poller);
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->waiters = calloc(sizeof(CoroutineWaiter *), COROUTINE_INITIAL_WAITER_BUCKETS)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for coroutine scheduler");
+    timer_wheel_free(ret->wheel);
+    poller_free(ret->poller);
+    free(ret);
+    return NULL;
+  }
+
+  ret->waiter_buckets = COROUTINE_INITIAL_WAITER_BUCKETS;
+
+  /* Expired timers are fired by the poller right after each wait */
+  poller_set_timer_wheel(ret->poller, ret->wheel);
+
+  ret->stack_size = COROUTINE_DEFAULT_STACK_SIZE;
+
+  return ret;
+}
+
+void coroutine_scheduler_set_stack_size(CoroutineScheduler *scheduler, size_t size) {
+  if (UNLIKELY(scheduler == NULL || size == 0)) {
+    return;
+  }
+
+  scheduler->stack_size = size;
+}
+
+size_t coroutine_scheduler_get_count(const CoroutineScheduler *scheduler) {
+  if (UNLIKELY(scheduler == NULL)) {
+    return 0;
+  }
+
+  return scheduler->count;
+}
+
+bool coroutine_scheduler_run(CoroutineScheduler *scheduler) {
+  Coroutine *coroutine;
+  int32_t timeout, evret, i;
+
+  if (UNLIKELY(scheduler == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY(scheduler->running || CURRENT_COROUTINE != NULL)) {
+    error_set_error((int32_t)ERROR_IO_IN_PROGRESS, 0, "Coroutine scheduler is already running");
+    return false;
+  }
+
+#ifdef COROUTINE_USE_FIBERS
+  if ((scheduler->fiber = ConvertThreadToFiber(NULL)) == NULL) {
+    scheduler->fiber = GetCurrentFiber();
+  }
+#endif
+
+  scheduler->running = true;
+  CURRENT_SCHEDULER = scheduler;
+
+  while (scheduler->count > 0) {
+    while ((coroutine = scheduler->ready_head) != NULL) {
+      if ((scheduler->ready_head = coroutine->next) == NULL) {
+        scheduler->ready_tail = NULL;
+      }
+
+      private_coroutine_resume(scheduler, coroutine);
+
+      if (coroutine->state == COROUTINE_STATE_DONE) {
+        scheduler->count--;
+
+        if (scheduler->free_count < COROUTINE_MAX_FREE) {
+          coroutine->next = scheduler->free_list;
+          scheduler->free_list = coroutine;
+          scheduler->free_count++;
+        } else {
+          private_coroutine_destroy(coroutine);
+        }
+      }
+    }
+
+    if (scheduler->count == 0) {
+      break;
+    }
+
+    /* The poller shortens the timeout to the next timer on its own */
+    timeout = scheduler->ready_head != NULL ? 0 : -1;
+
+    if (UNLIKELY((evret = poller_wait(scheduler->poller, scheduler->events, COROUTINE_MAX_EVENTS, timeout)) < 0)) {
+      scheduler->running = false;
+      CURRENT_SCHEDULER = NULL;
+      return false;
+    }
+
+    /* Errors wake both directions so the waiters see them on retry */
+    for (i = 0; i < evret; i++) {
+      private_coroutine_wake(scheduler, scheduler->events[i].data,
+        scheduler->events[i].error ? SOCKET_IO_CONDITION_POLLIN | SOCKET_IO_CONDITION_POLLOUT
+                                   : scheduler->events[i].condition);
+    }
+  }
+
+  scheduler->running = false;
+  CURRENT_SCHEDULER = NULL;
+
+  return true;
+}
+
+void coroutine_scheduler_free(CoroutineScheduler *scheduler) {
+  CoroutineWaiter *waiter;
+  Coroutine *coroutine;
+  size_t i;
+
+  if (UNLIKELY(scheduler == NULL)) {
+    return;
+  }
+
+  while ((coroutine = scheduler->free_list) != NULL) {
+    scheduler->free_list = coroutine->next;
+    private_coroutine_destroy(coroutine);
+  }
+
+  /* Never started coroutines can be freed, suspended ones leak their stacks */
+  while ((coroutine = scheduler->ready_head) != NULL) {
+    scheduler->ready_head = coroutine->next;
+    private_coroutine_destroy(coroutine);
+  }
+
+  for (i = 0; i < scheduler->waiter_buckets; i++) {
+    while ((waiter = scheduler->waiters[i]) != NULL) {
+      scheduler->waiters[i] = waiter->next;
+      free(waiter);
+    }
+  }
+
+  while ((waiter = scheduler->waiter_free) != NULL) {
+    scheduler->waiter_free = waiter->next;
+    free(waiter);
+  }
+
+  free(scheduler->waiters);
+  poller_free(scheduler->poller);
+  timer_wheel_free(scheduler->wheel);
+  free(scheduler);
+}
+
+bool coroutine_spawn(CoroutineScheduler *scheduler, CoroutineFunc func, void *data) {
+  Coroutine *coroutine;
+
+  if (UNLIKELY(scheduler == NULL || func == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if ((coroutine = scheduler->free_list) != NULL) {
+    scheduler->free_list = coroutine->next;
+    scheduler->free_count--;
+  } else {
+    if (UNLIKELY((coroutine = calloc(sizeof(Coroutine), 1)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for coroutine");
+      return false;
+    }
+
+    if (UNLIKELY((coroutine->timer = timer_new(private_coroutine_timer_expired, coroutine)) == NULL)) {
+      free(coroutine);
+      return false;
+    }
+
+    if (UNLIKELY(private_coroutine_prepare(scheduler, coroutine) == false)) {
+      timer_free(coroutine->timer);
+      free(coroutine);
+      return false;
+    }
+  }
+
+  coroutine->func = func;
+  coroutine->data = data;
+  coroutine->scheduler = scheduler;
+  coroutine->waiter = NULL;
+  coroutine->timed_out = false;
+
+  scheduler->count++;
+  private_coroutine_make_ready(scheduler, coroutine);
+
+  return true;
+}
+
+CoroutineScheduler *coroutine_get_scheduler(void) {
+  return CURRENT_SCHEDULER;
+}
+
+bool coroutine_is_active(void) {
+  return CURRENT_COROUTINE != NULL;
+}
+
+void coroutine_yield(void) {
+  Coroutine *coroutine;
+
+  if ((coroutine = CURRENT_COROUTINE) == NULL) {
+    return;
+  }
+
+  private_coroutine_make_ready(coroutine->scheduler, coroutine);
+  private_coroutine_suspend(coroutine);
+}
+
+bool coroutine_sleep(uint32_t msec) {
+  Coroutine *coroutine;
+
+  if (UNLIKELY((coroutine = CURRENT_COROUTINE) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NOT_AVAILABLE, 0, "Not running inside a coroutine");
+    return false;
+  }
+
+  /* Other coroutines may have run for a while since the last poll */
+  timer_wheel_update_time(coroutine->scheduler->wheel);
+
+  if (UNLIKELY(timer_wheel_schedule_after(coroutine->scheduler->wheel, coroutine->timer, msec) == false)) {
+    return false;
+  }
+
+  coroutine->state = COROUTINE_STATE_WAITING;
+  private_coroutine_suspend(coroutine);
+
+  return true;
+}
+
+/* Parks the coroutine until the condition is ready. One coroutine may
+ * wait to read and another to write on the same socket at once. */
+bool coroutine_io_wait(const Socket *socket, SocketIOCondition condition, int32_t timeout) {
+  CoroutineScheduler *scheduler;
+  CoroutineWaiter *waiter;
+  Coroutine *coroutine;
+
+  if (UNLIKELY(socket == NULL ||
+               (condition & (SOCKET_IO_CONDITION_POLLIN | SOCKET_IO_CONDITION_POLLOUT)) == 0)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((coroutine = CURRENT_COROUTINE) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NOT_AVAILABLE, 0, "Not running inside a coroutine");
+    return false;
+  }
+
+  scheduler = coroutine->scheduler;
+
+  if (timeout > 0) {
+    timer_wheel_update_time(scheduler->wheel);
+
+    if (UNLIKELY(timer_wheel_schedule_after(scheduler->wheel, coroutine->timer, (uint32_t)timeout) == false)) {
+      return false;
+    }
+  }
+
+  if (UNLIKELY((waiter = private_coroutine_get_waiter(scheduler, socket)) == NULL)) {
+    timer_wheel_cancel(scheduler->wheel, coroutine->timer);
+    return false;
+  }
+
+  if (UNLIKELY(((condition & SOCKET_IO_CONDITION_POLLIN) && waiter->reader != NULL) ||
+               ((condition & SOCKET_IO_CONDITION_POLLOUT) && waiter->writer != NULL))) {
+    error_set_error((int32_t)ERROR_IO_IN_PROGRESS, 0, "Another coroutine waits for the same socket condition");
+    timer_wheel_cancel(scheduler->wheel, coroutine->timer);
+    return false;
+  }
+
+  if (condition & SOCKET_IO_CONDITION_POLLIN) {
+    waiter->reader = coroutine;
+  }
+
+  if (condition & SOCKET_IO_CONDITION_POLLOUT) {
+    waiter->writer = coroutine;
+  }
+
+  if (UNLIKELY(poller_arm(scheduler->poller, waiter->socket,
+                          (waiter->reader != NULL ? SOCKET_IO_CONDITION_POLLIN : 0) |
+                          (waiter->writer != NULL ? SOCKET_IO_CONDITION_POLLOUT : 0), waiter) == false)) {
+    private_coroutine_detach(waiter, coroutine);
+    timer_wheel_cancel(scheduler->wheel, coroutine->timer);
+
+    if (waiter->reader == NULL && waiter->writer == NULL) {
+      private_coroutine_release_waiter(scheduler, waiter);
+    }
+
+    return false;
+  }
+
+  coroutine->waiter = waiter;
+  coroutine->timed_out = false;
+  coroutine->state = COROUTINE_STATE_WAITING;
+
+  private_coroutine_suspend(coroutine);
+
+  if (coroutine->timed_out) {
+    coroutine->timed_out = false;
+    error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Timed out while waiting socket condition");
+    return false;
+  }
+
+  return true;
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "error.h"
+#include "trace.h"
 
 #ifndef _WINDOWS
   #if defined(__OS2__)
@@ -43,7 +44,7 @@
 	#include <winsock2.h>
 #endif
 
-static struct {
+static THREAD_LOCAL struct {
   int32_t code;
   int32_t native_code;
   char *message;
@@ -464,6 +465,8 @@ int32_t error_get_native_code(void) {
 }
 
 void error_set_error(int32_t code, int32_t native_code, const char *message) {
+  TRACE_PROBE3(error__set, code, native_code, message);
+
   if (CURRENT_ERROR.message != NULL) {
     free(CURRENT_ERROR.message);
   }
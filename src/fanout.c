@@ -0,0 +1,707 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "fanout.h"
+#include "error.h"
+
+#define FANOUT_INITIAL_CAPACITY 64
+#define FANOUT_LATEST_BUCKETS 256
+
+struct FanoutMessage {
+  atomic_uint_fast32_t refs;
+  uint64_t key;
+  size_t len;
+  char data[];
+};
+
+struct FanoutSubscriber {
+  Fanout *fanout;
+  Socket *socket;
+  OutQueue *queue;
+  FanoutPolicy policy;
+  void *data;
+  size_t index;
+  uint64_t pause_seq;
+  FanoutSubscriber *next_dead;
+  bool paused;
+  bool resumed;
+  bool catching_up;
+  bool dirty;
+  bool dead;
+};
+
+/* Latest message of a key for conflating subscribers, linked in publish
+ * order. Links are indexes + 1, 0 ends the list. */
+typedef struct {
+  uint64_t key;
+  uint64_t seq;
+  FanoutMessage *message;
+  uint32_t prev;
+  uint32_t next;
+} FanoutLatest;
+
+struct Fanout {
+  FanoutSubscriber **subscribers;
+  size_t count;
+  size_t capacity;
+  FanoutSubscriber **dirty;
+  size_t dirty_count;
+  size_t dirty_capacity;
+  size_t dead_count;
+  size_t conflating;
+  uint64_t seq;
+  size_t low;
+  size_t high;
+  FanoutDisconnectFunc disconnect;
+  FanoutStats stats;
+  FanoutLatest *latest;
+  size_t latest_count;
+  size_t latest_capacity;
+  uint32_t latest_head;
+  uint32_t latest_tail;
+  uint32_t *buckets;
+  size_t bucket_count;
+};
+
+static void private_fanout_release(void *buffer, void *data);
+static void private_fanout_pause(OutQueue *queue, void *data);
+static void private_fanout_resume(OutQueue *queue, void *data);
+static bool private_fanout_grow(void **array, size_t *capacity, size_t count, size_t size);
+static void private_fanout_mark_dirty(Fanout *fanout, FanoutSubscriber *subscriber);
+static bool private_fanout_enqueue(Fanout *fanout, FanoutSubscriber *subscriber, FanoutMessage *message);
+static void private_fanout_kill(Fanout *fanout, FanoutSubscriber *subscriber);
+static void private_fanout_remove(Fanout *fanout, FanoutSubscriber *subscriber);
+static void private_fanout_reap(Fanout *fanout);
+static uint32_t *private_fanout_latest_find(const Fanout *fanout, uint64_t key);
+static bool private_fanout_latest_rehash(Fanout *fanout);
+static void private_fanout_latest_update(Fanout *fanout, FanoutMessage *message);
+static void private_fanout_latest_clear(Fanout *fanout);
+static void private_fanout_catch_up(Fanout *fanout, FanoutSubscriber *subscriber);
+static bool private_fanout_write(Fanout *fanout, FanoutSubscriber *subscriber);
+
+/* Output queue free callback, drops the queue's reference */
+static void private_fanout_release(void *buffer, void *data) {
+  UNUSED(buffer);
+  fanout_message_unref((FanoutMessage *) data);
+}
+
+static void private_fanout_pause(OutQueue *queue, void *data) {
+  FanoutSubscriber *subscriber = (FanoutSubscriber *) data;
+
+  UNUSED(queue);
+  subscriber->paused = true;
+
+  if (subscriber->policy == FANOUT_POLICY_DISCONNECT) {
+    private_fanout_kill(subscriber->fanout, subscriber);
+  } else if (subscriber->catching_up == false) {
+    subscriber->pause_seq = subscriber->fanout->seq;
+  }
+}
+
+static void private_fanout_resume(OutQueue *queue, void *data) {
+  FanoutSubscriber *subscriber = (FanoutSubscriber *) data;
+
+  UNUSED(queue);
+  subscriber->paused = false;
+  subscriber->resumed = true;
+}
+
+static bool private_fanout_grow(void **array, size_t *capacity, size_t count, size_t size) {
+  void *grown;
+  size_t wanted;
+
+  if (count < *capacity) {
+    return true;
+  }
+
+  wanted = *capacity ? *capacity * 2 : FANOUT_INITIAL_CAPACITY;
+
+  if (UNLIKELY((grown = realloc(*array, size * wanted)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for fanout");
+    return false;
+  }
+
+  *array = grown;
+  *capacity = wanted;
+
+  return true;
+}
+
+static void private_fanout_mark_dirty(Fanout *fanout, FanoutSubscriber *subscriber) {
+  if (subscriber->dirty) {
+    return;
+  }
+
+  /* Without room the data still goes out on the next writable event */
+  if (UNLIKELY(private_fanout_grow((void **) &fanout->dirty, &fanout->dirty_capacity,
+      fanout->dirty_count, sizeof(FanoutSubscriber *)) == false)) {
+    return;
+  }
+
+  fanout->dirty[fanout->dirty_count++] = subscriber;
+  subscriber->dirty = true;
+}
+
+static bool private_fanout_enqueue(Fanout *fanout, FanoutSubscriber *subscriber, FanoutMessage *message) {
+  fanout_message_ref(message);
+
+  if (UNLIKELY(out_queue_append(subscriber->queue, message->data, message->len,
+      private_fanout_release, message) == false)) {
+    fanout_message_unref(message);
+    fanout->stats.dropped++;
+    return false;
+  }
+
+  fanout->stats.queued++;
+  private_fanout_mark_dirty(fanout, subscriber);
+
+  return true;
+}
+
+/* Removal is deferred so loops over the subscribers stay valid */
+static void private_fanout_kill(Fanout *fanout, FanoutSubscriber *subscriber) {
+  if (subscriber->dead == false) {
+    subscriber->dead = true;
+    fanout->dead_count++;
+  }
+}
+
+static void private_fanout_remove(Fanout *fanout, FanoutSubscriber *subscriber) {
+  size_t i;
+
+  fanout->subscribers[subscriber->index] = fanout->subscribers[--fanout->count];
+  fanout->subscribers[subscriber->index]->index = subscriber->index;
+
+  if (subscriber->dirty) {
+    for (i = 0; i < fanout->dirty_count; i++) {
+      if (fanout->dirty[i] == subscriber) {
+        fanout->dirty[i] = fanout->dirty[--fanout->dirty_count];
+        break;
+      }
+    }
+  }
+
+  if (subscriber->dead) {
+    fanout->dead_count--;
+  }
+
+  if (subscriber->policy == FANOUT_POLICY_CONFLATE && --fanout->conflating == 0) {
+    private_fanout_latest_clear(fanout);
+  }
+}
+
+/* Unlinks every dead subscriber before the callbacks run, they may well
+ * unsubscribe others */
+static void private_fanout_reap(Fanout *fanout) {
+  FanoutSubscriber *dead = NULL, *subscriber;
+  size_t i;
+
+  for (i = fanout->count; i > 0 && fanout->dead_count > 0; i--) {
+    subscriber = fanout->subscribers[i - 1];
+
+    if (subscriber->dead) {
+      private_fanout_remove(fanout, subscriber);
+      subscriber->next_dead = dead;
+      dead = subscriber;
+    }
+  }
+
+  while ((subscriber = dead) != NULL) {
+    dead = subscriber->next_dead;
+    fanout->stats.disconnected++;
+
+    if (fanout->disconnect != NULL) {
+      fanout->disconnect(fanout, subscriber->socket, subscriber->data);
+    }
+
+    out_queue_free(subscriber->queue);
+    free(subscriber);
+  }
+}
+
+static uint32_t *private_fanout_latest_find(const Fanout *fanout, uint64_t key) {
+  size_t mask = fanout->bucket_count - 1;
+  size_t i = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+
+  while (fanout->buckets[i] != 0 && fanout->latest[fanout->buckets[i] - 1].key != key) {
+    i = (i + 1) & mask;
+  }
+
+  return &fanout->buckets[i];
+}
+
+static bool private_fanout_latest_rehash(Fanout *fanout) {
+  uint32_t *buckets, *old = fanout->buckets;
+  size_t count = fanout->bucket_count ? fanout->bucket_count * 2 : FANOUT_LATEST_BUCKETS;
+  size_t i;
+
+  if (UNLIKELY((buckets = calloc(sizeof(uint32_t), count)) == NULL)) {
+    return false;
+  }
+
+  fanout->buckets = buckets;
+  fanout->bucket_count = count;
+
+  for (i = 0; i < fanout->latest_count; i++) {
+    *private_fanout_latest_find(fanout, fanout->latest[i].key) = (uint32_t)(i + 1);
+  }
+
+  free(old);
+
+  return true;
+}
+
+/* Keeps the latest message of each key, most recently published last */
+static void private_fanout_latest_update(Fanout *fanout, FanoutMessage *message) {
+  FanoutLatest *entry;
+  uint32_t *bucket, index;
+
+  if ((fanout->latest_count + 1) * 4 > fanout->bucket_count * 3 &&
+      UNLIKELY(private_fanout_latest_rehash(fanout) == false)) {
+    return;
+  }
+
+  bucket = private_fanout_latest_find(fanout, message->key);
+
+  if ((index = *bucket) != 0) {
+    entry = &fanout->latest[index - 1];
+    fanout_message_unref(entry->message);
+
+    if (fanout->latest_tail == index) {
+      entry->message = fanout_message_ref(message);
+      entry->seq = fanout->seq;
+      return;
+    }
+
+    if (entry->prev != 0) {
+      fanout->latest[entry->prev - 1].next = entry->next;
+    } else {
+      fanout->latest_head = entry->next;
+    }
+
+    fanout->latest[entry->next - 1].prev = entry->prev;
+  } else {
+    if (UNLIKELY(private_fanout_grow((void **) &fanout->latest, &fanout->latest_capacity,
+        fanout->latest_count, sizeof(FanoutLatest)) == false)) {
+      return;
+    }
+
+    index = (uint32_t)(++fanout->latest_count);
+    *bucket = index;
+    entry = &fanout->latest[index - 1];
+    entry->key = message->key;
+  }
+
+  entry->message = fanout_message_ref(message);
+  entry->seq = fanout->seq;
+  entry->prev = fanout->latest_tail;
+  entry->next = 0;
+
+  if (fanout->latest_tail != 0) {
+    fanout->latest[fanout->latest_tail - 1].next = index;
+  } else {
+    fanout->latest_head = index;
+  }
+
+  fanout->latest_tail = index;
+}
+
+static void private_fanout_latest_clear(Fanout *fanout) {
+  size_t i;
+
+  for (i = 0; i < fanout->latest_count; i++) {
+    fanout_message_unref(fanout->latest[i].message);
+  }
+
+  free(fanout->latest);
+  free(fanout->buckets);
+  fanout->latest = NULL;
+  fanout->buckets = NULL;
+  fanout->latest_count = 0;
+  fanout->latest_capacity = 0;
+  fanout->bucket_count = 0;
+  fanout->latest_head = 0;
+  fanout->latest_tail = 0;
+}
+
+/* Queues the latest message of every key published while the subscriber
+ * was paused, oldest first */
+static void private_fanout_catch_up(Fanout *fanout, FanoutSubscriber *subscriber) {
+  uint32_t index = fanout->latest_tail;
+
+  while (index != 0 && fanout->latest[index - 1].prev != 0 &&
+         fanout->latest[fanout->latest[index - 1].prev - 1].seq > subscriber->pause_seq) {
+    index = fanout->latest[index - 1].prev;
+  }
+
+  subscriber->catching_up = true;
+
+  for (; index != 0; index = fanout->latest[index - 1].next) {
+    if (fanout->latest[index - 1].seq > subscriber->pause_seq) {
+      private_fanout_enqueue(fanout, subscriber, fanout->latest[index - 1].message);
+    }
+  }
+
+  subscriber->catching_up = false;
+
+  if (subscriber->paused) {
+    subscriber->pause_seq = fanout->seq;
+  }
+}
+
+static bool private_fanout_write(Fanout *fanout, FanoutSubscriber *subscriber) {
+  if (subscriber->dead) {
+    return false;
+  }
+
+  if (out_queue_flush(subscriber->queue) < 0) {
+    private_fanout_kill(fanout, subscriber);
+    return false;
+  }
+
+  if (subscriber->resumed) {
+    subscriber->resumed = false;
+
+    if (subscriber->policy == FANOUT_POLICY_CONFLATE) {
+      private_fanout_catch_up(fanout, subscriber);
+
+      if (out_queue_flush(subscriber->queue) < 0) {
+        private_fanout_kill(fanout, subscriber);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+FanoutMessage *fanout_message_new(const char *data, size_t len, uint64_t key) {
+  FanoutMessage *ret;
+
+  if (UNLIKELY(data == NULL && len > 0)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = malloc(sizeof(FanoutMessage) + len)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for fanout message");
+    return NULL;
+  }
+
+  atomic_init(&ret->refs, 1);
+  ret->key = key;
+  ret->len = len;
+
+  if (len > 0) {
+    memcpy(ret->data, data, len);
+  }
+
+  return ret;
+}
+
+FanoutMessage *fanout_message_ref(FanoutMessage *message) {
+  if (UNLIKELY(message == NULL)) {
+    return NULL;
+  }
+
+  atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+
+  return message;
+}
+
+void fanout_message_unref(FanoutMessage *message) {
+  if (UNLIKELY(message == NULL)) {
+    return;
+  }
+
+  if (atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) == 1) {
+    free(message);
+  }
+}
+
+const char *fanout_message_get_data(const FanoutMessage *message) {
+  if (UNLIKELY(message == NULL)) {
+    return NULL;
+  }
+
+  return message->data;
+}
+
+size_t fanout_message_get_size(const FanoutMessage *message) {
+  if (UNLIKELY(message == NULL)) {
+    return 0;
+  }
+
+  return message->len;
+}
+
+uint64_t fanout_message_get_key(const FanoutMessage *message) {
+  if (UNLIKELY(message == NULL)) {
+    return 0;
+  }
+
+  return message->key;
+}
+
+Fanout *fanout_new(void) {
+  Fanout *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Fanout), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for fanout");
+    return NULL;
+  }
+
+  return ret;
+}
+
+/* Watermarks count queued bytes per subscriber even though the payloads
+ * are shared, 0 keeps the output queue defaults */
+void fanout_set_watermarks(Fanout *fanout, size_t low, size_t high) {
+  size_t i;
+
+  if (UNLIKELY(fanout == NULL)) {
+    return;
+  }
+
+  fanout->low = low;
+  fanout->high = high;
+
+  for (i = 0; i < fanout->count && high > 0; i++) {
+    out_queue_set_watermarks(fanout->subscribers[i]->queue, low, high);
+  }
+}
+
+void fanout_set_disconnect_func(Fanout *fanout, FanoutDisconnectFunc func) {
+  if (UNLIKELY(fanout == NULL)) {
+    return;
+  }
+
+  fanout->disconnect = func;
+}
+
+/* data is passed to the disconnect callback */
+FanoutSubscriber *fanout_subscribe(Fanout *fanout, Socket *socket, FanoutPolicy policy, void *data) {
+  FanoutSubscriber *ret;
+
+  if (UNLIKELY(fanout == NULL || socket == NULL || (int32_t) policy < 0 || policy > FANOUT_POLICY_CONFLATE)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY(private_fanout_grow((void **) &fanout->subscribers, &fanout->capacity,
+      fanout->count, sizeof(FanoutSubscriber *)) == false)) {
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(FanoutSubscriber), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for fanout subscriber");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->queue = out_queue_new(socket)) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  if (fanout->high > 0) {
+    out_queue_set_watermarks(ret->queue, fanout->low, fanout->high);
+  }
+
+  out_queue_set_callbacks(ret->queue, private_fanout_pause, private_fanout_resume, ret);
+  ret->fanout = fanout;
+  ret->socket = socket;
+  ret->policy = policy;
+  ret->data = data;
+  ret->index = fanout->count;
+  fanout->subscribers[fanout->count++] = ret;
+
+  if (policy == FANOUT_POLICY_CONFLATE) {
+    fanout->conflating++;
+  }
+
+  return ret;
+}
+
+/* Drops whatever is still queued for the subscriber, the socket is left
+ * alone */
+void fanout_unsubscribe(Fanout *fanout, FanoutSubscriber *subscriber) {
+  if (UNLIKELY(fanout == NULL || subscriber == NULL)) {
+    return;
+  }
+
+  private_fanout_remove(fanout, subscriber);
+  out_queue_free(subscriber->queue);
+  free(subscriber);
+}
+
+size_t fanout_get_count(const Fanout *fanout) {
+  if (UNLIKELY(fanout == NULL)) {
+    return 0;
+  }
+
+  return fanout->count;
+}
+
+/* Returns how many subscribers the message was queued for, the caller
+ * keeps its reference */
+size_t fanout_publish(Fanout *fanout, FanoutMessage *message) {
+  FanoutSubscriber *subscriber;
+  size_t i, ret = 0;
+
+  if (UNLIKELY(fanout == NULL || message == NULL)) {
+    return 0;
+  }
+
+  fanout->seq++;
+  fanout->stats.published++;
+
+  if (fanout->conflating > 0 && message->key != 0) {
+    private_fanout_latest_update(fanout, message);
+  }
+
+  for (i = 0; i < fanout->count; i++) {
+    subscriber = fanout->subscribers[i];
+
+    if (subscriber->dead) {
+      continue;
+    }
+
+    if (subscriber->paused) {
+      if (subscriber->policy == FANOUT_POLICY_CONFLATE && message->key != 0) {
+        fanout->stats.conflated++;
+      } else {
+        fanout->stats.dropped++;
+      }
+
+      continue;
+    }
+
+    ret += private_fanout_enqueue(fanout, subscriber, message);
+  }
+
+  private_fanout_reap(fanout);
+
+  return ret;
+}
+
+size_t fanout_publish_data(Fanout *fanout, const char *data, size_t len, uint64_t key) {
+  FanoutMessage *message;
+  size_t ret;
+
+  if (UNLIKELY(fanout == NULL || (message = fanout_message_new(data, len, key)) == NULL)) {
+    return 0;
+  }
+
+  ret = fanout_publish(fanout, message);
+  fanout_message_unref(message);
+
+  return ret;
+}
+
+/* Writes every subscriber that got messages since the last flush, returns
+ * how many were written */
+size_t fanout_flush(Fanout *fanout) {
+  FanoutSubscriber *subscriber;
+  size_t i, ret = 0;
+
+  if (UNLIKELY(fanout == NULL)) {
+    return 0;
+  }
+
+  for (i = 0; i < fanout->dirty_count; i++) {
+    subscriber = fanout->dirty[i];
+    subscriber->dirty = false;
+    ret += private_fanout_write(fanout, subscriber);
+  }
+
+  fanout->dirty_count = 0;
+  private_fanout_reap(fanout);
+
+  return ret;
+}
+
+/* For subscribers whose socket turned writable, returns false once the
+ * subscriber was removed */
+bool fanout_subscriber_flush(Fanout *fanout, FanoutSubscriber *subscriber) {
+  bool ret;
+
+  if (UNLIKELY(fanout == NULL || subscriber == NULL)) {
+    return false;
+  }
+
+  ret = private_fanout_write(fanout, subscriber);
+  private_fanout_reap(fanout);
+
+  return ret;
+}
+
+/* True while queued data waits for the socket to become writable */
+bool fanout_subscriber_wants_write(const FanoutSubscriber *subscriber) {
+  if (UNLIKELY(subscriber == NULL)) {
+    return false;
+  }
+
+  return out_queue_get_size(subscriber->queue) > 0;
+}
+
+OutQueue *fanout_subscriber_get_queue(const FanoutSubscriber *subscriber) {
+  if (UNLIKELY(subscriber == NULL)) {
+    return NULL;
+  }
+
+  return subscriber->queue;
+}
+
+void fanout_get_stats(const Fanout *fanout, FanoutStats *stats) {
+  if (UNLIKELY(fanout == NULL || stats == NULL)) {
+    return;
+  }
+
+  *stats = fanout->stats;
+}
+
+void fanout_free(Fanout *fanout) {
+  size_t i;
+
+  if (UNLIKELY(fanout == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < fanout->count; i++) {
+    out_queue_free(fanout->subscribers[i]->queue);
+    free(fanout->subscribers[i]);
+  }
+
+  private_fanout_latest_clear(fanout);
+  free(fanout->subscribers);
+  free(fanout->dirty);
+  free(fanout);
+}
@@ -0,0 +1,429 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "histogram.h"
+#include "error.h"
+
+#define HISTOGRAM_SUB_BITS    5
+#define HISTOGRAM_SUB_COUNT   (1 << HISTOGRAM_SUB_BITS)
+/* Values below 2 * HISTOGRAM_SUB_COUNT are counted exactly, each higher
+ * power of two up to 2^63 adds HISTOGRAM_SUB_COUNT buckets */
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+/* Threads record into their own shard, picked round-robin on the first
+ * record, so concurrent recorders rarely share cache lines. Shards are
+ * allocated the first time a thread lands on them. */
+#define HISTOGRAM_SHARDS      16
+
+typedef struct {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+  atomic_uint_fast64_t min;
+  atomic_uint_fast64_t max;
+  atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+  char pad[CACHE_LINE_SIZE];
+} HistogramShard;
+
+struct Histogram {
+  _Atomic(HistogramShard *) shards[HISTOGRAM_SHARDS];
+};
+
+static atomic_uint private_histogram_next_slot;
+static THREAD_LOCAL uint32_t private_histogram_slot;
+
+static inline uint32_t private_histogram_msb(uint64_t value);
+static inline uint32_t private_histogram_index(uint64_t value);
+static inline uint64_t private_histogram_highest(uint32_t index);
+static HistogramShard *private_histogram_shard_new(void);
+static HistogramShard *private_histogram_get_shard(Histogram *histogram);
+static void private_histogram_shard_add(HistogramShard *shard, uint64_t value, uint64_t count);
+static void private_histogram_shard_limits(HistogramShard *shard, uint64_t min, uint64_t max);
+
+static inline uint32_t private_histogram_msb(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - (uint32_t)__builtin_clzll(value);
+#else
+  uint32_t ret;
+
+  for (ret = 0; value >>= 1; ret++);
+
+  return ret;
+#endif
+}
+
+static inline uint32_t private_histogram_index(uint64_t value) {
+  uint32_t shift;
+
+  if (value < 2 * HISTOGRAM_SUB_COUNT) {
+    return (uint32_t) value;
+  }
+
+  shift = private_histogram_msb(value) - HISTOGRAM_SUB_BITS;
+
+  return (shift + 1) * HISTOGRAM_SUB_COUNT + (uint32_t)(value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+/* Largest value that lands in the bucket */
+static inline uint64_t private_histogram_highest(uint32_t index) {
+  uint32_t shift;
+  uint64_t sub;
+
+  if (index < 2 * HISTOGRAM_SUB_COUNT) {
+    return index;
+  }
+
+  shift = index / HISTOGRAM_SUB_COUNT - 1;
+  sub = (uint64_t)(index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT);
+
+  /* The last bucket ends at UINT64_MAX, (sub + 1) << shift would be 2^64 */
+  if (index >= HISTOGRAM_BUCKETS - 1) {
+    return UINT64_MAX;
+  }
+
+  return ((sub + 1) << shift) - 1;
+}
+
+static HistogramShard *private_histogram_shard_new(void) {
+  HistogramShard *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(HistogramShard), 1)) == NULL)) {
+    return NULL;
+  }
+
+  atomic_init(&ret->min, UINT64_MAX);
+
+  return ret;
+}
+
+static HistogramShard *private_histogram_get_shard(Histogram *histogram) {
+  HistogramShard *ret, *expected;
+  uint32_t slot;
+
+  if (UNLIKELY((slot = private_histogram_slot) == 0)) {
+    slot = atomic_fetch_add(&private_histogram_next_slot, 1) % HISTOGRAM_SHARDS + 1;
+    private_histogram_slot = slot;
+  }
+
+  if (LIKELY((ret = atomic_load_explicit(&histogram->shards[slot - 1], memory_order_acquire)) != NULL)) {
+    return ret;
+  }
+
+  /* Shard 0 always exists and takes the records we can't shard */
+  if (UNLIKELY((ret = private_histogram_shard_new()) == NULL)) {
+    return atomic_load_explicit(&histogram->shards[0], memory_order_acquire);
+  }
+
+  expected = NULL;
+
+  if (atomic_compare_exchange_strong(&histogram->shards[slot - 1], &expected, ret) == false) {
+    free(ret);
+    ret = expected;
+  }
+
+  return ret;
+}
+
+static void private_histogram_shard_limits(HistogramShard *shard, uint64_t min, uint64_t max) {
+  uint_fast64_t current;
+
+  current = atomic_load_explicit(&shard->max, memory_order_relaxed);
+
+  while (max > current &&
+         atomic_compare_exchange_weak_explicit(&shard->max, &current, max,
+                                               memory_order_relaxed, memory_order_relaxed) == false);
+
+  current = atomic_load_explicit(&shard->min, memory_order_relaxed);
+
+  while (min < current &&
+         atomic_compare_exchange_weak_explicit(&shard->min, &current, min,
+                                               memory_order_relaxed, memory_order_relaxed) == false);
+}
+
+static void private_histogram_shard_add(HistogramShard *shard, uint64_t value, uint64_t count) {
+  atomic_fetch_add_explicit(&shard->buckets[private_histogram_index(value)], count, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->sum, value * count, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->count, count, memory_order_relaxed);
+  private_histogram_shard_limits(shard, value, value);
+}
+
+Histogram *histogram_new(void) {
+  Histogram *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Histogram), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for histogram");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->shards[0] = private_histogram_shard_new()) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for histogram");
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+  if (UNLIKELY(histogram == NULL)) {
+    return;
+  }
+
+  private_histogram_shard_add(private_histogram_get_shard(histogram), value, 1);
+}
+
+uint64_t histogram_get_count(const Histogram *histogram) {
+  HistogramShard *shard;
+  uint64_t ret;
+  uint32_t i;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return 0;
+  }
+
+  for (i = 0, ret = 0; i < HISTOGRAM_SHARDS; i++) {
+    if ((shard = atomic_load_explicit(&((Histogram *) histogram)->shards[i], memory_order_acquire)) != NULL) {
+      ret += atomic_load_explicit(&shard->count, memory_order_relaxed);
+    }
+  }
+
+  return ret;
+}
+
+uint64_t histogram_get_min(const Histogram *histogram) {
+  HistogramShard *shard;
+  uint64_t ret, value;
+  uint32_t i;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return 0;
+  }
+
+  for (i = 0, ret = UINT64_MAX; i < HISTOGRAM_SHARDS; i++) {
+    if ((shard = atomic_load_explicit(&((Histogram *) histogram)->shards[i], memory_order_acquire)) != NULL &&
+        (value = atomic_load_explicit(&shard->min, memory_order_relaxed)) < ret) {
+      ret = value;
+    }
+  }
+
+  return ret == UINT64_MAX ? 0 : ret;
+}
+
+uint64_t histogram_get_max(const Histogram *histogram) {
+  HistogramShard *shard;
+  uint64_t ret, value;
+  uint32_t i;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return 0;
+  }
+
+  for (i = 0, ret = 0; i < HISTOGRAM_SHARDS; i++) {
+    if ((shard = atomic_load_explicit(&((Histogram *) histogram)->shards[i], memory_order_acquire)) != NULL &&
+        (value = atomic_load_explicit(&shard->max, memory_order_relaxed)) > ret) {
+      ret = value;
+    }
+  }
+
+  return ret;
+}
+
+double histogram_get_mean(const Histogram *histogram) {
+  HistogramShard *shard;
+  uint64_t count, sum;
+  uint32_t i;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return 0.0;
+  }
+
+  for (i = 0, count = 0, sum = 0; i < HISTOGRAM_SHARDS; i++) {
+    if ((shard = atomic_load_explicit(&((Histogram *) histogram)->shards[i], memory_order_acquire)) != NULL) {
+      count += atomic_load_explicit(&shard->count, memory_order_relaxed);
+      sum += atomic_load_explicit(&shard->sum, memory_order_relaxed);
+    }
+  }
+
+  return count > 0 ? (double) sum / (double) count : 0.0;
+}
+
+/* Reports the highest values equivalent to the ones at the percentiles,
+ * never more than the recorded maximum. The shards are merged once for
+ * all the percentiles, which must be given in ascending order. */
+bool histogram_get_percentiles(const Histogram *histogram, const double *percentiles, uint64_t *values,
+                               size_t count) {
+  HistogramShard *shards[HISTOGRAM_SHARDS];
+  uint64_t total, target, seen, max;
+  uint32_t i, j, found;
+
+  if (UNLIKELY(histogram == NULL || percentiles == NULL || values == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  for (i = 0, total = 0; i < HISTOGRAM_SHARDS; i++) {
+    if ((shards[i] = atomic_load_explicit(&((Histogram *) histogram)->shards[i], memory_order_acquire)) != NULL) {
+      total += atomic_load_explicit(&shards[i]->count, memory_order_relaxed);
+    }
+  }
+
+  max = histogram_get_max(histogram);
+  found = 0;
+
+  for (i = 0, seen = 0; i < HISTOGRAM_BUCKETS && found < count && total > 0; i++) {
+    for (j = 0; j < HISTOGRAM_SHARDS; j++) {
+      if (shards[j] != NULL) {
+        seen += atomic_load_explicit(&shards[j]->buckets[i], memory_order_relaxed);
+      }
+    }
+
+    while (found < count) {
+      if (percentiles[found] >= 100.0) {
+        break;
+      }
+
+      target = percentiles[found] > 0.0 ? (uint64_t)(percentiles[found] / 100.0 * (double) total + 0.5) : 0;
+
+      if (seen < (target > 0 ? target : 1)) {
+        break;
+      }
+
+      values[found++] = private_histogram_highest(i) < max ? private_histogram_highest(i) : max;
+    }
+  }
+
+  /* Whatever is left is at or past the last recorded value */
+  for (; found < count; found++) {
+    values[found] = total > 0 ? max : 0;
+  }
+
+  return true;
+}
+
+uint64_t histogram_get_percentile(const Histogram *histogram, double percentile) {
+  uint64_t ret;
+
+  if (UNLIKELY(histogram_get_percentiles(histogram, &percentile, &ret, 1) == false)) {
+    return 0;
+  }
+
+  return ret;
+}
+
+bool histogram_get_summary(const Histogram *histogram, HistogramSummary *summary) {
+  static const double percentiles[3] = {50.0, 99.0, 99.9};
+  uint64_t values[3];
+
+  if (UNLIKELY(histogram == NULL || summary == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  histogram_get_percentiles(histogram, percentiles, values, 3);
+
+  summary->count = histogram_get_count(histogram);
+  summary->min = histogram_get_min(histogram);
+  summary->mean = histogram_get_mean(histogram);
+  summary->p50 = values[0];
+  summary->p99 = values[1];
+  summary->p999 = values[2];
+  summary->max = histogram_get_max(histogram);
+
+  return true;
+}
+
+/* Adds the counts of other, e.g. to roll interval histograms up into a total */
+bool histogram_merge(Histogram *histogram, const Histogram *other) {
+  HistogramShard *shard, *dest;
+  uint_fast64_t value;
+  uint32_t i, j;
+
+  if (UNLIKELY(histogram == NULL || other == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  dest = private_histogram_get_shard(histogram);
+
+  for (j = 0; j < HISTOGRAM_SHARDS; j++) {
+    if ((shard = atomic_load_explicit(&((Histogram *) other)->shards[j], memory_order_acquire)) == NULL) {
+      continue;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      if ((value = atomic_load_explicit(&shard->buckets[i], memory_order_relaxed)) != 0) {
+        atomic_fetch_add_explicit(&dest->buckets[i], value, memory_order_relaxed);
+      }
+    }
+
+    atomic_fetch_add_explicit(&dest->sum, atomic_load(&shard->sum), memory_order_relaxed);
+    atomic_fetch_add_explicit(&dest->count, atomic_load(&shard->count), memory_order_relaxed);
+    private_histogram_shard_limits(dest, atomic_load(&shard->min), atomic_load(&shard->max));
+  }
+
+  return true;
+}
+
+void histogram_reset(Histogram *histogram) {
+  HistogramShard *shard;
+  uint32_t i, j;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return;
+  }
+
+  for (j = 0; j < HISTOGRAM_SHARDS; j++) {
+    if ((shard = atomic_load_explicit(&histogram->shards[j], memory_order_acquire)) == NULL) {
+      continue;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      atomic_store_explicit(&shard->buckets[i], 0, memory_order_relaxed);
+    }
+
+    atomic_store(&shard->sum, 0);
+    atomic_store(&shard->count, 0);
+    atomic_store(&shard->max, 0);
+    atomic_store(&shard->min, UINT64_MAX);
+  }
+}
+
+void histogram_free(Histogram *histogram) {
+  uint32_t i;
+
+  if (UNLIKELY(histogram == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < HISTOGRAM_SHARDS; i++) {
+    free(atomic_load(&histogram->shards[i]));
+  }
+
+  free(histogram);
+}
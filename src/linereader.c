@@ -0,0 +1,442 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "linereader.h"
+#include "error.h"
+
+/* util.h claims __x86_64__ for every LP64 target, so look at what the
+ * compiler itself defines */
+#if defined(__amd64__) || defined(_M_AMD64)
+  #define LINE_READER_USE_SSE2
+  #include <emmintrin.h>
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+  #endif
+#endif
+
+#if defined(__amd64__) && (defined(__GNUC__) || defined(__clang__))
+  #define LINE_READER_USE_AVX2
+  #include <immintrin.h>
+#endif
+
+#define LINE_READER_INITIAL_SIZE 16384
+#define LINE_READER_DEFAULT_MAX_RECORD (1024 * 1024)
+
+struct LineReader {
+  Socket *socket;
+  char *buffer;
+  size_t capacity;
+  size_t start;
+  size_t end;
+  size_t scan;
+  size_t max_record;
+  char delimiter[LINE_READER_MAX_DELIMITER];
+  size_t delimiter_len;
+  bool eof;
+  bool oversized;
+};
+
+#ifdef LINE_READER_USE_SSE2
+static uint32_t private_line_reader_ctz(uint32_t value);
+static size_t private_line_reader_find_sse2(const char *data, size_t len, char byte, bool *found);
+#endif
+#ifdef LINE_READER_USE_AVX2
+static size_t private_line_reader_find_avx2(const char *data, size_t len, char byte, bool *found);
+#endif
+static size_t private_line_reader_find(const char *data, size_t len, char byte);
+static ssize_t private_line_reader_fill(LineReader *reader, bool use_deadline, uint64_t deadline);
+
+#ifdef LINE_READER_USE_SSE2
+static uint32_t private_line_reader_ctz(uint32_t value) {
+#if defined(_MSC_VER)
+  unsigned long index;
+
+  _BitScanForward(&index, value);
+
+  return (uint32_t) index;
+#else
+  return (uint32_t) __builtin_ctz(value);
+#endif
+}
+
+/* The vector variants return the match when found is set, otherwise how
+ * many bytes they got through */
+static size_t private_line_reader_find_sse2(const char *data, size_t len, char byte, bool *found) {
+  __m128i needle = _mm_set1_epi8(byte);
+  uint32_t mask;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), needle));
+
+    if (mask != 0) {
+      *found = true;
+      return i + private_line_reader_ctz(mask);
+    }
+  }
+
+  *found = false;
+
+  return i;
+}
+#endif
+
+#ifdef LINE_READER_USE_AVX2
+__attribute__((target("avx2")))
+static size_t private_line_reader_find_avx2(const char *data, size_t len, char byte, bool *found) {
+  __m256i needle = _mm256_set1_epi8(byte);
+  uint32_t mask;
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), needle));
+
+    if (mask != 0) {
+      *found = true;
+      return i + private_line_reader_ctz(mask);
+    }
+  }
+
+  *found = false;
+
+  return i;
+}
+#endif
+
+/* Returns the offset of the first byte, len when there is none */
+static size_t private_line_reader_find(const char *data, size_t len, char byte) {
+  const char *match;
+  size_t done = 0;
+#if defined(LINE_READER_USE_SSE2) || defined(LINE_READER_USE_AVX2)
+  size_t ret;
+  bool found;
+#endif
+
+#ifdef LINE_READER_USE_AVX2
+  if (len >= 32 && __builtin_cpu_supports("avx2")) {
+    if ((ret = private_line_reader_find_avx2(data, len, byte, &found)), found) {
+      return ret;
+    }
+
+    done = ret;
+  }
+#endif
+
+#ifdef LINE_READER_USE_SSE2
+  if ((ret = private_line_reader_find_sse2(data + done, len - done, byte, &found)), found) {
+    return done + ret;
+  }
+
+  done += ret;
+#endif
+
+  match = memchr(data + done, byte, len - done);
+
+  return match != NULL ? (size_t)(match - data) : len;
+}
+
+/* Makes room and reads once, the buffer is compacted only when its tail
+ * is full and grown only when a single record fills all of it */
+static ssize_t private_line_reader_fill(LineReader *reader, bool use_deadline, uint64_t deadline) {
+  size_t capacity;
+  ssize_t ret;
+  char *grown;
+
+  if (UNLIKELY(reader->oversized)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Record exceeds the size limit");
+    return -1;
+  }
+
+  if (reader->start == reader->end) {
+    reader->start = reader->end = reader->scan = 0;
+  }
+
+  if (reader->end == reader->capacity) {
+    if (reader->start > 0) {
+      memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+      reader->end -= reader->start;
+      reader->start = 0;
+    } else {
+      if (UNLIKELY(reader->capacity >= reader->max_record)) {
+        error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Record exceeds the size limit");
+        return -1;
+      }
+
+      capacity = reader->capacity * 2 < reader->max_record ? reader->capacity * 2 : reader->max_record;
+
+      if (UNLIKELY((grown = realloc(reader->buffer, capacity)) == NULL)) {
+        error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for line reader");
+        return -1;
+      }
+
+      reader->buffer = grown;
+      reader->capacity = capacity;
+    }
+  }
+
+  if (use_deadline) {
+    ret = socket_receive_until(reader->socket, reader->buffer + reader->end, reader->capacity - reader->end, deadline);
+  } else {
+    ret = socket_receive(reader->socket, reader->buffer + reader->end, reader->capacity - reader->end);
+  }
+
+  if (ret > 0) {
+    reader->end += (size_t) ret;
+  } else if (ret == 0) {
+    reader->eof = true;
+  }
+
+  return ret;
+}
+
+LineReader *line_reader_new(Socket *socket) {
+  LineReader *ret;
+
+  if (UNLIKELY(socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(LineReader), 1)) == NULL ||
+               (ret->buffer = malloc(LINE_READER_INITIAL_SIZE)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for line reader");
+    free(ret);
+    return NULL;
+  }
+
+  ret->socket = socket;
+  ret->capacity = LINE_READER_INITIAL_SIZE;
+  ret->max_record = LINE_READER_DEFAULT_MAX_RECORD;
+  ret->delimiter[0] = '\n';
+  ret->delimiter_len = 1;
+
+  return ret;
+}
+
+/* Takes effect from the next record on, "\r\n" for most text protocols */
+bool line_reader_set_delimiter(LineReader *reader, const char *delimiter, size_t len) {
+  if (UNLIKELY(reader == NULL || delimiter == NULL || len == 0 || len > LINE_READER_MAX_DELIMITER)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  memcpy(reader->delimiter, delimiter, len);
+  reader->delimiter_len = len;
+  reader->scan = 0;
+
+  return true;
+}
+
+/* Longest record including its delimiter, a larger one fails the read
+ * and every read after it */
+void line_reader_set_max_record(LineReader *reader, size_t max_record) {
+  if (UNLIKELY(reader == NULL)) {
+    return;
+  }
+
+  reader->max_record = max_record > 0 ? max_record : LINE_READER_DEFAULT_MAX_RECORD;
+}
+
+/* Reads once from the socket, returns like socket_receive() */
+ssize_t line_reader_fill(LineReader *reader) {
+  if (UNLIKELY(reader == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  return private_line_reader_fill(reader, false, 0);
+}
+
+/* Returns the next buffered record, NULL when more data is needed or,
+ * with the error state set, once the record can't fit the size limit */
+const char *line_reader_next(LineReader *reader, size_t *len) {
+  const char *ret, *data;
+  size_t available, offset;
+
+  if (UNLIKELY(reader == NULL || len == NULL)) {
+    return NULL;
+  }
+
+  if (UNLIKELY(reader->oversized)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Record exceeds the size limit");
+    return NULL;
+  }
+
+  data = reader->buffer + reader->start;
+  available = reader->end - reader->start;
+
+  /* Searching for the first delimiter byte, the rest is compared on a hit */
+  while (reader->scan < available) {
+    offset = reader->scan + private_line_reader_find(data + reader->scan, available - reader->scan,
+                                                     reader->delimiter[0]);
+
+    if (offset == available || offset + reader->delimiter_len > available) {
+      reader->scan = offset;
+      break;
+    }
+
+    if (reader->delimiter_len == 1 ||
+        memcmp(data + offset + 1, reader->delimiter + 1, reader->delimiter_len - 1) == 0) {
+      if (UNLIKELY(offset + reader->delimiter_len > reader->max_record)) {
+        reader->scan = offset;
+        break;
+      }
+
+      reader->start += offset + reader->delimiter_len;
+      reader->scan = 0;
+      *len = offset;
+      return data;
+    }
+
+    reader->scan = offset + 1;
+  }
+
+  /* No delimiter starts before scan, so the record is at least that long */
+  if (UNLIKELY(reader->scan + reader->delimiter_len > reader->max_record)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Record exceeds the size limit");
+    reader->oversized = true;
+    return NULL;
+  }
+
+  if (reader->eof && available > 0) {
+    ret = data;
+    *len = available;
+    reader->start = reader->end;
+    reader->scan = 0;
+    return ret;
+  }
+
+  return NULL;
+}
+
+/* Returns the next count bytes, for length prefixed payloads in between
+ * records, NULL while fewer are buffered */
+const char *line_reader_next_exact(LineReader *reader, size_t count) {
+  const char *ret;
+
+  if (UNLIKELY(reader == NULL) || reader->end - reader->start < count) {
+    return NULL;
+  }
+
+  ret = reader->buffer + reader->start;
+  reader->start += count;
+  reader->scan = 0;
+
+  return ret;
+}
+
+/* Reads until a whole record is buffered, on failure the error state says
+ * why, ERROR_IO_NO_MORE at end of stream */
+const char *line_reader_read_until(LineReader *reader, size_t *len, uint64_t deadline) {
+  const char *ret;
+
+  if (UNLIKELY(reader == NULL || len == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  while ((ret = line_reader_next(reader, len)) == NULL) {
+    if (reader->oversized) {
+      return NULL;
+    }
+
+    if (reader->eof) {
+      error_set_error((int32_t)ERROR_IO_NO_MORE, 0, "End of stream");
+      return NULL;
+    }
+
+    if (private_line_reader_fill(reader, true, deadline) < 0) {
+      return NULL;
+    }
+  }
+
+  return ret;
+}
+
+const char *line_reader_read_exact_until(LineReader *reader, size_t count, uint64_t deadline) {
+  const char *ret;
+
+  if (UNLIKELY(reader == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY(count > reader->max_record)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Record exceeds the size limit");
+    return NULL;
+  }
+
+  while ((ret = line_reader_next_exact(reader, count)) == NULL) {
+    if (reader->eof) {
+      error_set_error((int32_t)ERROR_IO_NO_MORE, 0, "End of stream");
+      return NULL;
+    }
+
+    if (private_line_reader_fill(reader, true, deadline) < 0) {
+      return NULL;
+    }
+  }
+
+  return ret;
+}
+
+/* Bytes read from the socket but not returned yet */
+size_t line_reader_get_buffered(const LineReader *reader) {
+  if (UNLIKELY(reader == NULL)) {
+    return 0;
+  }
+
+  return reader->end - reader->start;
+}
+
+bool line_reader_is_eof(const LineReader *reader) {
+  if (UNLIKELY(reader == NULL)) {
+    return false;
+  }
+
+  return reader->eof;
+}
+
+Socket *line_reader_get_socket(const LineReader *reader) {
+  if (UNLIKELY(reader == NULL)) {
+    return NULL;
+  }
+
+  return reader->socket;
+}
+
+void line_reader_free(LineReader *reader) {
+  if (UNLIKELY(reader == NULL)) {
+    return;
+  }
+
+  free(reader->buffer);
+  free(reader);
+}
@@ -0,0 +1,409 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "log.h"
+#include "util.h"
+#include "thread.h"
+
+#if defined(_WINDOWS)
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  /* Fiber local storage calls back on thread exit, it requires Vista */
+  #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x600
+  #endif
+  #include <windows.h>
+#else
+  #include <pthread.h>
+#endif
+
+#define LOG_RING_SIZE         128
+#define LOG_MESSAGE_SIZE      240
+#define LOG_DRAIN_INTERVAL    20
+#define LOG_DEFAULT_RATE      10
+
+typedef struct {
+  LogLevel level;
+  int32_t line;
+  const char *file;
+  char message[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+/* Single producer (the owning thread), single consumer (the drain). A ring
+ * whose thread exited is freed by the drain once it is empty. */
+typedef struct LogRing {
+  struct LogRing *next;
+  atomic_bool orphaned;
+  atomic_uint_fast64_t head;
+  char pad0[CACHE_LINE_SIZE];
+  atomic_uint_fast64_t tail;
+  char pad1[CACHE_LINE_SIZE];
+  LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+static _Atomic(LogRing *) private_log_rings;
+static THREAD_LOCAL LogRing *private_log_ring;
+static atomic_int private_log_level;
+static atomic_uint private_log_rate = LOG_DEFAULT_RATE;
+static atomic_uint_fast64_t private_log_dropped;
+static atomic_int private_log_state;
+static Mutex *private_log_lock;
+static Thread *private_log_thread;
+static atomic_bool private_log_stopping;
+static LogSinkFunc private_log_sink_func;
+static void *private_log_sink_data;
+static uint64_t private_log_reported;
+static bool private_log_key_valid;
+#if defined(_WINDOWS)
+static DWORD private_log_key;
+#else
+static pthread_key_t private_log_key;
+#endif
+
+static void private_log_default_sink(LogLevel level, const char *file, int32_t line, const char *message,
+                                     void *data);
+static void private_log_start(void);
+#if defined(_WINDOWS)
+static void WINAPI private_log_thread_exit(void *data);
+#else
+static void private_log_thread_exit(void *data);
+#endif
+static LogRing *private_log_get_ring(void);
+static void private_log_drain(void);
+static void private_log_thread_func(void *data);
+static void private_log_atexit(void);
+
+static void private_log_default_sink(LogLevel level, const char *file, int32_t line, const char *message,
+                                     void *data) {
+  static const char *names[] = {"Debug", "Warning", "Error"};
+
+  UNUSED(data);
+
+  if (file != NULL) {
+    printf("** %s [%s:%d] **\n%s\n\n", names[level], file, line, message);
+  } else {
+    printf("** %s **\n%s\n\n", names[level], message);
+  }
+}
+
+/* The drain thread is started by the first message */
+static void private_log_start(void) {
+  int expected;
+
+  expected = 0;
+
+  if (atomic_compare_exchange_strong(&private_log_state, &expected, 1) == false) {
+    return;
+  }
+
+  /* Without the key rings of exited threads stay around until shutdown */
+#if defined(_WINDOWS)
+  private_log_key_valid = (private_log_key = FlsAlloc(private_log_thread_exit)) != FLS_OUT_OF_INDEXES;
+#else
+  private_log_key_valid = pthread_key_create(&private_log_key, private_log_thread_exit) == 0;
+#endif
+
+  if (LIKELY((private_log_lock = mutex_new()) != NULL)) {
+    atomic_store(&private_log_stopping, false);
+    private_log_thread = thread_new(private_log_thread_func, NULL);
+    atexit(private_log_atexit);
+  }
+
+  atomic_store(&private_log_state, 2);
+}
+
+/* Runs as the thread exits, after its last message */
+#if defined(_WINDOWS)
+static void WINAPI private_log_thread_exit(void *data) {
+#else
+static void private_log_thread_exit(void *data) {
+#endif
+  if (data != NULL) {
+    atomic_store_explicit(&((LogRing *) data)->orphaned, true, memory_order_release);
+  }
+}
+
+static LogRing *private_log_get_ring(void) {
+  LogRing *ring;
+
+  if (LIKELY((ring = private_log_ring) != NULL)) {
+    return ring;
+  }
+
+  if (UNLIKELY((ring = calloc(sizeof(LogRing), 1)) == NULL)) {
+    return NULL;
+  }
+
+  ring->next = atomic_load(&private_log_rings);
+
+  while (atomic_compare_exchange_weak(&private_log_rings, &ring->next, ring) == false);
+
+  private_log_ring = ring;
+
+  if (private_log_key_valid) {
+#if defined(_WINDOWS)
+    FlsSetValue(private_log_key, ring);
+#else
+    pthread_setspecific(private_log_key, ring);
+#endif
+  }
+
+  return ring;
+}
+
+/* Only one drain runs at a time, the producers never wait for it.
+ * Producers only push new rings in front, so the drain alone changes the
+ * links behind the first ring. */
+static void private_log_drain(void) {
+  LogSinkFunc func;
+  LogRing *ring, *prev, *expected;
+  LogEntry *entry;
+  uint_fast64_t head, tail;
+  uint64_t dropped;
+  bool orphaned;
+  char buffer[64];
+
+  func = private_log_sink_func != NULL ? private_log_sink_func : private_log_default_sink;
+
+  for (prev = NULL, ring = atomic_load(&private_log_rings); ring != NULL;) {
+    orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+      entry = &ring->entries[tail % LOG_RING_SIZE];
+      func(entry->level, entry->file, entry->line, entry->message, private_log_sink_data);
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    if (orphaned == false) {
+      prev = ring;
+      ring = ring->next;
+      continue;
+    }
+
+    /* The first ring may have been pushed behind meanwhile, then it is
+     * left for the next drain */
+    if (prev != NULL) {
+      prev->next = ring->next;
+    } else {
+      expected = ring;
+
+      if (atomic_compare_exchange_strong(&private_log_rings, &expected, ring->next) == false) {
+        prev = ring;
+        ring = ring->next;
+        continue;
+      }
+    }
+
+    expected = ring->next;
+    free(ring);
+    ring = expected;
+  }
+
+  if ((dropped = atomic_load(&private_log_dropped)) != private_log_reported) {
+    snprintf(buffer, sizeof(buffer), "%llu log messages dropped",
+             (unsigned long long)(dropped - private_log_reported));
+    func(LOG_LEVEL_WARNING, NULL, 0, buffer, private_log_sink_data);
+    private_log_reported = dropped;
+  }
+
+  if (func == private_log_default_sink) {
+    fflush(stdout);
+  }
+}
+
+static void private_log_thread_func(void *data) {
+  UNUSED(data);
+
+  while (atomic_load(&private_log_stopping) == false) {
+    mutex_lock(private_log_lock);
+    private_log_drain();
+    mutex_unlock(private_log_lock);
+
+    thread_sleep(LOG_DRAIN_INTERVAL);
+  }
+}
+
+static void private_log_atexit(void) {
+  log_flush();
+}
+
+/* Allows up to the rate limit per second per call site, the state packs
+ * the current second and the count of messages in it */
+bool log_site_allow(LogSite *site, LogLevel level) {
+  uint_fast64_t state, next, now;
+  uint32_t rate;
+
+  if ((int) level < atomic_load_explicit(&private_log_level, memory_order_relaxed)) {
+    return false;
+  }
+
+  if ((rate = atomic_load_explicit(&private_log_rate, memory_order_relaxed)) == 0) {
+    return true;
+  }
+
+  now = sys_time_monotonic_coarse() / 1000;
+  state = atomic_load_explicit(&site->state, memory_order_relaxed);
+
+  do {
+    if ((state >> 32) != (now & 0xffffffff)) {
+      next = (now << 32) | 1;
+    } else if ((state & 0xffffffff) < rate) {
+      next = state + 1;
+    } else {
+      atomic_fetch_add_explicit(&private_log_dropped, 1, memory_order_relaxed);
+      return false;
+    }
+  } while (atomic_compare_exchange_weak_explicit(&site->state, &state, next,
+                                                 memory_order_relaxed, memory_order_relaxed) == false);
+
+  return true;
+}
+
+void log_write(LogLevel level, const char *file, int32_t line, const char *format, ...) {
+  LogRing *ring;
+  LogEntry *entry;
+  uint_fast64_t head;
+  va_list args;
+
+  if (UNLIKELY(format == NULL || (int) level < 0 || level >= LOG_LEVEL_NONE)) {
+    return;
+  }
+
+  if (UNLIKELY(atomic_load_explicit(&private_log_state, memory_order_acquire) != 2)) {
+    private_log_start();
+  }
+
+  if (UNLIKELY((ring = private_log_get_ring()) == NULL)) {
+    atomic_fetch_add_explicit(&private_log_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&private_log_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  entry = &ring->entries[head % LOG_RING_SIZE];
+  entry->level = level;
+  entry->file = file;
+  entry->line = line;
+
+  va_start(args, format);
+  vsnprintf(entry->message, LOG_MESSAGE_SIZE, format, args);
+  va_end(args);
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Runtime threshold on top of LOG_COMPILE_LEVEL */
+void log_set_level(LogLevel level) {
+  atomic_store(&private_log_level, (int) level);
+}
+
+/* Messages per second per call site, 0 turns the limit off */
+void log_set_rate_limit(uint32_t per_second) {
+  atomic_store(&private_log_rate, per_second);
+}
+
+/* NULL restores the default sink, which prints to stdout */
+void log_set_sink(LogSinkFunc func, void *data) {
+  if (private_log_lock != NULL) {
+    mutex_lock(private_log_lock);
+  }
+
+  private_log_sink_func = func;
+  private_log_sink_data = data;
+
+  if (private_log_lock != NULL) {
+    mutex_unlock(private_log_lock);
+  }
+}
+
+uint64_t log_get_dropped(void) {
+  return atomic_load(&private_log_dropped);
+}
+
+/* Writes out everything logged so far */
+void log_flush(void) {
+  if (atomic_load(&private_log_state) != 2 || private_log_lock == NULL) {
+    return;
+  }
+
+  mutex_lock(private_log_lock);
+  private_log_drain();
+  mutex_unlock(private_log_lock);
+}
+
+/* Threads must not log anymore once this is called */
+void log_shutdown(void) {
+  LogRing *ring, *next;
+
+  if (atomic_load(&private_log_state) != 2) {
+    return;
+  }
+
+  if (private_log_thread != NULL) {
+    atomic_store(&private_log_stopping, true);
+    thread_join(private_log_thread);
+    private_log_thread = NULL;
+  }
+
+  if (private_log_lock != NULL) {
+    private_log_drain();
+    mutex_free(private_log_lock);
+    private_log_lock = NULL;
+  }
+
+  /* Exiting threads must not touch the rings freed below */
+  if (private_log_key_valid) {
+#if defined(_WINDOWS)
+    FlsFree(private_log_key);
+#else
+    pthread_key_delete(private_log_key);
+#endif
+    private_log_key_valid = false;
+  }
+
+  for (ring = atomic_exchange(&private_log_rings, NULL); ring != NULL; ring = next) {
+    next = ring->next;
+    free(ring);
+  }
+
+  private_log_ring = NULL;
+  atomic_store(&private_log_state, 0);
+}
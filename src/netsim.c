@@ -0,0 +1,943 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "netsim.h"
+#include "poller.h"
+#include "addressmap.h"
+#include "thread.h"
+#include "error.h"
+
+#define NETSIM_MAX_EVENTS 64
+#define NETSIM_READ_SIZE (64 * 1024)
+#define NETSIM_QUEUE_LIMIT (4 * 1024 * 1024)
+#define NETSIM_MAX_WAIT 20
+#define NETSIM_FLOW_CAPACITY 64
+
+typedef struct NetSimFlow NetSimFlow;
+
+typedef struct NetSimPacket {
+  struct NetSimPacket *next;
+  NetSimFlow *flow;
+  uint64_t due;
+  uint64_t seq;
+  size_t len;
+  size_t offset;
+  char data[];
+} NetSimPacket;
+
+/* One direction of a TCP connection */
+typedef struct {
+  Socket *from;
+  Socket *to;
+  NetSimPacket *head;
+  NetSimPacket *tail;
+  size_t queued;
+  uint64_t bandwidth_free;
+  uint64_t last_due;
+  uint64_t stall_until;
+  bool blocked;
+  bool eof;
+  bool shut;
+} NetSimLink;
+
+typedef struct NetSimPair NetSimPair;
+
+typedef struct {
+  NetSimPair *pair;
+  int32_t side;
+  SocketIOCondition condition;
+} NetSimEnd;
+
+/* Side 0 is the accepted client, side 1 the connection to the target */
+struct NetSimPair {
+  NetSimPair *prev;
+  NetSimPair *next;
+  NetSimEnd ends[2];
+  NetSimLink links[NETSIM_DIRECTIONS];
+  bool connecting;
+  bool failed;
+};
+
+/* A UDP client and the socket its datagrams go out to the target from */
+struct NetSimFlow {
+  NetSimFlow *next;
+  SocketAddress *client;
+  Socket *socket;
+  SocketIOCondition condition;
+  uint64_t bandwidth_free[NETSIM_DIRECTIONS];
+};
+
+typedef struct {
+  NetSimConfig config;
+  NetSimStats stats;
+  uint64_t rng;
+  /* UDP only, stream links keep their own */
+  NetSimPacket **heap;
+  size_t heap_count;
+  size_t heap_capacity;
+  size_t queued;
+  uint64_t stall_until;
+} NetSimPath;
+
+struct NetSim {
+  SocketType type;
+  Socket *socket;
+  SocketAddress *target;
+  SocketIOCondition condition;
+  Poller *poller;
+  Mutex *lock;
+  Thread *thread;
+  bool stopping;
+  uint64_t seq;
+  char *buffer;
+  NetSimPath paths[NETSIM_DIRECTIONS];
+  NetSimPair *pairs;
+  NetSimFlow *flows;
+  AddressMap *flow_map;
+};
+
+static uint64_t private_netsim_random(NetSimPath *path);
+static bool private_netsim_chance(NetSimPath *path, uint32_t ppm);
+static uint64_t private_netsim_due(NetSimPath *path, uint64_t *bandwidth_free, size_t len, uint64_t now);
+static bool private_netsim_stall(NetSimPath *path, uint64_t *stall_until, uint64_t now);
+static NetSimPacket *private_netsim_packet_new(NetSim *sim, const char *data, size_t len);
+static bool private_netsim_heap_push(NetSimPath *path, NetSimPacket *packet);
+static NetSimPacket *private_netsim_heap_pop(NetSimPath *path);
+static void private_netsim_tune(const NetSim *sim, const Socket *socket);
+static void private_netsim_watch(NetSim *sim, const Socket *socket, SocketIOCondition *current,
+                                 SocketIOCondition condition, void *data);
+static void private_netsim_pair_accept(NetSim *sim);
+static void private_netsim_pair_free(NetSim *sim, NetSimPair *pair);
+static void private_netsim_link_read(NetSim *sim, NetSimPair *pair, NetSimDirection direction, uint64_t now);
+static void private_netsim_link_write(NetSim *sim, NetSimPair *pair, NetSimDirection direction, uint64_t now);
+static void private_netsim_pair_event(NetSim *sim, NetSimEnd *end, const PollerEvent *event, uint64_t now);
+static uint64_t private_netsim_pair_sweep(NetSim *sim, NetSimPair *pair, uint64_t now);
+static NetSimFlow *private_netsim_flow_get(NetSim *sim, SocketAddress *client);
+static void private_netsim_datagram_read(NetSim *sim, NetSimFlow *flow, uint64_t now);
+static uint64_t private_netsim_datagram_sweep(NetSim *sim, uint64_t now);
+static void private_netsim_thread(void *data);
+
+/* xorshift64*, one generator per direction keeps runs repeatable */
+static uint64_t private_netsim_random(NetSimPath *path) {
+  path->rng ^= path->rng >> 12;
+  path->rng ^= path->rng << 25;
+  path->rng ^= path->rng >> 27;
+
+  return path->rng * 0x2545f4914f6cdd1dull;
+}
+
+static bool private_netsim_chance(NetSimPath *path, uint32_t ppm) {
+  return ppm > 0 && private_netsim_random(path) % 1000000 < ppm;
+}
+
+/* Serializes len bytes behind whatever is already on the wire, then adds
+ * the propagation delay */
+static uint64_t private_netsim_due(NetSimPath *path, uint64_t *bandwidth_free, size_t len, uint64_t now) {
+  uint64_t sent = now;
+
+  if (path->config.bandwidth > 0) {
+    sent = *bandwidth_free > now ? *bandwidth_free : now;
+    sent += (uint64_t)len * 1000000ull / path->config.bandwidth;
+    *bandwidth_free = sent;
+  }
+
+  sent += path->config.latency_usec;
+
+  if (path->config.jitter_usec > 0) {
+    sent += private_netsim_random(path) % (path->config.jitter_usec + 1ull);
+  }
+
+  return sent;
+}
+
+static bool private_netsim_stall(NetSimPath *path, uint64_t *stall_until, uint64_t now) {
+  if (private_netsim_chance(path, path->config.stall_ppm) == false) {
+    return false;
+  }
+
+  *stall_until = now + path->config.stall_usec;
+  path->stats.stalls++;
+
+  return true;
+}
+
+static NetSimPacket *private_netsim_packet_new(NetSim *sim, const char *data, size_t len) {
+  NetSimPacket *ret;
+
+  if (UNLIKELY((ret = malloc(sizeof(NetSimPacket) + len)) == NULL)) {
+    return NULL;
+  }
+
+  memcpy(ret->data, data, len);
+  ret->next = NULL;
+  ret->flow = NULL;
+  ret->seq = sim->seq++;
+  ret->len = len;
+  ret->offset = 0;
+
+  return ret;
+}
+
+/* Datagrams are ordered by due time, ties by arrival */
+static bool private_netsim_heap_less(const NetSimPacket *a, const NetSimPacket *b) {
+  return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static bool private_netsim_heap_push(NetSimPath *path, NetSimPacket *packet) {
+  NetSimPacket **heap;
+  size_t i, parent, capacity;
+
+  if (path->heap_count == path->heap_capacity) {
+    capacity = path->heap_capacity ? path->heap_capacity * 2 : 256;
+
+    if (UNLIKELY((heap = realloc(path->heap, sizeof(NetSimPacket *) * capacity)) == NULL)) {
+      return false;
+    }
+
+    path->heap = heap;
+    path->heap_capacity = capacity;
+  }
+
+  for (i = path->heap_count++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+
+    if (private_netsim_heap_less(packet, path->heap[parent]) == false) {
+      break;
+    }
+
+    path->heap[i] = path->heap[parent];
+  }
+
+  path->heap[i] = packet;
+  path->queued += packet->len;
+
+  return true;
+}
+
+static NetSimPacket *private_netsim_heap_pop(NetSimPath *path) {
+  NetSimPacket *ret, *last;
+  size_t i, child;
+
+  ret = path->heap[0];
+  last = path->heap[--path->heap_count];
+
+  for (i = 0; (child = i * 2 + 1) < path->heap_count; i = child) {
+    if (child + 1 < path->heap_count && private_netsim_heap_less(path->heap[child + 1], path->heap[child])) {
+      child++;
+    }
+
+    if (private_netsim_heap_less(path->heap[child], last) == false) {
+      break;
+    }
+
+    path->heap[i] = path->heap[child];
+  }
+
+  if (path->heap_count > 0) {
+    path->heap[i] = last;
+  }
+
+  path->queued -= ret->len;
+
+  return ret;
+}
+
+/* Small buffers make backpressure reach the peers sooner */
+static void private_netsim_tune(const NetSim *sim, const Socket *socket) {
+  uint32_t size;
+
+  if ((size = sim->paths[NETSIM_DIRECTION_UPSTREAM].config.buffer_size) > 0 ||
+      (size = sim->paths[NETSIM_DIRECTION_DOWNSTREAM].config.buffer_size) > 0) {
+    socket_set_buffer_size(socket, SOCKET_DIRECTION_SND, size);
+    socket_set_buffer_size(socket, SOCKET_DIRECTION_RCV, size);
+  }
+}
+
+static void private_netsim_watch(NetSim *sim, const Socket *socket, SocketIOCondition *current,
+                                 SocketIOCondition condition, void *data) {
+  if (*current != condition) {
+    poller_modify(sim->poller, socket, condition, data);
+    *current = condition;
+  }
+}
+
+static void private_netsim_pair_accept(NetSim *sim) {
+  NetSimPair *pair;
+  Socket *client, *server;
+
+  while ((client = socket_accept(sim->socket)) != NULL) {
+    server = socket_new(socket_address_get_family(sim->target), SOCKET_TYPE_STREAM, SOCKET_PROTOCOL_TCP);
+
+    if (UNLIKELY(server == NULL || (pair = calloc(sizeof(NetSimPair), 1)) == NULL)) {
+      socket_free(server);
+      socket_free(client);
+      continue;
+    }
+
+    socket_set_blocking(client, false);
+    socket_set_blocking(server, false);
+    private_netsim_tune(sim, client);
+    private_netsim_tune(sim, server);
+
+    /* Nonblocking connect, finished when the target side turns writable */
+    pair->connecting = !socket_connect(server, sim->target);
+
+    if (pair->connecting && error_get_code() != (int32_t)ERROR_IO_IN_PROGRESS &&
+        error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+      socket_free(server);
+      socket_free(client);
+      free(pair);
+      continue;
+    }
+
+    pair->ends[0].pair = pair;
+    pair->ends[0].side = 0;
+    pair->ends[0].condition = SOCKET_IO_CONDITION_POLLIN;
+    pair->ends[1].pair = pair;
+    pair->ends[1].side = 1;
+    pair->ends[1].condition = pair->connecting ? SOCKET_IO_CONDITION_POLLOUT : SOCKET_IO_CONDITION_POLLIN;
+    pair->links[NETSIM_DIRECTION_UPSTREAM].from = client;
+    pair->links[NETSIM_DIRECTION_UPSTREAM].to = server;
+    pair->links[NETSIM_DIRECTION_DOWNSTREAM].from = server;
+    pair->links[NETSIM_DIRECTION_DOWNSTREAM].to = client;
+
+    poller_add(sim->poller, client, pair->ends[0].condition, &pair->ends[0]);
+    poller_add(sim->poller, server, pair->ends[1].condition, &pair->ends[1]);
+
+    pair->next = sim->pairs;
+
+    if (sim->pairs != NULL) {
+      sim->pairs->prev = pair;
+    }
+
+    sim->pairs = pair;
+  }
+}
+
+static void private_netsim_pair_free(NetSim *sim, NetSimPair *pair) {
+  NetSimPacket *packet;
+  int32_t i;
+
+  for (i = 0; i < NETSIM_DIRECTIONS; i++) {
+    while ((packet = pair->links[i].head) != NULL) {
+      pair->links[i].head = packet->next;
+      free(packet);
+    }
+  }
+
+  poller_remove(sim->poller, pair->links[NETSIM_DIRECTION_UPSTREAM].from);
+  poller_remove(sim->poller, pair->links[NETSIM_DIRECTION_UPSTREAM].to);
+  socket_free(pair->links[NETSIM_DIRECTION_UPSTREAM].from);
+  socket_free(pair->links[NETSIM_DIRECTION_UPSTREAM].to);
+
+  if (pair->prev != NULL) {
+    pair->prev->next = pair->next;
+  } else {
+    sim->pairs = pair->next;
+  }
+
+  if (pair->next != NULL) {
+    pair->next->prev = pair->prev;
+  }
+
+  free(pair);
+}
+
+static void private_netsim_link_read(NetSim *sim, NetSimPair *pair, NetSimDirection direction, uint64_t now) {
+  NetSimLink *link = &pair->links[direction];
+  NetSimPath *path = &sim->paths[direction];
+  NetSimPacket *packet;
+  uint64_t due;
+  ssize_t ret;
+
+  if (link->eof || link->stall_until > now || link->queued >= NETSIM_QUEUE_LIMIT) {
+    return;
+  }
+
+  if (private_netsim_stall(path, &link->stall_until, now)) {
+    return;
+  }
+
+  ret = socket_receive(link->from, sim->buffer, NETSIM_READ_SIZE);
+
+  if (ret < 0) {
+    if (error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+      pair->failed = true;
+    }
+
+    return;
+  }
+
+  if (ret == 0) {
+    link->eof = true;
+    return;
+  }
+
+  if (UNLIKELY((packet = private_netsim_packet_new(sim, sim->buffer, (size_t)ret)) == NULL)) {
+    pair->failed = true;
+    return;
+  }
+
+  /* Jitter must not reorder a stream */
+  due = private_netsim_due(path, &link->bandwidth_free, (size_t)ret, now);
+  packet->due = due > link->last_due ? due : link->last_due;
+  link->last_due = packet->due;
+
+  if (link->tail != NULL) {
+    link->tail->next = packet;
+  } else {
+    link->head = packet;
+  }
+
+  link->tail = packet;
+  link->queued += packet->len;
+}
+
+static void private_netsim_link_write(NetSim *sim, NetSimPair *pair, NetSimDirection direction, uint64_t now) {
+  NetSimLink *link = &pair->links[direction];
+  NetSimPath *path = &sim->paths[direction];
+  NetSimPacket *packet;
+  size_t len;
+  ssize_t ret;
+
+  while ((packet = link->head) != NULL && packet->due <= now && link->blocked == false) {
+    len = packet->len - packet->offset;
+
+    if (path->config.max_segment > 0 && len > path->config.max_segment) {
+      len = 1 + (size_t)(private_netsim_random(path) % path->config.max_segment);
+    }
+
+    ret = socket_send(link->to, packet->data + packet->offset, len);
+
+    if (ret < 0) {
+      if (error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK) {
+        link->blocked = true;
+      } else {
+        pair->failed = true;
+      }
+
+      return;
+    }
+
+    packet->offset += (size_t)ret;
+    path->stats.bytes += (uint64_t)ret;
+
+    if ((size_t)ret < len) {
+      link->blocked = true;
+      return;
+    }
+
+    if (packet->offset < packet->len) {
+      continue;
+    }
+
+    link->head = packet->next;
+
+    if (link->head == NULL) {
+      link->tail = NULL;
+    }
+
+    link->queued -= packet->len;
+    path->stats.packets++;
+    free(packet);
+  }
+}
+
+static void private_netsim_pair_event(NetSim *sim, NetSimEnd *end, const PollerEvent *event, uint64_t now) {
+  NetSimPair *pair = end->pair;
+  NetSimDirection reads, writes;
+
+  reads = end->side == 0 ? NETSIM_DIRECTION_UPSTREAM : NETSIM_DIRECTION_DOWNSTREAM;
+  writes = end->side == 0 ? NETSIM_DIRECTION_DOWNSTREAM : NETSIM_DIRECTION_UPSTREAM;
+
+  if (end->side == 1 && pair->connecting) {
+    if (event->error || socket_check_connect_result(pair->links[writes].to) == false) {
+      pair->failed = true;
+    } else {
+      pair->connecting = false;
+    }
+
+    return;
+  }
+
+  if (event->condition & SOCKET_IO_CONDITION_POLLOUT) {
+    pair->links[writes].blocked = false;
+  }
+
+  if (event->condition & SOCKET_IO_CONDITION_POLLIN || event->error) {
+    private_netsim_link_read(sim, pair, reads, now);
+  }
+}
+
+/* Delivers what is due, then works out what each side waits for. Returns
+ * the next time the pair needs attention, 0 once it was freed. */
+static uint64_t private_netsim_pair_sweep(NetSim *sim, NetSimPair *pair, uint64_t now) {
+  SocketIOCondition condition;
+  NetSimLink *link, *reads, *writes;
+  uint64_t ret = UINT64_MAX;
+  int32_t i;
+
+  for (i = 0; i < NETSIM_DIRECTIONS && pair->connecting == false && pair->failed == false; i++) {
+    link = &pair->links[i];
+    private_netsim_link_write(sim, pair, (NetSimDirection)i, now);
+
+    if (link->eof && link->head == NULL && link->shut == false) {
+      socket_shutdown(link->to, false, true);
+      link->shut = true;
+    }
+  }
+
+  if (pair->failed || (pair->links[0].shut && pair->links[1].shut)) {
+    private_netsim_pair_free(sim, pair);
+    return 0;
+  }
+
+  for (i = 0; i < NETSIM_DIRECTIONS; i++) {
+    link = &pair->links[i];
+
+    if (link->head != NULL && link->blocked == false && link->head->due < ret) {
+      ret = link->head->due;
+    }
+
+    if (link->stall_until > now && link->stall_until < ret) {
+      ret = link->stall_until;
+    }
+  }
+
+  /* Side 0 reads upstream and writes downstream, side 1 the other way */
+  for (i = 0; i < 2; i++) {
+    reads = &pair->links[i == 0 ? NETSIM_DIRECTION_UPSTREAM : NETSIM_DIRECTION_DOWNSTREAM];
+    writes = &pair->links[i == 0 ? NETSIM_DIRECTION_DOWNSTREAM : NETSIM_DIRECTION_UPSTREAM];
+    condition = 0;
+
+    if (i == 1 && pair->connecting) {
+      condition = SOCKET_IO_CONDITION_POLLOUT;
+    } else {
+      if (reads->eof == false && reads->stall_until <= now && reads->queued < NETSIM_QUEUE_LIMIT) {
+        condition |= SOCKET_IO_CONDITION_POLLIN;
+      }
+
+      if (writes->blocked) {
+        condition |= SOCKET_IO_CONDITION_POLLOUT;
+      }
+    }
+
+    private_netsim_watch(sim, reads->from, &pair->ends[i].condition, condition, &pair->ends[i]);
+  }
+
+  return ret;
+}
+
+static NetSimFlow *private_netsim_flow_get(NetSim *sim, SocketAddress *client) {
+  SocketAddressKey key;
+  NetSimFlow *ret;
+
+  if (UNLIKELY(socket_address_to_key(client, &key) == false)) {
+    return NULL;
+  }
+
+  if ((ret = address_map_get(sim->flow_map, &key)) != NULL) {
+    return ret;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(NetSimFlow), 1)) == NULL)) {
+    return NULL;
+  }
+
+  ret->socket = socket_new(socket_address_get_family(sim->target), SOCKET_TYPE_DATAGRAM, SOCKET_PROTOCOL_UDP);
+
+  if (UNLIKELY(ret->socket == NULL || (ret->client = socket_address_new_from_key(&key)) == NULL ||
+      address_map_put(sim->flow_map, &key, ret) == false)) {
+    socket_free(ret->socket);
+    socket_address_free(ret->client);
+    free(ret);
+    return NULL;
+  }
+
+  socket_set_blocking(ret->socket, false);
+  private_netsim_tune(sim, ret->socket);
+  ret->condition = SOCKET_IO_CONDITION_POLLIN;
+  poller_add(sim->poller, ret->socket, ret->condition, ret);
+  ret->next = sim->flows;
+  sim->flows = ret;
+
+  return ret;
+}
+
+/* flow is NULL for datagrams from clients to the simulator socket */
+static void private_netsim_datagram_read(NetSim *sim, NetSimFlow *flow, uint64_t now) {
+  NetSimDirection direction = flow == NULL ? NETSIM_DIRECTION_UPSTREAM : NETSIM_DIRECTION_DOWNSTREAM;
+  NetSimPath *path = &sim->paths[direction];
+  SocketAddress *client = NULL;
+  NetSimPacket *packet;
+  ssize_t ret;
+  int32_t i;
+
+  for (i = 0; i < NETSIM_MAX_EVENTS && path->stall_until <= now; i++) {
+    if (private_netsim_stall(path, &path->stall_until, now)) {
+      return;
+    }
+
+    if (flow == NULL) {
+      ret = socket_receive_from(sim->socket, &client, sim->buffer, NETSIM_READ_SIZE);
+    } else {
+      ret = socket_receive(flow->socket, sim->buffer, NETSIM_READ_SIZE);
+    }
+
+    if (ret < 0) {
+      return;
+    }
+
+    packet = NULL;
+
+    if (private_netsim_chance(path, path->config.loss_ppm) || path->queued >= NETSIM_QUEUE_LIMIT ||
+        (packet = private_netsim_packet_new(sim, sim->buffer, (size_t)ret)) == NULL ||
+        (packet->flow = flow != NULL ? flow : private_netsim_flow_get(sim, client)) == NULL) {
+      path->stats.dropped++;
+      free(packet);
+    } else {
+      packet->due = private_netsim_due(path, &packet->flow->bandwidth_free[direction], packet->len, now);
+
+      if (private_netsim_chance(path, path->config.reorder_ppm)) {
+        packet->due += path->config.reorder_usec;
+        path->stats.reordered++;
+      }
+
+      if (UNLIKELY(private_netsim_heap_push(path, packet) == false)) {
+        path->stats.dropped++;
+        free(packet);
+      }
+    }
+
+    if (client != NULL) {
+      socket_address_free(client);
+      client = NULL;
+    }
+  }
+}
+
+static uint64_t private_netsim_datagram_sweep(NetSim *sim, uint64_t now) {
+  SocketIOCondition condition;
+  NetSimPacket *packet;
+  NetSimPath *path;
+  NetSimFlow *flow;
+  uint64_t ret = UINT64_MAX;
+  ssize_t sent;
+  int32_t i;
+
+  for (i = 0; i < NETSIM_DIRECTIONS; i++) {
+    path = &sim->paths[i];
+
+    while (path->heap_count > 0 && path->heap[0]->due <= now) {
+      packet = private_netsim_heap_pop(path);
+
+      if (i == NETSIM_DIRECTION_UPSTREAM) {
+        sent = socket_send_to(packet->flow->socket, sim->target, packet->data, packet->len);
+      } else {
+        sent = socket_send_to(sim->socket, packet->flow->client, packet->data, packet->len);
+      }
+
+      /* A full socket buffer loses the datagram like a full router queue */
+      if (sent == (ssize_t)packet->len) {
+        path->stats.bytes += packet->len;
+        path->stats.packets++;
+      } else {
+        path->stats.dropped++;
+      }
+
+      free(packet);
+    }
+
+    if (path->heap_count > 0 && path->heap[0]->due < ret) {
+      ret = path->heap[0]->due;
+    }
+
+    if (path->stall_until > now && path->stall_until < ret) {
+      ret = path->stall_until;
+    }
+  }
+
+  condition = sim->paths[NETSIM_DIRECTION_UPSTREAM].stall_until <= now ? SOCKET_IO_CONDITION_POLLIN : 0;
+  private_netsim_watch(sim, sim->socket, &sim->condition, condition, NULL);
+
+  condition = sim->paths[NETSIM_DIRECTION_DOWNSTREAM].stall_until <= now ? SOCKET_IO_CONDITION_POLLIN : 0;
+
+  for (flow = sim->flows; flow != NULL; flow = flow->next) {
+    private_netsim_watch(sim, flow->socket, &flow->condition, condition, flow);
+  }
+
+  return ret;
+}
+
+static void private_netsim_thread(void *data) {
+  NetSim *sim = (NetSim *) data;
+  PollerEvent events[NETSIM_MAX_EVENTS];
+  NetSimPair *pair, *next_pair;
+  uint64_t now, next, due;
+  int32_t i, count, timeout;
+
+  next = 0;
+
+  for (;;) {
+    now = sys_time_monotonic_usec();
+    timeout = NETSIM_MAX_WAIT;
+
+    /* poller_wait() counts in milliseconds, round up so nothing goes early */
+    if (next <= now) {
+      timeout = 0;
+    } else if (next - now < (uint64_t)NETSIM_MAX_WAIT * 1000) {
+      timeout = (int32_t)((next - now + 999) / 1000);
+    }
+
+    count = poller_wait(sim->poller, events, NETSIM_MAX_EVENTS, timeout);
+
+    mutex_lock(sim->lock);
+
+    if (sim->stopping) {
+      mutex_unlock(sim->lock);
+      break;
+    }
+
+    now = sys_time_monotonic_usec();
+
+    for (i = 0; i < count; i++) {
+      if (sim->type == SOCKET_TYPE_DATAGRAM) {
+        private_netsim_datagram_read(sim, events[i].data, now);
+      } else if (events[i].data == NULL) {
+        private_netsim_pair_accept(sim);
+      } else {
+        private_netsim_pair_event(sim, events[i].data, &events[i], now);
+      }
+    }
+
+    if (sim->type == SOCKET_TYPE_DATAGRAM) {
+      next = private_netsim_datagram_sweep(sim, now);
+    } else {
+      next = UINT64_MAX;
+
+      for (pair = sim->pairs; pair != NULL; pair = next_pair) {
+        next_pair = pair->next;
+
+        if ((due = private_netsim_pair_sweep(sim, pair, now)) != 0 && due < next) {
+          next = due;
+        }
+      }
+    }
+
+    mutex_unlock(sim->lock);
+  }
+}
+
+NetSim *netsim_new(SocketType type, const SocketAddress *target, uint64_t seed) {
+  SocketAddressKey key;
+  SocketAddress *local;
+  NetSim *ret;
+  int32_t i;
+
+  if (UNLIKELY(target == NULL || (type != SOCKET_TYPE_STREAM && type != SOCKET_TYPE_DATAGRAM))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(NetSim), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for network simulator");
+    return NULL;
+  }
+
+  ret->type = type;
+
+  for (i = 0; i < NETSIM_DIRECTIONS; i++) {
+    /* A zero state would stick at zero */
+    ret->paths[i].rng = (seed ^ (0x9e3779b97f4a7c15ull * (uint64_t)(i + 1))) | 1;
+  }
+
+  if (UNLIKELY(socket_address_to_key(target, &key) == false ||
+      (ret->target = socket_address_new_from_key(&key)) == NULL ||
+      (ret->buffer = malloc(NETSIM_READ_SIZE)) == NULL ||
+      (ret->lock = mutex_new()) == NULL ||
+      (ret->poller = poller_new()) == NULL ||
+      (type == SOCKET_TYPE_DATAGRAM && (ret->flow_map = address_map_new(NETSIM_FLOW_CAPACITY)) == NULL))) {
+    netsim_free(ret);
+    return NULL;
+  }
+
+  local = socket_address_new_loopback(socket_address_get_family(target), 0);
+  ret->socket = socket_new(socket_address_get_family(target), type,
+                           type == SOCKET_TYPE_STREAM ? SOCKET_PROTOCOL_TCP : SOCKET_PROTOCOL_UDP);
+
+  if (UNLIKELY(local == NULL || ret->socket == NULL || socket_bind(ret->socket, local, false) == false ||
+      (type == SOCKET_TYPE_STREAM && socket_listen(ret->socket) == false))) {
+    socket_address_free(local);
+    netsim_free(ret);
+    return NULL;
+  }
+
+  socket_address_free(local);
+  socket_set_blocking(ret->socket, false);
+  ret->condition = SOCKET_IO_CONDITION_POLLIN;
+
+  if (UNLIKELY(poller_add(ret->poller, ret->socket, ret->condition, NULL) == false)) {
+    netsim_free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+/* Takes effect for data read from then on */
+bool netsim_set_config(NetSim *sim, NetSimDirection direction, const NetSimConfig *config) {
+  if (UNLIKELY(sim == NULL || config == NULL || (int32_t) direction < 0 || direction >= NETSIM_DIRECTIONS)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  mutex_lock(sim->lock);
+  sim->paths[direction].config = *config;
+
+  if (sim->type == SOCKET_TYPE_DATAGRAM) {
+    private_netsim_tune(sim, sim->socket);
+  }
+
+  mutex_unlock(sim->lock);
+
+  return true;
+}
+
+/* The address clients connect or send to, free with socket_address_free() */
+SocketAddress *netsim_get_address(const NetSim *sim) {
+  if (UNLIKELY(sim == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  return socket_get_local_address(sim->socket);
+}
+
+bool netsim_get_stats(NetSim *sim, NetSimDirection direction, NetSimStats *stats) {
+  if (UNLIKELY(sim == NULL || stats == NULL || (int32_t) direction < 0 || direction >= NETSIM_DIRECTIONS)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  mutex_lock(sim->lock);
+  *stats = sim->paths[direction].stats;
+  mutex_unlock(sim->lock);
+
+  return true;
+}
+
+bool netsim_start(NetSim *sim) {
+  if (UNLIKELY(sim == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (sim->thread != NULL) {
+    return true;
+  }
+
+  sim->stopping = false;
+
+  if (UNLIKELY((sim->thread = thread_new(private_netsim_thread, sim)) == NULL)) {
+    return false;
+  }
+
+  return true;
+}
+
+/* Connections and queued data are kept, netsim_start() carries on */
+void netsim_stop(NetSim *sim) {
+  if (UNLIKELY(sim == NULL) || sim->thread == NULL) {
+    return;
+  }
+
+  mutex_lock(sim->lock);
+  sim->stopping = true;
+  mutex_unlock(sim->lock);
+
+  thread_join(sim->thread);
+  sim->thread = NULL;
+}
+
+void netsim_free(NetSim *sim) {
+  NetSimFlow *flow;
+  size_t i;
+  int32_t j;
+
+  if (UNLIKELY(sim == NULL)) {
+    return;
+  }
+
+  netsim_stop(sim);
+
+  while (sim->pairs != NULL) {
+    private_netsim_pair_free(sim, sim->pairs);
+  }
+
+  while ((flow = sim->flows) != NULL) {
+    sim->flows = flow->next;
+    poller_remove(sim->poller, flow->socket);
+    socket_free(flow->socket);
+    socket_address_free(flow->client);
+    free(flow);
+  }
+
+  for (j = 0; j < NETSIM_DIRECTIONS; j++) {
+    for (i = 0; i < sim->paths[j].heap_count; i++) {
+      free(sim->paths[j].heap[i]);
+    }
+
+    free(sim->paths[j].heap);
+  }
+
+  if (sim->socket != NULL) {
+    if (sim->poller != NULL) {
+      poller_remove(sim->poller, sim->socket);
+    }
+
+    socket_free(sim->socket);
+  }
+
+  if (sim->flow_map != NULL) {
+    address_map_free(sim->flow_map);
+  }
+
+  if (sim->poller != NULL) {
+    poller_free(sim->poller);
+  }
+
+  if (sim->lock != NULL) {
+    mutex_free(sim->lock);
+  }
+
+  socket_address_free(sim->target);
+  free(sim->buffer);
+  free(sim);
+}
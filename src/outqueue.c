@@ -0,0 +1,390 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "outqueue.h"
+#include "error.h"
+
+#define OUT_QUEUE_DEFAULT_LOW (16 * 1024)
+#define OUT_QUEUE_DEFAULT_HIGH (64 * 1024)
+#define OUT_QUEUE_INITIAL_CAPACITY 16
+#define OUT_QUEUE_IOV 64
+
+typedef struct {
+  const char *data;
+  size_t len;
+  OutQueueFreeFunc free_func;
+  void *free_data;
+} OutQueueEntry;
+
+/* Ring of entries, capacity is a power of two. size counts the bytes not
+ * written yet, offset the written part of the head entry. */
+struct OutQueue {
+  Socket *socket;
+  OutQueueEntry *entries;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t offset;
+  size_t size;
+  size_t low;
+  size_t high;
+  size_t limit;
+  bool paused;
+  OutQueueFunc pause;
+  OutQueueFunc resume;
+  void *data;
+};
+
+static void private_out_queue_release(OutQueueEntry *entry);
+static bool private_out_queue_reserve(OutQueue *queue);
+static void private_out_queue_consume(OutQueue *queue, size_t bytes);
+static void private_out_queue_free_copy(void *buffer, void *data);
+static bool private_out_queue_push(OutQueue *queue, const char *buffer, size_t len,
+                                   OutQueueFreeFunc free_func, void *free_data, bool write_through);
+
+static void private_out_queue_release(OutQueueEntry *entry) {
+  if (entry->free_func != NULL) {
+    entry->free_func((void *) entry->data, entry->free_data);
+  }
+}
+
+static bool private_out_queue_reserve(OutQueue *queue) {
+  OutQueueEntry *entries;
+  size_t capacity, i;
+
+  if (queue->count < queue->capacity) {
+    return true;
+  }
+
+  capacity = queue->capacity ? queue->capacity * 2 : OUT_QUEUE_INITIAL_CAPACITY;
+
+  if (UNLIKELY((entries = malloc(sizeof(OutQueueEntry) * capacity)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for output queue");
+    return false;
+  }
+
+  /* Unwrap the ring so the head starts at 0 again */
+  for (i = 0; i < queue->count; i++) {
+    entries[i] = queue->entries[(queue->head + i) & (queue->capacity - 1)];
+  }
+
+  free(queue->entries);
+  queue->entries = entries;
+  queue->capacity = capacity;
+  queue->head = 0;
+
+  return true;
+}
+
+static void private_out_queue_consume(OutQueue *queue, size_t bytes) {
+  OutQueueEntry *entry;
+  size_t left;
+
+  while (bytes > 0) {
+    entry = &queue->entries[queue->head];
+    left = entry->len - queue->offset;
+
+    if (bytes < left) {
+      queue->offset += bytes;
+      queue->size -= bytes;
+      return;
+    }
+
+    bytes -= left;
+    queue->size -= left;
+    queue->offset = 0;
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->count--;
+    private_out_queue_release(entry);
+  }
+}
+
+static void private_out_queue_free_copy(void *buffer, void *data) {
+  UNUSED(data);
+  free(buffer);
+}
+
+static bool private_out_queue_push(OutQueue *queue, const char *buffer, size_t len,
+                                   OutQueueFreeFunc free_func, void *free_data, bool write_through) {
+  OutQueueEntry *entry;
+  ssize_t written = 0;
+
+  if (UNLIKELY(queue == NULL || (buffer == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  /* Empty buffers are never queued, so the head always has bytes left */
+  if (len == 0) {
+    if (free_func != NULL) {
+      free_func((void *) buffer, free_data);
+    }
+
+    return true;
+  }
+
+  if (queue->limit > 0 && queue->size + len > queue->limit) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Output queue is full");
+    return false;
+  }
+
+  /* Grown up front, a partly written buffer can't be handed back */
+  if (UNLIKELY(private_out_queue_reserve(queue) == false)) {
+    return false;
+  }
+
+  if (queue->count == 0 && write_through) {
+    if ((written = socket_send(queue->socket, buffer, len)) < 0) {
+      if (error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+        return false;
+      }
+
+      written = 0;
+    }
+  }
+
+  entry = &queue->entries[(queue->head + queue->count) & (queue->capacity - 1)];
+  entry->data = buffer;
+  entry->len = len;
+  entry->free_func = free_func;
+  entry->free_data = free_data;
+
+  if ((size_t) written == len) {
+    private_out_queue_release(entry);
+    return true;
+  }
+
+  if (queue->count++ == 0) {
+    queue->offset = (size_t) written;
+  }
+
+  queue->size += len - (size_t) written;
+
+  if (queue->paused == false && queue->size >= queue->high) {
+    queue->paused = true;
+
+    if (queue->pause != NULL) {
+      queue->pause(queue, queue->data);
+    }
+  }
+
+  return true;
+}
+
+OutQueue *out_queue_new(Socket *socket) {
+  OutQueue *ret;
+
+  if (UNLIKELY(socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(OutQueue), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for output queue");
+    return NULL;
+  }
+
+  ret->socket = socket;
+  ret->low = OUT_QUEUE_DEFAULT_LOW;
+  ret->high = OUT_QUEUE_DEFAULT_HIGH;
+
+  return ret;
+}
+
+void out_queue_set_watermarks(OutQueue *queue, size_t low, size_t high) {
+  if (UNLIKELY(queue == NULL)) {
+    return;
+  }
+
+  queue->high = high > 0 ? high : OUT_QUEUE_DEFAULT_HIGH;
+  queue->low = low < queue->high ? low : queue->high;
+}
+
+/* 0 lets the queue grow without bound */
+void out_queue_set_limit(OutQueue *queue, size_t limit) {
+  if (UNLIKELY(queue == NULL)) {
+    return;
+  }
+
+  queue->limit = limit;
+}
+
+void out_queue_set_callbacks(OutQueue *queue, OutQueueFunc pause, OutQueueFunc resume, void *data) {
+  if (UNLIKELY(queue == NULL)) {
+    return;
+  }
+
+  queue->pause = pause;
+  queue->resume = resume;
+  queue->data = data;
+}
+
+bool out_queue_push(OutQueue *queue, const char *buffer, size_t len, OutQueueFreeFunc free_func, void *free_data) {
+  return private_out_queue_push(queue, buffer, len, free_func, free_data, true);
+}
+
+/* Queues without trying to write, to batch several buffers into one flush */
+bool out_queue_append(OutQueue *queue, const char *buffer, size_t len, OutQueueFreeFunc free_func, void *free_data) {
+  return private_out_queue_push(queue, buffer, len, free_func, free_data, false);
+}
+
+/* For buffers the caller keeps using, the queue writes from a copy */
+bool out_queue_push_copy(OutQueue *queue, const char *buffer, size_t len) {
+  char *copy;
+
+  if (UNLIKELY(queue == NULL || (buffer == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((copy = malloc(len > 0 ? len : 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for output queue");
+    return false;
+  }
+
+  memcpy(copy, buffer, len);
+
+  if (out_queue_push(queue, copy, len, private_out_queue_free_copy, NULL) == false) {
+    free(copy);
+    return false;
+  }
+
+  return true;
+}
+
+/* Writes until the queue is empty or the socket is full. Returns the bytes
+ * written, 0 included, or -1 on an error other than would block. */
+ssize_t out_queue_flush(OutQueue *queue) {
+  SocketBuffer buffers[OUT_QUEUE_IOV];
+  OutQueueEntry *entry;
+  size_t count, wanted, i;
+  ssize_t ret, total = 0;
+
+  if (UNLIKELY(queue == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  while (queue->count > 0) {
+    count = queue->count < OUT_QUEUE_IOV ? queue->count : OUT_QUEUE_IOV;
+    wanted = 0;
+
+    for (i = 0; i < count; i++) {
+      entry = &queue->entries[(queue->head + i) & (queue->capacity - 1)];
+      buffers[i].data = entry->data + (i == 0 ? queue->offset : 0);
+      buffers[i].len = entry->len - (i == 0 ? queue->offset : 0);
+      wanted += buffers[i].len;
+    }
+
+    if ((ret = socket_send_iov(queue->socket, buffers, count)) < 0) {
+      if (error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+        return -1;
+      }
+
+      break;
+    }
+
+    total += ret;
+    private_out_queue_consume(queue, (size_t) ret);
+
+    if ((size_t) ret < wanted) {
+      break;
+    }
+  }
+
+  if (queue->paused && queue->size <= queue->low) {
+    queue->paused = false;
+
+    if (queue->resume != NULL) {
+      queue->resume(queue, queue->data);
+    }
+  }
+
+  return total;
+}
+
+size_t out_queue_get_size(const OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return 0;
+  }
+
+  return queue->size;
+}
+
+size_t out_queue_get_count(const OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return 0;
+  }
+
+  return queue->count;
+}
+
+bool out_queue_is_paused(const OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return false;
+  }
+
+  return queue->paused;
+}
+
+Socket *out_queue_get_socket(const OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return NULL;
+  }
+
+  return queue->socket;
+}
+
+/* Drops everything queued without calling the callbacks */
+void out_queue_clear(OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return;
+  }
+
+  while (queue->count > 0) {
+    private_out_queue_release(&queue->entries[queue->head]);
+    queue->head = (queue->head + 1) & (queue->capacity - 1);
+    queue->count--;
+  }
+
+  queue->offset = 0;
+  queue->size = 0;
+  queue->paused = false;
+}
+
+void out_queue_free(OutQueue *queue) {
+  if (UNLIKELY(queue == NULL)) {
+    return;
+  }
+
+  out_queue_clear(queue);
+  free(queue->entries);
+  free(queue);
+}
@@ -0,0 +1,475 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "poller.h"
+#include "error.h"
+
+#if defined(__linux__)
+  #define POLLER_USE_EPOLL
+  #include <sys/epoll.h>
+  #include <unistd.h>
+  #include <errno.h>
+#elif defined(_WINDOWS)
+  #define POLLER_USE_POLL
+  #define poll WSAPoll
+#else
+  #define POLLER_USE_POLL
+  #include <poll.h>
+  #include <errno.h>
+#endif
+
+#define POLLER_DEFAULT_CAPACITY 64
+
+#ifdef POLLER_USE_POLL
+typedef struct {
+  void *data;
+  bool oneshot;
+} PollerEntry;
+#endif
+
+struct Poller {
+  TimerWheel *wheel;
+#ifdef POLLER_USE_EPOLL
+  int32_t fd;
+  struct epoll_event *events;
+  int32_t capacity;
+#else
+  struct pollfd *fds;
+  PollerEntry *entries;
+  int32_t count;
+  int32_t capacity;
+#endif
+};
+
+#ifdef POLLER_USE_EPOLL
+static uint32_t private_poller_to_native(SocketIOCondition condition) {
+  uint32_t ret = 0;
+
+  if (condition & SOCKET_IO_CONDITION_POLLIN) {
+    ret |= EPOLLIN;
+  }
+
+  if (condition & SOCKET_IO_CONDITION_POLLOUT) {
+    ret |= EPOLLOUT;
+  }
+
+  return ret;
+}
+
+static bool private_poller_ctl(Poller *poller, int32_t op, int32_t fd, uint32_t events, void *data) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = data;
+
+  if (UNLIKELY(epoll_ctl(poller->fd, op, fd, &ev) != 0)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_net()),
+      (int32_t)error_get_last_net(),
+      "Failed to call epoll_ctl() on poller"
+    );
+    return false;
+  }
+
+  return true;
+}
+#else
+static short private_poller_to_native(SocketIOCondition condition) {
+  short ret = 0;
+
+  if (condition & SOCKET_IO_CONDITION_POLLIN) {
+    ret |= POLLIN;
+  }
+
+  if (condition & SOCKET_IO_CONDITION_POLLOUT) {
+    ret |= POLLOUT;
+  }
+
+  return ret;
+}
+
+static int32_t private_poller_find(const Poller *poller, int32_t fd) {
+  int32_t i;
+
+  for (i = 0; i < poller->count; i++) {
+    if ((int32_t)poller->fds[i].fd == fd) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static bool private_poller_insert(Poller *poller, int32_t fd, SocketIOCondition condition, void *data, bool oneshot) {
+  struct pollfd *fds;
+  PollerEntry *entries;
+  int32_t capacity;
+
+  if (poller->count == poller->capacity) {
+    capacity = poller->capacity * 2;
+
+    if (UNLIKELY((fds = realloc(poller->fds, sizeof(struct pollfd) * capacity)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+      return false;
+    }
+
+    poller->fds = fds;
+
+    if (UNLIKELY((entries = realloc(poller->entries, sizeof(PollerEntry) * capacity)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+      return false;
+    }
+
+    poller->entries = entries;
+    poller->capacity = capacity;
+  }
+
+  poller->fds[poller->count].fd = fd;
+  poller->fds[poller->count].events = private_poller_to_native(condition);
+  poller->fds[poller->count].revents = 0;
+  poller->entries[poller->count].data = data;
+  poller->entries[poller->count].oneshot = oneshot;
+  poller->count++;
+
+  return true;
+}
+
+static void private_poller_delete(Poller *poller, int32_t index) {
+  poller->count--;
+  poller->fds[index] = poller->fds[poller->count];
+  poller->entries[index] = poller->entries[poller->count];
+}
+#endif
+
+Poller *poller_new(void) {
+  Poller *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Poller), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+    return NULL;
+  }
+
+  ret->capacity = POLLER_DEFAULT_CAPACITY;
+
+#ifdef POLLER_USE_EPOLL
+  if (UNLIKELY((ret->fd = epoll_create1(EPOLL_CLOEXEC)) < 0)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_net()),
+      (int32_t)error_get_last_net(),
+      "Failed to call epoll_create1() to create poller"
+    );
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->events = calloc(sizeof(struct epoll_event), ret->capacity)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+    sys_close(ret->fd);
+    free(ret);
+    return NULL;
+  }
+#else
+  ret->fds = calloc(sizeof(struct pollfd), ret->capacity);
+  ret->entries = calloc(sizeof(PollerEntry), ret->capacity);
+
+  if (UNLIKELY(ret->fds == NULL || ret->entries == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+    free(ret->fds);
+    free(ret->entries);
+    free(ret);
+    return NULL;
+  }
+#endif
+
+  return ret;
+}
+
+bool poller_add(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data) {
+  if (UNLIKELY(poller == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  return private_poller_ctl(poller, EPOLL_CTL_ADD, socket_get_fd(socket),
+    private_poller_to_native(condition), data);
+#else
+  if (UNLIKELY(private_poller_find(poller, socket_get_fd(socket)) >= 0)) {
+    error_set_error((int32_t)ERROR_IO_EXISTS, 0, "Socket is already registered in poller");
+    return false;
+  }
+
+  return private_poller_insert(poller, socket_get_fd(socket), condition, data, false);
+#endif
+}
+
+bool poller_modify(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data) {
+#ifdef POLLER_USE_POLL
+  int32_t index;
+#endif
+
+  if (UNLIKELY(poller == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  return private_poller_ctl(poller, EPOLL_CTL_MOD, socket_get_fd(socket),
+    private_poller_to_native(condition), data);
+#else
+  if (UNLIKELY((index = private_poller_find(poller, socket_get_fd(socket))) < 0)) {
+    error_set_error((int32_t)ERROR_IO_NOT_EXISTS, 0, "Socket is not registered in poller");
+    return false;
+  }
+
+  poller->fds[index].events = private_poller_to_native(condition);
+  poller->entries[index].data = data;
+  poller->entries[index].oneshot = false;
+
+  return true;
+#endif
+}
+
+bool poller_arm(Poller *poller, const Socket *socket, SocketIOCondition condition, void *data) {
+#ifdef POLLER_USE_EPOLL
+  struct epoll_event ev;
+#else
+  int32_t index;
+#endif
+
+  if (UNLIKELY(poller == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  /* A disarmed one-shot registration stays in the set until the fd is
+   * closed, so try to re-arm it first */
+  memset(&ev, 0, sizeof(ev));
+  ev.events = private_poller_to_native(condition) | EPOLLONESHOT;
+  ev.data.ptr = data;
+
+  if (epoll_ctl(poller->fd, EPOLL_CTL_MOD, socket_get_fd(socket), &ev) == 0) {
+    return true;
+  }
+
+  if (UNLIKELY(error_get_last_net() != ENOENT)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_net()),
+      (int32_t)error_get_last_net(),
+      "Failed to call epoll_ctl() on poller"
+    );
+    return false;
+  }
+
+  return private_poller_ctl(poller, EPOLL_CTL_ADD, socket_get_fd(socket),
+    private_poller_to_native(condition) | EPOLLONESHOT, data);
+#else
+  if ((index = private_poller_find(poller, socket_get_fd(socket))) >= 0) {
+    poller->fds[index].events = private_poller_to_native(condition);
+    poller->entries[index].data = data;
+    poller->entries[index].oneshot = true;
+    return true;
+  }
+
+  return private_poller_insert(poller, socket_get_fd(socket), condition, data, true);
+#endif
+}
+
+bool poller_remove(Poller *poller, const Socket *socket) {
+#ifdef POLLER_USE_POLL
+  int32_t index;
+#endif
+
+  if (UNLIKELY(poller == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  return private_poller_ctl(poller, EPOLL_CTL_DEL, socket_get_fd(socket), 0, NULL);
+#else
+  if (UNLIKELY((index = private_poller_find(poller, socket_get_fd(socket))) < 0)) {
+    error_set_error((int32_t)ERROR_IO_NOT_EXISTS, 0, "Socket is not registered in poller");
+    return false;
+  }
+
+  private_poller_delete(poller, index);
+
+  return true;
+#endif
+}
+
+int32_t poller_wait(Poller *poller, PollerEvent *events, int32_t max_events, int32_t timeout) {
+#ifdef POLLER_USE_EPOLL
+  struct epoll_event *native;
+#else
+  short revents;
+#endif
+  int32_t evret, i, count, wheel_timeout;
+
+  if (UNLIKELY(poller == NULL || events == NULL || max_events <= 0)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  /* Never sleep past the next timer expiration */
+  if (poller->wheel != NULL && (wheel_timeout = timer_wheel_get_timeout(poller->wheel)) >= 0 &&
+      (timeout < 0 || wheel_timeout < timeout)) {
+    timeout = wheel_timeout;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  if (max_events > poller->capacity) {
+    if (UNLIKELY((native = realloc(poller->events, sizeof(struct epoll_event) * max_events)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for poller");
+      return -1;
+    }
+
+    poller->events = native;
+    poller->capacity = max_events;
+  }
+
+  if ((evret = epoll_wait(poller->fd, poller->events, max_events, timeout)) < 0) {
+    if (UNLIKELY(error_get_last_net() != EINTR)) {
+      error_set_error(
+        (int32_t)error_get_io_from_system(error_get_last_net()),
+        (int32_t)error_get_last_net(),
+        "Failed to call epoll_wait() on poller"
+      );
+      return -1;
+    }
+
+    evret = 0;
+  }
+
+  for (i = 0; i < evret; i++) {
+    events[i].data = poller->events[i].data.ptr;
+    events[i].condition = 0;
+    events[i].error = (poller->events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+
+    if (poller->events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+      events[i].condition |= SOCKET_IO_CONDITION_POLLIN;
+    }
+
+    if (poller->events[i].events & EPOLLOUT) {
+      events[i].condition |= SOCKET_IO_CONDITION_POLLOUT;
+    }
+  }
+
+  count = evret;
+#else
+  if ((evret = poll(poller->fds, poller->count, timeout)) < 0) {
+  #ifdef EINTR
+    if (error_get_last_net() != EINTR) {
+  #endif
+      error_set_error(
+        (int32_t)error_get_io_from_system(error_get_last_net()),
+        (int32_t)error_get_last_net(),
+        "Failed to call poll() on poller"
+      );
+      return -1;
+  #ifdef EINTR
+    }
+  #endif
+
+    evret = 0;
+  }
+
+  count = 0;
+
+  /* Walk backwards so fired one-shot entries can be deleted in place */
+  for (i = poller->count - 1; i >= 0 && count < max_events && evret > 0; i--) {
+    if ((revents = poller->fds[i].revents) == 0) {
+      continue;
+    }
+
+    evret--;
+    poller->fds[i].revents = 0;
+
+    events[count].data = poller->entries[i].data;
+    events[count].condition = 0;
+    events[count].error = (revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+
+    if (revents & POLLIN) {
+      events[count].condition |= SOCKET_IO_CONDITION_POLLIN;
+    }
+
+    if (revents & POLLOUT) {
+      events[count].condition |= SOCKET_IO_CONDITION_POLLOUT;
+    }
+
+    count++;
+
+    if (poller->entries[i].oneshot) {
+      private_poller_delete(poller, i);
+    }
+  }
+#endif
+
+  if (poller->wheel != NULL) {
+    timer_wheel_advance(poller->wheel);
+  }
+
+  return count;
+}
+
+void poller_set_timer_wheel(Poller *poller, TimerWheel *wheel) {
+  if (UNLIKELY(poller == NULL)) {
+    return;
+  }
+
+  poller->wheel = wheel;
+}
+
+TimerWheel *poller_get_timer_wheel(const Poller *poller) {
+  if (UNLIKELY(poller == NULL)) {
+    return NULL;
+  }
+
+  return poller->wheel;
+}
+
+void poller_free(Poller *poller) {
+  if (UNLIKELY(poller == NULL)) {
+    return;
+  }
+
+#ifdef POLLER_USE_EPOLL
+  sys_close(poller->fd);
+  free(poller->events);
+#else
+  free(poller->fds);
+  free(poller->entries);
+#endif
+
+  free(poller);
+}
@@ -0,0 +1,646 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "prefixtable.h"
+#include "thread.h"
+#include "error.h"
+
+#define PREFIX_TABLE_STRIDE 6
+#define PREFIX_TABLE_FANOUT (1 << PREFIX_TABLE_STRIDE)
+#define PREFIX_TABLE_NONE   0
+
+typedef enum {
+  PREFIX_TABLE_INET  = 0,
+  PREFIX_TABLE_INET6 = 1
+} PrefixTableFamily;
+
+/* Writer side binary trie, node 0 is unused so index 0 means no child */
+typedef struct {
+  uint32_t child[2];
+  uint32_t value;
+} PrefixTableBit;
+
+/* Poptrie node: vector marks slots with a child node, leafvec marks where
+ * runs of equal leaves start. Children and leaves are stored contiguously
+ * from base1 and base0 and indexed by popcount. */
+typedef struct {
+  uint64_t vector;
+  uint64_t leafvec;
+  uint32_t base0;
+  uint32_t base1;
+} PrefixTableNode;
+
+typedef struct {
+  PrefixTableNode *nodes;
+  uint32_t *leaves;
+  uint32_t node_count;
+  uint32_t node_capacity;
+  uint32_t leaf_count;
+  uint32_t leaf_capacity;
+} PrefixTableTrie;
+
+typedef struct {
+  PrefixTableTrie tries[2];
+} PrefixTableSnapshot;
+
+struct PrefixTable {
+  _Atomic(PrefixTableSnapshot *) snapshot;
+  /* Readers register under the generation parity they saw, commit()
+   * flips the generation twice and waits for both sides to drain */
+  atomic_uint_fast64_t generation;
+  char pad0[CACHE_LINE_SIZE];
+  atomic_size_t readers[2];
+  char pad1[CACHE_LINE_SIZE];
+  Mutex *lock;
+  PrefixTableBit *bits;
+  uint32_t bit_count;
+  uint32_t bit_capacity;
+  uint32_t bit_free;
+  uint32_t roots[2];
+  size_t count;
+};
+
+static inline uint32_t private_prefix_table_popcount(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (uint32_t)__builtin_popcountll(value);
+#else
+  value = value - ((value >> 1) & 0x5555555555555555ull);
+  value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+  value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0full;
+
+  return (uint32_t)((value * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/* Six key bits starting at bit offset (counted from the most significant
+ * bit), keys are zero padded past their width */
+static inline uint32_t private_prefix_table_chunk(uint64_t hi, uint64_t lo, uint32_t offset) {
+  if (offset <= 64 - PREFIX_TABLE_STRIDE) {
+    return (uint32_t)(hi >> (64 - PREFIX_TABLE_STRIDE - offset)) & (PREFIX_TABLE_FANOUT - 1);
+  }
+
+  if (offset < 64) {
+    return (uint32_t)((hi << (offset - (64 - PREFIX_TABLE_STRIDE))) |
+                      (lo >> (128 - PREFIX_TABLE_STRIDE - offset))) & (PREFIX_TABLE_FANOUT - 1);
+  }
+
+  offset -= 64;
+
+  if (offset <= 64 - PREFIX_TABLE_STRIDE) {
+    return (uint32_t)(lo >> (64 - PREFIX_TABLE_STRIDE - offset)) & (PREFIX_TABLE_FANOUT - 1);
+  }
+
+  return (uint32_t)(lo << (offset - (64 - PREFIX_TABLE_STRIDE))) & (PREFIX_TABLE_FANOUT - 1);
+}
+
+static inline uint32_t private_prefix_table_bit(uint64_t hi, uint64_t lo, uint32_t offset) {
+  return offset < 64 ? (uint32_t)(hi >> (63 - offset)) & 1 : (uint32_t)(lo >> (127 - offset)) & 1;
+}
+
+static inline uint64_t private_prefix_table_read64(const uint8_t *data) {
+  return ((uint64_t)data[0] << 56) | ((uint64_t)data[1] << 48) | ((uint64_t)data[2] << 40) |
+         ((uint64_t)data[3] << 32) | ((uint64_t)data[4] << 24) | ((uint64_t)data[5] << 16) |
+         ((uint64_t)data[6] << 8) | (uint64_t)data[7];
+}
+
+/* Loads the key into two words, IPv4 sits in the top 32 bits. IPv4-mapped
+ * IPv6 addresses (dual-stack listeners) are looked up as IPv4. */
+static bool private_prefix_table_key(SocketFamily family, const uint8_t *address, PrefixTableFamily *type,
+                                     uint64_t *hi, uint64_t *lo) {
+  static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+  if (family == SOCKET_FAMILY_INET) {
+    *type = PREFIX_TABLE_INET;
+    *hi = ((uint64_t)address[0] << 56) | ((uint64_t)address[1] << 48) |
+          ((uint64_t)address[2] << 40) | ((uint64_t)address[3] << 32);
+    *lo = 0;
+    return true;
+  }
+
+  if (family == SOCKET_FAMILY_INET6) {
+    if (memcmp(address, mapped, sizeof(mapped)) == 0) {
+      return private_prefix_table_key(SOCKET_FAMILY_INET, address + 12, type, hi, lo);
+    }
+
+    *type = PREFIX_TABLE_INET6;
+    *hi = private_prefix_table_read64(address);
+    *lo = private_prefix_table_read64(address + 8);
+    return true;
+  }
+
+  return false;
+}
+
+static uint32_t private_prefix_table_bit_new(PrefixTable *table) {
+  PrefixTableBit *bits;
+  uint32_t ret, capacity;
+
+  if ((ret = table->bit_free) != 0) {
+    table->bit_free = table->bits[ret].child[0];
+  } else {
+    if (table->bit_count >= table->bit_capacity) {
+      capacity = table->bit_capacity ? table->bit_capacity * 2 : 1024;
+
+      if (UNLIKELY((bits = realloc(table->bits, sizeof(PrefixTableBit) * capacity)) == NULL)) {
+        error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for prefix table");
+        return 0;
+      }
+
+      table->bits = bits;
+      table->bit_capacity = capacity;
+    }
+
+    ret = table->bit_count++;
+  }
+
+  memset(&table->bits[ret], 0, sizeof(PrefixTableBit));
+
+  return ret;
+}
+
+static void private_prefix_table_trie_clear(PrefixTableTrie *trie) {
+  free(trie->nodes);
+  free(trie->leaves);
+  memset(trie, 0, sizeof(PrefixTableTrie));
+}
+
+static void private_prefix_table_snapshot_free(PrefixTableSnapshot *snapshot) {
+  if (snapshot == NULL) {
+    return;
+  }
+
+  private_prefix_table_trie_clear(&snapshot->tries[PREFIX_TABLE_INET]);
+  private_prefix_table_trie_clear(&snapshot->tries[PREFIX_TABLE_INET6]);
+  free(snapshot);
+}
+
+static bool private_prefix_table_reserve(PrefixTableTrie *trie, uint32_t nodes, uint32_t leaves) {
+  PrefixTableNode *new_nodes;
+  uint32_t *new_leaves;
+  uint32_t capacity;
+
+  if (trie->node_count + nodes > trie->node_capacity) {
+    for (capacity = trie->node_capacity ? trie->node_capacity : 64; capacity < trie->node_count + nodes; capacity *= 2);
+
+    if (UNLIKELY((new_nodes = realloc(trie->nodes, sizeof(PrefixTableNode) * capacity)) == NULL)) {
+      return false;
+    }
+
+    trie->nodes = new_nodes;
+    trie->node_capacity = capacity;
+  }
+
+  if (trie->leaf_count + leaves > trie->leaf_capacity) {
+    for (capacity = trie->leaf_capacity ? trie->leaf_capacity : 64; capacity < trie->leaf_count + leaves; capacity *= 2);
+
+    if (UNLIKELY((new_leaves = realloc(trie->leaves, sizeof(uint32_t) * capacity)) == NULL)) {
+      return false;
+    }
+
+    trie->leaves = new_leaves;
+    trie->leaf_capacity = capacity;
+  }
+
+  return true;
+}
+
+/* Fills the reserved poptrie node from the binary subtree at bit, with
+ * leaf pushing: every slot without a child gets the longest match seen
+ * on the way down, which is why inherited is passed along */
+static bool private_prefix_table_compile(const PrefixTable *table, PrefixTableTrie *trie, uint32_t index,
+                                         uint32_t bit, uint32_t inherited) {
+  uint32_t ends[PREFIX_TABLE_FANOUT], best[PREFIX_TABLE_FANOUT];
+  uint32_t slot, depth, node, children, leaves, last, base1, i;
+  uint64_t vector, leafvec;
+
+  vector = 0;
+  leafvec = 0;
+  children = 0;
+  leaves = 0;
+  last = 0;
+
+  for (slot = 0; slot < PREFIX_TABLE_FANOUT; slot++) {
+    node = bit;
+    best[slot] = inherited;
+
+    for (depth = 0; depth < PREFIX_TABLE_STRIDE && node != PREFIX_TABLE_NONE; depth++) {
+      node = table->bits[node].child[(slot >> (PREFIX_TABLE_STRIDE - 1 - depth)) & 1];
+
+      if (node != PREFIX_TABLE_NONE && table->bits[node].value != 0) {
+        best[slot] = table->bits[node].value;
+      }
+    }
+
+    ends[slot] = node;
+
+    if (node != PREFIX_TABLE_NONE &&
+        (table->bits[node].child[0] != PREFIX_TABLE_NONE || table->bits[node].child[1] != PREFIX_TABLE_NONE)) {
+      vector |= (uint64_t) 1 << slot;
+      children++;
+    } else if (leaves == 0 || best[slot] != last) {
+      leafvec |= (uint64_t) 1 << slot;
+      last = best[slot];
+      leaves++;
+    }
+  }
+
+  if (UNLIKELY(private_prefix_table_reserve(trie, children, leaves) == false)) {
+    return false;
+  }
+
+  base1 = trie->node_count;
+  trie->node_count += children;
+  trie->nodes[index].vector = vector;
+  trie->nodes[index].leafvec = leafvec;
+  trie->nodes[index].base0 = trie->leaf_count;
+  trie->nodes[index].base1 = base1;
+
+  for (slot = 0; slot < PREFIX_TABLE_FANOUT; slot++) {
+    if (leafvec & ((uint64_t) 1 << slot)) {
+      trie->leaves[trie->leaf_count++] = best[slot];
+    }
+  }
+
+  for (slot = 0, i = 0; slot < PREFIX_TABLE_FANOUT; slot++) {
+    if ((vector & ((uint64_t) 1 << slot)) &&
+        UNLIKELY(private_prefix_table_compile(table, trie, base1 + i++, ends[slot], best[slot]) == false)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool private_prefix_table_build(const PrefixTable *table, PrefixTableTrie *trie, uint32_t root) {
+  memset(trie, 0, sizeof(PrefixTableTrie));
+
+  if (UNLIKELY(private_prefix_table_reserve(trie, 1, 0) == false)) {
+    return false;
+  }
+
+  trie->node_count = 1;
+
+  if (UNLIKELY(private_prefix_table_compile(table, trie, 0, root,
+                                            root != PREFIX_TABLE_NONE ? table->bits[root].value : 0) == false)) {
+    private_prefix_table_trie_clear(trie);
+    return false;
+  }
+
+  return true;
+}
+
+static uint32_t private_prefix_table_find(const PrefixTableTrie *trie, uint64_t hi, uint64_t lo) {
+  const PrefixTableNode *node;
+  uint64_t bit;
+  uint32_t offset;
+
+  node = trie->nodes;
+  offset = 0;
+  bit = (uint64_t) 1 << private_prefix_table_chunk(hi, lo, 0);
+
+  while (node->vector & bit) {
+    node = &trie->nodes[node->base1 + private_prefix_table_popcount(node->vector & ((bit << 1) - 1)) - 1];
+    offset += PREFIX_TABLE_STRIDE;
+    bit = (uint64_t) 1 << private_prefix_table_chunk(hi, lo, offset);
+  }
+
+  return trie->leaves[node->base0 + private_prefix_table_popcount(node->leafvec & ((bit << 1) - 1)) - 1];
+}
+
+PrefixTable *prefix_table_new(void) {
+  PrefixTable *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(PrefixTable), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for prefix table");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->lock = mutex_new()) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  atomic_init(&ret->snapshot, NULL);
+  atomic_init(&ret->generation, 0);
+  atomic_init(&ret->readers[0], 0);
+  atomic_init(&ret->readers[1], 0);
+
+  /* Reserve node 0 so it can stand for a missing child */
+  ret->bit_count = 1;
+
+  if (UNLIKELY(prefix_table_commit(ret) == false)) {
+    prefix_table_free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+bool prefix_table_add(PrefixTable *table, SocketFamily family, const uint8_t *address, uint32_t prefix_len,
+                      uint32_t value) {
+  PrefixTableFamily type;
+  uint64_t hi, lo;
+  uint32_t node, next, depth, side;
+
+  if (UNLIKELY(table == NULL || address == NULL || value == 0 ||
+               private_prefix_table_key(family, address, &type, &hi, &lo) == false ||
+               prefix_len > (type == PREFIX_TABLE_INET ? 32u : 128u))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  /* Mapped IPv6 prefixes shorter than the mapping can't be stored as IPv4 */
+  if (family == SOCKET_FAMILY_INET6 && type == PREFIX_TABLE_INET) {
+    if (prefix_len < 96) {
+      error_set_error((int32_t)ERROR_IO_NOT_SUPPORTED, 0, "IPv4-mapped prefixes must be at least /96");
+      return false;
+    }
+
+    prefix_len -= 96;
+  }
+
+  mutex_lock(table->lock);
+
+  if ((node = table->roots[type]) == PREFIX_TABLE_NONE) {
+    if (UNLIKELY((node = private_prefix_table_bit_new(table)) == PREFIX_TABLE_NONE)) {
+      mutex_unlock(table->lock);
+      return false;
+    }
+
+    table->roots[type] = node;
+  }
+
+  for (depth = 0; depth < prefix_len; depth++) {
+    side = private_prefix_table_bit(hi, lo, depth);
+
+    if ((next = table->bits[node].child[side]) == PREFIX_TABLE_NONE) {
+      if (UNLIKELY((next = private_prefix_table_bit_new(table)) == PREFIX_TABLE_NONE)) {
+        mutex_unlock(table->lock);
+        return false;
+      }
+
+      table->bits[node].child[side] = next;
+    }
+
+    node = next;
+  }
+
+  if (table->bits[node].value == 0) {
+    table->count++;
+  }
+
+  table->bits[node].value = value;
+
+  mutex_unlock(table->lock);
+
+  return true;
+}
+
+/* Accepts "address/length", a bare address is a host prefix */
+bool prefix_table_add_cidr(PrefixTable *table, const char *cidr, uint32_t value) {
+  const char *slash, *digit;
+  uint8_t address[16];
+  uint32_t prefix_len, max_len;
+  size_t len;
+  SocketFamily family;
+
+  if (UNLIKELY(cidr == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  len = (slash = strchr(cidr, '/')) != NULL ? (size_t)(slash - cidr) : strlen(cidr);
+
+  if (socket_address_parse_ipv4(cidr, len, address)) {
+    family = SOCKET_FAMILY_INET;
+    prefix_len = 32;
+  } else if (socket_address_parse_ipv6(cidr, len, address, NULL)) {
+    family = SOCKET_FAMILY_INET6;
+    prefix_len = 128;
+  } else {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid CIDR prefix");
+    return false;
+  }
+
+  /* Digits only up to the end of the string, checked as they accumulate
+   * so long inputs cannot wrap around */
+  if (slash != NULL) {
+    max_len = prefix_len;
+    prefix_len = 0;
+
+    for (digit = slash + 1; *digit >= '0' && *digit <= '9' && prefix_len <= max_len; digit++) {
+      prefix_len = prefix_len * 10 + (uint32_t)(*digit - '0');
+    }
+
+    if (digit == slash + 1 || *digit != '\0' || prefix_len > max_len) {
+      error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid CIDR prefix length");
+      return false;
+    }
+  }
+
+  return prefix_table_add(table, family, address, prefix_len, value);
+}
+
+bool prefix_table_remove(PrefixTable *table, SocketFamily family, const uint8_t *address, uint32_t prefix_len) {
+  PrefixTableFamily type;
+  uint32_t path[129];
+  uint64_t hi, lo;
+  uint32_t node, depth;
+
+  if (UNLIKELY(table == NULL || address == NULL ||
+               private_prefix_table_key(family, address, &type, &hi, &lo) == false ||
+               prefix_len > (type == PREFIX_TABLE_INET ? 32u : 128u))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (family == SOCKET_FAMILY_INET6 && type == PREFIX_TABLE_INET) {
+    if (prefix_len < 96) {
+      return false;
+    }
+
+    prefix_len -= 96;
+  }
+
+  mutex_lock(table->lock);
+
+  node = table->roots[type];
+
+  for (depth = 0; depth < prefix_len && node != PREFIX_TABLE_NONE; depth++) {
+    path[depth] = node;
+    node = table->bits[node].child[private_prefix_table_bit(hi, lo, depth)];
+  }
+
+  if (node == PREFIX_TABLE_NONE || table->bits[node].value == 0) {
+    mutex_unlock(table->lock);
+    return false;
+  }
+
+  table->bits[node].value = 0;
+  table->count--;
+
+  /* Prune the branch back up to the last node still in use */
+  while (depth > 0 && table->bits[node].value == 0 &&
+         table->bits[node].child[0] == PREFIX_TABLE_NONE && table->bits[node].child[1] == PREFIX_TABLE_NONE) {
+    depth--;
+    table->bits[path[depth]].child[private_prefix_table_bit(hi, lo, depth)] = PREFIX_TABLE_NONE;
+    table->bits[node].child[0] = table->bit_free;
+    table->bit_free = node;
+    node = path[depth];
+  }
+
+  mutex_unlock(table->lock);
+
+  return true;
+}
+
+void prefix_table_clear(PrefixTable *table) {
+  if (UNLIKELY(table == NULL)) {
+    return;
+  }
+
+  mutex_lock(table->lock);
+  table->bit_count = 1;
+  table->bit_free = PREFIX_TABLE_NONE;
+  table->roots[PREFIX_TABLE_INET] = PREFIX_TABLE_NONE;
+  table->roots[PREFIX_TABLE_INET6] = PREFIX_TABLE_NONE;
+  table->count = 0;
+  mutex_unlock(table->lock);
+}
+
+bool prefix_table_commit(PrefixTable *table) {
+  PrefixTableSnapshot *snapshot, *old;
+  uint_fast64_t generation;
+  int32_t i;
+
+  if (UNLIKELY(table == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((snapshot = calloc(sizeof(PrefixTableSnapshot), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for prefix table");
+    return false;
+  }
+
+  mutex_lock(table->lock);
+
+  if (UNLIKELY(private_prefix_table_build(table, &snapshot->tries[PREFIX_TABLE_INET],
+                                          table->roots[PREFIX_TABLE_INET]) == false) ||
+      UNLIKELY(private_prefix_table_build(table, &snapshot->tries[PREFIX_TABLE_INET6],
+                                          table->roots[PREFIX_TABLE_INET6]) == false)) {
+    mutex_unlock(table->lock);
+    private_prefix_table_snapshot_free(snapshot);
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for prefix table");
+    return false;
+  }
+
+  old = atomic_exchange(&table->snapshot, snapshot);
+
+  /* Wait out every reader that could still see the old snapshot */
+  for (i = 0; i < 2; i++) {
+    generation = atomic_fetch_add(&table->generation, 1);
+
+    while (atomic_load(&table->readers[generation & 1]) != 0) {
+      thread_yield();
+    }
+  }
+
+  mutex_unlock(table->lock);
+
+  private_prefix_table_snapshot_free(old);
+
+  return true;
+}
+
+size_t prefix_table_get_count(const PrefixTable *table) {
+  if (UNLIKELY(table == NULL)) {
+    return 0;
+  }
+
+  return table->count;
+}
+
+uint32_t prefix_table_lookup(PrefixTable *table, SocketFamily family, const uint8_t *address) {
+  PrefixTableSnapshot *snapshot;
+  PrefixTableFamily type;
+  uint64_t hi, lo;
+  uint32_t ret;
+  size_t side;
+
+  if (UNLIKELY(table == NULL || address == NULL) ||
+      UNLIKELY(private_prefix_table_key(family, address, &type, &hi, &lo) == false)) {
+    return 0;
+  }
+
+  side = (size_t)(atomic_load(&table->generation) & 1);
+  atomic_fetch_add(&table->readers[side], 1);
+
+  snapshot = atomic_load(&table->snapshot);
+  ret = private_prefix_table_find(&snapshot->tries[type], hi, lo);
+
+  atomic_fetch_sub_explicit(&table->readers[side], 1, memory_order_release);
+
+  return ret;
+}
+
+uint32_t prefix_table_lookup_key(PrefixTable *table, const SocketAddressKey *key) {
+  if (UNLIKELY(key == NULL)) {
+    return 0;
+  }
+
+  if (key->family == 4) {
+    return prefix_table_lookup(table, SOCKET_FAMILY_INET, key->address + 12);
+  }
+
+  return prefix_table_lookup(table, SOCKET_FAMILY_INET6, key->address);
+}
+
+SocketAcceptVerdict prefix_table_accept_filter(const SocketAddressKey *peer, void *table) {
+  uint32_t ret;
+
+  if ((ret = prefix_table_lookup_key((PrefixTable *) table, peer)) == 0) {
+    return SOCKET_ACCEPT_ALLOW;
+  }
+
+  return (SocketAcceptVerdict) ret;
+}
+
+void prefix_table_free(PrefixTable *table) {
+  if (UNLIKELY(table == NULL)) {
+    return;
+  }
+
+  private_prefix_table_snapshot_free(atomic_load(&table->snapshot));
+  mutex_free(table->lock);
+  free(table->bits);
+  free(table);
+}
@@ -0,0 +1,458 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  /* splice() */
+  #define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include "relay.h"
+#include "poller.h"
+#include "error.h"
+
+#if defined(__linux__)
+  #define RELAY_USE_SPLICE
+  #include <fcntl.h>
+  #include <errno.h>
+  #include <unistd.h>
+#endif
+
+/* Bytes held per direction, the default Linux pipe capacity */
+#define RELAY_BUFFER_SIZE 65536
+
+/* Bounds one relay_transfer() call so a fast pair can't starve the rest
+ * of an event loop */
+#define RELAY_MAX_ROUNDS 16
+
+typedef struct {
+  Socket *source;
+  Socket *sink;
+#ifdef RELAY_USE_SPLICE
+  int32_t pipe[2];
+#endif
+  char *buffer;
+  size_t start;
+  size_t pending;
+  uint64_t bytes;
+  bool eof;
+  bool closed;
+} RelayLink;
+
+struct Relay {
+  RelayLink links[RELAY_DIRECTIONS];
+  Poller *poller;
+  bool registered[RELAY_DIRECTIONS];
+  bool zero_copy;
+};
+
+static ssize_t private_relay_fill(Relay *relay, RelayLink *link);
+static ssize_t private_relay_drain(Relay *relay, RelayLink *link);
+#ifdef RELAY_USE_SPLICE
+static bool private_relay_use_buffers(Relay *relay);
+#endif
+
+/* Returns bytes read from the source, 0 at end of stream or when nothing
+ * is available, -1 on error */
+static ssize_t private_relay_fill(Relay *relay, RelayLink *link) {
+  ssize_t ret;
+
+#ifdef RELAY_USE_SPLICE
+  if (relay->zero_copy) {
+    ret = splice(socket_get_fd(link->source), NULL, link->pipe[1], NULL,
+                 RELAY_BUFFER_SIZE - link->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+
+      /* Not a socket splice() can read from, fall back before the first
+       * byte was moved */
+      if (errno == EINVAL && link->bytes == 0 && link->pending == 0 && private_relay_use_buffers(relay)) {
+        return private_relay_fill(relay, link);
+      }
+
+      error_set_error(
+        (int32_t)error_get_io_from_system(error_get_last_system()),
+        error_get_last_system(),
+        "Failed to call splice() on socket"
+      );
+      return -1;
+    }
+
+    link->eof = ret == 0;
+    link->pending += (size_t) ret;
+
+    return ret;
+  }
+#else
+  UNUSED(relay);
+#endif
+
+  /* The buffer is only refilled once drained, so reads stay contiguous */
+  if (link->pending > 0) {
+    return 0;
+  }
+
+  if ((ret = socket_receive(link->source, link->buffer, RELAY_BUFFER_SIZE)) < 0) {
+    return error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK ? 0 : -1;
+  }
+
+  link->eof = ret == 0;
+  link->start = 0;
+  link->pending = (size_t) ret;
+
+  return ret;
+}
+
+/* Returns bytes written to the sink, 0 when it is full, -1 on error */
+static ssize_t private_relay_drain(Relay *relay, RelayLink *link) {
+  ssize_t ret;
+
+#ifdef RELAY_USE_SPLICE
+  if (relay->zero_copy) {
+    ret = splice(link->pipe[0], NULL, socket_get_fd(link->sink), NULL,
+                 link->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+
+      error_set_error(
+        (int32_t)error_get_io_from_system(error_get_last_system()),
+        error_get_last_system(),
+        "Failed to call splice() on socket"
+      );
+      return -1;
+    }
+
+    link->pending -= (size_t) ret;
+    link->bytes += (uint64_t) ret;
+
+    return ret;
+  }
+#else
+  UNUSED(relay);
+#endif
+
+  if ((ret = socket_send(link->sink, link->buffer + link->start, link->pending)) < 0) {
+    return error_get_code() == (int32_t)ERROR_IO_WOULD_BLOCK ? 0 : -1;
+  }
+
+  link->start += (size_t) ret;
+  link->pending -= (size_t) ret;
+  link->bytes += (uint64_t) ret;
+
+  return ret;
+}
+
+#ifdef RELAY_USE_SPLICE
+static bool private_relay_use_buffers(Relay *relay) {
+  int32_t i;
+
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+    if (relay->links[i].pending > 0) {
+      return false;
+    }
+  }
+
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+    if (UNLIKELY((relay->links[i].buffer = malloc(RELAY_BUFFER_SIZE)) == NULL)) {
+      return false;
+    }
+  }
+
+  relay->zero_copy = false;
+
+  return true;
+}
+#endif
+
+Relay *relay_new(Socket *first, Socket *second) {
+  Relay *ret;
+  int32_t i;
+
+  if (UNLIKELY(first == NULL || second == NULL || first == second)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(Relay), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for relay");
+    return NULL;
+  }
+
+  ret->links[RELAY_DIRECTION_FORWARD].source = first;
+  ret->links[RELAY_DIRECTION_FORWARD].sink = second;
+  ret->links[RELAY_DIRECTION_BACKWARD].source = second;
+  ret->links[RELAY_DIRECTION_BACKWARD].sink = first;
+
+#ifdef RELAY_USE_SPLICE
+  ret->zero_copy = true;
+
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+    ret->links[i].pipe[0] = ret->links[i].pipe[1] = -1;
+
+    if (UNLIKELY(pipe2(ret->links[i].pipe, O_NONBLOCK | O_CLOEXEC) != 0)) {
+      error_set_error(
+        (int32_t)error_get_io_from_system(error_get_last_system()),
+        error_get_last_system(),
+        "Failed to create pipe for relay"
+      );
+      relay_free(ret);
+      return NULL;
+    }
+
+    /* The fill size assumes the pipe holds a full buffer */
+    if (fcntl(ret->links[i].pipe[1], F_GETPIPE_SZ) < RELAY_BUFFER_SIZE &&
+        fcntl(ret->links[i].pipe[1], F_SETPIPE_SZ, RELAY_BUFFER_SIZE) < RELAY_BUFFER_SIZE) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to resize pipe for relay");
+      relay_free(ret);
+      return NULL;
+    }
+  }
+#else
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+    if (UNLIKELY((ret->links[i].buffer = malloc(RELAY_BUFFER_SIZE)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for relay");
+      relay_free(ret);
+      return NULL;
+    }
+  }
+#endif
+
+  socket_set_blocking(first, false);
+  socket_set_blocking(second, false);
+
+  return ret;
+}
+
+/* Moves whatever can be moved without blocking, returns the bytes written
+ * to the sink or -1 on error. Pending data is never dropped, so the call
+ * can be repeated once the sink is writable again. */
+ssize_t relay_transfer(Relay *relay, RelayDirection direction) {
+  RelayLink *link;
+  ssize_t filled, drained, ret = 0;
+  int32_t round;
+
+  if (UNLIKELY(relay == NULL || (int32_t) direction < 0 || direction >= RELAY_DIRECTIONS)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  link = &relay->links[direction];
+
+  for (round = 0; round < RELAY_MAX_ROUNDS && link->closed == false; round++) {
+    filled = 0;
+
+    if (link->eof == false && link->pending < RELAY_BUFFER_SIZE &&
+        (filled = private_relay_fill(relay, link)) < 0) {
+      return -1;
+    }
+
+    drained = 0;
+
+    if (link->pending > 0 && (drained = private_relay_drain(relay, link)) < 0) {
+      return -1;
+    }
+
+    ret += drained;
+
+    if (link->eof && link->pending == 0) {
+      link->closed = true;
+
+      if (socket_shutdown(link->sink, false, true) == false &&
+          error_get_code() != (int32_t)ERROR_IO_NOT_CONNECTED) {
+        return -1;
+      }
+
+      break;
+    }
+
+    if (filled == 0 && drained == 0) {
+      break;
+    }
+  }
+
+  return ret;
+}
+
+/* Transfers both directions, returns the bytes written or -1 on error */
+ssize_t relay_pump(Relay *relay) {
+  ssize_t forward, backward;
+
+  if ((forward = relay_transfer(relay, RELAY_DIRECTION_FORWARD)) < 0 ||
+      (backward = relay_transfer(relay, RELAY_DIRECTION_BACKWARD)) < 0) {
+    return -1;
+  }
+
+  return forward + backward;
+}
+
+/* Relays until both directions reached end of stream, for a thread per
+ * connection pair */
+bool relay_run_until(Relay *relay, uint64_t deadline) {
+  PollerEvent events[RELAY_DIRECTIONS];
+  SocketIOCondition condition;
+  Socket *socket;
+  uint64_t now;
+  int32_t i;
+
+  if (UNLIKELY(relay == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (relay->poller == NULL && UNLIKELY((relay->poller = poller_new()) == NULL)) {
+    return false;
+  }
+
+  for (;;) {
+    if (relay_pump(relay) < 0) {
+      return false;
+    }
+
+    if (relay_is_done(relay)) {
+      return true;
+    }
+
+    if ((now = sys_time_monotonic()) >= deadline) {
+      error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Deadline exceeded while relaying");
+      return false;
+    }
+
+    /* Sockets with nothing to wait for leave the poller, a hung up one
+     * would otherwise keep reporting */
+    for (i = 0; i < RELAY_DIRECTIONS; i++) {
+      socket = relay->links[i].source;
+      condition = relay_get_condition(relay, socket);
+
+      if (condition == 0 && relay->registered[i]) {
+        relay->registered[i] = false;
+        poller_remove(relay->poller, socket);
+      } else if (condition != 0 && relay->registered[i]) {
+        if (UNLIKELY(poller_modify(relay->poller, socket, condition, NULL) == false)) {
+          return false;
+        }
+      } else if (condition != 0) {
+        if (UNLIKELY(poller_add(relay->poller, socket, condition, NULL) == false)) {
+          return false;
+        }
+
+        relay->registered[i] = true;
+      }
+    }
+
+    if (poller_wait(relay->poller, events, RELAY_DIRECTIONS,
+        (deadline - now) > INT32_MAX ? INT32_MAX : (int32_t)(deadline - now)) < 0) {
+      return false;
+    }
+  }
+}
+
+/* Conditions to wait for on one of the sockets before the next transfer */
+SocketIOCondition relay_get_condition(const Relay *relay, const Socket *socket) {
+  const RelayLink *link;
+  int32_t ret = 0, i;
+
+  if (UNLIKELY(relay == NULL || socket == NULL)) {
+    return 0;
+  }
+
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+    link = &relay->links[i];
+
+    if (link->closed) {
+      continue;
+    }
+
+    if (link->source == socket && link->eof == false && link->pending < RELAY_BUFFER_SIZE) {
+      ret |= SOCKET_IO_CONDITION_POLLIN;
+    }
+
+    if (link->sink == socket && link->pending > 0) {
+      ret |= SOCKET_IO_CONDITION_POLLOUT;
+    }
+  }
+
+  return (SocketIOCondition) ret;
+}
+
+/* True once the source of the direction ended and everything before it
+ * was written */
+bool relay_is_closed(const Relay *relay, RelayDirection direction) {
+  if (UNLIKELY(relay == NULL || (int32_t) direction < 0 || direction >= RELAY_DIRECTIONS)) {
+    return false;
+  }
+
+  return relay->links[direction].closed;
+}
+
+bool relay_is_done(const Relay *relay) {
+  return relay_is_closed(relay, RELAY_DIRECTION_FORWARD) && relay_is_closed(relay, RELAY_DIRECTION_BACKWARD);
+}
+
+bool relay_is_zero_copy(const Relay *relay) {
+  if (UNLIKELY(relay == NULL)) {
+    return false;
+  }
+
+  return relay->zero_copy;
+}
+
+/* Bytes written to the sink of the direction */
+uint64_t relay_get_bytes(const Relay *relay, RelayDirection direction) {
+  if (UNLIKELY(relay == NULL || (int32_t) direction < 0 || direction >= RELAY_DIRECTIONS)) {
+    return 0;
+  }
+
+  return relay->links[direction].bytes;
+}
+
+void relay_free(Relay *relay) {
+  int32_t i;
+
+  if (UNLIKELY(relay == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < RELAY_DIRECTIONS; i++) {
+#ifdef RELAY_USE_SPLICE
+    if (relay->links[i].pipe[0] >= 0) {
+      close(relay->links[i].pipe[0]);
+      close(relay->links[i].pipe[1]);
+    }
+#endif
+    free(relay->links[i].buffer);
+  }
+
+  poller_free(relay->poller);
+  free(relay);
+}
@@ -0,0 +1,1021 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "resolver.h"
+#include "poller.h"
+#include "timerwheel.h"
+#include "error.h"
+
+#define RESOLVER_DEFAULT_TIMEOUT  1000
+#define RESOLVER_DEFAULT_ATTEMPTS 3
+#define RESOLVER_DNS_PORT         53
+/* Seconds, used for negative answers without an SOA record */
+#define RESOLVER_NEGATIVE_TTL     30
+#define RESOLVER_MAX_TTL          86400
+#define RESOLVER_CACHE_BUCKETS    256
+#define RESOLVER_MAX_CACHE        1024
+#define RESOLVER_MAX_ADDRESSES    16
+#define RESOLVER_MAX_NAME         253
+#define RESOLVER_PACKET_SIZE      512
+#define RESOLVER_HEADER_SIZE      12
+#define RESOLVER_MAX_EVENTS       16
+
+#define RESOLVER_TYPE_A     1
+#define RESOLVER_TYPE_SOA   6
+#define RESOLVER_TYPE_AAAA  28
+#define RESOLVER_CLASS_IN   1
+
+#define RESOLVER_RCODE_NOERROR  0
+#define RESOLVER_RCODE_NXDOMAIN 3
+
+typedef enum {
+  RESOLVER_ANSWER_OK       = 0,
+  RESOLVER_ANSWER_NEGATIVE = 1,
+  RESOLVER_ANSWER_FAILED   = 2,
+  RESOLVER_ANSWER_IGNORE   = 3
+} ResolverAnswer;
+
+typedef struct {
+  SocketFamily family;
+  uint8_t address[16];
+} ResolverRecord;
+
+typedef struct ResolverWaiter {
+  ResolverFunc func;
+  void *data;
+  uint16_t port;
+  struct ResolverWaiter *next;
+} ResolverWaiter;
+
+typedef struct ResolverEntry {
+  char name[RESOLVER_MAX_NAME + 1];
+  uint32_t hash;
+  bool resolving;
+  uint64_t expires;
+  ResolverRecord records[RESOLVER_MAX_ADDRESSES];
+  size_t count;
+  /* Seconds, lowest TTLs seen while the queries are running, the
+   * negative one stays UINT32_MAX without an SOA record */
+  uint32_t ttl;
+  uint32_t negative_ttl;
+  size_t pending;
+  size_t failed;
+  ResolverWaiter *waiters;
+  struct ResolverEntry *next;
+} ResolverEntry;
+
+/* Every query has its own socket, so besides the random ID a spoofed
+ * answer has to hit the random source port the system picked for it */
+typedef struct ResolverQuery {
+  Resolver *resolver;
+  ResolverEntry *entry;
+  Socket *socket;
+  Timer *timer;
+  uint16_t id;
+  uint16_t type;
+  uint32_t attempts;
+  size_t length;
+  uint8_t packet[RESOLVER_PACKET_SIZE];
+  struct ResolverQuery *next;
+} ResolverQuery;
+
+struct Resolver {
+  SocketAddress *server;
+  Poller *poller;
+  TimerWheel *wheel;
+  PollerEvent events[RESOLVER_MAX_EVENTS];
+  ResolverEntry *buckets[RESOLVER_CACHE_BUCKETS];
+  size_t cache_count;
+  ResolverQuery *queries;
+  uint32_t timeout;
+  uint32_t attempts;
+};
+
+typedef struct {
+  SocketAddress **addresses;
+  size_t count;
+  int32_t code;
+  int32_t native_code;
+  bool done;
+} ResolverLookup;
+
+static uint16_t private_resolver_read16(const uint8_t *data) {
+  return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+static uint32_t private_resolver_read32(const uint8_t *data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void private_resolver_write16(uint8_t *data, uint16_t value) {
+  data[0] = (uint8_t)(value >> 8);
+  data[1] = (uint8_t)(value & 0xff);
+}
+
+static uint8_t private_resolver_lower(uint8_t c) {
+  return (c >= 'A' && c <= 'Z') ? (uint8_t)(c + ('a' - 'A')) : c;
+}
+
+/* FNV-1a over the normalized name */
+static uint32_t private_resolver_hash(const char *name) {
+  uint32_t ret = 2166136261u;
+
+  while (*name != '\0') {
+    ret = (ret ^ (uint8_t)*name++) * 16777619u;
+  }
+
+  return ret;
+}
+
+/* Lowercases the name and strips the root label, fails on names which
+ * can't go into a query */
+static bool private_resolver_normalize(const char *name, char *dest) {
+  size_t len, label, i;
+
+  len = strlen(name);
+
+  if (len > 0 && name[len - 1] == '.') {
+    len--;
+  }
+
+  if (len == 0 || len > RESOLVER_MAX_NAME) {
+    return false;
+  }
+
+  for (i = 0, label = 0; i < len; i++) {
+    if (name[i] == '.') {
+      if (label == 0) {
+        return false;
+      }
+
+      label = 0;
+    } else if (++label > 63) {
+      return false;
+    }
+
+    dest[i] = (char)private_resolver_lower((uint8_t)name[i]);
+  }
+
+  dest[len] = '\0';
+
+  return label > 0;
+}
+
+/* Skips a possibly compressed name, returns the offset past it or 0 */
+static size_t private_resolver_skip_name(const uint8_t *packet, size_t length, size_t offset) {
+  while (offset < length) {
+    if (packet[offset] == 0) {
+      return offset + 1;
+    }
+
+    if ((packet[offset] & 0xc0) == 0xc0) {
+      return offset + 2 <= length ? offset + 2 : 0;
+    }
+
+    offset += packet[offset] + 1;
+  }
+
+  return 0;
+}
+
+static SocketAddress *private_resolver_make_address(const ResolverRecord *record, uint16_t port) {
+  struct sockaddr_in sin;
+#ifdef AF_INET6
+  struct sockaddr_in6 sin6;
+
+  if (record->family == SOCKET_FAMILY_INET6) {
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(port);
+    memcpy(&sin6.sin6_addr, record->address, 16);
+
+    return socket_address_new_from_native(&sin6, sizeof(sin6));
+  }
+#endif
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  memcpy(&sin.sin_addr, record->address, 4);
+
+  return socket_address_new_from_native(&sin, sizeof(sin));
+}
+
+static void private_resolver_entry_remove(Resolver *resolver, ResolverEntry *entry) {
+  ResolverEntry **link;
+
+  for (link = &resolver->buckets[entry->hash % RESOLVER_CACHE_BUCKETS]; *link != NULL; link = &(*link)->next) {
+    if (*link == entry) {
+      *link = entry->next;
+      resolver->cache_count--;
+      break;
+    }
+  }
+
+  free(entry);
+}
+
+static ResolverEntry *private_resolver_entry_find(Resolver *resolver, const char *name, uint32_t hash) {
+  ResolverEntry *entry;
+
+  for (entry = resolver->buckets[hash % RESOLVER_CACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/* Drops expired answers and, if the cache is still full, the first
+ * settled entries found, lookups in flight are never evicted */
+static void private_resolver_cache_trim(Resolver *resolver, uint64_t now) {
+  ResolverEntry *entry, *next;
+  size_t i;
+
+  for (i = 0; i < RESOLVER_CACHE_BUCKETS && resolver->cache_count >= RESOLVER_MAX_CACHE; i++) {
+    for (entry = resolver->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+
+      if (!entry->resolving && entry->expires <= now) {
+        private_resolver_entry_remove(resolver, entry);
+      }
+    }
+  }
+
+  for (i = 0; i < RESOLVER_CACHE_BUCKETS && resolver->cache_count >= RESOLVER_MAX_CACHE; i++) {
+    for (entry = resolver->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+
+      if (!entry->resolving) {
+        private_resolver_entry_remove(resolver, entry);
+        break;
+      }
+    }
+  }
+}
+
+static void private_resolver_deliver(const char *name, const ResolverRecord *records, size_t count,
+                                     ResolverWaiter *waiter) {
+  SocketAddress **addresses;
+  size_t i;
+
+  if (count == 0) {
+    waiter->func(name, NULL, 0, waiter->data);
+    return;
+  }
+
+  if (UNLIKELY((addresses = calloc(sizeof(SocketAddress *), count)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolved addresses");
+    waiter->func(name, NULL, 0, waiter->data);
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (UNLIKELY((addresses[i] = private_resolver_make_address(&records[i], waiter->port)) == NULL)) {
+      resolver_free_addresses(addresses, i);
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolved addresses");
+      waiter->func(name, NULL, 0, waiter->data);
+      return;
+    }
+  }
+
+  waiter->func(name, addresses, count, waiter->data);
+}
+
+static void private_resolver_set_result_error(size_t count, size_t failed) {
+  if (count == 0 && failed > 0) {
+    error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Name server didn't answer");
+  } else if (count == 0) {
+    error_set_error((int32_t)ERROR_IO_NOT_EXISTS, 0, "Name has no addresses");
+  }
+}
+
+/* Settles the entry once all its queries are done and runs the waiters.
+ * Failed lookups are not cached. Callbacks may resolve again and so evict
+ * the entry, hence they only see a copy of the answer */
+static void private_resolver_complete(Resolver *resolver, ResolverEntry *entry) {
+  ResolverRecord records[RESOLVER_MAX_ADDRESSES];
+  char name[RESOLVER_MAX_NAME + 1];
+  ResolverWaiter *waiter, *next;
+  size_t count, failed;
+  uint32_t ttl;
+
+  entry->resolving = false;
+
+  if (entry->count > 0) {
+    ttl = entry->ttl;
+  } else {
+    ttl = entry->negative_ttl != UINT32_MAX ? entry->negative_ttl : RESOLVER_NEGATIVE_TTL;
+  }
+
+  entry->expires = timer_wheel_get_time(resolver->wheel) + (uint64_t)ttl * 1000;
+
+  waiter = entry->waiters;
+  entry->waiters = NULL;
+  count = entry->count;
+  failed = entry->failed;
+  memcpy(records, entry->records, sizeof(ResolverRecord) * count);
+  strcpy(name, entry->name);
+
+  if (count == 0 && failed > 0) {
+    private_resolver_entry_remove(resolver, entry);
+  }
+
+  for (; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    private_resolver_set_result_error(count, failed);
+    private_resolver_deliver(name, records, count, waiter);
+    free(waiter);
+  }
+}
+
+static void private_resolver_query_free(Resolver *resolver, ResolverQuery *query) {
+  ResolverQuery **link;
+
+  for (link = &resolver->queries; *link != NULL; link = &(*link)->next) {
+    if (*link == query) {
+      *link = query->next;
+      break;
+    }
+  }
+
+  if (query->socket != NULL) {
+    poller_remove(resolver->poller, query->socket);
+    socket_free(query->socket);
+  }
+
+  timer_free(query->timer);
+  free(query);
+}
+
+static void private_resolver_query_done(Resolver *resolver, ResolverQuery *query) {
+  ResolverEntry *entry;
+
+  entry = query->entry;
+  private_resolver_query_free(resolver, query);
+
+  if (--entry->pending == 0) {
+    private_resolver_complete(resolver, entry);
+  }
+}
+
+static bool private_resolver_query_send(Resolver *resolver, ResolverQuery *query) {
+  if (UNLIKELY(socket_send(query->socket, (const char *)query->packet, query->length) < 0)) {
+    /* Refused or unreachable servers are retried like lost packets */
+    if (error_get_code() != (int32_t)ERROR_IO_CONNECTION_REFUSED &&
+        error_get_code() != (int32_t)ERROR_IO_WOULD_BLOCK) {
+      return false;
+    }
+  }
+
+  query->attempts++;
+
+  return timer_wheel_schedule_after(resolver->wheel, query->timer, resolver->timeout);
+}
+
+static void private_resolver_query_expired(Timer *timer, void *data) {
+  ResolverQuery *query;
+  Resolver *resolver;
+
+  UNUSED(timer);
+  query = data;
+  resolver = query->resolver;
+
+  if (query->attempts < resolver->attempts && private_resolver_query_send(resolver, query) == true) {
+    return;
+  }
+
+  query->entry->failed++;
+  private_resolver_query_done(resolver, query);
+}
+
+static bool private_resolver_query_start(Resolver *resolver, ResolverEntry *entry, uint16_t type) {
+  ResolverQuery *query;
+  const char *label, *end;
+  size_t offset, len;
+
+  if (UNLIKELY((query = calloc(sizeof(ResolverQuery), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for DNS query");
+    return false;
+  }
+
+  if (UNLIKELY((query->timer = timer_new(private_resolver_query_expired, query)) == NULL)) {
+    free(query);
+    return false;
+  }
+
+  query->resolver = resolver;
+  query->entry = entry;
+  query->type = type;
+  query->next = resolver->queries;
+  resolver->queries = query;
+
+  if (UNLIKELY(sys_random_bytes(&query->id, sizeof(query->id)) == false)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to generate DNS query ID");
+    private_resolver_query_free(resolver, query);
+    return false;
+  }
+
+  /* A connected socket only sees datagrams from the server */
+  if (UNLIKELY((query->socket = socket_new(socket_address_get_family(resolver->server), SOCKET_TYPE_DATAGRAM,
+                                           SOCKET_PROTOCOL_UDP)) == NULL) ||
+      UNLIKELY(socket_connect(query->socket, resolver->server) == false)) {
+    socket_free(query->socket);
+    query->socket = NULL;
+    private_resolver_query_free(resolver, query);
+    return false;
+  }
+
+  socket_set_blocking(query->socket, false);
+
+  if (UNLIKELY(poller_add(resolver->poller, query->socket, SOCKET_IO_CONDITION_POLLIN, query) == false)) {
+    socket_free(query->socket);
+    query->socket = NULL;
+    private_resolver_query_free(resolver, query);
+    return false;
+  }
+
+  /* Header: id, recursion desired, one question */
+  private_resolver_write16(query->packet, query->id);
+  private_resolver_write16(query->packet + 2, 0x0100);
+  private_resolver_write16(query->packet + 4, 1);
+  offset = RESOLVER_HEADER_SIZE;
+
+  for (label = entry->name; *label != '\0'; label = *end == '.' ? end + 1 : end) {
+    if ((end = strchr(label, '.')) == NULL) {
+      end = label + strlen(label);
+    }
+
+    len = (size_t)(end - label);
+    query->packet[offset++] = (uint8_t)len;
+    memcpy(query->packet + offset, label, len);
+    offset += len;
+  }
+
+  query->packet[offset++] = 0;
+  private_resolver_write16(query->packet + offset, type);
+  private_resolver_write16(query->packet + offset + 2, RESOLVER_CLASS_IN);
+  query->length = offset + 4;
+
+  if (UNLIKELY(private_resolver_query_send(resolver, query) == false)) {
+    private_resolver_query_free(resolver, query);
+    return false;
+  }
+
+  entry->pending++;
+
+  return true;
+}
+
+/* Checks the echoed question and collects the answers matching the query
+ * type, CNAME records are skipped since recursive servers append the
+ * records of the canonical name */
+static ResolverAnswer private_resolver_parse(const ResolverQuery *query, const uint8_t *packet, size_t length) {
+  ResolverEntry *entry;
+  uint16_t flags, qdcount, ancount, nscount, type, rdlength;
+  uint32_t ttl;
+  size_t offset, end, i;
+  bool found;
+
+  if (length < query->length || (packet[2] & 0x80) == 0) {
+    return RESOLVER_ANSWER_IGNORE;
+  }
+
+  flags = private_resolver_read16(packet + 2);
+  qdcount = private_resolver_read16(packet + 4);
+  ancount = private_resolver_read16(packet + 6);
+  nscount = private_resolver_read16(packet + 8);
+
+  /* Same question, compared case-insensitively */
+  if (qdcount != 1) {
+    return RESOLVER_ANSWER_IGNORE;
+  }
+
+  for (i = RESOLVER_HEADER_SIZE; i < query->length; i++) {
+    if (private_resolver_lower(packet[i]) != private_resolver_lower(query->packet[i])) {
+      return RESOLVER_ANSWER_IGNORE;
+    }
+  }
+
+  entry = query->entry;
+
+  if ((flags & 0x000f) != RESOLVER_RCODE_NOERROR && (flags & 0x000f) != RESOLVER_RCODE_NXDOMAIN) {
+    return RESOLVER_ANSWER_FAILED;
+  }
+
+  offset = query->length;
+  found = false;
+
+  for (i = 0; i < (size_t)ancount + nscount; i++) {
+    if ((offset = private_resolver_skip_name(packet, length, offset)) == 0 || offset + 10 > length) {
+      return RESOLVER_ANSWER_FAILED;
+    }
+
+    type = private_resolver_read16(packet + offset);
+    ttl = private_resolver_read32(packet + offset + 4);
+    rdlength = private_resolver_read16(packet + offset + 8);
+    offset += 10;
+
+    if (offset + rdlength > length) {
+      return RESOLVER_ANSWER_FAILED;
+    }
+
+    if (ttl > RESOLVER_MAX_TTL) {
+      ttl = RESOLVER_MAX_TTL;
+    }
+
+    if (i < ancount && type == query->type && private_resolver_read16(packet + offset - 8) == RESOLVER_CLASS_IN &&
+        rdlength == (type == RESOLVER_TYPE_A ? 4 : 16)) {
+      if (entry->count < RESOLVER_MAX_ADDRESSES) {
+        entry->records[entry->count].family = type == RESOLVER_TYPE_A ? SOCKET_FAMILY_INET : SOCKET_FAMILY_INET6;
+        memcpy(entry->records[entry->count].address, packet + offset, rdlength);
+        entry->count++;
+      }
+
+      if (ttl < entry->ttl) {
+        entry->ttl = ttl;
+      }
+
+      found = true;
+    } else if (i >= ancount && type == RESOLVER_TYPE_SOA && !found) {
+      /* Negative TTL is the lower of the SOA TTL and its MINIMUM field */
+      end = offset + rdlength;
+
+      if (rdlength >= 22 && private_resolver_read32(packet + end - 4) < ttl) {
+        ttl = private_resolver_read32(packet + end - 4);
+      }
+
+      if (ttl < entry->negative_ttl) {
+        entry->negative_ttl = ttl;
+      }
+    }
+
+    offset += rdlength;
+  }
+
+  return found ? RESOLVER_ANSWER_OK : RESOLVER_ANSWER_NEGATIVE;
+}
+
+static void private_resolver_read(Resolver *resolver, ResolverQuery *query) {
+  uint8_t packet[RESOLVER_PACKET_SIZE];
+  ssize_t received;
+
+  for (;;) {
+    if ((received = socket_receive(query->socket, (char *)packet, sizeof(packet))) < 0) {
+      /* ICMP port unreachable shows up here, the query just retries */
+      if (error_get_code() == (int32_t)ERROR_IO_CONNECTION_REFUSED) {
+        continue;
+      }
+
+      break;
+    }
+
+    if (received < RESOLVER_HEADER_SIZE || private_resolver_read16(packet) != query->id) {
+      continue;
+    }
+
+    switch (private_resolver_parse(query, packet, (size_t)received)) {
+      case RESOLVER_ANSWER_IGNORE:
+        continue;
+      case RESOLVER_ANSWER_FAILED:
+        query->entry->failed++;
+        break;
+      default:
+        break;
+    }
+
+    timer_wheel_cancel(resolver->wheel, query->timer);
+    private_resolver_query_done(resolver, query);
+    break;
+  }
+}
+
+#ifndef _WINDOWS
+static SocketAddress *private_resolver_system_server(void) {
+  char line[256], *start, *end;
+  SocketAddress *ret;
+  FILE *file;
+
+  if ((file = fopen("/etc/resolv.conf", "r")) == NULL) {
+    return NULL;
+  }
+
+  ret = NULL;
+
+  while (ret == NULL && fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, "nameserver", 10) != 0 || (line[10] != ' ' && line[10] != '\t')) {
+      continue;
+    }
+
+    for (start = line + 10; *start == ' ' || *start == '\t'; start++);
+    for (end = start; *end != '\0' && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n'; end++);
+    *end = '\0';
+
+    ret = socket_address_new(start, RESOLVER_DNS_PORT);
+  }
+
+  fclose(file);
+
+  return ret;
+}
+#endif
+
+Resolver *resolver_new(SocketAddress *server) {
+  struct sockaddr_storage native;
+  SocketAddress *address;
+  Resolver *ret;
+
+  address = server;
+
+#ifndef _WINDOWS
+  if (address == NULL && (address = private_resolver_system_server()) == NULL) {
+#else
+  if (address == NULL) {
+#endif
+    error_set_error((int32_t)ERROR_IO_NOT_AVAILABLE, 0, "No name server configured");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(Resolver), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolver");
+    goto fail;
+  }
+
+  /* The caller keeps its address, the one from resolv.conf is ours */
+  if (address == server) {
+    socket_address_to_native(server, &native, sizeof(native));
+
+    if (UNLIKELY((address = socket_address_new_from_native(&native, socket_address_get_native_size(server))) == NULL)) {
+      goto fail;
+    }
+  }
+
+  ret->server = address;
+  address = server;
+
+  if (UNLIKELY((ret->poller = poller_new()) == NULL) ||
+      UNLIKELY((ret->wheel = timer_wheel_new(1)) == NULL)) {
+    goto fail;
+  }
+
+  poller_set_timer_wheel(ret->poller, ret->wheel);
+
+  ret->timeout = RESOLVER_DEFAULT_TIMEOUT;
+  ret->attempts = RESOLVER_DEFAULT_ATTEMPTS;
+
+  return ret;
+
+fail:
+  if (address != server) {
+    socket_address_free(address);
+  }
+
+  if (ret != NULL) {
+    timer_wheel_free(ret->wheel);
+    poller_free(ret->poller);
+    socket_address_free(ret->server);
+    free(ret);
+  }
+
+  return NULL;
+}
+
+void resolver_set_timeout(Resolver *resolver, uint32_t msec) {
+  if (UNLIKELY(resolver == NULL || msec == 0)) {
+    return;
+  }
+
+  resolver->timeout = msec;
+}
+
+void resolver_set_attempts(Resolver *resolver, uint32_t attempts) {
+  if (UNLIKELY(resolver == NULL || attempts == 0)) {
+    return;
+  }
+
+  resolver->attempts = attempts;
+}
+
+/* Time until the next retransmission, -1 if nothing is in flight */
+int32_t resolver_get_timeout(const Resolver *resolver) {
+  if (UNLIKELY(resolver == NULL)) {
+    return -1;
+  }
+
+  return timer_wheel_get_timeout(resolver->wheel);
+}
+
+size_t resolver_get_cache_count(const Resolver *resolver) {
+  if (UNLIKELY(resolver == NULL)) {
+    return 0;
+  }
+
+  return resolver->cache_count;
+}
+
+/* Numeric addresses and cached names complete before this returns */
+bool resolver_resolve(Resolver *resolver, const char *name, uint16_t port, ResolverFunc func, void *data) {
+  ResolverEntry *entry;
+  ResolverWaiter *waiter, waiter_now;
+  SocketAddress *literal, **addresses;
+  char normalized[RESOLVER_MAX_NAME + 1];
+  uint32_t hash;
+  uint64_t now;
+
+  if (UNLIKELY(resolver == NULL || name == NULL || func == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if ((literal = socket_address_new(name, port)) != NULL) {
+    if (UNLIKELY((addresses = malloc(sizeof(SocketAddress *))) == NULL)) {
+      socket_address_free(literal);
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolved addresses");
+      return false;
+    }
+
+    addresses[0] = literal;
+    func(name, addresses, 1, data);
+    return true;
+  }
+
+  if (UNLIKELY(private_resolver_normalize(name, normalized) == false)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid host name");
+    return false;
+  }
+
+  hash = private_resolver_hash(normalized);
+  now = timer_wheel_update_time(resolver->wheel);
+
+  if ((entry = private_resolver_entry_find(resolver, normalized, hash)) != NULL &&
+      !entry->resolving && entry->expires <= now) {
+    private_resolver_entry_remove(resolver, entry);
+    entry = NULL;
+  }
+
+  if (entry != NULL && !entry->resolving) {
+    waiter_now.func = func;
+    waiter_now.data = data;
+    waiter_now.port = port;
+    private_resolver_set_result_error(entry->count, entry->failed);
+    private_resolver_deliver(normalized, entry->records, entry->count, &waiter_now);
+    return true;
+  }
+
+  if (UNLIKELY((waiter = calloc(sizeof(ResolverWaiter), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolver lookup");
+    return false;
+  }
+
+  waiter->func = func;
+  waiter->data = data;
+  waiter->port = port;
+
+  if (entry == NULL) {
+    if (resolver->cache_count >= RESOLVER_MAX_CACHE) {
+      private_resolver_cache_trim(resolver, now);
+    }
+
+    if (UNLIKELY((entry = calloc(sizeof(ResolverEntry), 1)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for resolver cache");
+      free(waiter);
+      return false;
+    }
+
+    strcpy(entry->name, normalized);
+    entry->hash = hash;
+    entry->resolving = true;
+    entry->ttl = RESOLVER_MAX_TTL;
+    entry->negative_ttl = UINT32_MAX;
+    entry->next = resolver->buckets[hash % RESOLVER_CACHE_BUCKETS];
+    resolver->buckets[hash % RESOLVER_CACHE_BUCKETS] = entry;
+    resolver->cache_count++;
+
+    /* AAAA goes first so the answers keep IPv6 ahead of IPv4 */
+    if (UNLIKELY(private_resolver_query_start(resolver, entry, RESOLVER_TYPE_AAAA) == false) ||
+        UNLIKELY(private_resolver_query_start(resolver, entry, RESOLVER_TYPE_A) == false)) {
+      if (entry->pending > 0) {
+        /* The running query still finishes the lookup */
+        entry->failed++;
+      } else {
+        private_resolver_entry_remove(resolver, entry);
+        free(waiter);
+        return false;
+      }
+    }
+  }
+
+  waiter->next = entry->waiters;
+  entry->waiters = waiter;
+
+  return true;
+}
+
+bool resolver_poll(Resolver *resolver, int32_t timeout) {
+  ResolverQuery *query;
+  int32_t count, i;
+
+  if (UNLIKELY(resolver == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  /* Expired queries are retransmitted by the timer wheel inside the wait,
+   * those that ran out of attempts are gone before their events are seen */
+  if (UNLIKELY((count = poller_wait(resolver->poller, resolver->events, RESOLVER_MAX_EVENTS, timeout)) < 0)) {
+    return false;
+  }
+
+  for (i = 0; i < count; i++) {
+    for (query = resolver->queries; query != NULL && query != resolver->events[i].data; query = query->next);
+
+    if (query != NULL) {
+      private_resolver_read(resolver, query);
+    }
+  }
+
+  return true;
+}
+
+static void private_resolver_lookup_done(const char *name, SocketAddress **addresses, size_t count, void *data) {
+  ResolverLookup *lookup;
+
+  UNUSED(name);
+  lookup = data;
+  lookup->addresses = addresses;
+  lookup->count = count;
+  lookup->code = error_get_code();
+  lookup->native_code = error_get_native_code();
+  lookup->done = true;
+}
+
+/* Blocks until the lookup completes or the deadline (a sys_time_monotonic()
+ * value, 0 for none) passes, meant for simple clients */
+SocketAddress **resolver_lookup(Resolver *resolver, const char *name, uint16_t port, size_t *count, uint64_t deadline) {
+  ResolverLookup lookup;
+  ResolverEntry *entry;
+  ResolverWaiter **link, *waiter;
+  char normalized[RESOLVER_MAX_NAME + 1];
+  uint64_t now;
+  int32_t timeout;
+  bool timed_out;
+
+  if (UNLIKELY(count == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  memset(&lookup, 0, sizeof(lookup));
+  *count = 0;
+
+  if (UNLIKELY(resolver_resolve(resolver, name, port, private_resolver_lookup_done, &lookup) == false)) {
+    return NULL;
+  }
+
+  timed_out = false;
+
+  while (!lookup.done) {
+    timeout = -1;
+
+    if (deadline != 0) {
+      if ((now = sys_time_monotonic()) >= deadline) {
+        timed_out = true;
+        break;
+      }
+
+      timeout = deadline - now > INT32_MAX ? INT32_MAX : (int32_t)(deadline - now);
+    }
+
+    if (UNLIKELY(resolver_poll(resolver, timeout) == false)) {
+      break;
+    }
+  }
+
+  if (!lookup.done) {
+    /* The lookup goes on for other waiters, only this one is dropped */
+    private_resolver_normalize(name, normalized);
+
+    if ((entry = private_resolver_entry_find(resolver, normalized, private_resolver_hash(normalized))) != NULL) {
+      for (link = &entry->waiters; *link != NULL; link = &(*link)->next) {
+        if ((*link)->data == &lookup) {
+          waiter = *link;
+          *link = waiter->next;
+          free(waiter);
+          break;
+        }
+      }
+    }
+
+    if (timed_out) {
+      error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Timed out while resolving name");
+    }
+
+    return NULL;
+  }
+
+  if (lookup.count == 0) {
+    error_set_error(lookup.code, lookup.native_code, "Failed to resolve name");
+  }
+
+  *count = lookup.count;
+
+  return lookup.addresses;
+}
+
+void resolver_clear_cache(Resolver *resolver) {
+  ResolverEntry *entry, *next;
+  size_t i;
+
+  if (UNLIKELY(resolver == NULL)) {
+    return;
+  }
+
+  for (i = 0; i < RESOLVER_CACHE_BUCKETS; i++) {
+    for (entry = resolver->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+
+      if (!entry->resolving) {
+        private_resolver_entry_remove(resolver, entry);
+      }
+    }
+  }
+}
+
+/* Lookups still in flight complete with ERROR_IO_ABORTED */
+void resolver_free(Resolver *resolver) {
+  ResolverEntry *entry, *next;
+  size_t i;
+
+  if (UNLIKELY(resolver == NULL)) {
+    return;
+  }
+
+  while (resolver->queries != NULL) {
+    resolver->queries->entry->failed++;
+    private_resolver_query_free(resolver, resolver->queries);
+  }
+
+  for (i = 0; i < RESOLVER_CACHE_BUCKETS; i++) {
+    for (entry = resolver->buckets[i]; entry != NULL; entry = next) {
+      ResolverWaiter *waiter;
+
+      next = entry->next;
+
+      while ((waiter = entry->waiters) != NULL) {
+        entry->waiters = waiter->next;
+        error_set_error((int32_t)ERROR_IO_ABORTED, 0, "Resolver is being freed");
+        waiter->func(entry->name, NULL, 0, waiter->data);
+        free(waiter);
+      }
+
+      free(entry);
+    }
+  }
+
+  timer_wheel_free(resolver->wheel);
+  poller_free(resolver->poller);
+  socket_address_free(resolver->server);
+  free(resolver);
+}
+
+void resolver_free_addresses(SocketAddress **addresses, size_t count) {
+  size_t i;
+
+  if (addresses == NULL) {
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    socket_address_free(addresses[i]);
+  }
+
+  free(addresses);
+}
@@ -0,0 +1,865 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "rpc.h"
+#include "thread.h"
+#include "error.h"
+
+/* Frame header: payload length, flags and correlation id, big endian */
+#define RPC_HEADER_SIZE 16
+
+#define RPC_FLAG_RESPONSE 1
+#define RPC_FLAG_ERROR    2
+
+#define RPC_DEFAULT_CAPACITY 4096
+#define RPC_DEFAULT_MAX_FRAME (16 * 1024 * 1024)
+#define RPC_READ_SIZE 65536
+#define RPC_WRITE_BATCH 64
+
+/* How often the reader looks for calls past their deadline (msec) */
+#define RPC_SWEEP_INTERVAL 10
+
+/* Time a batch of frames may take to go out (msec), the channel closes
+ * once it's exceeded */
+#define RPC_WRITE_TIMEOUT 5000
+
+/* Slot ids besides the id of the call owning the slot */
+#define RPC_SLOT_FREE 0
+#define RPC_SLOT_BUSY UINT64_MAX
+
+typedef struct RpcFrame {
+  struct RpcFrame *next;
+  uint64_t id;
+  bool request;
+  size_t len;
+  char data[];
+} RpcFrame;
+
+/* Blocking callers sleep on their own condition, kept around for the
+ * next call once they return */
+typedef struct RpcWaiter {
+  struct RpcWaiter *next;
+  Cond *cond;
+} RpcWaiter;
+
+typedef struct RpcCall {
+  struct RpcCall *next;
+  RpcFunc func;
+  void *data;
+  RpcWaiter *waiter;
+  char *buffer;
+  size_t buflen;
+  ssize_t result;
+  int32_t error;
+  atomic_bool done;
+} RpcCall;
+
+/* A call is claimed by moving the id from RPC_SLOT_FREE to RPC_SLOT_BUSY
+ * and published with its own id. Whoever moves a published id back to
+ * RPC_SLOT_BUSY, the reader on a response, the sweeper or the caller on
+ * a deadline, owns the completion, so stale responses just miss. */
+typedef struct {
+  atomic_uint_fast64_t id;
+  atomic_uint_fast64_t deadline;
+  _Atomic(RpcCall *) call;
+} RpcSlot;
+
+struct RpcChannel {
+  Socket *socket;
+  RpcSlot *slots;
+  size_t capacity;
+  size_t max_frame;
+  atomic_uint_fast64_t next_id;
+  atomic_size_t pending;
+  _Atomic(RpcFrame *) queue;
+  atomic_bool writing;
+  atomic_bool closed;
+  atomic_bool stopping;
+  Mutex *lock;
+  RpcWaiter *waiters;
+  Thread *thread;
+  RpcHandlerFunc handler;
+  void *handler_data;
+  char *input;
+  size_t input_len;
+  size_t input_capacity;
+  atomic_uint_fast64_t calls;
+  atomic_uint_fast64_t completed;
+  atomic_uint_fast64_t timed_out;
+  atomic_uint_fast64_t failed;
+  atomic_uint_fast64_t frames;
+  atomic_uint_fast64_t writes;
+};
+
+static void private_rpc_put32(char *buffer, uint32_t value);
+static void private_rpc_put64(char *buffer, uint64_t value);
+static uint32_t private_rpc_get32(const char *buffer);
+static uint64_t private_rpc_get64(const char *buffer);
+static RpcFrame *private_rpc_frame_new(uint64_t id, uint32_t flags, const char *data, size_t len);
+static bool private_rpc_claim(RpcChannel *channel, RpcCall *call, uint64_t deadline, uint64_t *id);
+static RpcCall *private_rpc_take(RpcChannel *channel, uint64_t id);
+static const char *private_rpc_message(int32_t error);
+static RpcWaiter *private_rpc_acquire(RpcChannel *channel);
+static void private_rpc_release(RpcChannel *channel, RpcWaiter *waiter);
+static void private_rpc_finish(RpcChannel *channel, RpcCall *call, const char *response, size_t len,
+                               int32_t error, RpcCall **wake);
+static void private_rpc_wake(RpcChannel *channel, RpcCall *calls);
+static void private_rpc_sweep(RpcChannel *channel, bool all, RpcCall **wake);
+static void private_rpc_close(RpcChannel *channel);
+static void private_rpc_push(RpcChannel *channel, RpcFrame *frame);
+static bool private_rpc_write(RpcChannel *channel, RpcFrame **frames, size_t count);
+static void private_rpc_flush(RpcChannel *channel);
+static bool private_rpc_send(RpcChannel *channel, RpcCall *call, const char *request, size_t len,
+                             uint64_t deadline, uint64_t *id);
+static bool private_rpc_dispatch(RpcChannel *channel, RpcCall **wake);
+static void private_rpc_reader(void *data);
+
+static void private_rpc_put32(char *buffer, uint32_t value) {
+  buffer[0] = (char)(value >> 24);
+  buffer[1] = (char)(value >> 16);
+  buffer[2] = (char)(value >> 8);
+  buffer[3] = (char) value;
+}
+
+static void private_rpc_put64(char *buffer, uint64_t value) {
+  private_rpc_put32(buffer, (uint32_t)(value >> 32));
+  private_rpc_put32(buffer + 4, (uint32_t) value);
+}
+
+static uint32_t private_rpc_get32(const char *buffer) {
+  const uint8_t *bytes = (const uint8_t *) buffer;
+
+  return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+static uint64_t private_rpc_get64(const char *buffer) {
+  return ((uint64_t) private_rpc_get32(buffer) << 32) | private_rpc_get32(buffer + 4);
+}
+
+static RpcFrame *private_rpc_frame_new(uint64_t id, uint32_t flags, const char *data, size_t len) {
+  RpcFrame *ret;
+
+  if (UNLIKELY((ret = malloc(sizeof(RpcFrame) + RPC_HEADER_SIZE + len)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC frame");
+    return NULL;
+  }
+
+  ret->next = NULL;
+  ret->id = id;
+  ret->request = (flags & RPC_FLAG_RESPONSE) == 0;
+  ret->len = RPC_HEADER_SIZE + len;
+  private_rpc_put32(ret->data, (uint32_t) len);
+  private_rpc_put32(ret->data + 4, flags);
+  private_rpc_put64(ret->data + 8, id);
+
+  if (len > 0) {
+    memcpy(ret->data + RPC_HEADER_SIZE, data, len);
+  }
+
+  return ret;
+}
+
+static bool private_rpc_claim(RpcChannel *channel, RpcCall *call, uint64_t deadline, uint64_t *id) {
+  uint_fast64_t expected;
+  RpcSlot *slot;
+  size_t attempt;
+
+  for (attempt = 0; attempt < channel->capacity; attempt++) {
+    *id = atomic_fetch_add(&channel->next_id, 1);
+
+    if (UNLIKELY(*id == RPC_SLOT_FREE || *id == RPC_SLOT_BUSY)) {
+      continue;
+    }
+
+    slot = &channel->slots[*id & (channel->capacity - 1)];
+    expected = RPC_SLOT_FREE;
+
+    if (atomic_compare_exchange_strong(&slot->id, &expected, RPC_SLOT_BUSY)) {
+      atomic_store_explicit(&slot->deadline, deadline, memory_order_relaxed);
+      atomic_store_explicit(&slot->call, call, memory_order_relaxed);
+      atomic_store_explicit(&slot->id, *id, memory_order_release);
+      atomic_fetch_add(&channel->pending, 1);
+      return true;
+    }
+  }
+
+  error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Too many RPC calls in flight");
+
+  return false;
+}
+
+/* Returns the call with the given id if it is still pending, which makes
+ * the caller responsible for completing it */
+static RpcCall *private_rpc_take(RpcChannel *channel, uint64_t id) {
+  RpcSlot *slot = &channel->slots[id & (channel->capacity - 1)];
+  uint_fast64_t expected = id;
+  RpcCall *ret;
+
+  if (id == RPC_SLOT_FREE || id == RPC_SLOT_BUSY ||
+      atomic_compare_exchange_strong(&slot->id, &expected, RPC_SLOT_BUSY) == false) {
+    return NULL;
+  }
+
+  ret = atomic_load_explicit(&slot->call, memory_order_acquire);
+  atomic_store_explicit(&slot->id, RPC_SLOT_FREE, memory_order_release);
+  atomic_fetch_sub(&channel->pending, 1);
+
+  return ret;
+}
+
+static const char *private_rpc_message(int32_t error) {
+  switch (error) {
+    case ERROR_IO_TIMED_OUT:
+      return "Deadline exceeded while waiting for RPC response";
+    case ERROR_IO_NOT_SUPPORTED:
+      return "RPC peer has no request handler";
+    case ERROR_IO_NO_RESOURCES:
+      return "RPC response doesn't fit the buffer";
+    default:
+      return "RPC channel is closed";
+  }
+}
+
+static RpcWaiter *private_rpc_acquire(RpcChannel *channel) {
+  RpcWaiter *ret;
+
+  mutex_lock(channel->lock);
+
+  if ((ret = channel->waiters) != NULL) {
+    channel->waiters = ret->next;
+  }
+
+  mutex_unlock(channel->lock);
+
+  if (ret != NULL) {
+    return ret;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(RpcWaiter), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC call");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->cond = cond_new()) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  return ret;
+}
+
+/* Must be called with the channel lock held */
+static void private_rpc_release(RpcChannel *channel, RpcWaiter *waiter) {
+  waiter->next = channel->waiters;
+  channel->waiters = waiter;
+}
+
+/* Asynchronous calls are released here, blocking callers are queued on
+ * wake and only learn about the result from private_rpc_wake() */
+static void private_rpc_finish(RpcChannel *channel, RpcCall *call, const char *response, size_t len,
+                               int32_t error, RpcCall **wake) {
+  if (error == 0) {
+    atomic_fetch_add_explicit(&channel->completed, 1, memory_order_relaxed);
+  } else if (error == (int32_t)ERROR_IO_TIMED_OUT) {
+    atomic_fetch_add_explicit(&channel->timed_out, 1, memory_order_relaxed);
+  } else {
+    atomic_fetch_add_explicit(&channel->failed, 1, memory_order_relaxed);
+  }
+
+  if (call->func != NULL) {
+    if (error != 0) {
+      error_set_error(error, 0, private_rpc_message(error));
+      call->func(channel, NULL, 0, call->data);
+    } else {
+      call->func(channel, response, len, call->data);
+    }
+
+    free(call);
+    return;
+  }
+
+  if (error == 0 && len > call->buflen) {
+    error = (int32_t)ERROR_IO_NO_RESOURCES;
+  } else if (error == 0 && len > 0) {
+    memcpy(call->buffer, response, len);
+  }
+
+  call->result = (ssize_t) len;
+  call->error = error;
+  call->next = *wake;
+  *wake = call;
+}
+
+/* Signals only the callers whose calls completed. A caller checks done
+ * under the lock, so its call stays valid until the lock is released */
+static void private_rpc_wake(RpcChannel *channel, RpcCall *calls) {
+  RpcCall *next;
+
+  mutex_lock(channel->lock);
+
+  for (; calls != NULL; calls = next) {
+    next = calls->next;
+    atomic_store_explicit(&calls->done, true, memory_order_release);
+    cond_signal(calls->waiter->cond);
+  }
+
+  mutex_unlock(channel->lock);
+}
+
+static void private_rpc_sweep(RpcChannel *channel, bool all, RpcCall **wake) {
+  RpcSlot *slot;
+  RpcCall *call;
+  uint64_t now = sys_time_monotonic(), id;
+  size_t i;
+
+  for (i = 0; i < channel->capacity && atomic_load(&channel->pending) > 0; i++) {
+    slot = &channel->slots[i];
+    id = atomic_load_explicit(&slot->id, memory_order_acquire);
+
+    if (id == RPC_SLOT_FREE || id == RPC_SLOT_BUSY ||
+        (all == false && atomic_load_explicit(&slot->deadline, memory_order_relaxed) > now)) {
+      continue;
+    }
+
+    if ((call = private_rpc_take(channel, id)) != NULL) {
+      private_rpc_finish(channel, call, NULL, 0,
+                         all ? (int32_t)ERROR_IO_ABORTED : (int32_t)ERROR_IO_TIMED_OUT, wake);
+    }
+  }
+}
+
+/* Fails every pending call, calls started afterwards fail right away */
+static void private_rpc_close(RpcChannel *channel) {
+  RpcCall *wake = NULL;
+
+  if (atomic_exchange(&channel->closed, true)) {
+    return;
+  }
+
+  private_rpc_sweep(channel, true, &wake);
+
+  if (wake != NULL) {
+    private_rpc_wake(channel, wake);
+  }
+}
+
+static void private_rpc_push(RpcChannel *channel, RpcFrame *frame) {
+  frame->next = atomic_load_explicit(&channel->queue, memory_order_relaxed);
+
+  while (atomic_compare_exchange_weak(&channel->queue, &frame->next, frame) == false);
+}
+
+static bool private_rpc_write(RpcChannel *channel, RpcFrame **frames, size_t count) {
+  SocketBuffer buffers[RPC_WRITE_BATCH];
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    buffers[i].data = frames[i]->data;
+    buffers[i].len = frames[i]->len;
+  }
+
+  atomic_fetch_add_explicit(&channel->writes, 1, memory_order_relaxed);
+
+  return socket_send_iov_all_until(channel->socket, buffers, count, sys_time_monotonic() + RPC_WRITE_TIMEOUT,
+                                   NULL) >= 0;
+}
+
+/* Whoever finds nobody writing takes everything queued so far, so frames
+ * of concurrent callers share writes. Frames pushed while writing are
+ * picked up by the writer before it lets go. */
+static void private_rpc_flush(RpcChannel *channel) {
+  RpcFrame *batch[RPC_WRITE_BATCH], *list, *frame, *fifo;
+  size_t count, i;
+
+  for (;;) {
+    if (atomic_exchange(&channel->writing, true)) {
+      return;
+    }
+
+    list = atomic_exchange(&channel->queue, NULL);
+
+    for (fifo = NULL; list != NULL; list = frame) {
+      frame = list->next;
+      list->next = fifo;
+      fifo = list;
+    }
+
+    while (fifo != NULL) {
+      for (count = 0; fifo != NULL && count < RPC_WRITE_BATCH;) {
+        frame = fifo;
+        fifo = frame->next;
+
+        /* Requests whose call is already gone are not sent */
+        if (atomic_load(&channel->closed) || (frame->request &&
+            atomic_load(&channel->slots[frame->id & (channel->capacity - 1)].id) != frame->id)) {
+          free(frame);
+          continue;
+        }
+
+        batch[count++] = frame;
+      }
+
+      if (count > 0) {
+        atomic_fetch_add_explicit(&channel->frames, count, memory_order_relaxed);
+
+        if (private_rpc_write(channel, batch, count) == false) {
+          private_rpc_close(channel);
+        }
+      }
+
+      for (i = 0; i < count; i++) {
+        free(batch[i]);
+      }
+    }
+
+    atomic_store(&channel->writing, false);
+
+    if (atomic_load(&channel->queue) == NULL) {
+      return;
+    }
+  }
+}
+
+static bool private_rpc_send(RpcChannel *channel, RpcCall *call, const char *request, size_t len,
+                             uint64_t deadline, uint64_t *id) {
+  RpcFrame *frame;
+
+  if (UNLIKELY(atomic_load(&channel->closed))) {
+    error_set_error((int32_t)ERROR_IO_NOT_CONNECTED, 0, "RPC channel is closed");
+    return false;
+  }
+
+  if (UNLIKELY(len > channel->max_frame)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "RPC request exceeds the frame size limit");
+    return false;
+  }
+
+  if (UNLIKELY((frame = private_rpc_frame_new(0, 0, request, len)) == NULL)) {
+    return false;
+  }
+
+  if (UNLIKELY(private_rpc_claim(channel, call, deadline, id) == false)) {
+    free(frame);
+    return false;
+  }
+
+  atomic_fetch_add_explicit(&channel->calls, 1, memory_order_relaxed);
+  frame->id = *id;
+  private_rpc_put64(frame->data + 8, *id);
+  private_rpc_push(channel, frame);
+
+  /* Closed in between, the call may have missed the final sweep */
+  if (UNLIKELY(atomic_load(&channel->closed)) && private_rpc_take(channel, *id) != NULL) {
+    error_set_error((int32_t)ERROR_IO_NOT_CONNECTED, 0, "RPC channel is closed");
+    return false;
+  }
+
+  private_rpc_flush(channel);
+
+  return true;
+}
+
+static bool private_rpc_dispatch(RpcChannel *channel, RpcCall **wake) {
+  RpcFrame *frame;
+  RpcCall *call;
+  const char *header;
+  uint32_t len, flags;
+  uint64_t id;
+  size_t offset = 0, needed;
+  char *grown;
+
+  while (channel->input_len - offset >= RPC_HEADER_SIZE) {
+    header = channel->input + offset;
+    len = private_rpc_get32(header);
+    flags = private_rpc_get32(header + 4);
+    id = private_rpc_get64(header + 8);
+
+    if (UNLIKELY(len > channel->max_frame)) {
+      error_set_error((int32_t)ERROR_IO_FAILED, 0, "RPC frame exceeds the frame size limit");
+      return false;
+    }
+
+    if (channel->input_len - offset < RPC_HEADER_SIZE + len) {
+      break;
+    }
+
+    if (flags & RPC_FLAG_RESPONSE) {
+      /* Responses to calls that timed out are dropped */
+      if ((call = private_rpc_take(channel, id)) != NULL) {
+        private_rpc_finish(channel, call, header + RPC_HEADER_SIZE, len,
+                           (flags & RPC_FLAG_ERROR) ? (int32_t)ERROR_IO_NOT_SUPPORTED : 0, wake);
+      }
+    } else if (channel->handler != NULL) {
+      channel->handler(channel, id, header + RPC_HEADER_SIZE, len, channel->handler_data);
+    } else if ((frame = private_rpc_frame_new(id, RPC_FLAG_RESPONSE | RPC_FLAG_ERROR, NULL, 0)) != NULL) {
+      private_rpc_push(channel, frame);
+      private_rpc_flush(channel);
+    }
+
+    offset += RPC_HEADER_SIZE + len;
+  }
+
+  if (offset > 0) {
+    memmove(channel->input, channel->input + offset, channel->input_len - offset);
+    channel->input_len -= offset;
+  }
+
+  /* Room for the whole frame at the front */
+  if (channel->input_len >= RPC_HEADER_SIZE &&
+      (needed = RPC_HEADER_SIZE + private_rpc_get32(channel->input)) > channel->input_capacity) {
+    if (UNLIKELY((grown = realloc(channel->input, needed)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC frame");
+      return false;
+    }
+
+    channel->input = grown;
+    channel->input_capacity = needed;
+  }
+
+  return true;
+}
+
+static void private_rpc_reader(void *data) {
+  RpcChannel *channel;
+  uint64_t next_sweep, now;
+  ssize_t ret;
+  RpcCall *wake;
+
+  channel = (RpcChannel *) data;
+  next_sweep = sys_time_monotonic() + RPC_SWEEP_INTERVAL;
+
+  while (atomic_load(&channel->stopping) == false && atomic_load(&channel->closed) == false) {
+    wake = NULL;
+    ret = socket_receive_until(channel->socket, channel->input + channel->input_len,
+                               channel->input_capacity - channel->input_len, next_sweep);
+
+    if (ret == 0 || (ret < 0 && error_get_code() != (int32_t)ERROR_IO_TIMED_OUT)) {
+      private_rpc_close(channel);
+      break;
+    }
+
+    if (ret > 0) {
+      channel->input_len += (size_t) ret;
+
+      if (private_rpc_dispatch(channel, &wake) == false) {
+        private_rpc_close(channel);
+        break;
+      }
+    }
+
+    if ((now = sys_time_monotonic()) >= next_sweep) {
+      private_rpc_sweep(channel, false, &wake);
+      next_sweep = now + RPC_SWEEP_INTERVAL;
+    }
+
+    /* One lock per read, however many calls it completed */
+    if (wake != NULL) {
+      private_rpc_wake(channel, wake);
+    }
+  }
+}
+
+/* capacity bounds the calls in flight, rounded up to a power of two, 0
+ * picks the default */
+RpcChannel *rpc_channel_new(Socket *socket, size_t capacity) {
+  RpcChannel *ret;
+  size_t size;
+
+  if (UNLIKELY(socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(RpcChannel), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC channel");
+    return NULL;
+  }
+
+  for (size = 1; size < (capacity > 0 ? capacity : RPC_DEFAULT_CAPACITY); size <<= 1);
+
+  ret->socket = socket;
+  ret->capacity = size;
+  ret->max_frame = RPC_DEFAULT_MAX_FRAME;
+  ret->input_capacity = RPC_READ_SIZE;
+  atomic_init(&ret->next_id, 1);
+
+  if (UNLIKELY((ret->slots = calloc(sizeof(RpcSlot), size)) == NULL ||
+               (ret->input = malloc(ret->input_capacity)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC channel");
+    rpc_channel_free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->lock = mutex_new()) == NULL)) {
+    rpc_channel_free(ret);
+    return NULL;
+  }
+
+  socket_set_blocking(socket, false);
+
+  return ret;
+}
+
+/* Set before rpc_channel_start(), the handler runs on the reader thread */
+void rpc_channel_set_handler(RpcChannel *channel, RpcHandlerFunc func, void *data) {
+  if (UNLIKELY(channel == NULL)) {
+    return;
+  }
+
+  channel->handler = func;
+  channel->handler_data = data;
+}
+
+/* Larger frames from the peer close the channel */
+void rpc_channel_set_max_frame(RpcChannel *channel, size_t max_frame) {
+  if (UNLIKELY(channel == NULL)) {
+    return;
+  }
+
+  channel->max_frame = max_frame > 0 && max_frame <= UINT32_MAX ? max_frame : RPC_DEFAULT_MAX_FRAME;
+}
+
+bool rpc_channel_start(RpcChannel *channel) {
+  if (UNLIKELY(channel == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (channel->thread != NULL) {
+    return true;
+  }
+
+  atomic_store(&channel->stopping, false);
+
+  if (UNLIKELY((channel->thread = thread_new(private_rpc_reader, channel)) == NULL)) {
+    return false;
+  }
+
+  return true;
+}
+
+/* Pending calls stay pending. Blocking callers still give up at their
+ * deadline, asynchronous calls only time out once the reader runs again
+ * or fail in rpc_channel_free() */
+void rpc_channel_stop(RpcChannel *channel) {
+  if (UNLIKELY(channel == NULL) || channel->thread == NULL) {
+    return;
+  }
+
+  atomic_store(&channel->stopping, true);
+  thread_join(channel->thread);
+  channel->thread = NULL;
+}
+
+/* Returns the response length, the response must fit buflen */
+ssize_t rpc_channel_call_until(RpcChannel *channel, const char *request, size_t len,
+                               char *response, size_t buflen, uint64_t deadline) {
+  RpcCall call;
+  uint64_t id, now;
+
+  if (UNLIKELY(channel == NULL || (request == NULL && len > 0) || (response == NULL && buflen > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  memset(&call, 0, sizeof(call));
+  call.buffer = response;
+  call.buflen = buflen;
+  atomic_init(&call.done, false);
+
+  if (UNLIKELY((call.waiter = private_rpc_acquire(channel)) == NULL)) {
+    return -1;
+  }
+
+  if (private_rpc_send(channel, &call, request, len, deadline, &id) == false) {
+    mutex_lock(channel->lock);
+    private_rpc_release(channel, call.waiter);
+    mutex_unlock(channel->lock);
+    return -1;
+  }
+
+  mutex_lock(channel->lock);
+
+  while (atomic_load_explicit(&call.done, memory_order_acquire) == false) {
+    if ((now = sys_time_monotonic()) < deadline) {
+      cond_timed_wait(call.waiter->cond, channel->lock,
+                      (deadline - now) > INT32_MAX ? INT32_MAX : (int32_t)(deadline - now));
+      continue;
+    }
+
+    if (private_rpc_take(channel, id) == &call) {
+      private_rpc_release(channel, call.waiter);
+      mutex_unlock(channel->lock);
+      atomic_fetch_add_explicit(&channel->timed_out, 1, memory_order_relaxed);
+      error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, private_rpc_message((int32_t)ERROR_IO_TIMED_OUT));
+      return -1;
+    }
+
+    /* Someone else is completing the call right now */
+    cond_wait(call.waiter->cond, channel->lock);
+  }
+
+  private_rpc_release(channel, call.waiter);
+  mutex_unlock(channel->lock);
+
+  if (call.error != 0) {
+    error_set_error(call.error, 0, private_rpc_message(call.error));
+    return -1;
+  }
+
+  return call.result;
+}
+
+/* func runs exactly once, on the reader thread or, when the channel
+ * fails, on whichever thread noticed */
+bool rpc_channel_call_async(RpcChannel *channel, const char *request, size_t len, uint64_t deadline,
+                            RpcFunc func, void *data) {
+  RpcCall *call;
+  uint64_t id;
+
+  if (UNLIKELY(channel == NULL || func == NULL || (request == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((call = calloc(sizeof(RpcCall), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for RPC call");
+    return false;
+  }
+
+  call->func = func;
+  call->data = data;
+
+  if (private_rpc_send(channel, call, request, len, deadline, &id) == false) {
+    free(call);
+    return false;
+  }
+
+  return true;
+}
+
+bool rpc_channel_respond(RpcChannel *channel, uint64_t id, const char *response, size_t len) {
+  RpcFrame *frame;
+
+  if (UNLIKELY(channel == NULL || (response == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY(atomic_load(&channel->closed))) {
+    error_set_error((int32_t)ERROR_IO_NOT_CONNECTED, 0, "RPC channel is closed");
+    return false;
+  }
+
+  if (UNLIKELY((frame = private_rpc_frame_new(id, RPC_FLAG_RESPONSE, response, len)) == NULL)) {
+    return false;
+  }
+
+  private_rpc_push(channel, frame);
+  private_rpc_flush(channel);
+
+  return true;
+}
+
+size_t rpc_channel_get_pending(const RpcChannel *channel) {
+  if (UNLIKELY(channel == NULL)) {
+    return 0;
+  }
+
+  return atomic_load(&channel->pending);
+}
+
+/* True once the connection failed, the peer closed it or the channel
+ * was freed */
+bool rpc_channel_is_closed(const RpcChannel *channel) {
+  if (UNLIKELY(channel == NULL)) {
+    return true;
+  }
+
+  return atomic_load(&channel->closed);
+}
+
+void rpc_channel_get_stats(const RpcChannel *channel, RpcStats *stats) {
+  if (UNLIKELY(channel == NULL || stats == NULL)) {
+    return;
+  }
+
+  stats->calls = atomic_load_explicit(&channel->calls, memory_order_relaxed);
+  stats->completed = atomic_load_explicit(&channel->completed, memory_order_relaxed);
+  stats->timed_out = atomic_load_explicit(&channel->timed_out, memory_order_relaxed);
+  stats->failed = atomic_load_explicit(&channel->failed, memory_order_relaxed);
+  stats->frames = atomic_load_explicit(&channel->frames, memory_order_relaxed);
+  stats->writes = atomic_load_explicit(&channel->writes, memory_order_relaxed);
+}
+
+Socket *rpc_channel_get_socket(const RpcChannel *channel) {
+  if (UNLIKELY(channel == NULL)) {
+    return NULL;
+  }
+
+  return channel->socket;
+}
+
+/* Pending asynchronous calls fail with ERROR_IO_ABORTED, the socket is
+ * left open */
+void rpc_channel_free(RpcChannel *channel) {
+  RpcFrame *frame;
+  RpcWaiter *waiter;
+
+  if (UNLIKELY(channel == NULL)) {
+    return;
+  }
+
+  rpc_channel_stop(channel);
+
+  if (channel->slots != NULL && channel->lock != NULL) {
+    private_rpc_close(channel);
+  }
+
+  while ((frame = atomic_load(&channel->queue)) != NULL) {
+    atomic_store(&channel->queue, frame->next);
+    free(frame);
+  }
+
+  while ((waiter = channel->waiters) != NULL) {
+    channel->waiters = waiter->next;
+    cond_free(waiter->cond);
+    free(waiter);
+  }
+
+  if (channel->lock != NULL) {
+    mutex_free(channel->lock);
+  }
+
+  free(channel->slots);
+  free(channel->input);
+  free(channel);
+}
@@ -29,14 +29,21 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include "socket.h"
+#include "histogram.h"
+#include "trace.h"
 #include "error.h"
+#include "coroutine.h"
 
 #ifndef _WINDOWS
   #include <fcntl.h>
   #include <errno.h>
   #include <unistd.h>
   #include <signal.h>
+  #include <netinet/tcp.h>
+  #include <sys/uio.h>
   #if !defined(VMS) || !defined(__VMS)
     #include <stropts.h>
   #endif
@@ -54,6 +61,58 @@
   #endif
 #endif
 
+#if defined(__linux__) && defined(TCP_INFO)
+  #define SOCKET_USE_TCP_INFO
+
+/* Linux struct tcp_info up to tcpi_delivery_rate, libc headers lag behind
+ * the kernel. The kernel fills as much as both sides know about. */
+typedef struct {
+  uint8_t tcpi_state;
+  uint8_t tcpi_ca_state;
+  uint8_t tcpi_retransmits;
+  uint8_t tcpi_probes;
+  uint8_t tcpi_backoff;
+  uint8_t tcpi_options;
+  uint8_t tcpi_wscale;
+  uint8_t tcpi_flags;
+  uint32_t tcpi_rto;
+  uint32_t tcpi_ato;
+  uint32_t tcpi_snd_mss;
+  uint32_t tcpi_rcv_mss;
+  uint32_t tcpi_unacked;
+  uint32_t tcpi_sacked;
+  uint32_t tcpi_lost;
+  uint32_t tcpi_retrans;
+  uint32_t tcpi_fackets;
+  uint32_t tcpi_last_data_sent;
+  uint32_t tcpi_last_ack_sent;
+  uint32_t tcpi_last_data_recv;
+  uint32_t tcpi_last_ack_recv;
+  uint32_t tcpi_pmtu;
+  uint32_t tcpi_rcv_ssthresh;
+  uint32_t tcpi_rtt;
+  uint32_t tcpi_rttvar;
+  uint32_t tcpi_snd_ssthresh;
+  uint32_t tcpi_snd_cwnd;
+  uint32_t tcpi_advmss;
+  uint32_t tcpi_reordering;
+  uint32_t tcpi_rcv_rtt;
+  uint32_t tcpi_rcv_space;
+  uint32_t tcpi_total_retrans;
+  uint64_t tcpi_pacing_rate;
+  uint64_t tcpi_max_pacing_rate;
+  uint64_t tcpi_bytes_acked;
+  uint64_t tcpi_bytes_received;
+  uint32_t tcpi_segs_out;
+  uint32_t tcpi_segs_in;
+  uint32_t tcpi_notsent_bytes;
+  uint32_t tcpi_min_rtt;
+  uint32_t tcpi_data_segs_in;
+  uint32_t tcpi_data_segs_out;
+  uint64_t tcpi_delivery_rate;
+} SocketLinuxTcpInfo;
+#endif
+
 /* On old Solaris systems SOMAXCONN is set to 5 */
 #define SOCKET_DEFAULT_BACKLOG  5
 
@@ -69,6 +128,13 @@ struct Socket {
   uint32_t closed    : 1;
   uint32_t connected : 1;
   uint32_t listening : 1;
+  SocketAcceptFilter accept_filter;
+  SocketAcceptUndo accept_undo;
+  void *accept_filter_data;
+  /* One counter per SocketStats field, the sending and receiving threads
+   * may both update them */
+  atomic_uint_fast64_t *stats;
+  uint64_t connect_started;
   // uint32_t delay     : 1;
 #ifdef _WINDOWS
   WSAEVENT events;
@@ -96,9 +162,97 @@ struct Socket {
 	#define SOCKET_DEFAULT_SEND_FLAGS 0
 #endif
 
+/* Buffers passed to one sendmsg()/WSASend() call, the rest wait for the
+ * next call as for any partial write */
+#define SOCKET_IOV_MAX 64
+
+/* Process-wide counters are split in shards so threads doing I/O on
+ * different sockets don't bounce the same cache lines */
+#define SOCKET_STATS_SHARDS   64
+#define SOCKET_STATS_COUNTERS (sizeof(SocketStats) / sizeof(uint64_t))
+
+typedef struct {
+  atomic_uint_fast64_t counters[SOCKET_STATS_COUNTERS];
+  char pad[CACHE_LINE_SIZE];
+} SocketStatsShard;
+
+static SocketStatsShard private_socket_stats_shards[SOCKET_STATS_SHARDS];
+static atomic_uint private_socket_stats_next;
+static THREAD_LOCAL SocketStatsShard *private_socket_stats_shard;
+
+/* Sockets without stats pay a single pointer test */
+#define SOCKET_STATS_ADD(socket, field, value) do { \
+  if (UNLIKELY((socket)->stats != NULL)) { \
+    private_socket_stats_add((socket), offsetof(SocketStats, field) / sizeof(uint64_t), (uint64_t)(value)); \
+  } \
+} while (0)
+
+/* Latency histograms are shared by all sockets, when tracking is off the
+ * hot paths only test the flag */
+static Histogram *_Atomic private_socket_latency[SOCKET_LATENCY_KINDS];
+static atomic_bool private_socket_latency_enabled;
+
+static void private_socket_stats_add(const Socket *socket, size_t counter, uint64_t value);
+static inline uint64_t private_socket_latency_start(void);
+static inline void private_socket_latency_record(SocketLatency kind, uint64_t start);
+static void private_socket_wait_done(const Socket *socket, uint64_t start);
 static bool private_socket_set_fd_blocking(int32_t fd, bool blocking);
 static bool private_socket_check(const Socket *socket);
 static bool private_socket_set_details_from_fd(Socket *socket);
+static bool private_socket_io_condition_wait(const Socket *socket, SocketIOCondition condition, int32_t timeout);
+static bool private_socket_wait_until(const Socket *socket, SocketIOCondition condition, uint64_t deadline);
+static bool private_socket_connect(Socket *socket, SocketAddress *address, bool use_deadline, uint64_t deadline);
+static Socket *private_socket_accept(const Socket *socket, bool use_deadline, uint64_t deadline);
+
+static void private_socket_stats_add(const Socket *socket, size_t counter, uint64_t value) {
+  SocketStatsShard *shard;
+
+  atomic_fetch_add_explicit(&socket->stats[counter], value, memory_order_relaxed);
+
+  if (UNLIKELY((shard = private_socket_stats_shard) == NULL)) {
+    shard = &private_socket_stats_shards[atomic_fetch_add(&private_socket_stats_next, 1) % SOCKET_STATS_SHARDS];
+    private_socket_stats_shard = shard;
+  }
+
+  atomic_fetch_add_explicit(&shard->counters[counter], value, memory_order_relaxed);
+}
+
+/* Returns 0 when latency tracking is off */
+static inline uint64_t private_socket_latency_start(void) {
+  if (LIKELY(atomic_load_explicit(&private_socket_latency_enabled, memory_order_relaxed) == false)) {
+    return 0;
+  }
+
+  return sys_time_monotonic_usec();
+}
+
+static inline void private_socket_latency_record(SocketLatency kind, uint64_t start) {
+  if (LIKELY(start == 0)) {
+    return;
+  }
+
+  histogram_record(atomic_load_explicit(&private_socket_latency[kind], memory_order_acquire),
+                   sys_time_monotonic_usec() - start);
+}
+
+static void private_socket_wait_done(const Socket *socket, uint64_t start) {
+  uint64_t elapsed;
+
+  SOCKET_STATS_ADD(socket, waits, 1);
+
+  if (start == 0) {
+    return;
+  }
+
+  elapsed = sys_time_monotonic_usec() - start;
+
+  SOCKET_STATS_ADD(socket, wait_usec, elapsed);
+
+  if (atomic_load_explicit(&private_socket_latency_enabled, memory_order_relaxed)) {
+    histogram_record(atomic_load_explicit(&private_socket_latency[SOCKET_LATENCY_WAIT], memory_order_acquire),
+                     elapsed);
+  }
+}
 
 static bool private_socket_set_fd_blocking(int32_t fd, bool blocking) {
 #ifndef _WINDOWS
@@ -298,6 +452,32 @@ static bool private_socket_set_details_from_fd(Socket *socket) {
   return true;
 }
 
+static bool private_socket_wait_until(const Socket *socket, SocketIOCondition condition, uint64_t deadline) {
+  uint64_t now, start;
+  int32_t remaining;
+  bool ret;
+
+  /* The remaining time is recomputed on every wait, so partial progress
+   * never extends the operation past the deadline */
+  if (UNLIKELY((now = sys_time_monotonic()) >= deadline)) {
+    error_set_error((int32_t)ERROR_IO_TIMED_OUT, 0, "Deadline exceeded while waiting socket condition");
+    return false;
+  }
+
+  remaining = (deadline - now) > INT32_MAX ? INT32_MAX : (int32_t)(deadline - now);
+  start = socket->stats != NULL ? sys_time_monotonic_usec() : private_socket_latency_start();
+
+  if (coroutine_is_active()) {
+    ret = coroutine_io_wait(socket, condition, remaining);
+  } else {
+    ret = private_socket_io_condition_wait(socket, condition, remaining);
+  }
+
+  private_socket_wait_done(socket, start);
+
+  return ret;
+}
+
 bool socket_init_once(void) {
 #ifdef _WINDOWS
   WORD ver_req;
@@ -322,6 +502,14 @@ bool socket_init_once(void) {
 }
 
 void socket_close_once(void) {
+  int32_t i;
+
+  atomic_store(&private_socket_latency_enabled, false);
+
+  for (i = 0; i < SOCKET_LATENCY_KINDS; i++) {
+    histogram_free(atomic_exchange(&private_socket_latency[i], NULL));
+  }
+
 #ifdef _WINDOWS
   WSACleanup();
 #endif
@@ -380,6 +568,8 @@ Socket *socket_new_from_fd(int32_t fd) {
   }
 #endif
 
+  TRACE_PROBE3(socket__new, ret->fd, (int32_t) ret->family, (int32_t) ret->type);
+
   return ret;
 }
 
@@ -487,6 +677,8 @@ Socket *socket_new(SocketFamily family, SocketType type, SocketProtocol protocol
   }
 #endif
 
+  TRACE_PROBE3(socket__new, ret->fd, (int32_t) ret->family, (int32_t) ret->type);
+
   return ret;
 }
 
@@ -660,6 +852,13 @@ bool socket_check_connect_result(Socket  *socket) {
 
   socket->connected = (val == 0);
 
+  TRACE_PROBE2(socket__connect__done, socket->fd, val);
+
+  if (val == 0 && socket->connect_started != 0) {
+    private_socket_latency_record(SOCKET_LATENCY_CONNECT, socket->connect_started);
+    socket->connect_started = 0;
+  }
+
   return (val == 0);
 }
 
@@ -719,6 +918,117 @@ void socket_set_timeout(Socket *socket, int32_t timeout) {
   socket->timeout = timeout;
 }
 
+/* Counters start from zero every time they are enabled */
+bool socket_set_stats_enabled(Socket *socket, bool enabled) {
+  if (UNLIKELY(socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (enabled == false) {
+    free(socket->stats);
+    socket->stats = NULL;
+    return true;
+  }
+
+  if (socket->stats == NULL &&
+      UNLIKELY((socket->stats = calloc(sizeof(atomic_uint_fast64_t), SOCKET_STATS_COUNTERS)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for socket stats");
+    return false;
+  }
+
+  return true;
+}
+
+bool socket_get_stats(const Socket *socket, SocketStats *stats) {
+  size_t i;
+
+  if (UNLIKELY(socket == NULL || stats == NULL || socket->stats == NULL)) {
+    return false;
+  }
+
+  for (i = 0; i < SOCKET_STATS_COUNTERS; i++) {
+    ((uint64_t *) stats)[i] = atomic_load_explicit(&socket->stats[i], memory_order_relaxed);
+  }
+
+  return true;
+}
+
+/* Totals over every socket that had stats enabled */
+void socket_get_global_stats(SocketStats *stats) {
+  size_t i, j;
+
+  if (UNLIKELY(stats == NULL)) {
+    return;
+  }
+
+  memset(stats, 0, sizeof(SocketStats));
+
+  for (i = 0; i < SOCKET_STATS_SHARDS; i++) {
+    for (j = 0; j < SOCKET_STATS_COUNTERS; j++) {
+      ((uint64_t *) stats)[j] += atomic_load_explicit(&private_socket_stats_shards[i].counters[j],
+                                                      memory_order_relaxed);
+    }
+  }
+}
+
+/* Histograms are created on the first enable and kept until
+ * socket_close_once(), disabling only stops recording */
+bool socket_set_latency_tracking(bool enabled) {
+  Histogram *histogram, *expected;
+  int32_t i;
+
+  if (enabled) {
+    for (i = 0; i < SOCKET_LATENCY_KINDS; i++) {
+      if (atomic_load(&private_socket_latency[i]) != NULL) {
+        continue;
+      }
+
+      if (UNLIKELY((histogram = histogram_new()) == NULL)) {
+        return false;
+      }
+
+      expected = NULL;
+
+      if (atomic_compare_exchange_strong(&private_socket_latency[i], &expected, histogram) == false) {
+        histogram_free(histogram);
+      }
+    }
+  }
+
+  atomic_store(&private_socket_latency_enabled, enabled);
+
+  return true;
+}
+
+/* Values are in microseconds, NULL until tracking was enabled once */
+Histogram *socket_get_latency_histogram(SocketLatency kind) {
+  if (UNLIKELY((int32_t) kind < 0 || kind >= SOCKET_LATENCY_KINDS)) {
+    return NULL;
+  }
+
+  return atomic_load(&private_socket_latency[kind]);
+}
+
+void socket_set_accept_filter(Socket *socket, SocketAcceptFilter filter, void *data) {
+  if (UNLIKELY(socket == NULL)) {
+    return;
+  }
+
+  socket->accept_filter = filter;
+  socket->accept_filter_data = data;
+}
+
+/* Called with the filter data when a connection the filter let through
+ * is dropped because no Socket could be created for it */
+void socket_set_accept_undo(Socket *socket, SocketAcceptUndo undo) {
+  if (UNLIKELY(socket == NULL)) {
+    return;
+  }
+
+  socket->accept_undo = undo;
+}
+
 bool socket_bind(const Socket *socket, SocketAddress  *address, bool allow_reuse) {
   struct sockaddr_storage addr;
 
@@ -791,7 +1101,7 @@ bool socket_bind(const Socket *socket, SocketAddress  *address, bool allow_reuse
   return true;
 }
 
-bool socket_connect(Socket *socket, SocketAddress *address) {
+static bool private_socket_connect(Socket *socket, SocketAddress *address, bool use_deadline, uint64_t deadline) {
   struct sockaddr_storage buffer;
   int32_t err_code;
   int32_t conn_result;
@@ -811,6 +1121,9 @@ bool socket_connect(Socket *socket, SocketAddress *address) {
     return false;
   }
 
+  /* Finished by socket_check_connect_result() when connect() is in progress */
+  socket->connect_started = private_socket_latency_start();
+
 #if !defined(_WINDOWS) && defined(EINTR)
   for (;;) {
     conn_result = connect(socket->fd, (struct sockaddr *)&buffer,
@@ -837,15 +1150,25 @@ bool socket_connect(Socket *socket, SocketAddress *address) {
   }
 #endif
 
+  TRACE_PROBE2(socket__connect, socket->fd, conn_result == 0 ? 0 : err_code);
+
   if (conn_result == 0) {
     socket->connected = true;
+    private_socket_latency_record(SOCKET_LATENCY_CONNECT, socket->connect_started);
+    socket->connect_started = 0;
     return true;
   }
 
   sock_err = error_get_io_from_system(err_code);
 
   if (LIKELY(sock_err == ERROR_IO_WOULD_BLOCK || sock_err == ERROR_IO_IN_PROGRESS)) {
-    if (socket->blocking) {
+    if (use_deadline) {
+      if (private_socket_wait_until(socket, SOCKET_IO_CONDITION_POLLOUT, deadline) == true &&
+          socket_check_connect_result(socket) == true) {
+        socket->connected = true;
+        return true;
+      }
+    } else if (socket->blocking) {
       if (socket_io_condition_wait(socket,
               SOCKET_IO_CONDITION_POLLOUT) == true &&
           socket_check_connect_result(socket) == true) {
@@ -862,6 +1185,14 @@ bool socket_connect(Socket *socket, SocketAddress *address) {
   return false;
 }
 
+bool socket_connect(Socket *socket, SocketAddress *address) {
+  return private_socket_connect(socket, address, false, 0);
+}
+
+bool socket_connect_until(Socket *socket, SocketAddress *address, uint64_t deadline) {
+  return private_socket_connect(socket, address, true, deadline);
+}
+
 bool socket_listen(Socket *socket) {
   if (UNLIKELY(socket == NULL)) {
     error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
@@ -885,11 +1216,17 @@ bool socket_listen(Socket *socket) {
   return true;
 }
 
-Socket *socket_accept(const Socket  *socket) {
+static Socket *private_socket_accept(const Socket *socket, bool use_deadline, uint64_t deadline) {
   Socket *ret;
   ErrorIO sock_err;
   int32_t res;
   int32_t err_code;
+  struct sockaddr_storage peer;
+  SocketAddressKey key;
+  SocketAcceptVerdict verdict;
+  struct linger linger;
+  socklen_t peer_len;
+  uint64_t start;
 #ifndef _WINDOWS
   int32_t flags;
 #endif
@@ -904,13 +1241,10 @@ Socket *socket_accept(const Socket  *socket) {
   }
 
   for (;;) {
-    if (socket->blocking &&
-        socket_io_condition_wait(socket,
-            SOCKET_IO_CONDITION_POLLIN) == false) {
-      return NULL;
-	  }
+    peer_len = sizeof(peer);
 
-    if ((res = (int32_t)accept(socket->fd, NULL, 0)) < 0) {
+    if ((res = (int32_t)accept(socket->fd, socket->accept_filter != NULL ? (struct sockaddr *) &peer : NULL,
+                               socket->accept_filter != NULL ? &peer_len : NULL)) < 0) {
       err_code = error_get_last_net();
 #if !defined(_WINDOWS) && defined(EINTR)
       if (error_get_last_net() == EINTR) {
@@ -919,7 +1253,19 @@ Socket *socket_accept(const Socket  *socket) {
 #endif
       sock_err = error_get_io_from_system(err_code);
 
+      if (use_deadline && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (private_socket_wait_until(socket, SOCKET_IO_CONDITION_POLLIN, deadline) == false) {
+          return NULL;
+        }
+
+        continue;
+      }
+
       if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLIN) == false) {
+          return NULL;
+        }
+
         continue;
       }
 
@@ -928,6 +1274,29 @@ Socket *socket_accept(const Socket  *socket) {
       return NULL;
     }
 
+    start = private_socket_latency_start();
+    verdict = (SocketAcceptVerdict) 0;
+
+    /* Denied peers are dropped here, before anything is allocated for them */
+    if (socket->accept_filter != NULL && socket_address_key_from_native(&peer, (size_t) peer_len, &key) &&
+        (verdict = socket->accept_filter(&key, socket->accept_filter_data)) >= SOCKET_ACCEPT_DENY) {
+      /* A reset skips FIN_WAIT and TIME_WAIT and frees the kernel state at once */
+      if (verdict == SOCKET_ACCEPT_RESET) {
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+
+        if (UNLIKELY(setsockopt(res, SOL_SOCKET, SO_LINGER, (const void *) &linger, sizeof(linger)) < 0)) {
+          ALERT_WARNING("Socket::socket_accept: setsockopt() with SO_LINGER failed");
+        }
+      }
+
+      if (UNLIKELY(sys_close(res) != 0)) {
+        ALERT_WARNING("Socket::socket_accept: sys_close() failed");
+      }
+
+      continue;
+    }
+
     break;
   }
 
@@ -950,17 +1319,33 @@ Socket *socket_accept(const Socket  *socket) {
     if (UNLIKELY(sys_close(res) != 0)) {
       ALERT_WARNING("Socket::socket_accept: sys_close() failed");
     }
+
+    /* The filter may have counted the connection, nobody can release it now */
+    if (verdict != 0 && socket->accept_undo != NULL) {
+      socket->accept_undo(&key, socket->accept_filter_data);
+    }
   } else {
     ret->protocol = socket->protocol;
+    private_socket_latency_record(SOCKET_LATENCY_ACCEPT, start);
+    TRACE_PROBE2(socket__accept, socket->fd, res);
   }
 
   return ret;
 }
 
+Socket *socket_accept(const Socket *socket) {
+  return private_socket_accept(socket, false, 0);
+}
+
+Socket *socket_accept_until(const Socket *socket, uint64_t deadline) {
+  return private_socket_accept(socket, true, deadline);
+}
+
 ssize_t socket_receive(const Socket *socket, char *buffer, size_t buflen) {
   ErrorIO sock_err;
   ssize_t ret;
   int32_t err_code;
+  uint64_t start;
 
   if (UNLIKELY(socket == NULL || buffer == NULL)) {
     error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0,  "Invalid input argument");
@@ -971,27 +1356,35 @@ ssize_t socket_receive(const Socket *socket, char *buffer, size_t buflen) {
     return -1;
   }
 
+  start = private_socket_latency_start();
+
   for (;;) {
-    if (socket->blocking &&
-        socket_io_condition_wait(socket,
-            SOCKET_IO_CONDITION_POLLIN) == false) {
-      return -1;
-	  }
+    SOCKET_STATS_ADD(socket, receive_calls, 1);
 
     if ((ret = recv(socket->fd, buffer, (socklen_t) buflen, 0)) < 0) {
       err_code = error_get_last_net();
 
 #if !defined(_WINDOWS) && defined(EINTR)
       if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
         continue;
       }
 #endif
       sock_err = error_get_io_from_system(err_code);
 
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+      }
+
       if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLIN) == false) {
+          return -1;
+        }
+
         continue;
       }
 
+      TRACE_PROBE3(socket__receive, socket->fd, -1, err_code);
       error_set_error((int32_t)sock_err, err_code, "Failed to call recv() on socket");
 
       return -1;
@@ -1000,6 +1393,10 @@ ssize_t socket_receive(const Socket *socket, char *buffer, size_t buflen) {
     break;
   }
 
+  SOCKET_STATS_ADD(socket, bytes_received, (uint64_t)ret);
+  TRACE_PROBE3(socket__receive, socket->fd, ret, 0);
+  private_socket_latency_record(SOCKET_LATENCY_RECEIVE, start);
+
   return ret;
 }
 
@@ -1022,11 +1419,7 @@ ssize_t socket_receive_from(const Socket *socket, SocketAddress  **address, char
   optlen = sizeof(sa);
 
   for (;;) {
-    if (socket->blocking &&
-        socket_io_condition_wait(socket,
-            SOCKET_IO_CONDITION_POLLIN) == false) {
-      return -1;
-	  }
+    SOCKET_STATS_ADD(socket, receive_calls, 1);
 
     if ((ret = recvfrom(socket->fd,
              buffer,
@@ -1038,15 +1431,25 @@ ssize_t socket_receive_from(const Socket *socket, SocketAddress  **address, char
 
 #if !defined(_WINDOWS) && defined(EINTR)
       if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
         continue;
       }
 #endif
       sock_err = error_get_io_from_system(err_code);
 
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+      }
+
       if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLIN) == false) {
+          return -1;
+        }
+
         continue;
       }
 
+      TRACE_PROBE3(socket__receive, socket->fd, -1, err_code);
       error_set_error((int32_t)sock_err, err_code, "Failed to call recvfrom() on socket");
 
       return -1;
@@ -1059,6 +1462,9 @@ ssize_t socket_receive_from(const Socket *socket, SocketAddress  **address, char
     *address = socket_address_new_from_native(&sa, optlen);
   }
 
+  SOCKET_STATS_ADD(socket, bytes_received, (uint64_t)ret);
+  TRACE_PROBE3(socket__receive, socket->fd, ret, 0);
+
   return ret;
 }
 
@@ -1077,11 +1483,7 @@ ssize_t socket_send(const Socket *socket, const char *buffer, size_t buflen) {
   }
 
   for (;;) {
-    if (socket->blocking &&
-        socket_io_condition_wait(socket,
-            SOCKET_IO_CONDITION_POLLOUT) == false) {
-      return -1;
-	  }
+    SOCKET_STATS_ADD(socket, send_calls, 1);
 
     if ((ret = send (socket->fd,
          buffer,
@@ -1091,15 +1493,25 @@ ssize_t socket_send(const Socket *socket, const char *buffer, size_t buflen) {
 
 #if !defined(_WINDOWS) && defined(EINTR)
       if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
         continue;
       }
 #endif
       sock_err = error_get_io_from_system(err_code);
 
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+      }
+
       if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLOUT) == false) {
+          return -1;
+        }
+
         continue;
       }
 
+      TRACE_PROBE3(socket__send, socket->fd, -1, err_code);
       error_set_error((int32_t)sock_err, err_code, "Failed to call send() on socket");
 
       return -1;
@@ -1108,6 +1520,100 @@ ssize_t socket_send(const Socket *socket, const char *buffer, size_t buflen) {
     break;
   }
 
+  SOCKET_STATS_ADD(socket, bytes_sent, (uint64_t)ret);
+  TRACE_PROBE3(socket__send, socket->fd, ret, 0);
+
+  return ret;
+}
+
+/* Gathers the buffers into one send, returns the bytes written which may
+ * end in the middle of a buffer */
+ssize_t socket_send_iov(const Socket *socket, const SocketBuffer *buffers, size_t count) {
+  ErrorIO sock_err;
+  ssize_t ret;
+  int32_t err_code;
+  size_t i;
+#ifdef _WINDOWS
+  WSABUF iov[SOCKET_IOV_MAX];
+  DWORD sent;
+#else
+  struct iovec iov[SOCKET_IOV_MAX];
+  struct msghdr msg;
+#endif
+
+  if (UNLIKELY(socket == NULL || buffers == NULL || count == 0)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (UNLIKELY(private_socket_check(socket) == false)) {
+    return -1;
+  }
+
+  if (count > SOCKET_IOV_MAX) {
+    count = SOCKET_IOV_MAX;
+  }
+
+  for (i = 0; i < count; i++) {
+#ifdef _WINDOWS
+    iov[i].buf = (CHAR *) buffers[i].data;
+    iov[i].len = (ULONG) buffers[i].len;
+#else
+    iov[i].iov_base = (void *) buffers[i].data;
+    iov[i].iov_len = buffers[i].len;
+#endif
+  }
+
+#ifndef _WINDOWS
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+#endif
+
+  for (;;) {
+    SOCKET_STATS_ADD(socket, send_calls, 1);
+
+#ifdef _WINDOWS
+    ret = WSASend(socket->fd, iov, (DWORD) count, &sent, 0, NULL, NULL) == 0 ? (ssize_t) sent : -1;
+#else
+    ret = sendmsg(socket->fd, &msg, SOCKET_DEFAULT_SEND_FLAGS);
+#endif
+
+    if (ret < 0) {
+      err_code = error_get_last_net();
+
+#if !defined(_WINDOWS) && defined(EINTR)
+      if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
+        continue;
+      }
+#endif
+      sock_err = error_get_io_from_system(err_code);
+
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+      }
+
+      if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLOUT) == false) {
+          return -1;
+        }
+
+        continue;
+      }
+
+      TRACE_PROBE3(socket__send, socket->fd, -1, err_code);
+      error_set_error((int32_t)sock_err, err_code, "Failed to call sendmsg() on socket");
+
+      return -1;
+    }
+
+    break;
+  }
+
+  SOCKET_STATS_ADD(socket, bytes_sent, (uint64_t)ret);
+  TRACE_PROBE3(socket__send, socket->fd, ret, 0);
+
   return ret;
 }
 
@@ -1135,10 +1641,7 @@ ssize_t socket_send_to(const Socket *socket, SocketAddress *address, const char
   optlen = (socklen_t)socket_address_get_native_size(address);
 
   for (;;) {
-    if (socket->blocking &&
-        socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLOUT) == false) {
-      return -1;
-	  }
+    SOCKET_STATS_ADD(socket, send_calls, 1);
 
     if ((ret = sendto (socket->fd,
            buffer,
@@ -1150,15 +1653,25 @@ ssize_t socket_send_to(const Socket *socket, SocketAddress *address, const char
 
 #if !defined(_WINDOWS) && defined(EINTR)
       if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
         continue;
       }
 #endif
       sock_err = error_get_io_from_system(err_code);
 
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+      }
+
       if (socket->blocking && sock_err == ERROR_IO_WOULD_BLOCK) {
+        if (socket_io_condition_wait(socket, SOCKET_IO_CONDITION_POLLOUT) == false) {
+          return -1;
+        }
+
         continue;
       }
 
+      TRACE_PROBE3(socket__send, socket->fd, -1, err_code);
       error_set_error((int32_t)sock_err, err_code, "Failed to call sendto() on socket");
 
       return -1;
@@ -1167,9 +1680,287 @@ ssize_t socket_send_to(const Socket *socket, SocketAddress *address, const char
     break;
   }
 
+  SOCKET_STATS_ADD(socket, bytes_sent, (uint64_t)ret);
+  TRACE_PROBE3(socket__send, socket->fd, ret, 0);
+
   return ret;
 }
 
+ssize_t socket_receive_until(const Socket *socket, char *buffer, size_t buflen, uint64_t deadline) {
+  ErrorIO sock_err;
+  ssize_t ret;
+  int32_t err_code;
+  uint64_t start;
+
+  if (UNLIKELY(socket == NULL || buffer == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (UNLIKELY(private_socket_check(socket) == false)) {
+    return -1;
+  }
+
+  start = private_socket_latency_start();
+
+  for (;;) {
+    SOCKET_STATS_ADD(socket, receive_calls, 1);
+
+    if ((ret = recv(socket->fd, buffer, (socklen_t) buflen, 0)) < 0) {
+      err_code = error_get_last_net();
+
+#if !defined(_WINDOWS) && defined(EINTR)
+      if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
+        continue;
+      }
+#endif
+      sock_err = error_get_io_from_system(err_code);
+
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+
+        if (private_socket_wait_until(socket, SOCKET_IO_CONDITION_POLLIN, deadline) == false) {
+          return -1;
+        }
+
+        continue;
+      }
+
+      TRACE_PROBE3(socket__receive, socket->fd, -1, err_code);
+      error_set_error((int32_t)sock_err, err_code, "Failed to call recv() on socket");
+
+      return -1;
+    }
+
+    break;
+  }
+
+  SOCKET_STATS_ADD(socket, bytes_received, (uint64_t)ret);
+  TRACE_PROBE3(socket__receive, socket->fd, ret, 0);
+  private_socket_latency_record(SOCKET_LATENCY_RECEIVE, start);
+
+  return ret;
+}
+
+/* Fills the whole buffer unless the peer closes first. The bytes read
+ * so far go to done, also when -1 is returned, so the caller knows how
+ * much of the stream was consumed. */
+ssize_t socket_receive_exact_until(const Socket *socket, char *buffer, size_t buflen, uint64_t deadline,
+                                   size_t *done) {
+  ssize_t ret;
+  size_t total;
+
+  if (done != NULL) {
+    *done = 0;
+  }
+
+  if (UNLIKELY(socket == NULL || buffer == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  total = 0;
+
+  while (total < buflen) {
+    if ((ret = socket_receive_until(socket, buffer + total, buflen - total, deadline)) < 0) {
+      return -1;
+    }
+
+    /* Peer closed the connection, report what we have */
+    if (ret == 0) {
+      break;
+    }
+
+    total += (size_t)ret;
+
+    if (done != NULL) {
+      *done = total;
+    }
+  }
+
+  return (ssize_t)total;
+}
+
+/* Writes the whole buffer, done reports the bytes written like for
+ * socket_receive_exact_until() */
+ssize_t socket_send_all_until(const Socket *socket, const char *buffer, size_t buflen, uint64_t deadline,
+                              size_t *done) {
+  ErrorIO sock_err;
+  ssize_t ret;
+  size_t total;
+  int32_t err_code;
+
+  if (done != NULL) {
+    *done = 0;
+  }
+
+  if (UNLIKELY(socket == NULL || buffer == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (UNLIKELY(private_socket_check(socket) == false)) {
+    return -1;
+  }
+
+  total = 0;
+
+  while (total < buflen) {
+    SOCKET_STATS_ADD(socket, send_calls, 1);
+
+    if ((ret = send(socket->fd,
+         buffer + total,
+         (socklen_t) (buflen - total),
+         SOCKET_DEFAULT_SEND_FLAGS)) < 0) {
+      err_code = error_get_last_net();
+
+#if !defined(_WINDOWS) && defined(EINTR)
+      if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
+        continue;
+      }
+#endif
+      sock_err = error_get_io_from_system(err_code);
+
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+
+        if (private_socket_wait_until(socket, SOCKET_IO_CONDITION_POLLOUT, deadline) == false) {
+          return -1;
+        }
+
+        continue;
+      }
+
+      TRACE_PROBE3(socket__send, socket->fd, -1, err_code);
+      error_set_error((int32_t)sock_err, err_code, "Failed to call send() on socket");
+
+      return -1;
+    }
+
+    SOCKET_STATS_ADD(socket, bytes_sent, (uint64_t)ret);
+    TRACE_PROBE3(socket__send, socket->fd, ret, 0);
+    total += (size_t)ret;
+
+    if (done != NULL) {
+      *done = total;
+    }
+  }
+
+  return (ssize_t)total;
+}
+
+/* Writes all the buffers, resuming partial writes inside a buffer, done
+ * reports the bytes written like for socket_send_all_until() */
+ssize_t socket_send_iov_all_until(const Socket *socket, const SocketBuffer *buffers, size_t count,
+                                  uint64_t deadline, size_t *done) {
+  ErrorIO sock_err;
+  ssize_t ret;
+  size_t total, index, offset, taken, n;
+  int32_t err_code;
+#ifdef _WINDOWS
+  WSABUF iov[SOCKET_IOV_MAX];
+  DWORD sent;
+#else
+  struct iovec iov[SOCKET_IOV_MAX];
+  struct msghdr msg;
+#endif
+
+  if (done != NULL) {
+    *done = 0;
+  }
+
+  if (UNLIKELY(socket == NULL || (buffers == NULL && count > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (UNLIKELY(private_socket_check(socket) == false)) {
+    return -1;
+  }
+
+  total = index = offset = 0;
+
+  for (;;) {
+    while (index < count && offset == buffers[index].len) {
+      index++;
+      offset = 0;
+    }
+
+    if (index == count) {
+      break;
+    }
+
+    for (n = 0; n < SOCKET_IOV_MAX && index + n < count; n++) {
+#ifdef _WINDOWS
+      iov[n].buf = (CHAR *) buffers[index + n].data + (n == 0 ? offset : 0);
+      iov[n].len = (ULONG) (buffers[index + n].len - (n == 0 ? offset : 0));
+#else
+      iov[n].iov_base = (void *) (buffers[index + n].data + (n == 0 ? offset : 0));
+      iov[n].iov_len = buffers[index + n].len - (n == 0 ? offset : 0);
+#endif
+    }
+
+    SOCKET_STATS_ADD(socket, send_calls, 1);
+
+#ifdef _WINDOWS
+    ret = WSASend(socket->fd, iov, (DWORD) n, &sent, 0, NULL, NULL) == 0 ? (ssize_t) sent : -1;
+#else
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ret = sendmsg(socket->fd, &msg, SOCKET_DEFAULT_SEND_FLAGS);
+#endif
+
+    if (ret < 0) {
+      err_code = error_get_last_net();
+
+#if !defined(_WINDOWS) && defined(EINTR)
+      if (err_code == EINTR) {
+        SOCKET_STATS_ADD(socket, interrupted, 1);
+        continue;
+      }
+#endif
+      sock_err = error_get_io_from_system(err_code);
+
+      if (sock_err == ERROR_IO_WOULD_BLOCK) {
+        SOCKET_STATS_ADD(socket, would_block, 1);
+
+        if (private_socket_wait_until(socket, SOCKET_IO_CONDITION_POLLOUT, deadline) == false) {
+          return -1;
+        }
+
+        continue;
+      }
+
+      TRACE_PROBE3(socket__send, socket->fd, -1, err_code);
+      error_set_error((int32_t)sock_err, err_code, "Failed to call sendmsg() on socket");
+
+      return -1;
+    }
+
+    SOCKET_STATS_ADD(socket, bytes_sent, (uint64_t)ret);
+    TRACE_PROBE3(socket__send, socket->fd, ret, 0);
+    total += (size_t)ret;
+
+    if (done != NULL) {
+      *done = total;
+    }
+
+    for (; ret > 0; ret -= (ssize_t) taken) {
+      taken = buffers[index].len - offset < (size_t) ret ? buffers[index].len - offset : (size_t) ret;
+
+      if ((offset += taken) == buffers[index].len) {
+        index++;
+        offset = 0;
+      }
+    }
+  }
+
+  return (ssize_t)total;
+}
+
 bool socket_close(Socket *socket) {
   int32_t err_code;
 
@@ -1182,6 +1973,8 @@ bool socket_close(Socket *socket) {
     return true;
   }
 
+  TRACE_PROBE1(socket__close, socket->fd);
+
   if (LIKELY(sys_close(socket->fd) == 0)) {
     socket->connected = false;
     socket->closed = true;
@@ -1261,6 +2054,7 @@ void socket_free(Socket *socket) {
 
   socket_close(socket);
 
+  free(socket->stats);
   free(socket);
 }
 
@@ -1296,11 +2090,57 @@ bool socket_set_buffer_size(const Socket *socket, SocketDirection dir, size_t si
   return true;
 }
 
+/* Fields the platform doesn't report are left at zero */
+bool socket_get_tcp_info(const Socket *socket, SocketTcpInfo *info) {
+#ifdef SOCKET_USE_TCP_INFO
+  SocketLinuxTcpInfo native;
+  socklen_t optlen;
+#endif
+
+  if (UNLIKELY(socket == NULL || info == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY(private_socket_check(socket) == false)) {
+    return false;
+  }
+
+  memset(info, 0, sizeof(SocketTcpInfo));
+
+#ifdef SOCKET_USE_TCP_INFO
+  memset(&native, 0, sizeof(native));
+  optlen = sizeof(native);
+
+  if (UNLIKELY(getsockopt(socket->fd, IPPROTO_TCP, TCP_INFO, (void *) &native, &optlen) != 0)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_net()),
+      (int32_t)error_get_last_net(),
+      "Failed to call getsockopt() on socket to get TCP info"
+    );
+    return false;
+  }
+
+  info->rtt_usec = native.tcpi_rtt;
+  info->rtt_var_usec = native.tcpi_rttvar;
+  info->min_rtt_usec = native.tcpi_min_rtt;
+  info->cwnd = native.tcpi_snd_cwnd;
+  info->mss = native.tcpi_snd_mss;
+  info->unacked = native.tcpi_unacked;
+  info->lost = native.tcpi_lost;
+  info->retransmits = native.tcpi_total_retrans;
+  info->delivery_rate = native.tcpi_delivery_rate;
+
+  return true;
+#else
+  error_set_error((int32_t)ERROR_IO_NOT_SUPPORTED, 0, "TCP info is not supported on this platform");
+  return false;
+#endif
+}
+
 bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition) {
-#if defined(_WINDOWS)
-  int32_t network_events;
-  int32_t evret;
-  int32_t timeout;
+  uint64_t start;
+  bool ret;
 
   if (UNLIKELY(socket == NULL)) {
     error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
@@ -1311,7 +2151,26 @@ bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition)
     return false;
   }
 
-  timeout = socket->timeout > 0 ? socket->timeout : WSA_INFINITE;
+  start = socket->stats != NULL ? sys_time_monotonic_usec() : private_socket_latency_start();
+
+  /* Inside a coroutine only the coroutine is parked, not the thread */
+  if (coroutine_is_active()) {
+    ret = coroutine_io_wait(socket, condition, socket->timeout);
+  } else {
+    ret = private_socket_io_condition_wait(socket, condition, socket->timeout);
+  }
+
+  private_socket_wait_done(socket, start);
+
+  return ret;
+}
+
+static bool private_socket_io_condition_wait(const Socket *socket, SocketIOCondition condition, int32_t timeout) {
+#if defined(_WINDOWS)
+  int32_t network_events;
+  int32_t evret;
+
+  timeout = timeout > 0 ? timeout : WSA_INFINITE;
 
   if (condition == SOCKET_IO_CONDITION_POLLIN) {
     network_events = FD_READ | FD_ACCEPT;
@@ -1344,18 +2203,8 @@ bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition)
 #elif defined(SOCKET_USE_POLL)
   struct pollfd pfd;
   int32_t evret;
-  int32_t timeout;
-
-  if (UNLIKELY(socket == NULL)) {
-    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
-    return false;
-  }
 
-  if (UNLIKELY(private_socket_check(socket) == false)) {
-    return false;
-  }
-
-  timeout = socket->timeout > 0 ? socket->timeout : -1;
+  timeout = timeout > 0 ? timeout : -1;
 
   pfd.fd = socket->fd;
   pfd.revents = 0;
@@ -1399,16 +2248,7 @@ bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition)
   struct timeval *ptv;
   int32_t evret;
 
-  if (UNLIKELY(socket == NULL)) {
-    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
-    return false;
-  }
-
-  if (UNLIKELY(private_socket_check(socket) == false)) {
-    return false;
-  }
-
-  if (socket->timeout > 0) {
+  if (timeout > 0) {
     ptv = &tv;
   } else {
     ptv = NULL;
@@ -1418,9 +2258,9 @@ bool socket_io_condition_wait(const Socket *socket, SocketIOCondition condition)
     FD_ZERO(&fds);
     FD_SET(socket->fd, &fds);
 
-    if (socket->timeout > 0) {
-      tv.tv_sec  = socket->timeout / 1000;
-      tv.tv_usec = (socket->timeout % 1000) * 1000;
+    if (timeout > 0) {
+      tv.tv_sec  = timeout / 1000;
+      tv.tv_usec = (timeout % 1000) * 1000;
     }
 
     if (condition == SOCKET_IO_CONDITION_POLLIN) {
@@ -32,6 +32,7 @@
 #ifndef _WINDOWS
   #include <arpa/inet.h>
   #include <netdb.h>
+  #include <net/if.h>
 #endif
 
 /* According to Open Group specifications */
@@ -80,6 +81,99 @@ struct SocketAddress {
   uint32_t scope_id;
 };
 
+#define PRIVATE_SOCKET_ADDRESS_IS_DIGIT(c) ((uint8_t)((c) - '0') < 10)
+
+/* Hex digit values, -1 for anything else */
+static const int8_t PRIVATE_SOCKET_ADDRESS_HEX[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static inline char *private_socket_address_put_octet(char *dest, uint32_t value) {
+  if (value >= 100) {
+    *dest++ = (char)('0' + value / 100);
+    value %= 100;
+    *dest++ = (char)('0' + value / 10);
+  } else if (value >= 10) {
+    *dest++ = (char)('0' + value / 10);
+  }
+
+  *dest++ = (char)('0' + value % 10);
+
+  return dest;
+}
+
+static inline char *private_socket_address_put_hex(char *dest, uint32_t value) {
+  static const char digits[] = "0123456789abcdef";
+
+  if (value >= 0x1000) {
+    *dest++ = digits[value >> 12];
+  }
+
+  if (value >= 0x100) {
+    *dest++ = digits[(value >> 8) & 0xf];
+  }
+
+  if (value >= 0x10) {
+    *dest++ = digits[(value >> 4) & 0xf];
+  }
+
+  *dest++ = digits[value & 0xf];
+
+  return dest;
+}
+
+/* Numeric zone ids everywhere, interface names where if_nametoindex() exists */
+static bool private_socket_address_parse_zone(const char *str, size_t len, uint32_t *scope_id) {
+  uint64_t value;
+  size_t i;
+#ifndef _WINDOWS
+  char name[IF_NAMESIZE];
+#endif
+
+  if (len == 0) {
+    return false;
+  }
+
+  for (i = 0, value = 0; i < len && PRIVATE_SOCKET_ADDRESS_IS_DIGIT(str[i]); i++) {
+    if ((value = value * 10 + (uint64_t)(str[i] - '0')) > UINT32_MAX) {
+      return false;
+    }
+  }
+
+  if (i == len) {
+    *scope_id = (uint32_t)value;
+    return true;
+  }
+
+#ifndef _WINDOWS
+  if (len >= IF_NAMESIZE) {
+    return false;
+  }
+
+  memcpy(name, str, len);
+  name[len] = '\0';
+
+  return (*scope_id = if_nametoindex(name)) != 0;
+#else
+  return false;
+#endif
+}
+
 SocketAddress *socket_address_new_from_native(const void *native, size_t len) {
   SocketAddress *ret;
   uint16_t family;
@@ -133,94 +227,49 @@ SocketAddress *socket_address_new_from_native(const void *native, size_t len) {
 
 SocketAddress *socket_address_new(const char *address, uint16_t port) {
   SocketAddress *ret;
-#if defined(_WINDOWS)
-  struct addrinfo hints;
-  struct addrinfo *res;
-#endif
-
-#ifdef _WINDOWS
-  struct sockaddr_storage sa;
-  struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
-	#ifdef AF_INET6
-  	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &sa;
-	#endif /* AF_INET6 */
-  int32_t len;
-#endif /* _WINDOWS */
+  SocketFamily family;
+  uint8_t bytes[16];
+  uint32_t scope_id;
+  size_t len;
 
   if (UNLIKELY(address == NULL)) {
     return NULL;
   }
 
-#if (defined(_WINDOWS) || defined(AF_INET6))
-  if (strchr(address, ':') != NULL) {
-    memset(&hints, 0, sizeof(hints));
+  len = strlen(address);
+  scope_id = 0;
 
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = 0;
-#if !defined(__USLC__) || !defined(__UNIXWARE__)
-    hints.ai_flags = AI_NUMERICHOST;
-#endif
-
-    if (UNLIKELY(getaddrinfo(address, NULL, &hints, &res) != 0)) {
-      return NULL;
-    }
-    
-    if (LIKELY(res->ai_family == AF_INET6 &&
-            res->ai_addrlen == sizeof(struct sockaddr_in6))) {
-      ((struct sockaddr_in6 *) res->ai_addr)->sin6_port = htons(port);
-      ret = socket_address_new_from_native(res->ai_addr, res->ai_addrlen);
-    } else {
-      ret = NULL;
-    }
-
-    freeaddrinfo(res);
-    return ret;
+  if (socket_address_parse_ipv4(address, len, bytes)) {
+    family = SOCKET_FAMILY_INET;
+  }
+#ifdef AF_INET6
+  else if (socket_address_parse_ipv6(address, len, bytes, &scope_id)) {
+    family = SOCKET_FAMILY_INET6;
   }
 #endif
+  else {
+    return NULL;
+  }
 
   if (UNLIKELY((ret = calloc(sizeof(SocketAddress), 1)) == NULL)) {
     ALERT_ERROR("SocketAddress::socket_address_new: failed to allocate memory");
     return NULL;
   }
 
-  ret->port = port;
-
-#ifdef _WINDOWS
-  memset(&sa, 0, sizeof(sa));
-  len = sizeof(sa);
-  sin->sin_family = AF_INET;
-
-  if (WSAStringToAddressA((LPSTR) address, AF_INET, NULL, (LPSOCKADDR) &sa, &len) == 0) {
-    memcpy(&ret->addr.sin_addr, &sin->sin_addr, sizeof(struct in_addr));
-    ret->family = SOCKET_FAMILY_INET;
-    return ret;
+  if (family == SOCKET_FAMILY_INET) {
+    memcpy(&ret->addr.sin_addr, bytes, 4);
   }
-	#ifdef AF_INET6
+#ifdef AF_INET6
   else {
-    sin6->sin6_family = AF_INET6;
-    if (WSAStringToAddressA((LPSTR) address, AF_INET6, NULL, (LPSOCKADDR) &sa, &len) == 0) {
-      memcpy(&ret->addr.sin6_addr, &sin6->sin6_addr, sizeof(struct in6_addr));
-      ret->family = SOCKET_FAMILY_INET6;
-      return ret;
-    }
+    memcpy(&ret->addr.sin6_addr, bytes, 16);
   }
-	#endif /* AF_INET6 */
-#else /* _WINDOWS */
-  if (inet_pton(AF_INET, address, &ret->addr.sin_addr) > 0) {
-    ret->family = SOCKET_FAMILY_INET;
-    return ret;
-  }
-	#ifdef AF_INET6
-  else if (inet_pton(AF_INET6, address, &ret->addr.sin6_addr) > 0) {
-    ret->family = SOCKET_FAMILY_INET6;
-    return ret;
-  }
-	#endif /* AF_INET6 */
-#endif /* _WINDOWS */
+#endif
 
-  free(ret);
-  return NULL;
+  ret->family = family;
+  ret->port = port;
+  ret->scope_id = scope_id;
+
+  return ret;
 }
 
 SocketAddress *socket_address_new_any(SocketFamily  family, uint16_t port) {
@@ -256,7 +305,7 @@ SocketAddress *socket_address_new_any(SocketFamily  family, uint16_t port) {
 
 SocketAddress *socket_address_new_loopback(SocketFamily family, uint16_t port) {
   SocketAddress *ret;
-  uint8_t loop_addr[] = {127, 0, 0, 0};
+  uint8_t loop_addr[] = {127, 0, 0, 1};
 #ifdef AF_INET6
   struct in6_addr loop6_addr = IN6ADDR_LOOPBACK_INIT;
 #endif
@@ -361,67 +410,11 @@ SocketFamily socket_address_get_family(const SocketAddress *addr) {
 }
 
 char *socket_address_get_address(const SocketAddress *addr) {
-#ifdef AF_INET6
-  char buffer[INET6_ADDRSTRLEN];
-#else
-  char buffer[INET_ADDRSTRLEN];
-#endif
-
-#ifdef _WINDOWS
-  DWORD buflen = sizeof(buffer);
-  DWORD addrlen;
-  struct sockaddr_storage sa;
-  struct sockaddr_in *sin;
-#  ifdef AF_INET6
-  struct sockaddr_in6 *sin6;
-#  endif /* AF_INET6 */
-#endif /* _WINDOWS */
+  char buffer[SOCKET_ADDRESS_IPV6_STRLEN];
 
-  if (UNLIKELY(addr == NULL || addr->family == SOCKET_FAMILY_UNKNOWN)) {
+  if (UNLIKELY(socket_address_format(addr, buffer, sizeof(buffer)) == 0)) {
     return NULL;
   }
-#ifdef _WINDOWS
-  sin = (struct sockaddr_in *) &sa;
-#  ifdef AF_INET6
-  sin6 = (struct sockaddr_in6 *) &sa;
-#  endif /* AF_INET6 */
-#endif /* _WINDOWS */
-
-#ifdef _WINDOWS
-  memset(&sa, 0, sizeof(sa));
-#endif
-
-#ifdef _WINDOWS
-  sa.ss_family = addr->family;
-
-  if (addr->family == SOCKET_FAMILY_INET) {
-    addrlen = sizeof(struct sockaddr_in);
-    memcpy(&sin->sin_addr, &addr->addr.sin_addr, sizeof(struct in_addr));
-  }
-#  ifdef AF_INET6
-  else {
-    addrlen = sizeof(struct sockaddr_in6);
-    memcpy(&sin6->sin6_addr, &addr->addr.sin6_addr, sizeof(struct in6_addr));
-  }
-#  endif /* AF_INET6 */
-
-  if (UNLIKELY(WSAAddressToStringA ((LPSOCKADDR) &sa,
-               addrlen,
-               NULL,
-               (LPSTR) buffer,
-               &buflen) != 0)) {
-    return NULL;
-  }
-#else /* !_WINDOWS */
-  if (addr->family == SOCKET_FAMILY_INET) {
-    inet_ntop(AF_INET, &addr->addr.sin_addr, buffer, sizeof(buffer));
-  }
-#  ifdef AF_INET6
-  else {
-    inet_ntop(AF_INET6, &addr->addr.sin6_addr, buffer, sizeof(buffer));
-  }
-#  endif /* AF_INET6 */
-#endif /* _WINDOWS */
 
   return strdup(buffer);
 }
@@ -578,3 +571,503 @@ void socket_address_free (SocketAddress *addr) {
 
   free(addr);
 }
+
+bool socket_address_parse_ipv4(const char *str, size_t len, uint8_t *dest) {
+  const char *end;
+  uint8_t bytes[4];
+  uint32_t value;
+  int32_t i;
+
+  if (UNLIKELY(str == NULL || dest == NULL)) {
+    return false;
+  }
+
+  end = str + len;
+
+  for (i = 0; i < 4; i++) {
+    if (str == end || !PRIVATE_SOCKET_ADDRESS_IS_DIGIT(*str)) {
+      return false;
+    }
+
+    value = (uint32_t)(*str++ - '0');
+
+    /* Leading zeros would be octal for inet_aton(), reject them like inet_pton() */
+    if (value == 0 && str != end && PRIVATE_SOCKET_ADDRESS_IS_DIGIT(*str)) {
+      return false;
+    }
+
+    while (str != end && PRIVATE_SOCKET_ADDRESS_IS_DIGIT(*str)) {
+      if ((value = value * 10 + (uint32_t)(*str++ - '0')) > 255) {
+        return false;
+      }
+    }
+
+    bytes[i] = (uint8_t)value;
+
+    if (i < 3) {
+      if (str == end || *str != '.') {
+        return false;
+      }
+
+      str++;
+    }
+  }
+
+  if (str != end) {
+    return false;
+  }
+
+  memcpy(dest, bytes, 4);
+
+  return true;
+}
+
+bool socket_address_parse_ipv6(const char *str, size_t len, uint8_t *dest, uint32_t *scope_id) {
+  const char *end, *zone, *group;
+  uint8_t bytes[16];
+  uint32_t value;
+  int32_t digit, pos, gap, i;
+
+  if (UNLIKELY(str == NULL || dest == NULL)) {
+    return false;
+  }
+
+  end = str + len;
+
+  if ((zone = memchr(str, '%', len)) != NULL) {
+    if (scope_id == NULL || private_socket_address_parse_zone(zone + 1, (size_t)(end - zone - 1), scope_id) == false) {
+      return false;
+    }
+
+    end = zone;
+  } else if (scope_id != NULL) {
+    *scope_id = 0;
+  }
+
+  pos = 0;
+  gap = -1;
+
+  if (str != end && *str == ':') {
+    if (end - str < 2 || str[1] != ':') {
+      return false;
+    }
+
+    gap = 0;
+    str += 2;
+  }
+
+  while (str != end) {
+    if (pos == 16) {
+      return false;
+    }
+
+    group = str;
+    value = 0;
+
+    while (str != end && (digit = PRIVATE_SOCKET_ADDRESS_HEX[(uint8_t) *str]) >= 0) {
+      value = (value << 4) | (uint32_t)digit;
+      str++;
+    }
+
+    i = (int32_t)(str - group);
+
+    /* Dotted IPv4 form of the last 32 bits */
+    if (str != end && *str == '.') {
+      if (pos > 12 || socket_address_parse_ipv4(group, (size_t)(end - group), bytes + pos) == false) {
+        return false;
+      }
+
+      pos += 4;
+      break;
+    }
+
+    if (i == 0 || i > 4) {
+      return false;
+    }
+
+    bytes[pos++] = (uint8_t)(value >> 8);
+    bytes[pos++] = (uint8_t)(value & 0xff);
+
+    if (str == end) {
+      break;
+    }
+
+    if (*str++ != ':' || str == end) {
+      return false;
+    }
+
+    if (*str == ':') {
+      if (gap >= 0) {
+        return false;
+      }
+
+      gap = pos;
+      str++;
+    }
+  }
+
+  if (gap >= 0) {
+    if (pos == 16) {
+      return false;
+    }
+
+    memmove(bytes + 16 - (pos - gap), bytes + gap, (size_t)(pos - gap));
+    memset(bytes + gap, 0, (size_t)(16 - pos));
+  } else if (pos != 16) {
+    return false;
+  }
+
+  memcpy(dest, bytes, 16);
+
+  return true;
+}
+
+size_t socket_address_format_ipv4(const uint8_t *addr, char *dest) {
+  char *out;
+  int32_t i;
+
+  if (UNLIKELY(addr == NULL || dest == NULL)) {
+    return 0;
+  }
+
+  out = private_socket_address_put_octet(dest, addr[0]);
+
+  for (i = 1; i < 4; i++) {
+    *out++ = '.';
+    out = private_socket_address_put_octet(out, addr[i]);
+  }
+
+  *out = '\0';
+
+  return (size_t)(out - dest);
+}
+
+size_t socket_address_format_ipv6(const uint8_t *addr, char *dest) {
+  uint16_t words[8];
+  int32_t best_base, best_len, cur_base, i;
+  char *out;
+
+  if (UNLIKELY(addr == NULL || dest == NULL)) {
+    return 0;
+  }
+
+  best_base = -1;
+  best_len = 0;
+  cur_base = -1;
+
+  /* The longest run of zero words, the first one on ties */
+  for (i = 0; i < 8; i++) {
+    words[i] = (uint16_t)((addr[i * 2] << 8) | addr[i * 2 + 1]);
+
+    if (words[i] != 0) {
+      cur_base = -1;
+    } else {
+      if (cur_base < 0) {
+        cur_base = i;
+      }
+
+      if (i - cur_base + 1 > best_len) {
+        best_base = cur_base;
+        best_len = i - cur_base + 1;
+      }
+    }
+  }
+
+  /* A single zero word is not compressed */
+  if (best_len < 2) {
+    best_base = -1;
+  }
+
+  out = dest;
+
+  /* IPv4-mapped addresses keep the dotted form */
+  if (best_base == 0 && best_len == 5 && words[5] == 0xffff) {
+    memcpy(out, "::ffff:", 7);
+
+    return 7 + socket_address_format_ipv4(addr + 12, out + 7);
+  }
+
+  for (i = 0; i < 8; i++) {
+    if (i == best_base) {
+      *out++ = ':';
+      i += best_len - 1;
+
+      if (i == 7) {
+        *out++ = ':';
+      }
+
+      continue;
+    }
+
+    if (i != 0) {
+      *out++ = ':';
+    }
+
+    out = private_socket_address_put_hex(out, words[i]);
+  }
+
+  *out = '\0';
+
+  return (size_t)(out - dest);
+}
+
+size_t socket_address_format(const SocketAddress *addr, char *dest, size_t destlen) {
+  char buffer[SOCKET_ADDRESS_IPV6_STRLEN];
+  size_t len;
+
+  if (UNLIKELY(addr == NULL || dest == NULL || destlen == 0)) {
+    return 0;
+  }
+
+  if (addr->family == SOCKET_FAMILY_INET) {
+    if (LIKELY(destlen >= SOCKET_ADDRESS_IPV4_STRLEN)) {
+      return socket_address_format_ipv4((const uint8_t *) &addr->addr.sin_addr, dest);
+    }
+
+    len = socket_address_format_ipv4((const uint8_t *) &addr->addr.sin_addr, buffer);
+  }
+#ifdef AF_INET6
+  else if (addr->family == SOCKET_FAMILY_INET6) {
+    if (LIKELY(destlen >= SOCKET_ADDRESS_IPV6_STRLEN)) {
+      return socket_address_format_ipv6((const uint8_t *) &addr->addr.sin6_addr, dest);
+    }
+
+    len = socket_address_format_ipv6((const uint8_t *) &addr->addr.sin6_addr, buffer);
+  }
+#endif
+  else {
+    return 0;
+  }
+
+  /* Short buffers still work as long as this address fits */
+  if (len >= destlen) {
+    return 0;
+  }
+
+  memcpy(dest, buffer, len + 1);
+
+  return len;
+}
+
+
+bool socket_address_to_key(const SocketAddress *addr, SocketAddressKey *key) {
+  if (UNLIKELY(addr == NULL || key == NULL)) {
+    return false;
+  }
+
+  if (addr->family == SOCKET_FAMILY_INET) {
+    memset(key->address, 0, 10);
+    key->address[10] = 0xff;
+    key->address[11] = 0xff;
+    memcpy(key->address + 12, &addr->addr.sin_addr, 4);
+    key->family = 4;
+  }
+#ifdef AF_INET6
+  else if (addr->family == SOCKET_FAMILY_INET6) {
+    memcpy(key->address, &addr->addr.sin6_addr, 16);
+    key->family = 6;
+  }
+#endif
+  else {
+    return false;
+  }
+
+  key->port[0] = (uint8_t)(addr->port >> 8);
+  key->port[1] = (uint8_t)(addr->port & 0xff);
+  key->reserved = 0;
+
+  return true;
+}
+
+/* Same as socket_address_to_key() straight from a sockaddr, so hot paths
+ * like accept() can classify a peer without allocating an address */
+bool socket_address_key_from_native(const void *native, size_t len, SocketAddressKey *key) {
+  const struct sockaddr_in *inet;
+#ifdef AF_INET6
+  const struct sockaddr_in6 *inet6;
+#endif
+
+  if (UNLIKELY(native == NULL || key == NULL || len < sizeof(struct sockaddr_in))) {
+    return false;
+  }
+
+  if (((const struct sockaddr *) native)->sa_family == AF_INET) {
+    inet = (const struct sockaddr_in *) native;
+    memset(key->address, 0, 10);
+    key->address[10] = 0xff;
+    key->address[11] = 0xff;
+    memcpy(key->address + 12, &inet->sin_addr, 4);
+    memcpy(key->port, &inet->sin_port, 2);
+    key->family = 4;
+  }
+#ifdef AF_INET6
+  else if (((const struct sockaddr *) native)->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6)) {
+    inet6 = (const struct sockaddr_in6 *) native;
+    memcpy(key->address, &inet6->sin6_addr, 16);
+    memcpy(key->port, &inet6->sin6_port, 2);
+    key->family = 6;
+  }
+#endif
+  else {
+    return false;
+  }
+
+  key->reserved = 0;
+
+  return true;
+}
+
+SocketAddress *socket_address_new_from_key(const SocketAddressKey *key) {
+  SocketAddress *ret;
+
+  if (UNLIKELY(key == NULL || (key->family != 4 && key->family != 6))) {
+    return NULL;
+  }
+
+#ifndef AF_INET6
+  if (key->family == 6) {
+    return NULL;
+  }
+#endif
+
+  if (UNLIKELY((ret = calloc(sizeof(SocketAddress), 1)) == NULL)) {
+    ALERT_ERROR("SocketAddress::socket_address_new_from_key: failed to allocate memory");
+    return NULL;
+  }
+
+  if (key->family == 4) {
+    memcpy(&ret->addr.sin_addr, key->address + 12, 4);
+    ret->family = SOCKET_FAMILY_INET;
+  }
+#ifdef AF_INET6
+  else {
+    memcpy(&ret->addr.sin6_addr, key->address, 16);
+    ret->family = SOCKET_FAMILY_INET6;
+  }
+#endif
+
+  ret->port = (uint16_t)((key->port[0] << 8) | key->port[1]);
+
+  return ret;
+}
+
+bool socket_address_key_equal(const SocketAddressKey *a, const SocketAddressKey *b) {
+  uint64_t a0, a1, b0, b1;
+  uint32_t a2, b2;
+
+  if (UNLIKELY(a == NULL || b == NULL)) {
+    return a == b;
+  }
+
+  memcpy(&a0, (const uint8_t *) a, 8);
+  memcpy(&a1, (const uint8_t *) a + 8, 8);
+  memcpy(&a2, (const uint8_t *) a + 16, 4);
+  memcpy(&b0, (const uint8_t *) b, 8);
+  memcpy(&b1, (const uint8_t *) b + 8, 8);
+  memcpy(&b2, (const uint8_t *) b + 16, 4);
+
+  return ((a0 ^ b0) | (a1 ^ b1) | (uint64_t)(a2 ^ b2)) == 0;
+}
+
+int32_t socket_address_key_compare(const SocketAddressKey *a, const SocketAddressKey *b) {
+  int32_t ret;
+
+  if (UNLIKELY(a == NULL || b == NULL)) {
+    return (a != NULL) - (b != NULL);
+  }
+
+  ret = memcmp(a, b, sizeof(SocketAddressKey));
+
+  return (ret > 0) - (ret < 0);
+}
+
+/* 64x64->128 multiply folded to 64 bits, the core of wyhash */
+static inline uint64_t private_socket_address_mum(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t) a * b;
+
+  return (uint64_t) r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha, hb, la, lb, rh, rm0, rm1, rl, t, lo, hi;
+
+  ha = a >> 32;
+  hb = b >> 32;
+  la = (uint32_t) a;
+  lb = (uint32_t) b;
+  rh = ha * hb;
+  rm0 = ha * lb;
+  rm1 = hb * la;
+  rl = la * lb;
+  t = rl + (rm0 << 32);
+  lo = t + (rm1 << 32);
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+
+  return lo ^ hi;
+#endif
+}
+
+/* wyhash specialized for the fixed 20-byte key */
+uint64_t socket_address_key_hash(const SocketAddressKey *key, uint64_t seed) {
+  uint64_t a, b;
+  uint32_t c;
+
+  if (UNLIKELY(key == NULL)) {
+    return 0;
+  }
+
+  memcpy(&a, (const uint8_t *) key, 8);
+  memcpy(&b, (const uint8_t *) key + 8, 8);
+  memcpy(&c, (const uint8_t *) key + 16, 4);
+
+  seed ^= 0xa0761d6478bd642full;
+  seed = private_socket_address_mum(a ^ 0xe7037ed1a0b428dbull, b ^ seed);
+  seed = private_socket_address_mum((uint64_t) c ^ 0x8ebc6af09c88c6e3ull, seed ^ 0xe7037ed1a0b428dbull);
+
+  return private_socket_address_mum(seed ^ 0x589965cc75374cc3ull, sizeof(SocketAddressKey) ^ 0xe7037ed1a0b428dbull);
+}
+
+bool socket_address_equal(const SocketAddress *a, const SocketAddress *b) {
+  if (UNLIKELY(a == NULL || b == NULL)) {
+    return a == b;
+  }
+
+  if (a->family != b->family || a->port != b->port) {
+    return false;
+  }
+
+  if (a->family == SOCKET_FAMILY_INET) {
+    return memcmp(&a->addr.sin_addr, &b->addr.sin_addr, 4) == 0;
+  }
+#ifdef AF_INET6
+  else if (a->family == SOCKET_FAMILY_INET6) {
+    return memcmp(&a->addr.sin6_addr, &b->addr.sin6_addr, 16) == 0;
+  }
+#endif
+
+  return true;
+}
+
+int32_t socket_address_compare(const SocketAddress *a, const SocketAddress *b) {
+  SocketAddressKey ka, kb;
+  bool va, vb;
+
+  va = socket_address_to_key(a, &ka);
+  vb = socket_address_to_key(b, &kb);
+
+  /* Invalid addresses sort first */
+  if (UNLIKELY(!va || !vb)) {
+    return (int32_t) va - (int32_t) vb;
+  }
+
+  return socket_address_key_compare(&ka, &kb);
+}
+
+uint64_t socket_address_hash(const SocketAddress *addr, uint64_t seed) {
+  SocketAddressKey key;
+
+  if (UNLIKELY(socket_address_to_key(addr, &key) == false)) {
+    return 0;
+  }
+
+  return socket_address_key_hash(&key, seed);
+}
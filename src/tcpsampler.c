@@ -0,0 +1,291 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "tcpsampler.h"
+#include "thread.h"
+#include "error.h"
+
+#define TCP_SAMPLER_DEFAULT_INTERVAL 1000
+
+typedef struct {
+  Socket *socket;
+  uint32_t retransmits;
+} TcpSamplerEntry;
+
+struct TcpSampler {
+  Mutex *lock;
+  Cond *cond;
+  Thread *thread;
+  bool stopping;
+  uint32_t interval;
+  TcpSamplerEntry *entries;
+  size_t count;
+  size_t capacity;
+  Histogram *histograms[TCP_SAMPLER_METRICS];
+};
+
+static size_t private_tcp_sampler_sample(TcpSampler *sampler);
+static void private_tcp_sampler_thread(void *data);
+
+static size_t private_tcp_sampler_sample(TcpSampler *sampler) {
+  TcpSamplerEntry *entry;
+  SocketTcpInfo info;
+  size_t i, ret;
+
+  for (i = 0, ret = 0; i < sampler->count; i++) {
+    entry = &sampler->entries[i];
+
+    /* Closed or non-TCP sockets are skipped, not dropped */
+    if (socket_get_tcp_info(entry->socket, &info) == false) {
+      continue;
+    }
+
+    histogram_record(sampler->histograms[TCP_SAMPLER_RTT], info.rtt_usec);
+    histogram_record(sampler->histograms[TCP_SAMPLER_RTT_VAR], info.rtt_var_usec);
+    histogram_record(sampler->histograms[TCP_SAMPLER_CWND], info.cwnd);
+    histogram_record(sampler->histograms[TCP_SAMPLER_UNACKED], info.unacked);
+    histogram_record(sampler->histograms[TCP_SAMPLER_LOST], info.lost);
+    histogram_record(sampler->histograms[TCP_SAMPLER_RETRANSMITS],
+                     info.retransmits >= entry->retransmits ? info.retransmits - entry->retransmits : 0);
+    histogram_record(sampler->histograms[TCP_SAMPLER_DELIVERY_RATE], info.delivery_rate);
+
+    entry->retransmits = info.retransmits;
+    ret++;
+  }
+
+  return ret;
+}
+
+static void private_tcp_sampler_thread(void *data) {
+  TcpSampler *sampler;
+  uint64_t next, now;
+
+  sampler = (TcpSampler *) data;
+
+  mutex_lock(sampler->lock);
+
+  next = sys_time_monotonic() + sampler->interval;
+
+  while (sampler->stopping == false) {
+    if ((now = sys_time_monotonic()) < next) {
+      cond_timed_wait(sampler->cond, sampler->lock, (int32_t)(next - now));
+      continue;
+    }
+
+    private_tcp_sampler_sample(sampler);
+
+    /* Don't try to catch up after a stall, just keep the cadence */
+    next += sampler->interval;
+
+    if (next <= now) {
+      next = now + sampler->interval;
+    }
+  }
+
+  mutex_unlock(sampler->lock);
+}
+
+TcpSampler *tcp_sampler_new(uint32_t interval) {
+  TcpSampler *ret;
+  int32_t i;
+
+  if (UNLIKELY((ret = calloc(sizeof(TcpSampler), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for TCP sampler");
+    return NULL;
+  }
+
+  ret->interval = interval > 0 ? interval : TCP_SAMPLER_DEFAULT_INTERVAL;
+
+  if (UNLIKELY((ret->lock = mutex_new()) == NULL || (ret->cond = cond_new()) == NULL)) {
+    tcp_sampler_free(ret);
+    return NULL;
+  }
+
+  for (i = 0; i < TCP_SAMPLER_METRICS; i++) {
+    if (UNLIKELY((ret->histograms[i] = histogram_new()) == NULL)) {
+      tcp_sampler_free(ret);
+      return NULL;
+    }
+  }
+
+  return ret;
+}
+
+bool tcp_sampler_add(TcpSampler *sampler, Socket *socket) {
+  TcpSamplerEntry *entries;
+  SocketTcpInfo info;
+  size_t capacity;
+
+  if (UNLIKELY(sampler == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  mutex_lock(sampler->lock);
+
+  if (sampler->count == sampler->capacity) {
+    capacity = sampler->capacity ? sampler->capacity * 2 : 64;
+
+    if (UNLIKELY((entries = realloc(sampler->entries, sizeof(TcpSamplerEntry) * capacity)) == NULL)) {
+      mutex_unlock(sampler->lock);
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for TCP sampler");
+      return false;
+    }
+
+    sampler->entries = entries;
+    sampler->capacity = capacity;
+  }
+
+  /* Retransmits are reported per interval, start from the current total */
+  sampler->entries[sampler->count].socket = socket;
+  sampler->entries[sampler->count].retransmits = socket_get_tcp_info(socket, &info) ? info.retransmits : 0;
+  sampler->count++;
+
+  mutex_unlock(sampler->lock);
+
+  return true;
+}
+
+bool tcp_sampler_remove(TcpSampler *sampler, Socket *socket) {
+  size_t i;
+
+  if (UNLIKELY(sampler == NULL || socket == NULL)) {
+    return false;
+  }
+
+  mutex_lock(sampler->lock);
+
+  for (i = 0; i < sampler->count; i++) {
+    if (sampler->entries[i].socket == socket) {
+      sampler->entries[i] = sampler->entries[--sampler->count];
+      mutex_unlock(sampler->lock);
+      return true;
+    }
+  }
+
+  mutex_unlock(sampler->lock);
+
+  return false;
+}
+
+size_t tcp_sampler_get_count(TcpSampler *sampler) {
+  size_t ret;
+
+  if (UNLIKELY(sampler == NULL)) {
+    return 0;
+  }
+
+  mutex_lock(sampler->lock);
+  ret = sampler->count;
+  mutex_unlock(sampler->lock);
+
+  return ret;
+}
+
+/* Returns how many sockets were sampled */
+size_t tcp_sampler_sample(TcpSampler *sampler) {
+  size_t ret;
+
+  if (UNLIKELY(sampler == NULL)) {
+    return 0;
+  }
+
+  mutex_lock(sampler->lock);
+  ret = private_tcp_sampler_sample(sampler);
+  mutex_unlock(sampler->lock);
+
+  return ret;
+}
+
+bool tcp_sampler_start(TcpSampler *sampler) {
+  if (UNLIKELY(sampler == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (sampler->thread != NULL) {
+    return true;
+  }
+
+  sampler->stopping = false;
+
+  if (UNLIKELY((sampler->thread = thread_new(private_tcp_sampler_thread, sampler)) == NULL)) {
+    return false;
+  }
+
+  return true;
+}
+
+void tcp_sampler_stop(TcpSampler *sampler) {
+  if (UNLIKELY(sampler == NULL) || sampler->thread == NULL) {
+    return;
+  }
+
+  mutex_lock(sampler->lock);
+  sampler->stopping = true;
+  cond_signal(sampler->cond);
+  mutex_unlock(sampler->lock);
+
+  thread_join(sampler->thread);
+  sampler->thread = NULL;
+}
+
+Histogram *tcp_sampler_get_histogram(TcpSampler *sampler, TcpSamplerMetric metric) {
+  if (UNLIKELY(sampler == NULL || (int32_t) metric < 0 || metric >= TCP_SAMPLER_METRICS)) {
+    return NULL;
+  }
+
+  return sampler->histograms[metric];
+}
+
+void tcp_sampler_free(TcpSampler *sampler) {
+  int32_t i;
+
+  if (UNLIKELY(sampler == NULL)) {
+    return;
+  }
+
+  tcp_sampler_stop(sampler);
+
+  for (i = 0; i < TCP_SAMPLER_METRICS; i++) {
+    histogram_free(sampler->histograms[i]);
+  }
+
+  if (sampler->cond != NULL) {
+    cond_free(sampler->cond);
+  }
+
+  if (sampler->lock != NULL) {
+    mutex_free(sampler->lock);
+  }
+
+  free(sampler->entries);
+  free(sampler);
+}
@@ -0,0 +1,333 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#if defined(_WIN32) || defined(_WIN64)
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  /* Condition variables and SRW locks require Vista */
+  #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x600
+  #endif
+  #include <windows.h>
+#else
+  #include <pthread.h>
+  #include <sched.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <errno.h>
+#endif
+
+#include <stdlib.h>
+#include "thread.h"
+#include "error.h"
+
+struct Thread {
+  ThreadFunc func;
+  void *data;
+#ifdef _WINDOWS
+  HANDLE handle;
+#else
+  pthread_t handle;
+#endif
+};
+
+struct Mutex {
+#ifdef _WINDOWS
+  SRWLOCK lock;
+#else
+  pthread_mutex_t lock;
+#endif
+};
+
+struct Cond {
+#ifdef _WINDOWS
+  CONDITION_VARIABLE cond;
+#else
+  pthread_cond_t cond;
+#endif
+};
+
+#ifdef _WINDOWS
+static DWORD WINAPI private_thread_proxy(LPVOID arg) {
+  Thread *thread = arg;
+
+  thread->func(thread->data);
+  return 0;
+}
+#else
+static void *private_thread_proxy(void *arg) {
+  Thread *thread = arg;
+
+  thread->func(thread->data);
+  return NULL;
+}
+#endif
+
+Thread *thread_new(ThreadFunc func, void *data) {
+  Thread *ret;
+#ifndef _WINDOWS
+  int32_t res;
+#endif
+
+  if (UNLIKELY(func == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(Thread), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for thread");
+    return NULL;
+  }
+
+  ret->func = func;
+  ret->data = data;
+
+#ifdef _WINDOWS
+  if (UNLIKELY((ret->handle = CreateThread(NULL, 0, private_thread_proxy, ret, 0, NULL)) == NULL)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(error_get_last_system()),
+      (int32_t)error_get_last_system(),
+      "Failed to call CreateThread() to create thread"
+    );
+    free(ret);
+    return NULL;
+  }
+#else
+  if (UNLIKELY((res = pthread_create(&ret->handle, NULL, private_thread_proxy, ret)) != 0)) {
+    error_set_error(
+      (int32_t)error_get_io_from_system(res),
+      res,
+      "Failed to call pthread_create() to create thread"
+    );
+    free(ret);
+    return NULL;
+  }
+#endif
+
+  return ret;
+}
+
+bool thread_join(Thread *thread) {
+  if (UNLIKELY(thread == NULL)) {
+    return false;
+  }
+
+#ifdef _WINDOWS
+  if (UNLIKELY(WaitForSingleObject(thread->handle, INFINITE) != WAIT_OBJECT_0)) {
+    ALERT_ERROR("Thread::thread_join: WaitForSingleObject() failed");
+    return false;
+  }
+
+  CloseHandle(thread->handle);
+#else
+  if (UNLIKELY(pthread_join(thread->handle, NULL) != 0)) {
+    ALERT_ERROR("Thread::thread_join: pthread_join() failed");
+    return false;
+  }
+#endif
+
+  free(thread);
+  return true;
+}
+
+void thread_yield(void) {
+#ifdef _WINDOWS
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+void thread_sleep(uint32_t msec) {
+#ifdef _WINDOWS
+  Sleep(msec);
+#else
+  struct timespec ts;
+
+  ts.tv_sec = msec / 1000;
+  ts.tv_nsec = (long)(msec % 1000) * 1000000L;
+
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+#endif
+}
+
+uint32_t thread_get_ideal_count(void) {
+#ifdef _WINDOWS
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (uint32_t)info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count;
+
+  count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (uint32_t)count : 1;
+#else
+  return 1;
+#endif
+}
+
+Mutex *mutex_new(void) {
+  Mutex *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Mutex), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for mutex");
+    return NULL;
+  }
+
+#ifdef _WINDOWS
+  InitializeSRWLock(&ret->lock);
+#else
+  if (UNLIKELY(pthread_mutex_init(&ret->lock, NULL) != 0)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to call pthread_mutex_init() on mutex");
+    free(ret);
+    return NULL;
+  }
+#endif
+
+  return ret;
+}
+
+void mutex_lock(Mutex *mutex) {
+#ifdef _WINDOWS
+  AcquireSRWLockExclusive(&mutex->lock);
+#else
+  pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+bool mutex_trylock(Mutex *mutex) {
+#ifdef _WINDOWS
+  return TryAcquireSRWLockExclusive(&mutex->lock) != 0;
+#else
+  return pthread_mutex_trylock(&mutex->lock) == 0;
+#endif
+}
+
+void mutex_unlock(Mutex *mutex) {
+#ifdef _WINDOWS
+  ReleaseSRWLockExclusive(&mutex->lock);
+#else
+  pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+void mutex_free(Mutex *mutex) {
+  if (UNLIKELY(mutex == NULL)) {
+    return;
+  }
+
+#ifndef _WINDOWS
+  pthread_mutex_destroy(&mutex->lock);
+#endif
+
+  free(mutex);
+}
+
+Cond *cond_new(void) {
+  Cond *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(Cond), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for condition variable");
+    return NULL;
+  }
+
+#ifdef _WINDOWS
+  InitializeConditionVariable(&ret->cond);
+#else
+  if (UNLIKELY(pthread_cond_init(&ret->cond, NULL) != 0)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to call pthread_cond_init() on condition variable");
+    free(ret);
+    return NULL;
+  }
+#endif
+
+  return ret;
+}
+
+void cond_wait(Cond *cond, Mutex *mutex) {
+#ifdef _WINDOWS
+  SleepConditionVariableSRW(&cond->cond, &mutex->lock, INFINITE, 0);
+#else
+  pthread_cond_wait(&cond->cond, &mutex->lock);
+#endif
+}
+
+bool cond_timed_wait(Cond *cond, Mutex *mutex, int32_t msec) {
+#ifdef _WINDOWS
+  return SleepConditionVariableSRW(&cond->cond, &mutex->lock, msec < 0 ? INFINITE : (DWORD)msec, 0) != 0;
+#else
+  struct timespec ts;
+
+  if (msec < 0) {
+    return pthread_cond_wait(&cond->cond, &mutex->lock) == 0;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  ts.tv_sec += msec / 1000;
+  ts.tv_nsec += (long)(msec % 1000) * 1000000L;
+
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  return pthread_cond_timedwait(&cond->cond, &mutex->lock, &ts) == 0;
+#endif
+}
+
+void cond_signal(Cond *cond) {
+#ifdef _WINDOWS
+  WakeConditionVariable(&cond->cond);
+#else
+  pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void cond_broadcast(Cond *cond) {
+#ifdef _WINDOWS
+  WakeAllConditionVariable(&cond->cond);
+#else
+  pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+void cond_free(Cond *cond) {
+  if (UNLIKELY(cond == NULL)) {
+    return;
+  }
+
+#ifndef _WINDOWS
+  pthread_cond_destroy(&cond->cond);
+#endif
+
+  free(cond);
+}
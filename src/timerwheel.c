@@ -0,0 +1,489 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "timerwheel.h"
+#include "error.h"
+
+/* Level 0 has 256 slots of one tick, each of the four upper levels has
+ * 64 slots covering a whole turn of the level below, like the classic
+ * BSD/Linux cascading timer wheel. */
+#define TIMER_WHEEL_ROOT_BITS   8
+#define TIMER_WHEEL_LEVEL_BITS  6
+#define TIMER_WHEEL_ROOT_SIZE   (1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE  (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_ROOT_MASK   (TIMER_WHEEL_ROOT_SIZE - 1)
+#define TIMER_WHEEL_LEVEL_MASK  (TIMER_WHEEL_LEVEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS      4
+#define TIMER_WHEEL_MAX_TICKS   ((uint64_t) 0xffffffff)
+
+#define TIMER_WHEEL_LEVEL_INDEX(tick, level) \
+  (((tick) >> (TIMER_WHEEL_ROOT_BITS + (level) * TIMER_WHEEL_LEVEL_BITS)) & TIMER_WHEEL_LEVEL_MASK)
+
+typedef struct TimerLink {
+  struct TimerLink *next;
+  struct TimerLink *prev;
+} TimerLink;
+
+struct Timer {
+  TimerLink link;
+  TimerWheel *wheel;
+  TimerFunc func;
+  void *data;
+  uint64_t deadline;
+  uint64_t expires;
+  int32_t root_slot;
+};
+
+struct TimerWheel {
+  TimerLink root[TIMER_WHEEL_ROOT_SIZE];
+  TimerLink levels[TIMER_WHEEL_LEVELS][TIMER_WHEEL_LEVEL_SIZE];
+  /* Non-empty level 0 slots, used to find the next expiration */
+  uint64_t occupied[TIMER_WHEEL_ROOT_SIZE / 64];
+  uint64_t base;
+  uint64_t now;
+  uint64_t tick;
+  uint32_t resolution;
+  size_t count;
+};
+
+static inline void private_timer_link_init(TimerLink *link) {
+  link->next = link;
+  link->prev = link;
+}
+
+static inline bool private_timer_link_empty(const TimerLink *link) {
+  return link->next == link;
+}
+
+static inline void private_timer_link_append(TimerLink *head, TimerLink *link) {
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static inline void private_timer_link_remove(TimerLink *link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->next = link;
+  link->prev = link;
+}
+
+static inline uint32_t private_timer_wheel_ctz(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (uint32_t)__builtin_ctzll(value);
+#else
+  uint32_t ret = 0;
+
+  while ((value & 1) == 0) {
+    value >>= 1;
+    ret++;
+  }
+
+  return ret;
+#endif
+}
+
+static uint64_t private_timer_wheel_clock(void) {
+  return sys_time_monotonic_coarse();
+}
+
+static void private_timer_wheel_insert(TimerWheel *wheel, Timer *timer) {
+  uint64_t expires, delta;
+  int32_t level;
+
+  expires = timer->expires;
+
+  /* Already due timers fire on the next processed tick */
+  if (expires < wheel->tick) {
+    expires = wheel->tick;
+  }
+
+  delta = expires - wheel->tick;
+
+  if (delta < TIMER_WHEEL_ROOT_SIZE) {
+    timer->root_slot = (int32_t)(expires & TIMER_WHEEL_ROOT_MASK);
+    private_timer_link_append(&wheel->root[timer->root_slot], &timer->link);
+    wheel->occupied[timer->root_slot >> 6] |= (uint64_t) 1 << (timer->root_slot & 63);
+    return;
+  }
+
+  timer->root_slot = -1;
+
+  for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+    if (delta < ((uint64_t) 1 << (TIMER_WHEEL_ROOT_BITS + (level + 1) * TIMER_WHEEL_LEVEL_BITS))) {
+      break;
+    }
+  }
+
+  if (delta > TIMER_WHEEL_MAX_TICKS) {
+    expires = wheel->tick + TIMER_WHEEL_MAX_TICKS;
+  }
+
+  private_timer_link_append(&wheel->levels[level][TIMER_WHEEL_LEVEL_INDEX(expires, level)], &timer->link);
+}
+
+static void private_timer_wheel_unlink(TimerWheel *wheel, Timer *timer) {
+  int32_t slot;
+
+  private_timer_link_remove(&timer->link);
+
+  if ((slot = timer->root_slot) >= 0 && private_timer_link_empty(&wheel->root[slot])) {
+    wheel->occupied[slot >> 6] &= ~((uint64_t) 1 << (slot & 63));
+  }
+}
+
+/* Scans the level 0 bitmap from the current slot up to the end of this
+ * turn, past that the next cascade is a safe upper bound */
+static uint64_t private_timer_wheel_next_tick(const TimerWheel *wheel) {
+  uint32_t start, i;
+  uint64_t bits;
+
+  start = (uint32_t)(wheel->tick & TIMER_WHEEL_ROOT_MASK);
+
+  for (i = start >> 6; i < TIMER_WHEEL_ROOT_SIZE / 64; i++) {
+    bits = wheel->occupied[i];
+
+    if (i == start >> 6) {
+      bits &= ~(uint64_t) 0 << (start & 63);
+    }
+
+    if (bits != 0) {
+      return wheel->tick + (i * 64 + private_timer_wheel_ctz(bits) - start);
+    }
+  }
+
+  return wheel->tick + (TIMER_WHEEL_ROOT_SIZE - start);
+}
+
+static uint32_t private_timer_wheel_cascade(TimerWheel *wheel, int32_t level) {
+  TimerLink list, *link;
+  uint32_t index;
+
+  index = (uint32_t)TIMER_WHEEL_LEVEL_INDEX(wheel->tick, level);
+
+  if (private_timer_link_empty(&wheel->levels[level][index])) {
+    return index;
+  }
+
+  /* Move the whole slot away first, re-inserting may put timers back
+   * into the same level */
+  list = wheel->levels[level][index];
+  list.next->prev = &list;
+  list.prev->next = &list;
+  private_timer_link_init(&wheel->levels[level][index]);
+
+  while ((link = list.next) != &list) {
+    private_timer_link_remove(link);
+    private_timer_wheel_insert(wheel, (Timer *) link);
+  }
+
+  return index;
+}
+
+TimerWheel *timer_wheel_new(uint32_t resolution) {
+  TimerWheel *ret;
+  int32_t i, j;
+
+  if (UNLIKELY((ret = calloc(sizeof(TimerWheel), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for timer wheel");
+    return NULL;
+  }
+
+  for (i = 0; i < TIMER_WHEEL_ROOT_SIZE; i++) {
+    private_timer_link_init(&ret->root[i]);
+  }
+
+  for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+    for (j = 0; j < TIMER_WHEEL_LEVEL_SIZE; j++) {
+      private_timer_link_init(&ret->levels[i][j]);
+    }
+  }
+
+  ret->resolution = resolution > 0 ? resolution : 1;
+  ret->base = private_timer_wheel_clock();
+  ret->now = ret->base;
+  ret->tick = 0;
+
+  return ret;
+}
+
+uint64_t timer_wheel_get_time(const TimerWheel *wheel) {
+  if (UNLIKELY(wheel == NULL)) {
+    return 0;
+  }
+
+  return wheel->now;
+}
+
+uint64_t timer_wheel_update_time(TimerWheel *wheel) {
+  uint64_t now;
+
+  if (UNLIKELY(wheel == NULL)) {
+    return 0;
+  }
+
+  /* The coarse clock may lag behind, never let the cached time go back */
+  if ((now = private_timer_wheel_clock()) > wheel->now) {
+    wheel->now = now;
+  }
+
+  return wheel->now;
+}
+
+size_t timer_wheel_get_count(const TimerWheel *wheel) {
+  if (UNLIKELY(wheel == NULL)) {
+    return 0;
+  }
+
+  return wheel->count;
+}
+
+/* Refreshes the cached time first, a stale one would oversleep the next
+ * expiration by however long ago it was taken */
+int32_t timer_wheel_get_timeout(TimerWheel *wheel) {
+  uint64_t next, now_tick;
+
+  if (UNLIKELY(wheel == NULL) || wheel->count == 0) {
+    return -1;
+  }
+
+  timer_wheel_update_time(wheel);
+  next = private_timer_wheel_next_tick(wheel);
+  now_tick = (wheel->now - wheel->base) / wheel->resolution;
+
+  if (next <= now_tick) {
+    return 0;
+  }
+
+  next = wheel->base + next * wheel->resolution;
+
+  return next - wheel->now > INT32_MAX ? INT32_MAX : (int32_t)(next - wheel->now);
+}
+
+bool timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t deadline) {
+  if (UNLIKELY(wheel == NULL || timer == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (timer->wheel != NULL) {
+    timer_wheel_cancel(timer->wheel, timer);
+  }
+
+  timer->wheel = wheel;
+  timer->deadline = deadline;
+  /* Round up, a timer never fires before its deadline */
+  timer->expires = deadline > wheel->base ?
+    (deadline - wheel->base + wheel->resolution - 1) / wheel->resolution : 0;
+
+  private_timer_wheel_insert(wheel, timer);
+  wheel->count++;
+
+  return true;
+}
+
+bool timer_wheel_schedule_after(TimerWheel *wheel, Timer *timer, uint32_t msec) {
+  if (UNLIKELY(wheel == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  return timer_wheel_schedule(wheel, timer, wheel->now + msec);
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer) {
+  if (UNLIKELY(wheel == NULL || timer == NULL || timer->wheel != wheel)) {
+    return;
+  }
+
+  private_timer_wheel_unlink(wheel, timer);
+  timer->wheel = NULL;
+  wheel->count--;
+}
+
+size_t timer_wheel_advance(TimerWheel *wheel) {
+  TimerLink list, *link;
+  Timer *timer;
+  uint64_t target, next;
+  uint32_t index;
+  int32_t level;
+  size_t fired;
+
+  if (UNLIKELY(wheel == NULL)) {
+    return 0;
+  }
+
+  timer_wheel_update_time(wheel);
+  target = (wheel->now - wheel->base) / wheel->resolution;
+  fired = 0;
+
+  while (wheel->tick <= target) {
+    if (wheel->count == 0) {
+      wheel->tick = target + 1;
+      break;
+    }
+
+    index = (uint32_t)(wheel->tick & TIMER_WHEEL_ROOT_MASK);
+
+    /* Jump over empty slots instead of walking them one tick at a time */
+    if (index != 0 && private_timer_link_empty(&wheel->root[index])) {
+      next = private_timer_wheel_next_tick(wheel);
+      wheel->tick = next <= target ? next : target + 1;
+      continue;
+    }
+
+    if (index == 0) {
+      for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (private_timer_wheel_cascade(wheel, level) != 0) {
+          break;
+        }
+      }
+    }
+
+    if (private_timer_link_empty(&wheel->root[index])) {
+      wheel->tick++;
+      continue;
+    }
+
+    list = wheel->root[index];
+    list.next->prev = &list;
+    list.prev->next = &list;
+    private_timer_link_init(&wheel->root[index]);
+    wheel->occupied[index >> 6] &= ~((uint64_t) 1 << (index & 63));
+
+    for (link = list.next; link != &list; link = link->next) {
+      ((Timer *) link)->root_slot = -1;
+    }
+
+    /* Step past the slot first so timers rescheduled as already due
+     * land on the next tick instead of a full turn later */
+    wheel->tick++;
+
+    /* Callbacks may cancel or reschedule any timer, including the
+     * ones still queued on the detached list */
+    while ((link = list.next) != &list) {
+      timer = (Timer *) link;
+      private_timer_link_remove(link);
+      timer->wheel = NULL;
+      wheel->count--;
+      fired++;
+
+      timer->func(timer, timer->data);
+    }
+  }
+
+  return fired;
+}
+
+void timer_wheel_free(TimerWheel *wheel) {
+  TimerLink *link;
+  int32_t i, j;
+
+  if (UNLIKELY(wheel == NULL)) {
+    return;
+  }
+
+  /* Detach pending timers, they are owned by the caller */
+  for (i = 0; i < TIMER_WHEEL_ROOT_SIZE; i++) {
+    while ((link = wheel->root[i].next) != &wheel->root[i]) {
+      private_timer_link_remove(link);
+      ((Timer *) link)->wheel = NULL;
+    }
+  }
+
+  for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+    for (j = 0; j < TIMER_WHEEL_LEVEL_SIZE; j++) {
+      while ((link = wheel->levels[i][j].next) != &wheel->levels[i][j]) {
+        private_timer_link_remove(link);
+        ((Timer *) link)->wheel = NULL;
+      }
+    }
+  }
+
+  free(wheel);
+}
+
+Timer *timer_new(TimerFunc func, void *data) {
+  Timer *ret;
+
+  if (UNLIKELY(func == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(Timer), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for timer");
+    return NULL;
+  }
+
+  private_timer_link_init(&ret->link);
+  ret->func = func;
+  ret->data = data;
+  ret->root_slot = -1;
+
+  return ret;
+}
+
+bool timer_is_pending(const Timer *timer) {
+  if (UNLIKELY(timer == NULL)) {
+    return false;
+  }
+
+  return timer->wheel != NULL;
+}
+
+uint64_t timer_get_deadline(const Timer *timer) {
+  if (UNLIKELY(timer == NULL)) {
+    return 0;
+  }
+
+  return timer->deadline;
+}
+
+void timer_set_data(Timer *timer, void *data) {
+  if (UNLIKELY(timer == NULL)) {
+    return;
+  }
+
+  timer->data = data;
+}
+
+void timer_free(Timer *timer) {
+  if (UNLIKELY(timer == NULL)) {
+    return;
+  }
+
+  if (timer->wheel != NULL) {
+    timer_wheel_cancel(timer->wheel, timer);
+  }
+
+  free(timer);
+}
@@ -144,3 +144,150 @@ int32_t sys_close(int32_t fd) {
 
 #endif
 
+
+#if defined(_WINDOWS)
+
+uint64_t sys_time_monotonic(void) {
+  return (uint64_t)GetTickCount64();
+}
+
+uint64_t sys_time_monotonic_coarse(void) {
+  /* GetTickCount64() is already a cached tick counter */
+  return (uint64_t)GetTickCount64();
+}
+
+uint64_t sys_time_monotonic_usec(void) {
+  LARGE_INTEGER counter, frequency;
+
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+         (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
+}
+
+#else
+
+#include <time.h>
+
+uint64_t sys_time_monotonic(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t sys_time_monotonic_coarse(void) {
+#ifdef CLOCK_MONOTONIC_COARSE
+  struct timespec ts;
+
+  /* Served from the vDSO without reading the hardware clock, only
+   * advances once per scheduler tick */
+  if (LIKELY(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)) {
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+  }
+#endif
+
+  return sys_time_monotonic();
+}
+
+uint64_t sys_time_monotonic_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+#endif
+
+
+#if defined(_WINDOWS)
+
+#include <bcrypt.h>
+
+#if defined(_MSC_VER)
+  #pragma comment(lib, "bcrypt.lib")
+#endif
+
+bool sys_random_bytes(void *buffer, size_t len) {
+  return BCryptGenRandom(NULL, (PUCHAR) buffer, (ULONG) len, BCRYPT_USE_SYSTEM_PREFERRED_RNG) >= 0;
+}
+
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+
+#include <stdlib.h>
+
+bool sys_random_bytes(void *buffer, size_t len) {
+  arc4random_buf(buffer, len);
+  return true;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef O_CLOEXEC
+  #define O_CLOEXEC 0
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+  #define SYS_USE_GETRANDOM
+  #include <sys/random.h>
+#endif
+
+/* getrandom() never returns short for up to 256 bytes once the pool is
+ * ready, larger or interrupted reads just loop. Kernels without it and
+ * other systems read /dev/urandom. */
+bool sys_random_bytes(void *buffer, size_t len) {
+  char *data = buffer;
+  ssize_t ret;
+  int fd;
+
+#ifdef SYS_USE_GETRANDOM
+  while (len > 0) {
+    if ((ret = getrandom(data, len, 0)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == ENOSYS) {
+        break;
+      }
+
+      return false;
+    }
+
+    data += ret;
+    len -= (size_t) ret;
+  }
+
+  if (len == 0) {
+    return true;
+  }
+#endif
+
+  if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0) {
+    return false;
+  }
+
+  while (len > 0) {
+    if ((ret = read(fd, data, len)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+
+      close(fd);
+      return false;
+    }
+
+    data += ret;
+    len -= (size_t) ret;
+  }
+
+  close(fd);
+
+  return true;
+}
+
+#endif
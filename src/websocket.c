@@ -0,0 +1,1115 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "websocket.h"
+#include "error.h"
+
+/* util.h claims __x86_64__ for every LP64 target, so look at what the
+ * compiler itself defines */
+#if defined(__amd64__) || defined(_M_AMD64)
+  #define WEBSOCKET_USE_SSE2
+  #include <emmintrin.h>
+#endif
+
+#if defined(__amd64__) && (defined(__GNUC__) || defined(__clang__))
+  #define WEBSOCKET_USE_AVX2
+  #include <immintrin.h>
+#endif
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_KEY_SIZE 25
+#define WEBSOCKET_ACCEPT_SIZE 29
+#define WEBSOCKET_MAX_CONTROL 125
+#define WEBSOCKET_MAX_HANDSHAKE 8192
+#define WEBSOCKET_DEFAULT_MAX_MESSAGE (16 * 1024 * 1024)
+#define WEBSOCKET_READ_SIZE 65536
+
+/* A frame has this long (msec) to go out on a full socket before the
+ * connection is given up */
+#define WEBSOCKET_WRITE_TIMEOUT 5000
+/* Masking keys are taken from a block of CSPRNG output, one system call
+ * covers 64 client frames */
+#define WEBSOCKET_RANDOM_SIZE 256
+
+/* Status of a close frame without a body */
+#define WEBSOCKET_CLOSE_NO_STATUS 1005
+
+struct WebSocket {
+  Socket *socket;
+  bool client;
+  WebSocketMessageFunc func;
+  void *user;
+  size_t max_message;
+  uint8_t random[WEBSOCKET_RANDOM_SIZE];
+  size_t random_used;
+  char key[WEBSOCKET_KEY_SIZE];
+  char header[WEBSOCKET_MAX_HEADER_SIZE];
+  size_t header_len;
+  bool in_payload;
+  WebSocketFrame frame;
+  uint64_t payload_offset;
+  char control[WEBSOCKET_MAX_CONTROL];
+  size_t control_len;
+  char *message;
+  size_t message_len;
+  size_t message_capacity;
+  WebSocketOpcode message_opcode;
+  bool in_message;
+  bool sending;
+  bool close_sent;
+  bool closed;
+  uint16_t close_code;
+  char *input;
+  char *scratch;
+  size_t scratch_capacity;
+};
+
+static void private_websocket_mask_scalar(uint8_t *data, size_t len, uint32_t key);
+#ifdef WEBSOCKET_USE_SSE2
+static size_t private_websocket_mask_sse2(uint8_t *data, size_t len, uint32_t key);
+#endif
+#ifdef WEBSOCKET_USE_AVX2
+static size_t private_websocket_mask_avx2(uint8_t *data, size_t len, uint32_t key);
+#endif
+static void private_websocket_sha1(const uint8_t *data, size_t len, uint8_t *digest);
+static void private_websocket_base64(const uint8_t *data, size_t len, char *out);
+static void private_websocket_accept(const char *key, size_t len, char *accept);
+static bool private_websocket_random(WebSocket *websocket, void *dest, size_t len);
+static size_t private_websocket_headers_end(const char *buffer, size_t len);
+static bool private_websocket_equal_nocase(const char *a, size_t len, const char *b);
+static bool private_websocket_header(const char *headers, size_t len, const char *name,
+                                     const char **value, size_t *value_len);
+static bool private_websocket_has_token(const char *headers, size_t len, const char *name, const char *token);
+static bool private_websocket_send_frame(WebSocket *websocket, bool fin, WebSocketOpcode opcode,
+                                         const char *data, size_t len);
+static ssize_t private_websocket_fail(WebSocket *websocket, uint16_t code, const char *message);
+static uint16_t private_websocket_check(WebSocket *websocket);
+static bool private_websocket_append(WebSocket *websocket, const char *data, size_t len);
+static void private_websocket_deliver(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len);
+static ssize_t private_websocket_complete(WebSocket *websocket, const char *data, size_t len);
+
+static void private_websocket_mask_scalar(uint8_t *data, size_t len, uint32_t key) {
+  uint64_t wide = (uint64_t) key | ((uint64_t) key << 32), word;
+  uint8_t bytes[4];
+  size_t i;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy(&word, data, 8);
+    word ^= wide;
+    memcpy(data, &word, 8);
+  }
+
+  memcpy(bytes, &key, 4);
+
+  for (i = 0; i < len; i++) {
+    data[i] ^= bytes[i & 3];
+  }
+}
+
+/* The SIMD variants only take whole vectors, which keeps the key phase
+ * for whatever follows */
+#ifdef WEBSOCKET_USE_SSE2
+static size_t private_websocket_mask_sse2(uint8_t *data, size_t len, uint32_t key) {
+  __m128i mask = _mm_set1_epi32((int32_t) key);
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(data + i)), mask));
+  }
+
+  return i;
+}
+#endif
+
+#ifdef WEBSOCKET_USE_AVX2
+__attribute__((target("avx2")))
+static size_t private_websocket_mask_avx2(uint8_t *data, size_t len, uint32_t key) {
+  __m256i mask = _mm256_set1_epi32((int32_t) key);
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    _mm256_storeu_si256((__m256i *)(data + i),
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), mask));
+    _mm256_storeu_si256((__m256i *)(data + i + 32),
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i + 32)), mask));
+  }
+
+  return i;
+}
+#endif
+
+static void private_websocket_sha1(const uint8_t *data, size_t len, uint8_t *digest) {
+  uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  uint32_t w[80], a, b, c, d, e, f, k, temp;
+  uint8_t block[64];
+  uint64_t bits = (uint64_t) len * 8;
+  size_t offset, i, fill;
+  bool padded = false, done = false;
+
+  for (offset = 0; done == false; offset += 64) {
+    if (offset + 64 <= len) {
+      memcpy(block, data + offset, 64);
+    } else {
+      fill = offset < len ? len - offset : 0;
+      memset(block, 0, 64);
+      memcpy(block, data + offset, fill);
+
+      if (padded == false) {
+        block[fill] = 0x80;
+        padded = true;
+      }
+
+      /* The length goes in the last block that has room for it */
+      if (fill < 56) {
+        for (i = 0; i < 8; i++) {
+          block[63 - i] = (uint8_t)(bits >> (i * 8));
+        }
+
+        done = true;
+      }
+    }
+
+    for (i = 0; i < 16; i++) {
+      w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+             ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+
+    for (i = 16; i < 80; i++) {
+      temp = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = (temp << 1) | (temp >> 31);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 80; i++) {
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+
+      temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+
+  for (i = 0; i < 20; i++) {
+    digest[i] = (uint8_t)(state[i / 4] >> (24 - (i % 4) * 8));
+  }
+}
+
+static void private_websocket_base64(const uint8_t *data, size_t len, char *out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t triple;
+  size_t i;
+
+  for (i = 0; i < len; i += 3) {
+    triple = (uint32_t) data[i] << 16;
+    triple |= i + 1 < len ? (uint32_t) data[i + 1] << 8 : 0;
+    triple |= i + 2 < len ? data[i + 2] : 0;
+
+    *out++ = alphabet[(triple >> 18) & 0x3f];
+    *out++ = alphabet[(triple >> 12) & 0x3f];
+    *out++ = i + 1 < len ? alphabet[(triple >> 6) & 0x3f] : '=';
+    *out++ = i + 2 < len ? alphabet[triple & 0x3f] : '=';
+  }
+
+  *out = '\0';
+}
+
+/* Sec-WebSocket-Accept for a key, base64 of SHA-1 over key and GUID */
+static void private_websocket_accept(const char *key, size_t len, char *accept) {
+  uint8_t input[64 + sizeof(WEBSOCKET_GUID)], digest[20];
+
+  len = len > 64 ? 64 : len;
+  memcpy(input, key, len);
+  memcpy(input + len, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+  private_websocket_sha1(input, len + sizeof(WEBSOCKET_GUID) - 1, digest);
+  private_websocket_base64(digest, sizeof(digest), accept);
+}
+
+/* Masking keys and nonces must come from a strong entropy source
+ * (RFC 6455, section 5.3), len is at most WEBSOCKET_RANDOM_SIZE */
+static bool private_websocket_random(WebSocket *websocket, void *dest, size_t len) {
+  if (websocket->random_used + len > WEBSOCKET_RANDOM_SIZE) {
+    if (UNLIKELY(sys_random_bytes(websocket->random, WEBSOCKET_RANDOM_SIZE) == false)) {
+      error_set_error((int32_t)ERROR_IO_FAILED, 0, "Failed to generate WebSocket masking key");
+      return false;
+    }
+
+    websocket->random_used = 0;
+  }
+
+  memcpy(dest, websocket->random + websocket->random_used, len);
+  websocket->random_used += len;
+
+  return true;
+}
+
+/* Returns the length of the headers up to the blank line, 0 when
+ * incomplete */
+static size_t private_websocket_headers_end(const char *buffer, size_t len) {
+  size_t i;
+
+  for (i = 3; i < len; i++) {
+    if (buffer[i] == '\n' && buffer[i - 1] == '\r' && buffer[i - 2] == '\n' && buffer[i - 3] == '\r') {
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+static bool private_websocket_equal_nocase(const char *a, size_t len, const char *b) {
+  size_t i;
+  char x, y;
+
+  for (i = 0; i < len; i++) {
+    x = a[i] >= 'A' && a[i] <= 'Z' ? (char)(a[i] + 32) : a[i];
+    y = b[i] >= 'A' && b[i] <= 'Z' ? (char)(b[i] + 32) : b[i];
+
+    if (x != y || y == '\0') {
+      return false;
+    }
+  }
+
+  return b[len] == '\0';
+}
+
+/* Finds a header after the start line, value is trimmed */
+static bool private_websocket_header(const char *headers, size_t len, const char *name,
+                                     const char **value, size_t *value_len) {
+  const char *line, *end = headers + len, *next, *colon;
+
+  for (line = headers; line < end; line = next) {
+    if ((next = memchr(line, '\n', (size_t)(end - line))) == NULL) {
+      return false;
+    }
+
+    next++;
+
+    if (line == headers || (colon = memchr(line, ':', (size_t)(next - line))) == NULL ||
+        private_websocket_equal_nocase(line, (size_t)(colon - line), name) == false) {
+      continue;
+    }
+
+    for (*value = colon + 1; *value < next && (**value == ' ' || **value == '\t'); (*value)++);
+    for (*value_len = (size_t)(next - *value); *value_len > 0 &&
+         ((*value)[*value_len - 1] == '\r' || (*value)[*value_len - 1] == '\n' ||
+          (*value)[*value_len - 1] == ' ' || (*value)[*value_len - 1] == '\t'); (*value_len)--);
+
+    return true;
+  }
+
+  return false;
+}
+
+/* Looks for token in a comma separated header value, ignoring case */
+static bool private_websocket_has_token(const char *headers, size_t len, const char *name, const char *token) {
+  const char *value, *start, *stop;
+  size_t value_len, i;
+
+  if (private_websocket_header(headers, len, name, &value, &value_len) == false) {
+    return false;
+  }
+
+  for (i = 0, start = value; i <= value_len; i++) {
+    if (i < value_len && value[i] != ',') {
+      continue;
+    }
+
+    for (stop = value + i; start < stop && (*start == ' ' || *start == '\t'); start++);
+    for (; stop > start && (stop[-1] == ' ' || stop[-1] == '\t'); stop--);
+
+    if (private_websocket_equal_nocase(start, (size_t)(stop - start), token)) {
+      return true;
+    }
+
+    start = value + i + 1;
+  }
+
+  return false;
+}
+
+/* Server frames go out with the caller's payload as is, client frames
+ * need a masked copy */
+static bool private_websocket_send_frame(WebSocket *websocket, bool fin, WebSocketOpcode opcode,
+                                         const char *data, size_t len) {
+  SocketBuffer buffers[2];
+  char header[WEBSOCKET_MAX_HEADER_SIZE], *grown;
+  uint8_t mask[4];
+  size_t done;
+
+  if (UNLIKELY(websocket->socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NOT_CONNECTED, 0, "WebSocket has no socket");
+    return false;
+  }
+
+  buffers[1].data = data;
+  buffers[1].len = len;
+
+  if (websocket->client) {
+    if (UNLIKELY(private_websocket_random(websocket, mask, sizeof(mask)) == false)) {
+      return false;
+    }
+
+    if (len > websocket->scratch_capacity) {
+      if (UNLIKELY((grown = realloc(websocket->scratch, len)) == NULL)) {
+        error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for WebSocket frame");
+        return false;
+      }
+
+      websocket->scratch = grown;
+      websocket->scratch_capacity = len;
+    }
+
+    if (len > 0) {
+      memcpy(websocket->scratch, data, len);
+      websocket_mask(websocket->scratch, len, mask, 0);
+    }
+
+    buffers[1].data = websocket->scratch;
+  }
+
+  buffers[0].data = header;
+  buffers[0].len = websocket_frame_encode(header, fin, opcode, len, websocket->client ? mask : NULL);
+
+  /* A frame that went out in part leaves the stream unusable, so the
+   * connection counts as closed after such a failure */
+  if (socket_send_iov_all_until(websocket->socket, buffers, 2, sys_time_monotonic() + WEBSOCKET_WRITE_TIMEOUT,
+                                &done) < 0) {
+    websocket->closed = websocket->closed || done > 0;
+    return false;
+  }
+
+  return true;
+}
+
+/* Closes with the given status after a protocol violation, the message
+ * is copied first as it may come from the error state itself */
+static ssize_t private_websocket_fail(WebSocket *websocket, uint16_t code, const char *message) {
+  char payload[2], reason[64];
+
+  snprintf(reason, sizeof(reason), "%s", message != NULL ? message : "WebSocket protocol error");
+
+  if (websocket->close_sent == false && websocket->socket != NULL) {
+    payload[0] = (char)(code >> 8);
+    payload[1] = (char) code;
+    websocket->close_sent = true;
+    private_websocket_send_frame(websocket, true, WEBSOCKET_OPCODE_CLOSE, payload, sizeof(payload));
+  }
+
+  websocket->closed = true;
+  websocket->close_code = code;
+  error_set_error((int32_t)ERROR_IO_FAILED, 0, reason);
+
+  return -1;
+}
+
+/* Returns the close status to fail with, 0 for a valid frame */
+static uint16_t private_websocket_check(WebSocket *websocket) {
+  WebSocketFrame *frame = &websocket->frame;
+
+  if (frame->masked == websocket->client) {
+    return WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (frame->opcode & 0x8) {
+    return 0;
+  }
+
+  if ((frame->opcode == WEBSOCKET_OPCODE_CONTINUATION) != websocket->in_message) {
+    return WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+  }
+
+  if (frame->length > websocket->max_message ||
+      (websocket->in_message && frame->length > websocket->max_message - websocket->message_len)) {
+    return WEBSOCKET_CLOSE_TOO_BIG;
+  }
+
+  return 0;
+}
+
+static bool private_websocket_append(WebSocket *websocket, const char *data, size_t len) {
+  size_t capacity;
+  char *grown;
+
+  if (len == 0) {
+    return true;
+  }
+
+  if (websocket->frame.opcode & 0x8) {
+    memcpy(websocket->control + websocket->control_len, data, len);
+    websocket->control_len += len;
+    return true;
+  }
+
+  if (websocket->message_len + len > websocket->message_capacity) {
+    for (capacity = websocket->message_capacity ? websocket->message_capacity : 4096;
+         capacity < websocket->message_len + len; capacity *= 2);
+
+    if (UNLIKELY((grown = realloc(websocket->message, capacity)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for WebSocket message");
+      return false;
+    }
+
+    websocket->message = grown;
+    websocket->message_capacity = capacity;
+  }
+
+  memcpy(websocket->message + websocket->message_len, data, len);
+  websocket->message_len += len;
+
+  return true;
+}
+
+static void private_websocket_deliver(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len) {
+  if (websocket->func != NULL) {
+    websocket->func(websocket, opcode, data, len, websocket->user);
+  }
+}
+
+/* Handles a frame whose payload is complete, data being the payload for
+ * control frames and unfragmented messages */
+static ssize_t private_websocket_complete(WebSocket *websocket, const char *data, size_t len) {
+  WebSocketOpcode opcode = websocket->frame.opcode;
+  uint16_t code;
+
+  websocket->in_payload = false;
+
+  switch (opcode) {
+    case WEBSOCKET_OPCODE_PING:
+      if (websocket->close_sent == false && websocket->socket != NULL &&
+          private_websocket_send_frame(websocket, true, WEBSOCKET_OPCODE_PONG, data, len) == false) {
+        return -1;
+      }
+
+      private_websocket_deliver(websocket, opcode, data, len);
+      return 0;
+    case WEBSOCKET_OPCODE_PONG:
+      private_websocket_deliver(websocket, opcode, data, len);
+      return 0;
+    case WEBSOCKET_OPCODE_CLOSE:
+      if (len == 1) {
+        return private_websocket_fail(websocket, WEBSOCKET_CLOSE_PROTOCOL_ERROR, "Malformed WebSocket close frame");
+      }
+
+      code = len >= 2 ? (uint16_t)(((uint8_t) data[0] << 8) | (uint8_t) data[1]) : WEBSOCKET_CLOSE_NO_STATUS;
+
+      /* Echo the status back, the peer closes the connection afterwards */
+      if (websocket->close_sent == false && websocket->socket != NULL) {
+        websocket->close_sent = true;
+
+        if (private_websocket_send_frame(websocket, true, WEBSOCKET_OPCODE_CLOSE, data, len < 2 ? 0 : 2) == false) {
+          websocket->closed = true;
+          return -1;
+        }
+      }
+
+      websocket->closed = true;
+      websocket->close_code = code;
+      private_websocket_deliver(websocket, opcode, data, len);
+      return 0;
+    default:
+      break;
+  }
+
+  if (opcode != WEBSOCKET_OPCODE_CONTINUATION) {
+    websocket->message_opcode = opcode;
+  }
+
+  if (websocket->frame.fin == false) {
+    websocket->in_message = true;
+    return 0;
+  }
+
+  websocket->in_message = false;
+  websocket->message_len = 0;
+  private_websocket_deliver(websocket, websocket->message_opcode, data, len);
+
+  return 0;
+}
+
+ssize_t websocket_frame_parse(const char *buffer, size_t len, WebSocketFrame *frame) {
+  const uint8_t *bytes = (const uint8_t *) buffer;
+  size_t size = 2, extra, i;
+  uint64_t length;
+  uint8_t opcode;
+
+  if (UNLIKELY(buffer == NULL || frame == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (len < 2) {
+    return 0;
+  }
+
+  length = bytes[1] & 0x7f;
+  extra = length == 126 ? 2 : length == 127 ? 8 : 0;
+  size += extra + ((bytes[1] & 0x80) ? 4 : 0);
+
+  if (len < size) {
+    return 0;
+  }
+
+  opcode = bytes[0] & 0x0f;
+
+  if (UNLIKELY(bytes[0] & 0x70)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "WebSocket frame uses reserved bits");
+    return -1;
+  }
+
+  if (UNLIKELY((opcode > WEBSOCKET_OPCODE_BINARY && opcode < WEBSOCKET_OPCODE_CLOSE) ||
+               opcode > WEBSOCKET_OPCODE_PONG)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Unknown WebSocket opcode");
+    return -1;
+  }
+
+  if (extra > 0) {
+    for (length = 0, i = 0; i < extra; i++) {
+      length = (length << 8) | bytes[2 + i];
+    }
+  }
+
+  if (UNLIKELY(length >> 63)) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Invalid WebSocket payload length");
+    return -1;
+  }
+
+  if (UNLIKELY((opcode & 0x8) && ((bytes[0] & 0x80) == 0 || length > WEBSOCKET_MAX_CONTROL))) {
+    error_set_error((int32_t)ERROR_IO_FAILED, 0, "Invalid WebSocket control frame");
+    return -1;
+  }
+
+  frame->fin = (bytes[0] & 0x80) != 0;
+  frame->opcode = (WebSocketOpcode) opcode;
+  frame->masked = (bytes[1] & 0x80) != 0;
+  frame->length = length;
+  frame->header_size = size;
+
+  if (frame->masked) {
+    memcpy(frame->mask, bytes + 2 + extra, 4);
+  } else {
+    memset(frame->mask, 0, 4);
+  }
+
+  return (ssize_t) size;
+}
+
+/* buffer needs WEBSOCKET_MAX_HEADER_SIZE bytes, mask is NULL for an
+ * unmasked frame */
+size_t websocket_frame_encode(char *buffer, bool fin, WebSocketOpcode opcode, uint64_t length, const uint8_t *mask) {
+  uint8_t *bytes = (uint8_t *) buffer;
+  size_t size = 2, i;
+
+  if (UNLIKELY(buffer == NULL)) {
+    return 0;
+  }
+
+  bytes[0] = (uint8_t)((fin ? 0x80 : 0) | (opcode & 0x0f));
+
+  if (length < 126) {
+    bytes[1] = (uint8_t) length;
+  } else if (length <= UINT16_MAX) {
+    bytes[1] = 126;
+    bytes[2] = (uint8_t)(length >> 8);
+    bytes[3] = (uint8_t) length;
+    size = 4;
+  } else {
+    bytes[1] = 127;
+
+    for (i = 0; i < 8; i++) {
+      bytes[2 + i] = (uint8_t)(length >> (56 - i * 8));
+    }
+
+    size = 10;
+  }
+
+  if (mask != NULL) {
+    bytes[1] |= 0x80;
+    memcpy(bytes + size, mask, 4);
+    size += 4;
+  }
+
+  return size;
+}
+
+void websocket_mask(char *data, size_t len, const uint8_t *mask, uint64_t offset) {
+  uint8_t *bytes = (uint8_t *) data, rotated[4];
+  uint32_t key;
+  size_t done;
+  int32_t i;
+
+  if (UNLIKELY(data == NULL || mask == NULL || len == 0)) {
+    return;
+  }
+
+  for (i = 0; i < 4; i++) {
+    rotated[i] = mask[(offset + (uint64_t) i) & 3];
+  }
+
+  memcpy(&key, rotated, 4);
+
+#ifdef WEBSOCKET_USE_AVX2
+  if (len >= 64 && __builtin_cpu_supports("avx2")) {
+    done = private_websocket_mask_avx2(bytes, len, key);
+    bytes += done;
+    len -= done;
+  }
+#endif
+
+#ifdef WEBSOCKET_USE_SSE2
+  done = private_websocket_mask_sse2(bytes, len, key);
+  bytes += done;
+  len -= done;
+#else
+  UNUSED(done);
+#endif
+
+  private_websocket_mask_scalar(bytes, len, key);
+}
+
+ssize_t websocket_handshake_respond(const char *request, size_t len, size_t *consumed, char *response, size_t buflen) {
+  char accept[WEBSOCKET_ACCEPT_SIZE];
+  const char *value;
+  size_t headers, value_len;
+  int32_t ret;
+
+  if (UNLIKELY(request == NULL || consumed == NULL || response == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if ((headers = private_websocket_headers_end(request, len)) == 0) {
+    if (UNLIKELY(len > WEBSOCKET_MAX_HANDSHAKE)) {
+      error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "WebSocket handshake is too long");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (UNLIKELY(len < 4 || memcmp(request, "GET ", 4) != 0 ||
+               private_websocket_has_token(request, headers, "upgrade", "websocket") == false ||
+               private_websocket_has_token(request, headers, "connection", "upgrade") == false)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Not a WebSocket upgrade request");
+    return -1;
+  }
+
+  if (UNLIKELY(private_websocket_header(request, headers, "sec-websocket-version", &value, &value_len) == false ||
+               value_len != 2 || memcmp(value, "13", 2) != 0)) {
+    error_set_error((int32_t)ERROR_IO_NOT_SUPPORTED, 0, "Unsupported WebSocket version");
+    return -1;
+  }
+
+  if (UNLIKELY(private_websocket_header(request, headers, "sec-websocket-key", &value, &value_len) == false ||
+               value_len != WEBSOCKET_KEY_SIZE - 1)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid WebSocket key");
+    return -1;
+  }
+
+  private_websocket_accept(value, value_len, accept);
+  ret = snprintf(response, buflen,
+                 "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+  if (UNLIKELY(ret < 0 || (size_t) ret >= buflen)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "WebSocket handshake doesn't fit the buffer");
+    return -1;
+  }
+
+  *consumed = headers;
+
+  return ret;
+}
+
+/* Picks a fresh key for the handshake, path defaults to "/" */
+ssize_t websocket_handshake_request(WebSocket *websocket, const char *host, const char *path, char *buffer,
+                                    size_t buflen) {
+  uint8_t nonce[16];
+  int32_t ret;
+
+  if (UNLIKELY(websocket == NULL || host == NULL || buffer == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (UNLIKELY(private_websocket_random(websocket, nonce, sizeof(nonce)) == false)) {
+    return -1;
+  }
+
+  private_websocket_base64(nonce, sizeof(nonce), websocket->key);
+  ret = snprintf(buffer, buflen,
+                 "GET %s HTTP/1.1\r\n"
+                 "Host: %s\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: %s\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n", path != NULL ? path : "/", host, websocket->key);
+
+  if (UNLIKELY(ret < 0 || (size_t) ret >= buflen)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "WebSocket handshake doesn't fit the buffer");
+    return -1;
+  }
+
+  return ret;
+}
+
+ssize_t websocket_handshake_verify(WebSocket *websocket, const char *response, size_t len) {
+  char accept[WEBSOCKET_ACCEPT_SIZE];
+  const char *value;
+  size_t headers, value_len;
+
+  if (UNLIKELY(websocket == NULL || response == NULL || websocket->key[0] == '\0')) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if ((headers = private_websocket_headers_end(response, len)) == 0) {
+    if (UNLIKELY(len > WEBSOCKET_MAX_HANDSHAKE)) {
+      error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "WebSocket handshake is too long");
+      return -1;
+    }
+
+    return 0;
+  }
+
+  private_websocket_accept(websocket->key, WEBSOCKET_KEY_SIZE - 1, accept);
+
+  if (UNLIKELY(len < 13 || memcmp(response, "HTTP/1.1 101 ", 13) != 0 ||
+               private_websocket_has_token(response, headers, "upgrade", "websocket") == false ||
+               private_websocket_has_token(response, headers, "connection", "upgrade") == false ||
+               private_websocket_header(response, headers, "sec-websocket-accept", &value, &value_len) == false ||
+               value_len != WEBSOCKET_ACCEPT_SIZE - 1 || memcmp(value, accept, value_len) != 0)) {
+    error_set_error((int32_t)ERROR_IO_ACCESS_DENIED, 0, "WebSocket upgrade was refused");
+    return -1;
+  }
+
+  return (ssize_t) headers;
+}
+
+/* socket may be NULL to only decode, replies are then up to the caller */
+WebSocket *websocket_new(Socket *socket, bool client) {
+  WebSocket *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(WebSocket), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for WebSocket");
+    return NULL;
+  }
+
+  ret->socket = socket;
+  ret->client = client;
+  ret->max_message = WEBSOCKET_DEFAULT_MAX_MESSAGE;
+  ret->random_used = WEBSOCKET_RANDOM_SIZE;
+
+  return ret;
+}
+
+void websocket_set_message_func(WebSocket *websocket, WebSocketMessageFunc func, void *user) {
+  if (UNLIKELY(websocket == NULL)) {
+    return;
+  }
+
+  websocket->func = func;
+  websocket->user = user;
+}
+
+/* Larger messages close the connection with WEBSOCKET_CLOSE_TOO_BIG */
+void websocket_set_max_message(WebSocket *websocket, size_t max_message) {
+  if (UNLIKELY(websocket == NULL)) {
+    return;
+  }
+
+  websocket->max_message = max_message > 0 ? max_message : WEBSOCKET_DEFAULT_MAX_MESSAGE;
+}
+
+/* Returns the bytes consumed, less than len only once the connection is
+ * closed, or -1 on a protocol error */
+ssize_t websocket_feed(WebSocket *websocket, char *data, size_t len) {
+  WebSocketFrame *frame;
+  size_t consumed = 0, taken, chunk;
+  ssize_t ret;
+  uint16_t code;
+
+  if (UNLIKELY(websocket == NULL || (data == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  frame = &websocket->frame;
+
+  while (consumed < len && websocket->closed == false) {
+    if (websocket->in_payload == false) {
+      /* Headers split across reads are gathered first */
+      if (websocket->header_len == 0) {
+        ret = websocket_frame_parse(data + consumed, len - consumed, frame);
+        taken = ret > 0 ? (size_t) ret : len - consumed;
+
+        if (ret == 0) {
+          memcpy(websocket->header, data + consumed, taken);
+        }
+      } else {
+        taken = WEBSOCKET_MAX_HEADER_SIZE - websocket->header_len;
+        taken = taken < len - consumed ? taken : len - consumed;
+        memcpy(websocket->header + websocket->header_len, data + consumed, taken);
+
+        if ((ret = websocket_frame_parse(websocket->header, websocket->header_len + taken, frame)) > 0) {
+          taken = (size_t) ret - websocket->header_len;
+        }
+      }
+
+      if (ret < 0) {
+        return private_websocket_fail(websocket, WEBSOCKET_CLOSE_PROTOCOL_ERROR, error_get_message());
+      }
+
+      consumed += taken;
+
+      if (ret == 0) {
+        websocket->header_len += taken;
+        continue;
+      }
+
+      websocket->header_len = 0;
+
+      if ((code = private_websocket_check(websocket)) != 0) {
+        return private_websocket_fail(websocket, code, code == WEBSOCKET_CLOSE_TOO_BIG ?
+          "WebSocket message is too big" : "Unexpected WebSocket frame");
+      }
+
+      websocket->in_payload = true;
+      websocket->payload_offset = 0;
+      websocket->control_len = 0;
+
+      /* A whole unfragmented payload at hand is unmasked and delivered in
+       * place */
+      if (frame->length <= len - consumed && (frame->opcode & 0x8) == 0 && frame->fin && websocket->in_message == false) {
+        if (frame->masked) {
+          websocket_mask(data + consumed, (size_t) frame->length, frame->mask, 0);
+        }
+
+        consumed += (size_t) frame->length;
+
+        if (private_websocket_complete(websocket, data + consumed - frame->length, (size_t) frame->length) < 0) {
+          return -1;
+        }
+
+        continue;
+      }
+    }
+
+    chunk = frame->length - websocket->payload_offset < len - consumed ?
+            (size_t)(frame->length - websocket->payload_offset) : len - consumed;
+
+    if (frame->masked) {
+      websocket_mask(data + consumed, chunk, frame->mask, websocket->payload_offset);
+    }
+
+    if (private_websocket_append(websocket, data + consumed, chunk) == false) {
+      return private_websocket_fail(websocket, WEBSOCKET_CLOSE_TOO_BIG, error_get_message());
+    }
+
+    consumed += chunk;
+    websocket->payload_offset += chunk;
+
+    if (websocket->payload_offset == frame->length) {
+      ret = (frame->opcode & 0x8) ?
+        private_websocket_complete(websocket, websocket->control, websocket->control_len) :
+        private_websocket_complete(websocket, websocket->message, websocket->message_len);
+
+      if (ret < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return (ssize_t) consumed;
+}
+
+/* Reads once from the socket and decodes what arrived, returns like
+ * socket_receive() */
+ssize_t websocket_receive(WebSocket *websocket) {
+  ssize_t ret;
+
+  if (UNLIKELY(websocket == NULL || websocket->socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return -1;
+  }
+
+  if (websocket->input == NULL && UNLIKELY((websocket->input = malloc(WEBSOCKET_READ_SIZE)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for WebSocket");
+    return -1;
+  }
+
+  if ((ret = socket_receive(websocket->socket, websocket->input, WEBSOCKET_READ_SIZE)) <= 0) {
+    if (ret == 0) {
+      websocket->closed = true;
+    }
+
+    return ret;
+  }
+
+  if (websocket_feed(websocket, websocket->input, (size_t) ret) < 0) {
+    return -1;
+  }
+
+  return ret;
+}
+
+bool websocket_send(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len) {
+  return websocket_send_fragment(websocket, opcode, data, len, true);
+}
+
+/* The first fragment carries the message opcode, the ones after it go out
+ * as continuations whatever opcode is passed. Control frames may be sent
+ * between fragments. */
+bool websocket_send_fragment(WebSocket *websocket, WebSocketOpcode opcode, const char *data, size_t len, bool fin) {
+  if (UNLIKELY(websocket == NULL || (data == NULL && len > 0))) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY(websocket->close_sent || websocket->closed)) {
+    error_set_error((int32_t)ERROR_IO_NOT_CONNECTED, 0, "WebSocket is closed");
+    return false;
+  }
+
+  if (opcode & 0x8) {
+    if (UNLIKELY(fin == false || len > WEBSOCKET_MAX_CONTROL || opcode > WEBSOCKET_OPCODE_PONG)) {
+      error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid WebSocket control frame");
+      return false;
+    }
+
+    if (opcode == WEBSOCKET_OPCODE_CLOSE) {
+      websocket->close_sent = true;
+    }
+
+    return private_websocket_send_frame(websocket, true, opcode, data, len);
+  }
+
+  if (websocket->sending) {
+    opcode = WEBSOCKET_OPCODE_CONTINUATION;
+  } else if (UNLIKELY(opcode != WEBSOCKET_OPCODE_TEXT && opcode != WEBSOCKET_OPCODE_BINARY)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid WebSocket opcode");
+    return false;
+  }
+
+  if (private_websocket_send_frame(websocket, fin, opcode, data, len) == false) {
+    return false;
+  }
+
+  websocket->sending = fin == false;
+
+  return true;
+}
+
+/* Starts the closing handshake, the reason is cut to fit a control frame */
+bool websocket_close(WebSocket *websocket, uint16_t code, const char *reason) {
+  char payload[WEBSOCKET_MAX_CONTROL];
+  size_t len = 2;
+
+  if (UNLIKELY(websocket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  payload[0] = (char)(code >> 8);
+  payload[1] = (char) code;
+
+  if (reason != NULL) {
+    len += strlen(reason) > sizeof(payload) - 2 ? sizeof(payload) - 2 : strlen(reason);
+    memcpy(payload + 2, reason, len - 2);
+  }
+
+  return websocket_send(websocket, WEBSOCKET_OPCODE_CLOSE, payload, len);
+}
+
+/* True once a close frame arrived, the connection dropped or the peer
+ * broke the protocol */
+bool websocket_is_closed(const WebSocket *websocket) {
+  if (UNLIKELY(websocket == NULL)) {
+    return true;
+  }
+
+  return websocket->closed;
+}
+
+/* Status of the close frame received or sent on failure, 0 while open */
+uint16_t websocket_get_close_code(const WebSocket *websocket) {
+  if (UNLIKELY(websocket == NULL)) {
+    return 0;
+  }
+
+  return websocket->close_code;
+}
+
+Socket *websocket_get_socket(const WebSocket *websocket) {
+  if (UNLIKELY(websocket == NULL)) {
+    return NULL;
+  }
+
+  return websocket->socket;
+}
+
+void websocket_free(WebSocket *websocket) {
+  if (UNLIKELY(websocket == NULL)) {
+    return;
+  }
+
+  free(websocket->message);
+  free(websocket->input);
+  free(websocket->scratch);
+  free(websocket);
+}
@@ -0,0 +1,599 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2018 emekoi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * 'Software'), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED 'AS IS', WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#ifdef _WINDOWS
+#include <malloc.h>
+#endif
+#include "workpool.h"
+#include "thread.h"
+#include "error.h"
+
+/* Must be a power of two */
+#define WORK_POOL_DEQUE_SIZE 256
+
+/* Idle workers wake up at least this often (msec) to look for work
+ * pushed to other workers' deques without a signal */
+#define WORK_POOL_IDLE_WAIT 10
+
+typedef enum {
+  WORK_POOL_TASK_GENERIC = 0,
+  WORK_POOL_TASK_SOCKET  = 1,
+  WORK_POOL_TASK_IO      = 2
+} WorkPoolTaskType;
+
+typedef struct WorkPoolTask {
+  WorkPoolTaskType type;
+  union {
+    WorkPoolFunc generic;
+    WorkPoolSocketFunc socket;
+    WorkPoolIOFunc io;
+  } func;
+  Socket *socket;
+  SocketIOCondition condition;
+  void *data;
+  struct WorkPoolTask *next;
+} WorkPoolTask;
+
+/* Circular buffer of a Chase-Lev deque, replaced arrays are kept alive
+ * until the pool is freed because thieves may still read from them */
+typedef struct WorkPoolArray {
+  int64_t size;
+  struct WorkPoolArray *retired;
+  _Atomic(WorkPoolTask *) tasks[];
+} WorkPoolArray;
+
+/* Exactly two cache lines, the array of workers is allocated aligned so
+ * neighbouring workers never share a line */
+typedef struct {
+  /* Touched by thieves */
+  atomic_int_fast64_t top;
+  char pad0[CACHE_LINE_SIZE - sizeof(atomic_int_fast64_t)];
+  /* Touched by the owner */
+  union {
+    struct {
+      atomic_int_fast64_t bottom;
+      _Atomic(WorkPoolArray *) array;
+      atomic_uint_fast64_t executed;
+      atomic_uint_fast64_t steals;
+      WorkPool *pool;
+      Thread *thread;
+      uint32_t index;
+      uint32_t seed;
+    };
+    char pad1[CACHE_LINE_SIZE];
+  };
+} WorkPoolWorker;
+
+struct WorkPool {
+  WorkPoolWorker *workers;
+  uint32_t size;
+  uint32_t started;
+  Mutex *lock;
+  Cond *cond;
+  WorkPoolTask *injected_head;
+  WorkPoolTask *injected_tail;
+  atomic_size_t injected;
+  atomic_uint sleepers;
+  atomic_bool stopping;
+};
+
+static THREAD_LOCAL WorkPoolWorker *CURRENT_WORKER = NULL;
+
+static WorkPoolWorker *private_work_pool_workers_new(uint32_t count);
+static void private_work_pool_workers_free(WorkPoolWorker *workers);
+static WorkPoolArray *private_work_pool_array_new(int64_t size);
+static bool private_work_pool_push(WorkPoolWorker *worker, WorkPoolTask *task);
+static WorkPoolTask *private_work_pool_take(WorkPoolWorker *worker);
+static WorkPoolTask *private_work_pool_steal(WorkPoolWorker *victim);
+static WorkPoolTask *private_work_pool_steal_any(WorkPoolWorker *worker);
+static WorkPoolTask *private_work_pool_pop_injected(WorkPool *pool);
+static bool private_work_pool_has_work(WorkPool *pool);
+static bool private_work_pool_schedule(WorkPool *pool, WorkPoolTask *task);
+static void private_work_pool_run(WorkPoolTask *task);
+static void private_work_pool_worker(void *data);
+
+static WorkPoolWorker *private_work_pool_workers_new(uint32_t count) {
+  WorkPoolWorker *ret;
+  size_t size = sizeof(WorkPoolWorker) * count;
+
+#ifdef _WINDOWS
+  if (UNLIKELY((ret = _aligned_malloc(size, CACHE_LINE_SIZE)) == NULL)) {
+#else
+  if (UNLIKELY(posix_memalign((void **) &ret, CACHE_LINE_SIZE, size) != 0)) {
+#endif
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool workers");
+    return NULL;
+  }
+
+  memset(ret, 0, size);
+
+  return ret;
+}
+
+static void private_work_pool_workers_free(WorkPoolWorker *workers) {
+#ifdef _WINDOWS
+  _aligned_free(workers);
+#else
+  free(workers);
+#endif
+}
+
+static WorkPoolArray *private_work_pool_array_new(int64_t size) {
+  WorkPoolArray *ret;
+
+  if (UNLIKELY((ret = calloc(sizeof(WorkPoolArray) + (size_t)size * sizeof(WorkPoolTask *), 1)) == NULL)) {
+    return NULL;
+  }
+
+  ret->size = size;
+
+  return ret;
+}
+
+static bool private_work_pool_push(WorkPoolWorker *worker, WorkPoolTask *task) {
+  WorkPoolArray *array, *grown;
+  int64_t top, bottom, i;
+
+  bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+  top = atomic_load_explicit(&worker->top, memory_order_acquire);
+  array = atomic_load_explicit(&worker->array, memory_order_relaxed);
+
+  if (UNLIKELY(bottom - top > array->size - 1)) {
+    if (UNLIKELY((grown = private_work_pool_array_new(array->size * 2)) == NULL)) {
+      return false;
+    }
+
+    for (i = top; i < bottom; i++) {
+      atomic_store_explicit(&grown->tasks[i & (grown->size - 1)],
+        atomic_load_explicit(&array->tasks[i & (array->size - 1)], memory_order_relaxed),
+        memory_order_relaxed);
+    }
+
+    grown->retired = array;
+    atomic_store_explicit(&worker->array, grown, memory_order_release);
+    array = grown;
+  }
+
+  atomic_store_explicit(&array->tasks[bottom & (array->size - 1)], task, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+
+  return true;
+}
+
+static WorkPoolTask *private_work_pool_take(WorkPoolWorker *worker) {
+  WorkPoolArray *array;
+  WorkPoolTask *task;
+  int64_t top, bottom;
+
+  bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+  array = atomic_load_explicit(&worker->array, memory_order_relaxed);
+  atomic_store_explicit(&worker->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  top = atomic_load_explicit(&worker->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  task = atomic_load_explicit(&array->tasks[bottom & (array->size - 1)], memory_order_relaxed);
+
+  if (top == bottom) {
+    /* Last task, race against thieves for it */
+    if (!atomic_compare_exchange_strong_explicit(&worker->top, &top, top + 1,
+          memory_order_seq_cst, memory_order_relaxed)) {
+      task = NULL;
+    }
+
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+  }
+
+  return task;
+}
+
+static WorkPoolTask *private_work_pool_steal(WorkPoolWorker *victim) {
+  WorkPoolArray *array;
+  WorkPoolTask *task;
+  int64_t top, bottom;
+
+  top = atomic_load_explicit(&victim->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  array = atomic_load_explicit(&victim->array, memory_order_acquire);
+  task = atomic_load_explicit(&array->tasks[top & (array->size - 1)], memory_order_relaxed);
+
+  if (!atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+
+  return task;
+}
+
+static WorkPoolTask *private_work_pool_steal_any(WorkPoolWorker *worker) {
+  WorkPool *pool;
+  WorkPoolWorker *victim;
+  WorkPoolTask *task;
+  uint32_t start, i;
+
+  pool = worker->pool;
+
+  if (pool->size < 2) {
+    return NULL;
+  }
+
+  /* xorshift32 */
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+  start = worker->seed % pool->size;
+
+  for (i = 0; i < pool->size; i++) {
+    victim = &pool->workers[(start + i) % pool->size];
+
+    if (victim == worker) {
+      continue;
+    }
+
+    if ((task = private_work_pool_steal(victim)) != NULL) {
+      atomic_fetch_add_explicit(&worker->steals, 1, memory_order_relaxed);
+      return task;
+    }
+  }
+
+  return NULL;
+}
+
+static WorkPoolTask *private_work_pool_pop_injected(WorkPool *pool) {
+  WorkPoolTask *task;
+
+  if (atomic_load_explicit(&pool->injected, memory_order_acquire) == 0) {
+    return NULL;
+  }
+
+  mutex_lock(pool->lock);
+
+  if ((task = pool->injected_head) != NULL) {
+    pool->injected_head = task->next;
+
+    if (pool->injected_head == NULL) {
+      pool->injected_tail = NULL;
+    }
+
+    atomic_fetch_sub_explicit(&pool->injected, 1, memory_order_release);
+  }
+
+  mutex_unlock(pool->lock);
+
+  return task;
+}
+
+static bool private_work_pool_has_work(WorkPool *pool) {
+  uint32_t i;
+
+  if (atomic_load_explicit(&pool->injected, memory_order_acquire) > 0) {
+    return true;
+  }
+
+  for (i = 0; i < pool->size; i++) {
+    if (atomic_load_explicit(&pool->workers[i].bottom, memory_order_acquire) >
+        atomic_load_explicit(&pool->workers[i].top, memory_order_acquire)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool private_work_pool_schedule(WorkPool *pool, WorkPoolTask *task) {
+  WorkPoolWorker *worker;
+
+  worker = CURRENT_WORKER;
+
+  /* Tasks spawned from a handler stay local, idle workers steal them */
+  if (worker != NULL && worker->pool == pool && private_work_pool_push(worker, task)) {
+    if (atomic_load_explicit(&pool->sleepers, memory_order_acquire) > 0) {
+      mutex_lock(pool->lock);
+      cond_signal(pool->cond);
+      mutex_unlock(pool->lock);
+    }
+
+    return true;
+  }
+
+  task->next = NULL;
+
+  mutex_lock(pool->lock);
+
+  if (pool->injected_tail != NULL) {
+    pool->injected_tail->next = task;
+  } else {
+    pool->injected_head = task;
+  }
+
+  pool->injected_tail = task;
+  atomic_fetch_add_explicit(&pool->injected, 1, memory_order_release);
+
+  cond_signal(pool->cond);
+  mutex_unlock(pool->lock);
+
+  return true;
+}
+
+static void private_work_pool_run(WorkPoolTask *task) {
+  switch (task->type) {
+    case WORK_POOL_TASK_GENERIC:
+      task->func.generic(task->data);
+      break;
+    case WORK_POOL_TASK_SOCKET:
+      task->func.socket(task->socket, task->data);
+      break;
+    case WORK_POOL_TASK_IO:
+      task->func.io(task->socket, task->condition, task->data);
+      break;
+  }
+
+  free(task);
+}
+
+static void private_work_pool_worker(void *data) {
+  WorkPoolWorker *worker;
+  WorkPool *pool;
+  WorkPoolTask *task;
+
+  worker = data;
+  pool = worker->pool;
+  CURRENT_WORKER = worker;
+
+  for (;;) {
+    if ((task = private_work_pool_take(worker)) == NULL &&
+        (task = private_work_pool_pop_injected(pool)) == NULL) {
+      task = private_work_pool_steal_any(worker);
+    }
+
+    if (task != NULL) {
+      private_work_pool_run(task);
+      atomic_fetch_add_explicit(&worker->executed, 1, memory_order_relaxed);
+      continue;
+    }
+
+    mutex_lock(pool->lock);
+
+    if (private_work_pool_has_work(pool)) {
+      mutex_unlock(pool->lock);
+      continue;
+    }
+
+    if (atomic_load_explicit(&pool->stopping, memory_order_acquire)) {
+      mutex_unlock(pool->lock);
+      break;
+    }
+
+    atomic_fetch_add_explicit(&pool->sleepers, 1, memory_order_acq_rel);
+    cond_timed_wait(pool->cond, pool->lock, WORK_POOL_IDLE_WAIT);
+    atomic_fetch_sub_explicit(&pool->sleepers, 1, memory_order_acq_rel);
+
+    mutex_unlock(pool->lock);
+  }
+
+  CURRENT_WORKER = NULL;
+}
+
+WorkPool *work_pool_new(uint32_t workers) {
+  WorkPool *ret;
+  WorkPoolWorker *worker;
+  uint32_t i;
+
+  if (workers == 0) {
+    workers = thread_get_ideal_count();
+  }
+
+  if (UNLIKELY((ret = calloc(sizeof(WorkPool), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool");
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->workers = private_work_pool_workers_new(workers)) == NULL)) {
+    free(ret);
+    return NULL;
+  }
+
+  if (UNLIKELY((ret->lock = mutex_new()) == NULL || (ret->cond = cond_new()) == NULL)) {
+    error_set_error(error_get_code(), error_get_native_code(), "Failed to create work pool lock");
+    mutex_free(ret->lock);
+    private_work_pool_workers_free(ret->workers);
+    free(ret);
+    return NULL;
+  }
+
+  ret->size = workers;
+
+  for (i = 0; i < workers; i++) {
+    worker = &ret->workers[i];
+    worker->pool = ret;
+    worker->index = i;
+    worker->seed = 2463534242u ^ (i * 0x9e3779b9u);
+
+    if (UNLIKELY((worker->array = private_work_pool_array_new(WORK_POOL_DEQUE_SIZE)) == NULL)) {
+      error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool deque");
+      work_pool_free(ret);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < workers; i++) {
+    if (UNLIKELY((ret->workers[i].thread = thread_new(private_work_pool_worker, &ret->workers[i])) == NULL)) {
+      work_pool_free(ret);
+      return NULL;
+    }
+
+    ret->started++;
+  }
+
+  return ret;
+}
+
+uint32_t work_pool_get_size(const WorkPool *pool) {
+  if (UNLIKELY(pool == NULL)) {
+    return 0;
+  }
+
+  return pool->size;
+}
+
+bool work_pool_submit(WorkPool *pool, WorkPoolFunc func, void *data) {
+  WorkPoolTask *task;
+
+  if (UNLIKELY(pool == NULL || func == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((task = calloc(sizeof(WorkPoolTask), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool task");
+    return false;
+  }
+
+  task->type = WORK_POOL_TASK_GENERIC;
+  task->func.generic = func;
+  task->data = data;
+
+  return private_work_pool_schedule(pool, task);
+}
+
+bool work_pool_submit_socket(WorkPool *pool, WorkPoolSocketFunc func, Socket *socket, void *data) {
+  WorkPoolTask *task;
+
+  if (UNLIKELY(pool == NULL || func == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((task = calloc(sizeof(WorkPoolTask), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool task");
+    return false;
+  }
+
+  task->type = WORK_POOL_TASK_SOCKET;
+  task->func.socket = func;
+  task->socket = socket;
+  task->data = data;
+
+  return private_work_pool_schedule(pool, task);
+}
+
+bool work_pool_submit_io(WorkPool *pool, WorkPoolIOFunc func, Socket *socket, SocketIOCondition condition, void *data) {
+  WorkPoolTask *task;
+
+  if (UNLIKELY(pool == NULL || func == NULL || socket == NULL)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  if (UNLIKELY((task = calloc(sizeof(WorkPoolTask), 1)) == NULL)) {
+    error_set_error((int32_t)ERROR_IO_NO_RESOURCES, 0, "Failed to allocate memory for work pool task");
+    return false;
+  }
+
+  task->type = WORK_POOL_TASK_IO;
+  task->func.io = func;
+  task->socket = socket;
+  task->condition = condition;
+  task->data = data;
+
+  return private_work_pool_schedule(pool, task);
+}
+
+bool work_pool_get_stats(const WorkPool *pool, uint32_t worker, WorkPoolStats *stats) {
+  const WorkPoolWorker *w;
+  int64_t depth;
+
+  if (UNLIKELY(pool == NULL || stats == NULL || worker >= pool->size)) {
+    error_set_error((int32_t)ERROR_IO_INVALID_ARGUMENT, 0, "Invalid input argument");
+    return false;
+  }
+
+  w = &pool->workers[worker];
+  depth = atomic_load_explicit(&w->bottom, memory_order_relaxed) -
+          atomic_load_explicit(&w->top, memory_order_relaxed);
+
+  stats->queue_depth = depth > 0 ? (size_t)depth : 0;
+  stats->executed = atomic_load_explicit(&w->executed, memory_order_relaxed);
+  stats->steals = atomic_load_explicit(&w->steals, memory_order_relaxed);
+
+  return true;
+}
+
+void work_pool_free(WorkPool *pool) {
+  WorkPoolArray *array, *retired;
+  WorkPoolTask *task;
+  uint32_t i;
+
+  if (UNLIKELY(pool == NULL)) {
+    return;
+  }
+
+  /* Workers drain all queued tasks before exiting */
+  mutex_lock(pool->lock);
+  atomic_store_explicit(&pool->stopping, true, memory_order_release);
+  cond_broadcast(pool->cond);
+  mutex_unlock(pool->lock);
+
+  for (i = 0; i < pool->started; i++) {
+    thread_join(pool->workers[i].thread);
+  }
+
+  while ((task = pool->injected_head) != NULL) {
+    pool->injected_head = task->next;
+    free(task);
+  }
+
+  for (i = 0; i < pool->size; i++) {
+    array = atomic_load_explicit(&pool->workers[i].array, memory_order_relaxed);
+
+    while (array != NULL) {
+      retired = array->retired;
+      free(array);
+      array = retired;
+    }
+  }
+
+  cond_free(pool->cond);
+  mutex_free(pool->lock);
+  private_work_pool_workers_free(pool->workers);
+  free(pool);
+}